@@ -14,6 +14,7 @@
  * limitations under the License.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -22,6 +23,7 @@
 #include <getopt.h>
 #include <sys/mman.h>
 #include <signal.h>
+#include <sched.h>
 
 #include "libocxl.h"
 #include "ocxl_afp3.h"
@@ -37,20 +39,43 @@ static int size_ld = 64;
 static int size_st = 64;
 static int extra_read = 0;
 static uint64_t iterations = 10000;
+static int cpu = -1;
+static uint64_t jitter_ns = 0;
+static int json = 0;
+
+// Progress messages go to stderr when the results are written as JSON
+#define info(...) fprintf(json ? stderr : stdout, __VA_ARGS__)
+
+#define OUTLIERS_MAX 1024
+
+// An iteration slower than the jitter threshold
+struct outlier {
+	uint64_t timestamp_ns; // When it completed, in CLOCK_MONOTONIC ns
+	uint64_t iteration;
+	uint64_t latency_ns;
+};
+
+// The latencies measured for a completion method
+struct latency_run {
+	const char *method;
+	ocxl_histogram_h histogram;
+	uint64_t iterations;
+	uint64_t total_ns;
+	uint64_t outlier_count; // May exceed OUTLIERS_MAX, only the first are kept
+	struct outlier outliers[OUTLIERS_MAX];
+};
+
+static struct latency_run poll_run = { .method = "poll" };
 
 static uint64_t disableAfu  = 0x0000000000000000;
 static uint64_t resetCnt    = 0x4000000000000000;
 
+#ifdef _ARCH_PPC64
 #define miso()          asm volatile("or 26, 26, 26")
-
-#define mfspr(rn)       ({unsigned long rval;				\
-                        asm volatile("mfspr %0, %1"			\
-				: "=r" (rval) : "i" (rn)); rval;})
-
-static uint64_t read_timebase(void)
-{
-	return mfspr(268);
-}
+#else
+/* Only POWER gathers the stores to the MMIO area, elsewhere just keep them in order */
+#define miso()          asm volatile("": : :"memory")
+#endif
 
 static void printf_buf(uint64_t addr, uint64_t size)
 {
@@ -59,17 +84,31 @@ static void printf_buf(uint64_t addr, uint64_t size)
 	uint64_t per_line = 32;
 
 	for (i = 0; i < size/per_line; i++) {
-		printf("0x%016lx:", (uint64_t) base_p);
+		info("0x%016lx:", (uint64_t) base_p);
 		for (j = 0; j < per_line; j++) {
 			if (j % 8 == 0)
-				printf(" ");
+				info(" ");
 
-			printf("%02x", *base_p);
+			info("%02x", *base_p);
 			base_p++;
 		}
-		printf("\n");
+		info("\n");
 	}
-	printf("\n");
+	info("\n");
+}
+
+static void json_string(const char *str)
+{
+	putchar('"');
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			printf("\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			printf("\\u%04x", *str);
+		else
+			putchar(*str);
+	}
+	putchar('"');
 }
 
 static int flag_stop = 0;
@@ -79,12 +118,31 @@ static void stop_handler(int signal)
 	flag_stop = 1;
 }
 
+// Record the latency of an iteration, noting it if it is an outlier
+static inline void record_iteration(struct latency_run *run, uint64_t iteration,
+				    uint64_t start, uint64_t end)
+{
+	uint64_t end_ns = ocxl_timestamp_to_ns(end);
+	uint64_t latency_ns = end_ns - ocxl_timestamp_to_ns(start);
+
+	ocxl_histogram_record(run->histogram, latency_ns);
+
+	if (jitter_ns && latency_ns > jitter_ns) {
+		if (run->outlier_count < OUTLIERS_MAX) {
+			run->outliers[run->outlier_count].timestamp_ns = end_ns;
+			run->outliers[run->outlier_count].iteration = iteration;
+			run->outliers[run->outlier_count].latency_ns = latency_ns;
+		}
+		run->outlier_count++;
+	}
+}
+
 static inline uint64_t ping_8B(uint64_t global_mmio_start,
 			       volatile uint64_t *flag, uint64_t enable_in,
-			       uint64_t *count)
+			       uint64_t *count, struct latency_run *run)
 {
 	uint64_t *afu_enable_reg_p;
-	uint64_t timebase[2];
+	uint64_t timestamp[2], start;
 	uint64_t j, loop_count;
 
 	afu_enable_reg_p = (uint64_t *)(global_mmio_start +
@@ -94,35 +152,38 @@ static inline uint64_t ping_8B(uint64_t global_mmio_start,
 		loop_count = *count;
 	} else {
 		loop_count = ~0ull;
-		printf("Running test forever, interrupt with ctrl-c\n");
+		info("Running test forever, interrupt with ctrl-c\n");
 	}
 
-	timebase[0] = read_timebase();
+	timestamp[0] = ocxl_timestamp();
 	for (j = 0; j < loop_count; j++) {
 		if (flag_stop)
 			break;
 
 		*flag = 0;
 		__sync_synchronize();
+		start = ocxl_timestamp();
 		*afu_enable_reg_p = enable_in;
 		miso(); // force no gather
 
 		while (*flag == 0);
+		record_iteration(run, j, start, ocxl_timestamp());
 	}
-	timebase[1] = read_timebase();
+	timestamp[1] = ocxl_timestamp();
 
 	*count = j;
-	return (timebase[1] - timebase[0]);
+	return ocxl_timestamp_to_ns(timestamp[1]) - ocxl_timestamp_to_ns(timestamp[0]);
 }
 
 // use '-m' option with value > 8 to use this function doing a 64/128B
 // MMIO write before the mmpp DMA write
 static inline uint64_t ping_OVER_8B(uint64_t global_mmio_start,
 				    volatile uint64_t *flag,
-				    uint64_t enable_in, uint64_t *count)
+				    uint64_t enable_in, uint64_t *count,
+				    struct latency_run *run)
 {
 	uint64_t *afu_enable_reg_p, *afu_large_data0_p;
-	uint64_t timebase[2];
+	uint64_t timestamp[2], start;
 	uint64_t i, j, num_dw, loop_count;
 
 	fprintf(stderr, "Use of ping data bigger than 8B requires special support in the ocxl driver for mmio write-combine. Disabled by default as it generates HMI on default setup\n");
@@ -153,16 +214,17 @@ static inline uint64_t ping_OVER_8B(uint64_t global_mmio_start,
 		loop_count = *count;
 	} else {
 		loop_count = ~0ull;
-		printf("Running test forever, interrupt with ctrl-c\n");
+		info("Running test forever, interrupt with ctrl-c\n");
 	}
 
-	timebase[0] = read_timebase();
+	timestamp[0] = ocxl_timestamp();
 	for (j = 0; j < loop_count; j++) {
 		if (flag_stop)
 			break;
 
 		*flag = 0;
 		__sync_synchronize();
+		start = ocxl_timestamp();
 		// Write the large_data0 128 register
 		// num_dw = 8 if m64, num_dw = 16 if m128
 		for (i = 0; i < num_dw; i++) {
@@ -173,11 +235,82 @@ static inline uint64_t ping_OVER_8B(uint64_t global_mmio_start,
 		miso(); // force no gather
 
 		while (*flag == 0);
+		record_iteration(run, j, start, ocxl_timestamp());
 	}
-	timebase[1] = read_timebase();
+	timestamp[1] = ocxl_timestamp();
 
 	*count = j;
-	return (timebase[1] - timebase[0]);
+	return ocxl_timestamp_to_ns(timestamp[1]) - ocxl_timestamp_to_ns(timestamp[0]);
+}
+
+static void print_run(struct latency_run *run)
+{
+	ocxl_histogram_h h = run->histogram;
+	uint64_t i, shown, previous = 0;
+
+	printf("%s: %lu iterations in %lu ns\n", run->method, run->iterations, run->total_ns);
+	printf("\tmin %lu ns, p50 %lu ns, p99 %lu ns, p99.9 %lu ns, max %lu ns, mean %lu ns\n",
+	       ocxl_histogram_percentile(h, 0), ocxl_histogram_percentile(h, 50),
+	       ocxl_histogram_percentile(h, 99), ocxl_histogram_percentile(h, 99.9),
+	       ocxl_histogram_percentile(h, 100), ocxl_histogram_mean(h));
+
+	if (!jitter_ns)
+		return;
+
+	printf("\t%lu iterations over %lu ns\n", run->outlier_count, jitter_ns);
+	shown = run->outlier_count < OUTLIERS_MAX ? run->outlier_count : OUTLIERS_MAX;
+	for (i = 0; i < shown; i++) {
+		struct outlier *outlier = &run->outliers[i];
+
+		printf("\t[%lu.%09lu] iteration %lu took %lu ns",
+		       outlier->timestamp_ns / 1000000000, outlier->timestamp_ns % 1000000000,
+		       outlier->iteration, outlier->latency_ns);
+		if (i)
+			printf(", %lu ns after the previous outlier", outlier->timestamp_ns - previous);
+		printf("\n");
+		previous = outlier->timestamp_ns;
+	}
+	if (run->outlier_count > shown)
+		printf("\t%lu more outliers were not kept\n", run->outlier_count - shown);
+}
+
+static void print_json(struct latency_run **runs, int count)
+{
+	int i;
+	uint64_t j, shown;
+
+	printf("{\n\t\"device\": ");
+	json_string(device ? device : AFU_NAME);
+	printf(",\n\t\"ping\": %d,\n\t\"pong\": %d,\n\t\"extra_read\": %s,\n",
+	       size_ping, size_st, extra_read ? "true" : "false");
+	printf("\t\"cpu\": %d,\n\t\"jitter_ns\": %lu,\n\t\"methods\": [", cpu, jitter_ns);
+
+	for (i = 0; i < count; i++) {
+		struct latency_run *run = runs[i];
+		ocxl_histogram_h h = run->histogram;
+
+		printf("%s\n\t\t{\n\t\t\t\"method\": ", i ? "," : "");
+		json_string(run->method);
+		printf(",\n\t\t\t\"iterations\": %lu,\n\t\t\t\"total_ns\": %lu,\n",
+		       run->iterations, run->total_ns);
+		printf("\t\t\t\"min_ns\": %lu,\n\t\t\t\"p50_ns\": %lu,\n\t\t\t\"p99_ns\": %lu,\n",
+		       ocxl_histogram_percentile(h, 0), ocxl_histogram_percentile(h, 50),
+		       ocxl_histogram_percentile(h, 99));
+		printf("\t\t\t\"p999_ns\": %lu,\n\t\t\t\"max_ns\": %lu,\n\t\t\t\"mean_ns\": %lu,\n",
+		       ocxl_histogram_percentile(h, 99.9), ocxl_histogram_percentile(h, 100),
+		       ocxl_histogram_mean(h));
+		printf("\t\t\t\"outlier_count\": %lu,\n\t\t\t\"outliers\": [", run->outlier_count);
+
+		shown = run->outlier_count < OUTLIERS_MAX ? run->outlier_count : OUTLIERS_MAX;
+		for (j = 0; j < shown; j++) {
+			printf("%s\n\t\t\t\t{ \"timestamp_ns\": %lu, \"iteration\": %lu, \"latency_ns\": %lu }",
+			       j ? "," : "", run->outliers[j].timestamp_ns, run->outliers[j].iteration,
+			       run->outliers[j].latency_ns);
+		}
+		printf("%s]\n\t\t}", shown ? "\n\t\t\t" : "");
+	}
+
+	printf("\n\t]\n}\n");
 }
 
 //Main function called after line commands arguments processed
@@ -188,7 +321,7 @@ int ocapi_afp3_lat(void)
 	int tags_ld = 0, tags_st = 7;
 	int npu_ld = 0, npu_st = 0;
 	int num_dw, use_large_data;
-	uint64_t total_latency, global_mmio_start, offsetmask;
+	uint64_t global_mmio_start, offsetmask;
 	uint64_t wed_in, misc_in, enable_in, extra_read_ea_in;
 	int flag_location;
 	volatile uint64_t *buffer;
@@ -216,7 +349,7 @@ int ocapi_afp3_lat(void)
 		size_enc_st = 3;
 		break;
 	default:
-		printf("\nIllegal value entered for --size_st argument = %d!!!!\n", size_st);
+		info("\nIllegal value entered for --size_st argument = %d!!!!\n", size_st);
 		return -1;
 	}
 
@@ -232,19 +365,19 @@ int ocapi_afp3_lat(void)
 		size_enc_ld = 3;
 		break;
 	default:
-		printf("\nIllegal value entered for --size_ld argument = %d!!!!\n", size_ld);
+		info("\nIllegal value entered for --size_ld argument = %d!!!!\n", size_ld);
 		return -1;
 	}
 
 	if ((tags_ld != 0) || (tags_st == 0))
-		printf("WARNING: For MMIO ping-pong latency mode, it is recommended to enable stores (tags_st > 0), and disable loads (tags_ld = 0)\n");
+		info("WARNING: For MMIO ping-pong latency mode, it is recommended to enable stores (tags_st > 0), and disable loads (tags_ld = 0)\n");
 
-	printf("Parameters used: tags_ld=%d - size_ld=%d - tags_st=%d - size_st=%d\n",
+	info("Parameters used: tags_ld=%d - size_ld=%d - tags_st=%d - size_st=%d\n",
 	       tags_ld, size_ld, tags_st, size_st);
 
 	// Open AFU device(s)
 	if (verbose)
-		printf("Calling ocxl_afu_open\n");
+		info("Calling ocxl_afu_open\n");
 	if (device)
 		err = ocxl_afu_open_from_dev(device, &afu_h);
 	else
@@ -257,7 +390,7 @@ int ocapi_afp3_lat(void)
 
 	// attach to afu - attach does not "start" the afu anymore
 	if (verbose)
-		printf("Calling ocxl_afu_attach\n");
+		info("Calling ocxl_afu_attach\n");
 	err = ocxl_afu_attach(afu_h, OCXL_ATTACH_FLAGS_NONE);
 	if (err != OCXL_OK) {
 		fprintf(stderr, "ocxl_afu_attach: %d", err);
@@ -276,7 +409,7 @@ int ocapi_afp3_lat(void)
 		fprintf(stderr, "ocxl_mmio_get_info: %d\n", err);
 		return err;
 	}
-	printf("MMIO INFO: address 0x%016lx - size 0x%lx\n",
+	info("MMIO INFO: address 0x%016lx - size 0x%lx\n",
 	       global_mmio_start, size);
 
 	// Allocate a buffer for "to" memory buffer.
@@ -288,7 +421,7 @@ int ocapi_afp3_lat(void)
 		return -1;
 	}
 	if (verbose)
-		printf("Allocated Buffer memory @ 0x%016llx\n",
+		info("Allocated Buffer memory @ 0x%016llx\n",
 		       (long long)buffer);
 
 	// Turn off MMIO latency mode
@@ -305,7 +438,7 @@ int ocapi_afp3_lat(void)
 		(tags_ld << 9) + (size_enc_ld << 7) + (npu_ld << 6) +
 		(tags_st << 3) + (size_enc_st << 1) + (npu_st);
 	if (verbose)
-		printf("WED = %016lx\n", wed_in);
+		info("WED = %016lx\n", wed_in);
 	err = ocxl_mmio_write64(mmio_h, AFUWED_AFP_REGISTER,
 				OCXL_MMIO_LITTLE_ENDIAN, wed_in);
 	if (err != OCXL_OK) {
@@ -315,7 +448,7 @@ int ocapi_afp3_lat(void)
 	}
 
 	if (verbose)
-		printf("BUFMASK = %016lx\n", offsetmask);
+		info("BUFMASK = %016lx\n", offsetmask);
 	err = ocxl_mmio_write64(mmio_h, AFUBufmask_AFP_REGISTER,
 				OCXL_MMIO_LITTLE_ENDIAN, offsetmask);
 	if (err != OCXL_OK) {
@@ -328,7 +461,7 @@ int ocapi_afp3_lat(void)
 		misc_in = 1 << 12; // 0b01: triggered by writing or
 				   // reading large data 0 register
 		if (verbose)
-			printf("MISC_REG = %016lx\n", misc_in);
+			info("MISC_REG = %016lx\n", misc_in);
 
 		err = ocxl_mmio_write64(mmio_h, AFUMisc_AFP_REGISTER,
 					OCXL_MMIO_LITTLE_ENDIAN, misc_in);
@@ -341,7 +474,7 @@ int ocapi_afp3_lat(void)
 	}
 
 	if (verbose)
-		printf("CONTROL_REG (reset) = %016lx\n", resetCnt);
+		info("CONTROL_REG (reset) = %016lx\n", resetCnt);
 	err = ocxl_mmio_write64(mmio_h, AFUControl_AFP_REGISTER,
 				OCXL_MMIO_LITTLE_ENDIAN, resetCnt);
 	if (err != OCXL_OK) {
@@ -355,7 +488,7 @@ int ocapi_afp3_lat(void)
 		// and we do not need to set up more memory
 		extra_read_ea_in = (uint64_t) buffer + 1024;
 		if (verbose)
-			printf("EXTRA_READ_EA = %016lx\n", extra_read_ea_in);
+			info("EXTRA_READ_EA = %016lx\n", extra_read_ea_in);
 
 		err = ocxl_mmio_write64(mmio_h, AFUExtraReadEA_AFP_REGISTER,
 					OCXL_MMIO_LITTLE_ENDIAN,
@@ -366,12 +499,12 @@ int ocapi_afp3_lat(void)
 			return err;
 		}
 
-		printf("Initializing extra_read memory .....\n");
+		info("Initializing extra_read memory .....\n");
 		for (j = 0; j < 64; j++)
 			buffer[(1024/8) + j] = 0xdafa0201dafa0100 + j;
 
 		if (verbose) {
-			printf("Done initializing extra read memory\n");
+			info("Done initializing extra read memory\n");
 			printf_buf(extra_read_ea_in, 512);
 		}
 	}
@@ -387,11 +520,11 @@ int ocapi_afp3_lat(void)
 	if (size_ld == 512)
 		enable_in |= BIT(58); // use 512B loads
 	if (verbose) {
-		printf("ENABLE_REG = %016lx", enable_in);
+		info("ENABLE_REG = %016lx", enable_in);
 		if (use_large_data)
-			printf("\t> use large data regs value\n");
+			info("\t> use large data regs value\n");
 		else
-			printf("\n");
+			info("\n");
 	}
 
 	num_dw = size_st / sizeof(uint64_t);
@@ -399,44 +532,72 @@ int ocapi_afp3_lat(void)
 		buffer[k] = 0;
 
 	if (verbose) {
-		printf("Buffer before test\n");
+		info("Buffer before test\n");
 		printf_buf((uint64_t) buffer, 512);
 	}
 
+	err = ocxl_histogram_alloc(&poll_run.histogram);
+	if (err != OCXL_OK) {
+		fprintf(stderr, "ocxl_histogram_alloc: %d\n", err);
+		return err;
+	}
+
+	if (cpu >= 0) {
+		cpu_set_t set;
+
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("sched_setaffinity");
+			return -1;
+		}
+		if (verbose)
+			info("Pinned to CPU %d\n", cpu);
+	}
+
 	asm volatile("": : :"memory");
+#ifdef _ARCH_PPC64
 	asm volatile("sync");
+#else
+	__sync_synchronize();
+#endif
 
 	///////////////////////////////////////////////////////////////////////
 	// MMIO Ping-Pong Latency Test
 	///////////////////////////////////////////////////////////////////////
 
 	if (verbose)
-		printf("Calling ping_pong test\n");
-	printf("MMIO WR %dB (host to card) -> %sDMA WR %dB (card to host)\n",
+		info("Calling ping_pong test\n");
+	info("MMIO WR %dB (host to card) -> %sDMA WR %dB (card to host)\n",
 	       size_ping, (extra_read ? "DMA RD + " : ""), size_st);
 
 	// flag_location is the address where lower bytes of counter
 	// value will be set
 	flag_location = (size_st - 64) / sizeof(uint64_t);
 
+	poll_run.iterations = iterations;
 	if (size_ping == 8)
-		total_latency = ping_8B(global_mmio_start,
-					&buffer[flag_location], enable_in,
-					&iterations);
+		poll_run.total_ns = ping_8B(global_mmio_start,
+					    &buffer[flag_location], enable_in,
+					    &poll_run.iterations, &poll_run);
 	else
-		total_latency = ping_OVER_8B(global_mmio_start,
-					     &buffer[flag_location], enable_in,
-					     &iterations);
+		poll_run.total_ns = ping_OVER_8B(global_mmio_start,
+						 &buffer[flag_location], enable_in,
+						 &poll_run.iterations, &poll_run);
 
 	if (verbose) {
 		usleep(100000); // .1s
-		printf("\nBuffer after test\n");
+		info("\nBuffer after test\n");
 		printf_buf((uint64_t) buffer, 512);
 	}
-	printf("Completed %lu iterations. Total time measured using timebase: %10.2f ns\n",
-	       iterations, total_latency*1000./512);
-	printf("Average roundtrip per iteration: %10.2f ns\n",
-	       total_latency*1000./iterations/512);
+	if (json) {
+		struct latency_run *runs[] = { &poll_run };
+
+		print_json(runs, 1);
+	} else {
+		print_run(&poll_run);
+	}
+	ocxl_histogram_free(poll_run.histogram);
 
 	// Turn off MMIO latency mode
 	err = ocxl_mmio_write64(mmio_h, AFUEnable_AFP_REGISTER,
@@ -448,11 +609,11 @@ int ocapi_afp3_lat(void)
 	}
 
 	if (verbose)
-		printf("Unmap afu\n");
+		info("Unmap afu\n");
 	ocxl_mmio_unmap(mmio_h);
 
 	if (verbose)
-		printf("Free afu\n");
+		info("Free afu\n");
 	ocxl_afu_close(afu_h);
 	return 0;
 }
@@ -465,6 +626,9 @@ static void print_help(char *name)
 	printf("\t-x           --extraread \tAdd an DMA extraread before the DMA Wr Default is no\n");
 	printf("\t-f           --forever   \tRun until CTRL+C, Default=no\n");
 	printf("\t-d           --device    \tDevice to open instead of first AFP AFU found\n");
+	printf("\t-c 0         --cpu       \tPin the test to a CPU\n");
+	printf("\t-j 5000      --jitter    \tReport iterations slower than this many ns, with their timestamps\n");
+	printf("\t             --json      \tWrite the results to stdout as JSON\n");
 	printf("\t-v           --verbose   \tVerbose output\n");
 	printf("\t-h           --help      \tPrint this message\n");
 	printf("\n");
@@ -484,10 +648,13 @@ int main(int argc, char *argv[])
 		{"verbose",    no_argument      , &verbose,  1 },
 		{"help",       no_argument      , 0       , 'h'},
 		{"device",     required_argument, 0       , 'd'},
+		{"cpu",        required_argument, 0       , 'c'},
+		{"jitter",     required_argument, 0       , 'j'},
+		{"json",       no_argument      , &json   ,  1 },
 		{NULL, 0, 0, 0}
 	};
 
-	while ((opt = getopt_long(argc, argv, "vxhi:p:m:fd:", long_options,
+	while ((opt = getopt_long(argc, argv, "vxhi:p:m:fd:c:j:", long_options,
 				  &option_index)) >= 0) {
 		switch (opt) {
 		case 'v':
@@ -514,6 +681,14 @@ int main(int argc, char *argv[])
 		case 'd':
 			device = optarg;
 			break;
+		case 'c':
+			cpu = strtol(optarg, NULL, 0);
+			break;
+		case 'j':
+			jitter_ns = strtoull(optarg, NULL, 0);
+			break;
+		case 0:
+			break;
 		default:
 			print_help(argv[0]);
 			return -1;
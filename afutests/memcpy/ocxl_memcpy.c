@@ -91,10 +91,26 @@ struct memcpy_weq {
 	int count;
 };
 
+/* How the completion of the work elements is detected */
+enum completion {
+	COMPLETION_POLL, /* Poll the status of the last work element */
+	COMPLETION_IRQ, /* Wait for an interrupt through ocxl_afu_event_check() */
+	COMPLETION_WAIT, /* Sleep in ocxl_wait() until woken by wake_host_thread */
+	COMPLETION_COUNT
+};
+
+/* The latencies measured for a completion method, with -L */
+struct completion_run {
+	const char *method;
+	ocxl_histogram_h histogram;
+	uint64_t fallbacks; /* wake_host_thread commands which fell back to an interrupt */
+};
+
 struct memcpy_test_args {
 	int loop_count;
 	int size;
 	int irq;
+	int latency;
 	int completion_timeout;
 	int reallocate;
 	int initialize;
@@ -310,7 +326,9 @@ int wait_fast(struct memcpy_work_element *we, int timeout, pid_t pid, ocxl_afu_h
 	 * having the thread running.
 	 */
 	for (;;) {
+#ifdef _ARCH_PPC64
 		ocxl_wait();
+#endif
 		if (we->status)
 			break;
 		gettimeofday(&temp, NULL);
@@ -358,6 +376,20 @@ int restart_afu(pid_t pid, ocxl_mmio_h pp_mmio)
 	return 0;
 }
 
+void print_completion_run(pid_t pid, struct completion_run *run)
+{
+	ocxl_histogram_h h = run->histogram;
+
+	LOG_INF(pid, "%s: %lu loops, min %lu ns, p50 %lu ns, p99 %lu ns, p99.9 %lu ns, max %lu ns, mean %lu ns\n",
+		run->method, ocxl_histogram_count(h), ocxl_histogram_percentile(h, 0),
+		ocxl_histogram_percentile(h, 50), ocxl_histogram_percentile(h, 99),
+		ocxl_histogram_percentile(h, 99.9), ocxl_histogram_percentile(h, 100),
+		ocxl_histogram_mean(h));
+	if (run->fallbacks)
+		LOG_INF(pid, "%s: %lu wake_host_thread commands fell back to an interrupt\n",
+			run->method, run->fallbacks);
+}
+
 int test_afu_memcpy(struct memcpy_test_args *args)
 {
 	uint64_t wed;
@@ -366,10 +398,16 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 	uint64_t status, afu_irq_ea = 0, err_irq_ea;
 	uint16_t tidr;
 	struct memcpy_weq weq;
-	struct memcpy_work_element memcpy_we, irq_we;
+	struct memcpy_work_element memcpy_we, irq_we, wake_we;
 	struct memcpy_work_element increment_we, atomic_cas_we;
 	struct memcpy_work_element *first_we, *last_we;
 	struct timeval start, end;
+	struct completion_run runs[COMPLETION_COUNT] = {
+		{ .method = "poll" }, { .method = "irq" }, { .method = "wait" },
+	};
+	enum completion completions[COMPLETION_COUNT], completion;
+	int completion_count = 0;
+	uint64_t submitted;
 	char *src, *dst;
 	int nevent;
 	ocxl_err err;
@@ -443,8 +481,22 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 	memcpy_we.src = htole64((uintptr_t) src);
 	memcpy_we.dst = htole64((uintptr_t) dst);
 
-	/* Setup the interrupt work element */
-	if (args->irq || args->wake_host_thread) {
+	/*
+	 * Choose how completions are detected. With -L, the methods
+	 * take turns on each loop, so they are compared under the
+	 * same conditions
+	 */
+	if (args->latency) {
+		completions[completion_count++] = COMPLETION_POLL;
+		completions[completion_count++] = COMPLETION_IRQ;
+	} else if (args->irq) {
+		completions[completion_count++] = COMPLETION_IRQ;
+	} else if (!args->wake_host_thread) {
+		completions[completion_count++] = COMPLETION_POLL;
+	}
+
+	/* Setup the interrupt & wake_host_thread work elements */
+	if (args->irq || args->wake_host_thread || args->latency) {
 		err = ocxl_irq_alloc(afu_h, NULL, &afu_irq);
 		if (err != OCXL_OK) {
 			LOG_ERR(pid, "ocxl_irq_alloc() failed: %d\n", err);
@@ -455,20 +507,41 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 
 		memset(&irq_we, 0, sizeof(irq_we));
 		irq_we.src = htole64(afu_irq_ea);
-		if (args->irq)
-			irq_we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_IRQ);
-		else {
-			err = ocxl_afu_get_p9_thread_id(afu_h, &tidr);
-			if (err < 0) {
-				LOG_ERR(pid, "ocxl_afu_get_p9_thread_id() failed: %d\n", err);
-				goto err;
-			}
+		wake_we = irq_we;
+		irq_we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_IRQ);
+		wake_we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_WAKE_HOST_THREAD);
+	}
+
+	if (args->wake_host_thread || args->latency) {
+#ifdef _ARCH_PPC64
+		err = ocxl_afu_get_p9_thread_id(afu_h, &tidr);
+#else
+		/* wake_host_thread needs the POWER9 wait instruction */
+		(void)tidr;
+		err = OCXL_NO_DEV;
+#endif
+		if (err == OCXL_OK) {
 			/*
 			 * tidr allocated before attaching, so it will
 			 * be in the Process Element and the default
 			 * tid value used by AFU
 			 */
-			irq_we.cmd = MEMCPY_WE_CMD(1, MEMCPY_WE_CMD_WAKE_HOST_THREAD);
+			completions[completion_count++] = COMPLETION_WAIT;
+		} else if (args->latency) {
+			LOG_INF(pid, "wake_host_thread is not available, not measuring wait\n");
+		} else {
+			LOG_ERR(pid, "ocxl_afu_get_p9_thread_id() failed: %d\n", err);
+			goto err;
+		}
+	}
+
+	if (args->latency) {
+		for (i = 0; i < completion_count; i++) {
+			err = ocxl_histogram_alloc(&runs[completions[i]].histogram);
+			if (err != OCXL_OK) {
+				LOG_ERR(pid, "ocxl_histogram_alloc() failed: %d\n", err);
+				goto err;
+			}
 		}
 	}
 
@@ -518,6 +591,7 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 	gettimeofday(&start, NULL);
 
 	for (i = 0; i < args->loop_count; i++) {
+		completion = completions[i % completion_count];
 
 		/* setup the work queue */
 		if (args->atomic_cas) {
@@ -535,11 +609,14 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 		} else {
 			first_we = last_we = memcpy3_add_we(&weq, memcpy_we);
 		}
-		if (args->irq || args->wake_host_thread)
+		if (completion == COMPLETION_IRQ)
 			last_we = memcpy3_add_we(&weq, irq_we);
+		else if (completion == COMPLETION_WAIT)
+			last_we = memcpy3_add_we(&weq, wake_we);
 		__sync_synchronize();
 
 		/* press the big red 'go' button */
+		submitted = ocxl_timestamp();
 		first_we->cmd |= MEMCPY_WE_CMD_VALID;
 
 		/*
@@ -548,27 +625,32 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 		 * if we're using an interrupt, we can go to sleep.
 		 * Otherwise, we poll the last work element status from memory
 		 */
-		if (args->irq)
+		if (completion == COMPLETION_IRQ)
 			rc = wait_for_irq(last_we, args->completion_timeout, pid, afu_h, afu_irq_ea, err_irq_ea);
-		else if (args->wake_host_thread)
+		else if (completion == COMPLETION_WAIT)
 			rc = wait_fast(last_we, args->completion_timeout, pid, afu_h, afu_irq_ea);
 		else
 			rc = wait_for_status(last_we, args->completion_timeout, pid);
+		if (args->latency)
+			ocxl_histogram_record(runs[completion].histogram,
+					      ocxl_timestamp_to_ns(ocxl_timestamp()) - ocxl_timestamp_to_ns(submitted));
 		if (rc)
 			goto err_status;
 		if (first_we->status != 1) {
 			LOG_ERR(pid, "unexpected status 0x%x for copy\n", first_we->status);
 			goto err_status;
 		}
-		if (args->irq && last_we->status != 1) {
+		if (completion == COMPLETION_IRQ && last_we->status != 1) {
 			LOG_ERR(pid, "unexpected status 0x%x for irq\n", last_we->status);
 			goto err_status;
 		}
-		if (args->wake_host_thread && (last_we->status != 1) &&
+		if (completion == COMPLETION_WAIT && (last_we->status != 1) &&
 		    (last_we->status != 0x11)) {
 			LOG_ERR(pid, "unexpected status 0x%x for wake_host_thread\n", last_we->status);
 			goto err_status;
 		}
+		if (completion == COMPLETION_WAIT && last_we->status == 0x11)
+			runs[completion].fallbacks++;
 
 		/*
 		 * The memory barrier is to avoid instructions
@@ -590,7 +672,7 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 				goto err_status;
 			}
 		}
-		if (args->irq || args->wake_host_thread) {
+		if (completion != COMPLETION_POLL) {
 			/* AFU engine stops on irq, need to restart it */
 			rc = restart_afu(pid, pp_mmio);
 			if (rc)
@@ -644,6 +726,12 @@ int test_afu_memcpy(struct memcpy_test_args *args)
 	}
 
 	LOG_INF(pid, "%d loops in %d uS (%0.2f uS per loop)\n", args->loop_count, t, ((float) t)/args->loop_count);
+	if (args->latency) {
+		for (i = 0; i < completion_count; i++) {
+			print_completion_run(pid, &runs[completions[i]]);
+			ocxl_histogram_free(runs[completions[i]].histogram);
+		}
+	}
 	ocxl_afu_close(afu_h);
 	if (args->shared_mem)
 		shm_destroy(args);
@@ -656,6 +744,8 @@ err_status:
 	else
 		LOG_ERR(pid, "process status at end of failed test=0x%lx\n", status);
 err:
+	for (i = 0; i < COMPLETION_COUNT; i++)
+		ocxl_histogram_free(runs[i].histogram);
 	ocxl_afu_close(afu_h);
 	if (args->shared_mem)
 		shm_destroy(args);
@@ -672,6 +762,8 @@ void usage(char *name)
 	fprintf(stderr, "\t-I\t\tInitialize the destination buffer after each loop\n");
 	fprintf(stderr, "\t-i\t\tSend an interrupt after copy\n");
 	fprintf(stderr, "\t-w\t\tSend a wake_host_thread command after copy\n");
+	fprintf(stderr, "\t-L\t\tAlternate polling, interrupt & wake_host_thread (when available)\n"
+			"\t\t\tcompletions, and report the latency distribution of each\n");
 	fprintf(stderr, "\t-l <loops>\tRun this number of memcpy loops (default 1)\n");
 	fprintf(stderr, "\t-p <procs>\tFork this number of processes (default 1)\n");
 	fprintf(stderr, "\t-p 0\t\tUse the maximum number of processes permitted by the AFU\n");
@@ -691,6 +783,7 @@ int main(int argc, char *argv[])
 	args.loop_count = 1;
 	args.size = 2048;
 	args.irq = 0;
+	args.latency = 0;
 	args.completion_timeout = -1;
 	args.reallocate = 0;
 	args.initialize = 0;
@@ -704,7 +797,7 @@ int main(int argc, char *argv[])
 	args.counter = NULL;
 
 	while (1) {
-		c = getopt(argc, argv, "+aAhl:p:Ss:Iit:rd:w");
+		c = getopt(argc, argv, "+aAhl:Lp:Ss:Iit:rd:w");
 		if (c < 0)
 			break;
 		switch (c) {
@@ -724,6 +817,9 @@ int main(int argc, char *argv[])
 		case 'i':
 			args.irq = 1;
 			break;
+		case 'L':
+			args.latency = 1;
+			break;
 		case 't':
 			args.completion_timeout = atoi(optarg);
 			break;
@@ -770,6 +866,11 @@ int main(int argc, char *argv[])
 		usage(argv[0]);
 	}
 
+	if (args.latency && (args.irq || args.wake_host_thread)) {
+		fprintf(stderr, "Error: -L and -i/-w are mutually exclusive\n");
+		usage(argv[0]);
+	}
+
 	if (args.atomic_cas && args.reallocate) {
 		fprintf(stderr, "Error: -A and -r are mutually exclusive\n");
 		usage(argv[0]);
@@ -0,0 +1,277 @@
+#!/usr/bin/env perl
+#
+# Compare benchmark results against a stored baseline, and flag regressions.
+#
+# Results are the JSON files written by the benchmarks' --json option. Several files may
+# be given for repeated trials, their samples are pooled. Baselines are stored per host
+# class, as timings are only comparable on similar hosts.
+#
+# For each benchmark, the change is the ratio of the median of the new samples to the
+# median of the baseline samples, with a bootstrap confidence interval. Trials are
+# resampled before the samples within them, so the interval accounts for the variation
+# between runs as well as within them. A change is
+# only reported as a regression (or improvement) if the whole confidence interval lies
+# beyond the threshold, so noise alone does not fail the check.
+#
+# Exit status: 0 if there are no regressions, 1 if there are, 2 on error.
+
+use English;
+use strict;
+use warnings;
+use Getopt::Long;
+use JSON::PP;
+
+my $baselines = 'benchmarks/baselines';
+my $host_class = $ENV{LIBOCXL_BENCH_HOST_CLASS};
+my $threshold = 5;
+my $confidence = 95;
+my $resamples = 2000;
+my $save = 0;
+my $help = 0;
+
+# The areas of the library the benchmarks cover, reported alongside each benchmark
+my @groups = (
+	[ qr/^mmio_/, 'MMIO path' ],
+	[ qr{^(event_check_|events/|wake_)}, 'event harvest' ],
+	[ qr/^(afu_|irq_alloc)/, 'context setup' ],
+);
+
+sub usage {
+	print STDERR <<"EOF";
+Usage: $PROGRAM_NAME [ options ] RESULT.json...
+	--baselines DIR		Directory holding the baselines (default $baselines)
+	--host-class NAME	Baseline to compare against (default derived from the CPU, or LIBOCXL_BENCH_HOST_CLASS)
+	--threshold PERCENT	Smallest change to report (default $threshold)
+	--confidence PERCENT	Confidence level of the intervals (default $confidence)
+	--resamples N		Bootstrap resamples per benchmark (default $resamples)
+	--save			Store the results as the baseline, rather than comparing them
+	--help			Print this message
+EOF
+	exit 2;
+}
+
+# Derive a name for the class of host, from the architecture, CPU model & CPU count
+sub default_host_class {
+	my $machine = `uname -m`;
+	chomp $machine;
+
+	my $model = 'unknown';
+	my $cpus = 0;
+	if (open(my $cpuinfo, '<', '/proc/cpuinfo')) {
+		while (<$cpuinfo>) {
+			if (/^(model name|cpu)\s*:\s*(.+)$/ && $model eq 'unknown') {
+				$model = $2;
+			}
+			$cpus++ if /^processor\s*:/;
+		}
+		close $cpuinfo;
+	}
+
+	my $class = "$machine-$model-${cpus}cpu";
+	$class =~ s/[^A-Za-z0-9.]+/-/g;
+	$class =~ s/-+$//;
+
+	return $class;
+}
+
+sub read_json {
+	my ($path) = @_;
+
+	open(my $file, '<', $path) or die "Could not open '$path': $OS_ERROR\n";
+	local $INPUT_RECORD_SEPARATOR;
+	my $text = <$file>;
+	close $file;
+
+	return decode_json($text);
+}
+
+# Pool the samples of each benchmark across trials
+sub merge_results {
+	my (@paths) = @_;
+	my (%benchmarks, @order, $build);
+
+	for my $path (@paths) {
+		my $run = read_json($path);
+		$build //= $run->{build};
+
+		for my $bench (@{$run->{benchmarks}}) {
+			my $name = $bench->{name};
+			if (!$benchmarks{$name}) {
+				$benchmarks{$name} = { name => $name, unit => $bench->{unit}, trials => [] };
+				push @order, $name;
+			}
+			push @{$benchmarks{$name}{trials}}, $bench->{samples};
+		}
+	}
+
+	return {
+		build => $build,
+		benchmarks => [ map { $benchmarks{$_} } @order ],
+	};
+}
+
+sub median {
+	my @sorted = sort { $a <=> $b } @_;
+	my $count = scalar @sorted;
+
+	return ($count % 2) ? $sorted[$count / 2] : ($sorted[$count / 2 - 1] + $sorted[$count / 2]) / 2;
+}
+
+sub pooled {
+	my ($trials) = @_;
+
+	return map { @$_ } @$trials;
+}
+
+# Draw a bootstrap resample of the trials, then of the samples within each drawn trial
+sub resample {
+	my ($trials) = @_;
+
+	return map {
+		my $trial = $trials->[int(rand(@$trials))];
+		map { $trial->[int(rand(@$trial))] } @$trial;
+	} @$trials;
+}
+
+# Bootstrap a confidence interval of the ratio of the new median to the baseline median
+sub ratio_interval {
+	my ($baseline, $new) = @_;
+	my @ratios;
+
+	for (1 .. $resamples) {
+		my @b = resample($baseline);
+		my @n = resample($new);
+		my $b_median = median(@b);
+		push @ratios, $b_median ? median(@n) / $b_median : 1;
+	}
+
+	@ratios = sort { $a <=> $b } @ratios;
+	my $tail = (100 - $confidence) / 200;
+
+	return ($ratios[int($tail * ($resamples - 1))], $ratios[int((1 - $tail) * ($resamples - 1) + 0.5)]);
+}
+
+sub group_of {
+	my ($name) = @_;
+
+	for my $group (@groups) {
+		return $group->[1] if $name =~ $group->[0];
+	}
+
+	return 'other';
+}
+
+# Rates (eg. events/s) improve as they rise, times as they fall
+sub higher_is_better {
+	my ($unit) = @_;
+
+	return $unit =~ m{/s$};
+}
+
+GetOptions(
+	'baselines=s' => \$baselines,
+	'host-class=s' => \$host_class,
+	'threshold=f' => \$threshold,
+	'confidence=f' => \$confidence,
+	'resamples=i' => \$resamples,
+	'save' => \$save,
+	'help' => \$help,
+) or usage();
+
+usage() if $help || !@ARGV || $confidence <= 0 || $confidence >= 100 || $resamples < 1;
+
+$host_class //= default_host_class();
+my $baseline_path = "$baselines/$host_class.json";
+
+my $results = eval { merge_results(@ARGV) };
+if (!$results) {
+	print STDERR $EVAL_ERROR;
+	exit 2;
+}
+
+if ($save) {
+	mkdir $baselines unless -d $baselines;
+	$results->{host_class} = $host_class;
+	$results->{timestamp} = time;
+
+	open(my $file, '>', $baseline_path) or do {
+		print STDERR "Could not write '$baseline_path': $OS_ERROR\n";
+		exit 2;
+	};
+	print $file JSON::PP->new->canonical->pretty->encode($results);
+	close $file;
+
+	printf "Saved %d benchmarks from %d file(s) as the baseline for '%s'\n",
+		scalar @{$results->{benchmarks}}, scalar @ARGV, $host_class;
+	exit 0;
+}
+
+my $baseline = eval { read_json($baseline_path) };
+if (!$baseline) {
+	print STDERR "No baseline for host class '$host_class' in '$baselines', create one with --save\n";
+	exit 2;
+}
+
+my %baseline_benchmarks = map { $_->{name} => $_ } @{$baseline->{benchmarks}};
+
+# Make the intervals reproducible for the same inputs
+srand(1);
+
+printf "Comparing against the baseline for '%s' (%d%% confidence, %g%% threshold)\n",
+	$host_class, $confidence, $threshold;
+printf "%-28s %-14s %14s %14s %9s %21s  %s\n",
+	'benchmark', 'group', 'baseline', 'new', 'change', "$confidence% interval", 'verdict';
+
+my (@regressions, $compared);
+for my $bench (@{$results->{benchmarks}}) {
+	my $name = $bench->{name};
+	my $base = $baseline_benchmarks{$name};
+	if (!$base) {
+		printf "%-28s %-14s %14s %14s\n", $name, group_of($name), '-', 'new benchmark';
+		next;
+	}
+	if ($base->{unit} ne $bench->{unit}) {
+		printf "%-28s %-14s unit changed from %s to %s\n", $name, group_of($name), $base->{unit}, $bench->{unit};
+		next;
+	}
+
+	my $base_median = median(pooled($base->{trials}));
+	my $new_median = median(pooled($bench->{trials}));
+	my $ratio = $base_median ? $new_median / $base_median : 1;
+	my ($low, $high) = ratio_interval($base->{trials}, $bench->{trials});
+
+	# The bounds of the slowdown factor nearest to no change, which must clear the threshold
+	my ($worse, $better) = higher_is_better($bench->{unit}) ? (1 / $high, 1 / $low) : ($low, $high);
+	my $limit = $threshold / 100;
+	my $verdict = 'unchanged';
+	if ($worse - 1 > $limit) {
+		$verdict = 'REGRESSION';
+		push @regressions, $name;
+	} elsif (1 - $better > $limit) {
+		$verdict = 'improved';
+	}
+
+	printf "%-28s %-14s %14.2f %14.2f %+8.1f%% [%+8.1f%%, %+8.1f%%]  %s\n",
+		$name, group_of($name), $base_median, $new_median, ($ratio - 1) * 100,
+		($low - 1) * 100, ($high - 1) * 100, $verdict;
+	$compared++;
+}
+
+for my $name (sort keys %baseline_benchmarks) {
+	if (!grep { $_->{name} eq $name } @{$results->{benchmarks}}) {
+		printf "%-28s %-14s missing from the results\n", $name, group_of($name);
+	}
+}
+
+if (@regressions) {
+	my %by_group;
+	push @{$by_group{group_of($_)}}, $_ for @regressions;
+	print "\nRegressions:\n";
+	for my $group (sort keys %by_group) {
+		printf "  %-14s %s\n", $group, join(', ', @{$by_group{$group}});
+	}
+	exit 1;
+}
+
+printf "\nNo regressions in %d benchmarks\n", $compared // 0;
+exit 0;
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The benchmark harness: calibrates & repeats measurements, prints a summary, and
+ * records the results as JSON for comparison between builds.
+ *
+ * Each benchmark is run for a number of repetitions, each of enough iterations to take
+ * at least the minimum time. Every repetition is recorded as a sample, so comparisons can
+ * account for the run to run variation.
+ */
+
+#include "libocxl_internal.h"
+#include <errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "static.h"
+#include "bench.h"
+
+/* Calibration stops doubling the iterations at this many */
+#define MAX_ITERATIONS	(1ULL << 32)
+
+typedef struct bench_result {
+	char *name;
+	char *unit;
+	double *samples;
+	size_t count;
+	uint64_t iterations;
+	struct bench_result *next;
+} bench_result;
+
+static const bench_suite *current_suite;
+static const char *json_path;
+static const char *filter;
+static unsigned repetitions = BENCH_DEFAULT_REPETITIONS;
+static double min_time = BENCH_DEFAULT_MIN_TIME;
+static bench_result *results;
+static bench_result **results_tail = &results;
+static bool failed;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [ options ]\n", name);
+	if (current_suite->usage) {
+		fputs(current_suite->usage, stderr);
+	}
+	fprintf(stderr, "\t--json FILE\t\tWrite the results to FILE as JSON\n");
+	fprintf(stderr, "\t--filter PATTERN\tOnly run benchmarks whose names match the glob PATTERN\n");
+	fprintf(stderr, "\t--repetitions N\t\tSamples to take of each benchmark (default %u)\n",
+	        BENCH_DEFAULT_REPETITIONS);
+	fprintf(stderr, "\t--min-time SECONDS\tMinimum duration of each sample (default %g)\n",
+	        BENCH_DEFAULT_MIN_TIME);
+	fprintf(stderr, "\t--help\t\t\tPrint this message\n");
+}
+
+/**
+ * Parse the benchmark options
+ *
+ * @param argc the argument count
+ * @param argv the arguments
+ * @param suite the benchmark suite
+ * @return 0 on success, -1 if the arguments are invalid
+ */
+int bench_init(int argc, char **argv, const bench_suite *suite)
+{
+	int opt, option_index;
+	struct option long_options[BENCH_MAX_OPTIONS + 6] = {
+		{"json", required_argument, 0, 'j'},
+		{"filter", required_argument, 0, 'f'},
+		{"repetitions", required_argument, 0, 'r'},
+		{"min-time", required_argument, 0, 't'},
+		{"help", no_argument, 0, 'h'},
+	};
+	size_t option_count = 5;
+
+	current_suite = suite;
+
+	for (const struct option *option = suite->options; option && option->name; option++) {
+		if (option_count == BENCH_MAX_OPTIONS + 5) {
+			fprintf(stderr, "Too many options for suite '%s'\n", suite->name);
+			return -1;
+		}
+		long_options[option_count++] = *option;
+	}
+
+	while ((opt = getopt_long(argc, argv, "j:f:r:t:h", long_options, &option_index)) >= 0) {
+		if (opt >= BENCH_OPTION_BASE) {
+			if (suite->handle_option(opt, optarg)) {
+				usage(argv[0]);
+				return -1;
+			}
+			continue;
+		}
+
+		switch (opt) {
+		case 'j':
+			json_path = optarg;
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'r':
+			repetitions = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			min_time = strtod(optarg, NULL);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!repetitions || min_time < 0) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	printf("%-32s %22s %14s %10s %12s\n", "benchmark", "median", "min", "stddev", "iterations");
+
+	return 0;
+}
+
+/**
+ * Point the library at the virtual devices
+ *
+ * @return 0 on success, -1 on error
+ */
+int bench_setup_devices()
+{
+	struct stat sysfs_stat;
+
+	ocxl_set_sys_path(BENCH_SYSFS_PATH);
+	ocxl_set_dev_path(virtocxl_dev_path());
+	ocxl_enable_messages(OCXL_ERRORS);
+
+	if (stat(BENCH_SYSFS_PATH, &sysfs_stat) && mkdir(BENCH_SYSFS_PATH, 0775)) {
+		fprintf(stderr, "Could not mkdir '%s': %d: %s\n", BENCH_SYSFS_PATH, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Get the current time
+ * @return the monotonic time in nanoseconds
+ */
+uint64_t bench_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Compare two uint64_t, for qsort()
+ */
+int bench_compare_u64(const void *a, const void *b)
+{
+	uint64_t left = *(const uint64_t *)a;
+	uint64_t right = *(const uint64_t *)b;
+
+	return (left > right) - (left < right);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double left = *(const double *)a;
+	double right = *(const double *)b;
+
+	return (left > right) - (left < right);
+}
+
+/**
+ * Get a percentile of sorted samples
+ *
+ * @param sorted the samples, in ascending order
+ * @param count the number of samples
+ * @param percentile the percentile (0-100)
+ * @return the sample at the percentile
+ */
+uint64_t bench_percentile(const uint64_t *sorted, uint64_t count, double percentile)
+{
+	uint64_t index = (uint64_t)(percentile / 100.0 * (count - 1) + 0.5);
+
+	return sorted[index];
+}
+
+/**
+ * Should a benchmark be run
+ *
+ * @param name the name of the benchmark
+ * @return true if no filter was given, or the name matches it
+ */
+bool bench_selected(const char *name)
+{
+	return !filter || !fnmatch(filter, name, 0);
+}
+
+/**
+ * Get the number of samples to take of each benchmark
+ *
+ * @return the number of repetitions
+ */
+unsigned bench_repetitions()
+{
+	return repetitions;
+}
+
+/**
+ * Record the samples of a benchmark, and print a summary of them
+ *
+ * @param name the name of the benchmark
+ * @param unit the unit of the samples
+ * @param samples the samples
+ * @param count the number of samples
+ * @param iterations the number of operations each sample is the result of, 0 if not applicable
+ */
+void bench_record(const char *name, const char *unit, const double *samples, size_t count, uint64_t iterations)
+{
+	bench_result *result = calloc(1, sizeof(*result));
+	double *sorted = malloc(count * sizeof(*sorted));
+
+	if (!result || !sorted || !count || !(result->samples = malloc(count * sizeof(*samples)))) {
+		fprintf(stderr, "Could not record benchmark '%s'\n", name);
+		free(sorted);
+		free(result);
+		failed = true;
+		return;
+	}
+
+	result->name = strdup(name);
+	result->unit = strdup(unit);
+	memcpy(result->samples, samples, count * sizeof(*samples));
+	result->count = count;
+	result->iterations = iterations;
+	*results_tail = result;
+	results_tail = &result->next;
+
+	memcpy(sorted, samples, count * sizeof(*samples));
+	qsort(sorted, count, sizeof(*sorted), compare_double);
+
+	double mean = 0, variance = 0;
+	for (size_t i = 0; i < count; i++) {
+		mean += samples[i] / count;
+	}
+	for (size_t i = 0; i < count; i++) {
+		variance += (samples[i] - mean) * (samples[i] - mean) / (count > 1 ? count - 1 : 1);
+	}
+
+	char median[40], min[32], count_text[24] = "-";
+	snprintf(median, sizeof(median), "%.2f %s", sorted[count / 2], unit);
+	snprintf(min, sizeof(min), "%.2f", sorted[0]);
+	if (iterations) {
+		snprintf(count_text, sizeof(count_text), "%llu", (unsigned long long)iterations);
+	}
+	printf("%-32s %22s %14s %9.1f%% %12s\n", name, median, min,
+	       mean ? 100.0 * sqrt(variance) / mean : 0.0, count_text);
+	fflush(stdout);
+
+	free(sorted);
+}
+
+/**
+ * Measure a benchmark in nanoseconds per operation
+ *
+ * The number of iterations is doubled until a run takes the minimum time, including any
+ * untimed setup, then that many iterations are run for each repetition.
+ *
+ * @param name the name of the benchmark
+ * @param fn the benchmark
+ * @param data passed to fn
+ * @return 0 on success (or if the benchmark is not selected), -1 on error
+ */
+int bench_run(const char *name, bench_fn fn, void *data)
+{
+	uint64_t iterations = 1, elapsed;
+	uint64_t min_ns = (uint64_t)(min_time * 1e9);
+
+	if (!bench_selected(name)) {
+		return 0;
+	}
+
+	double *samples = malloc(repetitions * sizeof(*samples));
+	if (!samples) {
+		goto err;
+	}
+
+	for (;;) {
+		// Calibrate on the wall time, as benchmarks may exclude costly setup from elapsed
+		uint64_t start = bench_now();
+		if (fn(data, iterations, &elapsed)) {
+			goto err;
+		}
+		uint64_t wall = bench_now() - start;
+		if (wall > elapsed) {
+			elapsed = wall;
+		}
+
+		if (elapsed >= min_ns || iterations >= MAX_ITERATIONS) {
+			break;
+		}
+
+		// Jump most of the way in one go once the run is long enough to time
+		if (elapsed > min_ns / 100) {
+			uint64_t target = (uint64_t)((double)iterations * min_ns / elapsed * 1.1) + 1;
+			iterations = (target > iterations * 2) ? target : iterations * 2;
+		} else {
+			iterations *= 2;
+		}
+	}
+
+	for (unsigned i = 0; i < repetitions; i++) {
+		if (fn(data, iterations, &elapsed)) {
+			goto err;
+		}
+		samples[i] = (double)elapsed / iterations;
+	}
+
+	bench_record(name, "ns/op", samples, repetitions, iterations);
+	free(samples);
+
+	return 0;
+
+err:
+	free(samples);
+	fprintf(stderr, "Benchmark '%s' failed\n", name);
+	failed = true;
+	return -1;
+}
+
+/**
+ * Write a string as a JSON string literal
+ *
+ * @param file the file to write to
+ * @param str the string
+ */
+static void json_string(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for (; *str; str++) {
+		switch (*str) {
+		case '"':
+			fputs("\\\"", file);
+			break;
+		case '\\':
+			fputs("\\\\", file);
+			break;
+		case '\n':
+			fputs("\\n", file);
+			break;
+		default:
+			if ((unsigned char)*str < 0x20) {
+				fprintf(file, "\\u%04x", *str);
+			} else {
+				fputc(*str, file);
+			}
+		}
+	}
+	fputc('"', file);
+}
+
+/**
+ * Write the results as JSON
+ *
+ * @param file the file to write to
+ */
+static void write_json(FILE *file)
+{
+	fprintf(file, "{\n\t\"suite\": ");
+	json_string(file, current_suite->name);
+	fprintf(file, ",\n\t\"build\": ");
+	json_string(file, ocxl_info());
+	fprintf(file, ",\n\t\"timestamp\": %lld,\n", (long long)time(NULL));
+	fprintf(file, "\t\"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+	fprintf(file, "\t\"repetitions\": %u,\n", repetitions);
+	fprintf(file, "\t\"min_time\": %g,\n", min_time);
+	fprintf(file, "\t\"benchmarks\": [");
+
+	for (bench_result *result = results; result; result = result->next) {
+		fprintf(file, "%s\n\t\t{\n\t\t\t\"name\": ", result == results ? "" : ",");
+		json_string(file, result->name);
+		fprintf(file, ",\n\t\t\t\"unit\": ");
+		json_string(file, result->unit);
+		fprintf(file, ",\n\t\t\t\"iterations\": %llu,\n\t\t\t\"samples\": [",
+		        (unsigned long long)result->iterations);
+		for (size_t i = 0; i < result->count; i++) {
+			fprintf(file, "%s%.4f", i ? ", " : "", result->samples[i]);
+		}
+		fprintf(file, "]\n\t\t}");
+	}
+
+	fprintf(file, "\n\t]\n}\n");
+}
+
+/**
+ * Write the results, and free them
+ *
+ * @return 0 if all benchmarks succeeded and the results were written, 1 otherwise
+ */
+int bench_finish()
+{
+	if (json_path) {
+		FILE *file = fopen(json_path, "w");
+		if (!file) {
+			fprintf(stderr, "Could not open '%s': %d: %s\n", json_path, errno, strerror(errno));
+			failed = true;
+		} else {
+			write_json(file);
+			if (fclose(file)) {
+				failed = true;
+			} else {
+				printf("Results written to '%s'\n", json_path);
+			}
+		}
+	}
+
+	while (results) {
+		bench_result *next = results->next;
+		free(results->name);
+		free(results->unit);
+		free(results->samples);
+		free(results);
+		results = next;
+	}
+	results_tail = &results;
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "virtocxl.h"
+
+/* The directory the virtual devices' sysfs entries are created in */
+#define BENCH_SYSFS_PATH	"/tmp/ocxl-test"
+
+/* Default measurement parameters */
+#define BENCH_DEFAULT_REPETITIONS	10
+#define BENCH_DEFAULT_MIN_TIME		0.01
+
+/**
+ * Run a benchmark
+ *
+ * The function performs the operation under test the given number of times, and reports
+ * the time taken, excluding any setup.
+ *
+ * @param data the data passed to bench_run()
+ * @param iterations the number of operations to perform
+ * @param[out] elapsed_ns the time taken by the operations
+ * @return 0 on success, -1 on error
+ */
+typedef int (*bench_fn)(void *data, uint64_t iterations, uint64_t *elapsed_ns);
+
+/* Suite specific options must use values from here up, they have no short form */
+#define BENCH_OPTION_BASE	256
+
+/* The most suite specific options */
+#define BENCH_MAX_OPTIONS	16
+
+/**
+ * Handle a suite specific option
+ *
+ * @param opt the value of the option
+ * @param arg the argument of the option, or NULL
+ * @return 0 on success, -1 if the argument is invalid
+ */
+typedef int (*bench_option_fn)(int opt, const char *arg);
+
+/**
+ * A suite of benchmarks
+ */
+typedef struct bench_suite {
+	const char *name; /**< The name of the suite, recorded in the results */
+	const struct option *options; /**< Suite specific options, terminated by a zeroed entry, or NULL */
+	const char *usage; /**< Help for the suite specific options, or NULL */
+	bench_option_fn handle_option; /**< Called for each suite specific option */
+} bench_suite;
+
+int bench_init(int argc, char **argv, const bench_suite *suite);
+bool bench_selected(const char *name);
+unsigned bench_repetitions();
+int bench_run(const char *name, bench_fn fn, void *data);
+void bench_record(const char *name, const char *unit, const double *samples, size_t count, uint64_t iterations);
+int bench_finish();
+
+int bench_setup_devices();
+uint64_t bench_now();
+int bench_compare_u64(const void *a, const void *b);
+uint64_t bench_percentile(const uint64_t *sorted, uint64_t count, double percentile);
+
+#endif /* _BENCH_H */
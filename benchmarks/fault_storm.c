@@ -0,0 +1,296 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how quickly ocxl_afu_event_check() drains a storm of translation faults raised
+ * by a virtual AFU, and how much a concurrent fault storm delays the delivery of an IRQ.
+ */
+
+#include "libocxl_internal.h"
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+#define FAULT_BASE	0x7f0000000000ULL
+#define MAX_EVENTS	64
+
+static double duration = 1.0;
+static uint64_t samples = 10000;
+static double storm_rate = 0;
+static uint32_t fault_addresses = 64;
+static uint32_t faults_per_irq = 0;
+
+/**
+ * Start a storm of translation faults, optionally interleaved with an IRQ
+ *
+ * @param context the context to raise faults on
+ * @param handle the IRQ to interleave with the faults, if faults_per_irq is set
+ * @return the storm, or NULL on error
+ */
+static virtocxl_irq_storm *start_fault_storm(virtocxl_context *context, uint64_t *handle)
+{
+	virtocxl_irq_storm_config config = {
+		.handles = handle,
+		.handle_count = faults_per_irq ? 1 : 0,
+		.rate = storm_rate,
+		.fault_context = context,
+		.fault_base = FAULT_BASE,
+		.fault_addresses = fault_addresses,
+		.faults_per_irq = faults_per_irq,
+	};
+
+	return virtocxl_irq_storm_start(&config);
+}
+
+/**
+ * Measure the rate at which faults are drained by ocxl_afu_event_check()
+ *
+ * @param afu the AFU
+ * @param context the virtual context of the AFU
+ * @param handle an IRQ to interleave with the faults
+ * @param batch the number of events to collect per call
+ * @return 0 on success, -1 on error
+ */
+static int bench_fault_throughput(ocxl_afu_h afu, virtocxl_context *context, uint64_t handle, uint16_t batch)
+{
+	ocxl_event events[MAX_EVENTS];
+	uint64_t faults = 0, irqs = 0, calls = 0, failed;
+	int count;
+
+	virtocxl_irq_storm *storm = start_fault_storm(context, &handle);
+	if (!storm) {
+		fprintf(stderr, "Could not start the fault storm\n");
+		return -1;
+	}
+
+	uint64_t start = bench_now();
+	uint64_t end = start + (uint64_t)(duration * 1e9);
+	uint64_t now = start;
+	while (now < end) {
+		count = ocxl_afu_event_check(afu, 10, events, batch);
+		if (count < 0) {
+			fprintf(stderr, "ocxl_afu_event_check failed\n");
+			(void)virtocxl_irq_storm_stop(storm, false, NULL);
+			return -1;
+		}
+
+		calls++;
+		for (int i = 0; i < count; i++) {
+			if (events[i].type == OCXL_EVENT_TRANSLATION_FAULT) {
+				faults++;
+			} else {
+				irqs += events[i].irq.count;
+			}
+		}
+		now = bench_now();
+	}
+
+	uint64_t raised = virtocxl_irq_storm_stop(storm, false, &failed);
+	double elapsed = (now - start) / 1e9;
+
+	// Drain what is left so the next run starts from an empty queue
+	while ((count = ocxl_afu_event_check(afu, 0, events, MAX_EVENTS)) > 0) {
+	}
+
+	printf("  batch %-3u %12.0f faults/s  %10.0f IRQs/s  %6.2f events/call  %12llu raised  %10llu dropped\n",
+	       batch, faults / elapsed, irqs / elapsed, calls ? (double)(faults + irqs) / calls : 0.0,
+	       (unsigned long long)raised, (unsigned long long)failed);
+
+	return 0;
+}
+
+/**
+ * Measure the time from an IRQ being triggered to it being reported by ocxl_afu_event_check()
+ *
+ * Any faults reported in the meantime are handled as part of the same calls.
+ *
+ * @param afu the AFU
+ * @param handle the IRQ to trigger
+ * @param label the name of the run
+ * @return 0 on success, -1 on error
+ */
+static int bench_irq_latency(ocxl_afu_h afu, uint64_t handle, const char *label)
+{
+	ocxl_event events[MAX_EVENTS];
+	uint64_t faults = 0;
+
+	uint64_t *latencies = malloc(samples * sizeof(*latencies));
+	if (!latencies) {
+		fprintf(stderr, "Could not allocate %llu samples\n", (unsigned long long)samples);
+		return -1;
+	}
+
+	for (uint64_t sample = 0; sample < samples; sample++) {
+		bool seen = false;
+		uint64_t start = bench_now();
+
+		if (virtocxl_irq_fire(handle)) {
+			fprintf(stderr, "Could not trigger the IRQ\n");
+			free(latencies);
+			return -1;
+		}
+
+		while (!seen) {
+			int count = ocxl_afu_event_check(afu, 1000, events, MAX_EVENTS);
+			if (count <= 0) {
+				fprintf(stderr, "The IRQ was not reported\n");
+				free(latencies);
+				return -1;
+			}
+
+			for (int i = 0; i < count; i++) {
+				if (events[i].type == OCXL_EVENT_IRQ && events[i].irq.handle == handle) {
+					seen = true;
+				} else if (events[i].type == OCXL_EVENT_TRANSLATION_FAULT) {
+					faults++;
+				}
+			}
+		}
+		latencies[sample] = bench_now() - start;
+	}
+
+	qsort(latencies, samples, sizeof(*latencies), bench_compare_u64);
+	printf("  %-10s p50 %8llu ns  p99 %8llu ns  p99.9 %8llu ns  max %9llu ns  (%llu faults handled)\n", label,
+	       (unsigned long long)bench_percentile(latencies, samples, 50),
+	       (unsigned long long)bench_percentile(latencies, samples, 99),
+	       (unsigned long long)bench_percentile(latencies, samples, 99.9),
+	       (unsigned long long)latencies[samples - 1], (unsigned long long)faults);
+
+	free(latencies);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [ options ]\n", name);
+	fprintf(stderr, "\t--duration\tSeconds to run each throughput measurement (default 1)\n");
+	fprintf(stderr, "\t--samples\tIRQ latency samples per measurement (default 10000)\n");
+	fprintf(stderr, "\t--rate\t\tStorm triggers per second, 0 for as fast as possible (default 0)\n");
+	fprintf(stderr, "\t--addresses\tDistinct fault addresses (default 64)\n");
+	fprintf(stderr, "\t--faults-per-irq\tInterleave an IRQ after this many faults, 0 for none (default 0)\n");
+	fprintf(stderr, "\t--help\t\tPrint this message\n");
+}
+
+int main(int argc, char **argv)
+{
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_irq_h ping_irq, storm_irq;
+	int opt, option_index;
+	int rc = 1;
+
+	static struct option long_options[] = {
+		{"duration", required_argument, 0, 'd'},
+		{"samples", required_argument, 0, 'n'},
+		{"rate", required_argument, 0, 'r'},
+		{"addresses", required_argument, 0, 'a'},
+		{"faults-per-irq", required_argument, 0, 'i'},
+		{"help", no_argument, 0, 'h'},
+		{NULL, 0, 0, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "d:n:r:a:i:h", long_options, &option_index)) >= 0) {
+		switch (opt) {
+		case 'd':
+			duration = strtod(optarg, NULL);
+			break;
+		case 'n':
+			samples = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			storm_rate = strtod(optarg, NULL);
+			break;
+		case 'a':
+			fault_addresses = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			faults_per_irq = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (duration <= 0 || !samples) {
+		usage(argv[0]);
+		exit(1);
+	}
+
+	if (bench_setup_devices()) {
+		exit(1);
+	}
+
+	virtocxl_device *device = create_ocxl_device("IBM,FaultStorm", 4096, 4096);
+	if (!device || virtocxl_devices_wait(&device, 1, 5000)) {
+		fprintf(stderr, "Could not create the virtual AFU\n");
+		exit(1);
+	}
+
+	if (OCXL_OK != ocxl_afu_open_from_dev(virtocxl_device_path(device), &afu) ||
+	    OCXL_OK != ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE) ||
+	    OCXL_OK != ocxl_irq_alloc(afu, NULL, &ping_irq) ||
+	    OCXL_OK != ocxl_irq_alloc(afu, NULL, &storm_irq)) {
+		fprintf(stderr, "Could not set up the virtual AFU\n");
+		goto out;
+	}
+
+	uint64_t ping_handle = ocxl_irq_get_handle(afu, ping_irq);
+	uint64_t storm_handle = ocxl_irq_get_handle(afu, storm_irq);
+	virtocxl_context *context = virtocxl_device_find_context(device, ocxl_afu_get_pasid(afu));
+
+	char rate[32] = "unlimited";
+	if (storm_rate > 0) {
+		snprintf(rate, sizeof(rate), "%.0f/s", storm_rate);
+	}
+	printf("Fault storm: %u addresses, rate %s, %u faults per IRQ, queue depth %u\n",
+	       fault_addresses, rate, faults_per_irq, VIRTOCXL_FAULT_QUEUE_DEPTH);
+
+	printf("Fault throughput (%.1fs per batch size):\n", duration);
+	static const uint16_t batches[] = { 1, 8, MAX_EVENTS };
+	for (size_t i = 0; i < sizeof(batches) / sizeof(*batches); i++) {
+		if (bench_fault_throughput(afu, context, storm_handle, batches[i])) {
+			goto out;
+		}
+	}
+
+	printf("IRQ latency (%llu samples):\n", (unsigned long long)samples);
+	if (bench_irq_latency(afu, ping_handle, "quiet")) {
+		goto out;
+	}
+
+	virtocxl_irq_storm *storm = start_fault_storm(context, &storm_handle);
+	if (!storm) {
+		fprintf(stderr, "Could not start the fault storm\n");
+		goto out;
+	}
+	int latency_rc = bench_irq_latency(afu, ping_handle, "storm");
+	(void)virtocxl_irq_storm_stop(storm, false, NULL);
+	if (latency_rc) {
+		goto out;
+	}
+
+	rc = 0;
+
+out:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	virtocxl_device_destroy(device);
+
+	return rc;
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Microbenchmarks of the library's hot paths, run against an in-process virtual AFU.
+ *
+ * The per-PASID MMIO area of the virtual AFU is ordinary shared memory, so the MMIO
+ * benchmarks measure the library's overhead on top of a memory access, rather than the
+ * latency of a device.
+ */
+
+#include "libocxl_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include "static.h"
+#include "bench.h"
+
+#define AFU_NAME	"IBM,MicroBench"
+#define MMIO_SIZE	4096
+
+/* IRQs are allocated on a fresh AFU in chunks of this many, to stay within the descriptor limits */
+#define IRQ_CHUNK	128
+
+/* The number of IRQs pending for the event throughput benchmark */
+#define EVENT_IRQS	64
+
+typedef struct microbench {
+	virtocxl_device *device;
+	ocxl_afu_h afu;
+	ocxl_mmio_h pp_mmio;
+	ocxl_irq_h irqs[EVENT_IRQS];
+	uint64_t handles[EVENT_IRQS];
+} microbench;
+
+typedef enum {
+	PHASE_OPEN,
+	PHASE_ATTACH,
+	PHASE_CLOSE,
+} lifecycle_phase;
+
+typedef struct lifecycle_bench {
+	microbench *bench;
+	lifecycle_phase phase;
+} lifecycle_bench;
+
+/* Results are accumulated here, so the compiler can't discard the reads */
+uint64_t bench_sink;
+
+static int bench_mmio_read64(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	uint64_t value, sum = 0;
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (OCXL_OK != ocxl_mmio_read64(bench->pp_mmio, (i & 0x1f) * 8, OCXL_MMIO_LITTLE_ENDIAN, &value)) {
+			return -1;
+		}
+		sum += value;
+	}
+	*elapsed_ns = bench_now() - start;
+
+	bench_sink += sum;
+	return 0;
+}
+
+static int bench_mmio_write64(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (OCXL_OK != ocxl_mmio_write64(bench->pp_mmio, (i & 0x1f) * 8, OCXL_MMIO_LITTLE_ENDIAN, i)) {
+			return -1;
+		}
+	}
+	*elapsed_ns = bench_now() - start;
+
+	return 0;
+}
+
+/**
+ * The cost of the memory access alone, with the barriers the library inserts around MMIO,
+ * as a baseline for the MMIO benchmarks
+ */
+static int bench_mmio_raw_read64(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	volatile uint64_t *addr = (volatile uint64_t *)bench->pp_mmio->start;
+	uint64_t sum = 0;
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		__sync_synchronize();
+		sum += addr[i & 0x1f];
+		__sync_synchronize();
+	}
+	*elapsed_ns = bench_now() - start;
+
+	bench_sink += sum;
+	return 0;
+}
+
+static int bench_mmio_check(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (OCXL_OK != mmio_check(bench->pp_mmio, (i & 0x1f) * 8, 8)) {
+			return -1;
+		}
+	}
+	*elapsed_ns = bench_now() - start;
+
+	return 0;
+}
+
+/**
+ * Allocate IRQs, timing only the allocations
+ *
+ * The AFUs the IRQs are allocated on are opened, attached & closed outside the timed region.
+ */
+static int bench_irq_alloc(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	ocxl_irq_h irq;
+
+	*elapsed_ns = 0;
+	while (iterations) {
+		ocxl_afu_h afu;
+		uint64_t chunk = (iterations < IRQ_CHUNK) ? iterations : IRQ_CHUNK;
+
+		if (OCXL_OK != ocxl_afu_open_from_dev(virtocxl_device_path(bench->device), &afu)) {
+			return -1;
+		}
+		if (OCXL_OK != ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE)) {
+			ocxl_afu_close(afu);
+			return -1;
+		}
+
+		uint64_t start = bench_now();
+		for (uint64_t i = 0; i < chunk; i++) {
+			if (OCXL_OK != ocxl_irq_alloc(afu, NULL, &irq)) {
+				ocxl_afu_close(afu);
+				return -1;
+			}
+		}
+		*elapsed_ns += bench_now() - start;
+
+		ocxl_afu_close(afu);
+		iterations -= chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * The cost of checking for events when there are none
+ */
+static int bench_event_check_empty(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	ocxl_event events[EVENT_IRQS];
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (ocxl_afu_event_check(bench->afu, 0, events, EVENT_IRQS) != 0) {
+			return -1;
+		}
+	}
+	*elapsed_ns = bench_now() - start;
+
+	return 0;
+}
+
+/**
+ * The time from triggering an IRQ to it being reported by ocxl_afu_event_check()
+ */
+static int bench_event_check_latency(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	ocxl_event events[EVENT_IRQS];
+
+	uint64_t start = bench_now();
+	for (uint64_t i = 0; i < iterations; i++) {
+		if (virtocxl_irq_fire(bench->handles[0])) {
+			return -1;
+		}
+
+		int count;
+		while ((count = ocxl_afu_event_check(bench->afu, 0, events, EVENT_IRQS)) == 0) {
+		}
+		if (count != 1 || events[0].type != OCXL_EVENT_IRQ) {
+			return -1;
+		}
+	}
+	*elapsed_ns = bench_now() - start;
+
+	return 0;
+}
+
+/**
+ * The time per event to drain a number of pending IRQs
+ *
+ * Triggering the IRQs is excluded from the timing.
+ */
+static int bench_event_check_throughput(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	microbench *bench = data;
+	ocxl_event events[EVENT_IRQS];
+
+	*elapsed_ns = 0;
+	while (iterations) {
+		uint64_t batch = (iterations < EVENT_IRQS) ? iterations : EVENT_IRQS;
+
+		for (uint64_t i = 0; i < batch; i++) {
+			if (virtocxl_irq_fire(bench->handles[i])) {
+				return -1;
+			}
+		}
+
+		uint64_t seen = 0;
+		uint64_t start = bench_now();
+		while (seen < batch) {
+			int count = ocxl_afu_event_check(bench->afu, 0, events, EVENT_IRQS);
+			if (count <= 0) {
+				return -1;
+			}
+			seen += count;
+		}
+		*elapsed_ns += bench_now() - start;
+
+		iterations -= batch;
+	}
+
+	return 0;
+}
+
+/**
+ * Open, attach & close an AFU, timing only one of the phases
+ */
+static int bench_lifecycle(void *data, uint64_t iterations, uint64_t *elapsed_ns)
+{
+	lifecycle_bench *lifecycle = data;
+	const char *path = virtocxl_device_path(lifecycle->bench->device);
+	ocxl_afu_h afu;
+
+	*elapsed_ns = 0;
+	for (uint64_t i = 0; i < iterations; i++) {
+		uint64_t start = bench_now();
+		if (OCXL_OK != ocxl_afu_open_from_dev(path, &afu)) {
+			return -1;
+		}
+		uint64_t opened = bench_now();
+		if (OCXL_OK != ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE)) {
+			ocxl_afu_close(afu);
+			return -1;
+		}
+		uint64_t attached = bench_now();
+		ocxl_afu_close(afu);
+		uint64_t closed = bench_now();
+
+		switch (lifecycle->phase) {
+		case PHASE_OPEN:
+			*elapsed_ns += opened - start;
+			break;
+		case PHASE_ATTACH:
+			*elapsed_ns += attached - opened;
+			break;
+		case PHASE_CLOSE:
+			*elapsed_ns += closed - attached;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * Create the virtual AFU, and open an AFU on it with the per-PASID MMIO area mapped and IRQs allocated
+ *
+ * @param bench the benchmark state to populate
+ * @return 0 on success, -1 on error
+ */
+static int setup(microbench *bench)
+{
+	bench->device = create_ocxl_device(AFU_NAME, MMIO_SIZE, MMIO_SIZE);
+	if (!bench->device || virtocxl_devices_wait(&bench->device, 1, 5000)) {
+		fprintf(stderr, "Could not create the virtual AFU\n");
+		return -1;
+	}
+
+	if (OCXL_OK != ocxl_afu_open_from_dev(virtocxl_device_path(bench->device), &bench->afu) ||
+	    OCXL_OK != ocxl_afu_attach(bench->afu, OCXL_ATTACH_FLAGS_NONE) ||
+	    OCXL_OK != ocxl_mmio_map(bench->afu, OCXL_PER_PASID_MMIO, &bench->pp_mmio)) {
+		fprintf(stderr, "Could not set up the virtual AFU\n");
+		return -1;
+	}
+
+	for (size_t i = 0; i < EVENT_IRQS; i++) {
+		if (OCXL_OK != ocxl_irq_alloc(bench->afu, NULL, &bench->irqs[i])) {
+			fprintf(stderr, "Could not allocate IRQs\n");
+			return -1;
+		}
+		bench->handles[i] = ocxl_irq_get_handle(bench->afu, bench->irqs[i]);
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	microbench bench = { .afu = OCXL_INVALID_AFU };
+	lifecycle_bench open_phase = { &bench, PHASE_OPEN };
+	lifecycle_bench attach_phase = { &bench, PHASE_ATTACH };
+	lifecycle_bench close_phase = { &bench, PHASE_CLOSE };
+	const bench_suite suite = { .name = "microbench" };
+	int rc = 1;
+
+	if (bench_init(argc, argv, &suite)) {
+		exit(1);
+	}
+
+	if (bench_setup_devices() || setup(&bench)) {
+		goto out;
+	}
+
+	bench_run("mmio_raw_read64", bench_mmio_raw_read64, &bench);
+	bench_run("mmio_read64", bench_mmio_read64, &bench);
+	bench_run("mmio_write64", bench_mmio_write64, &bench);
+	bench_run("mmio_check", bench_mmio_check, &bench);
+	bench_run("irq_alloc", bench_irq_alloc, &bench);
+	bench_run("event_check_empty", bench_event_check_empty, &bench);
+	bench_run("event_check_latency", bench_event_check_latency, &bench);
+	bench_run("event_check_throughput", bench_event_check_throughput, &bench);
+	bench_run("afu_open", bench_lifecycle, &open_phase);
+	bench_run("afu_attach", bench_lifecycle, &attach_phase);
+	bench_run("afu_close", bench_lifecycle, &close_phase);
+
+	rc = bench_finish();
+
+out:
+	if (bench.afu) {
+		ocxl_afu_close(bench.afu);
+	}
+	if (bench.device) {
+		virtocxl_device_destroy(bench.device);
+	}
+
+	return rc;
+}
@@ -0,0 +1,718 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how a single process scales as threads, contexts & IRQs are added, against an
+ * in-process virtual AFU.
+ *
+ * Each point of the sweep opens the given number of contexts (AFUs) with the given number
+ * of IRQs each, and shares them out between the threads: with more threads than contexts,
+ * threads share AFUs, with more contexts than threads, each thread services several.
+ * ocxl_afu_event_check() must not be called concurrently on the same AFU, so threads
+ * sharing an AFU serialise their calls with a lock, as an application would have to.
+ * At each point, three phases are measured:
+ *  - events: each thread triggers all the IRQs of its contexts, and harvests them with
+ *    ocxl_afu_event_check(), giving the aggregate harvest rate
+ *  - wake: the threads block waiting for events, while one IRQ at a time is triggered
+ *    from the main thread, giving the latency from trigger to the thread waking with it
+ *  - mmio: each thread writes to the per-PASID MMIO areas of its contexts, giving the
+ *    aggregate MMIO write rate. Threads sharing a context write adjacent words, so they
+ *    contend for the same cache line, as they would for a shared doorbell
+ *
+ * A summary then reports, for each metric, how each configuration scales with threads,
+ * and where adding threads stops paying.
+ */
+
+#include "libocxl_internal.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include "bench.h"
+
+#define AFU_NAME	"IBM,Scaling"
+#define MMIO_SIZE	4096
+#define MAX_EVENTS	64
+
+/* Limits of the sweep */
+#define MAX_LIST	16
+#define MAX_THREADS	256
+#define MAX_CONTEXTS	VIRTOCXL_DEFAULT_MAX_CONTEXTS
+
+/* Adding threads counts as still scaling while it gains at least this much */
+#define FLAT_GAIN	1.1
+
+/* Wake latency samples kept per repetition */
+#define MAX_WAKE_SAMPLES	100000
+
+/* How long a worker blocks before rechecking whether the phase is over */
+#define WAKE_POLL_MS	20
+
+/* How long to wait for a triggered IRQ to be reported before giving up */
+#define WAKE_TIMEOUT_NS	1000000000ULL
+
+enum {
+	OPT_THREADS = BENCH_OPTION_BASE,
+	OPT_CONTEXTS,
+	OPT_IRQS,
+	OPT_DURATION,
+};
+
+enum {
+	METRIC_EVENTS,
+	METRIC_WAKE_P99,
+	METRIC_MMIO,
+	METRIC_COUNT,
+};
+
+static const char *metric_names[METRIC_COUNT] = { "events", "wake_p99", "mmio_writes" };
+static const char *metric_units[METRIC_COUNT] = { "events/s", "ns", "writes/s" };
+
+typedef struct sweep_list {
+	unsigned values[MAX_LIST];
+	size_t count;
+} sweep_list;
+
+static sweep_list thread_list = { { 1, 2, 4, 8 }, 4 };
+static sweep_list context_list = { { 1, 2, 4, 8 }, 4 };
+static sweep_list irq_list = { { 1, 8, 64 }, 3 };
+static double duration = 0.1;
+
+typedef struct context {
+	ocxl_afu_h afu;
+	ocxl_mmio_h pp_mmio;
+	ocxl_irq_h *irqs;
+	uint64_t *handles;
+	bool shared;
+	pthread_mutex_t lock;
+} context;
+
+/* Each worker's counters have a cache line to themselves, so the benchmark itself does not contend */
+typedef struct worker {
+	pthread_t thread;
+	struct sweep_point *point;
+	unsigned index;
+	context **contexts;
+	unsigned context_count;
+	uint64_t count;
+	bool failed;
+} __attribute__((aligned(64))) worker;
+
+typedef struct sweep_point {
+	unsigned threads;
+	unsigned contexts;
+	unsigned irqs;
+	context *context;
+	worker *workers;
+	pthread_barrier_t barrier;
+	uint64_t deadline;
+	bool stop;
+
+	// The IRQ being waited for in the wake phase, and when it was triggered
+	uint64_t ping_handle;
+	uint64_t ping_time;
+	uint64_t ping_latency;
+	bool ping_seen;
+} sweep_point;
+
+/* The medians of each metric, indexed by context, IRQ & thread list positions */
+static double *medians[METRIC_COUNT];
+
+static int parse_list(sweep_list *list, const char *arg, unsigned max)
+{
+	char *end;
+
+	list->count = 0;
+	do {
+		unsigned long value = strtoul(arg, &end, 0);
+		if (end == arg || !value || value > max || list->count == MAX_LIST) {
+			return -1;
+		}
+		list->values[list->count++] = value;
+		arg = end + 1;
+	} while (*end == ',');
+
+	return *end ? -1 : 0;
+}
+
+static int handle_option(int opt, const char *arg)
+{
+	switch (opt) {
+	case OPT_THREADS:
+		return parse_list(&thread_list, arg, MAX_THREADS);
+	case OPT_CONTEXTS:
+		return parse_list(&context_list, arg, MAX_CONTEXTS);
+	case OPT_IRQS:
+		return parse_list(&irq_list, arg, INITIAL_IRQ_COUNT);
+	case OPT_DURATION:
+		duration = strtod(arg, NULL);
+		return (duration > 0) ? 0 : -1;
+	}
+
+	return -1;
+}
+
+/**
+ * Harvest the pending events of a context, taking its lock if it is shared between threads
+ *
+ * @return the number of events, or -1 on error
+ */
+static int harvest(context *ctx, ocxl_event *events)
+{
+	if (ctx->shared) {
+		pthread_mutex_lock(&ctx->lock);
+	}
+
+	int count = ocxl_afu_event_check(ctx->afu, 0, events, MAX_EVENTS);
+
+	if (ctx->shared) {
+		pthread_mutex_unlock(&ctx->lock);
+	}
+
+	return count;
+}
+
+/**
+ * Trigger all IRQs of the worker's contexts & harvest the events, until the deadline
+ */
+static void worker_events(worker *self)
+{
+	sweep_point *point = self->point;
+	ocxl_event events[MAX_EVENTS];
+
+	while (bench_now() < point->deadline) {
+		for (unsigned c = 0; c < self->context_count; c++) {
+			for (unsigned i = 0; i < point->irqs; i++) {
+				if (virtocxl_irq_fire(self->contexts[c]->handles[i])) {
+					self->failed = true;
+					return;
+				}
+			}
+		}
+
+		for (unsigned c = 0; c < self->context_count; c++) {
+			int count = harvest(self->contexts[c], events);
+			if (count < 0) {
+				self->failed = true;
+				return;
+			}
+			self->count += count;
+		}
+	}
+}
+
+/**
+ * Block waiting for events on the worker's contexts, timing the wake up for the IRQ being pinged
+ */
+static void worker_wake(worker *self)
+{
+	sweep_point *point = self->point;
+	ocxl_event events[MAX_EVENTS];
+	struct epoll_event ready[MAX_EVENTS];
+
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	self->failed = epoll_fd < 0;
+
+	// Each IRQ has its own descriptor, the AFU's event descriptor only reports translation faults
+	for (unsigned c = 0; !self->failed && c < self->context_count; c++) {
+		context *ctx = self->contexts[c];
+		for (unsigned i = 0; !self->failed && i < point->irqs; i++) {
+			struct epoll_event ev = { .events = EPOLLIN, .data.ptr = ctx };
+			self->failed = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, ocxl_irq_get_fd(ctx->afu, ctx->irqs[i]), &ev);
+		}
+	}
+
+	// The barrier must be reached even on failure, or the other threads would wait forever
+	pthread_barrier_wait(&point->barrier);
+
+	while (!self->failed && !__atomic_load_n(&point->stop, __ATOMIC_ACQUIRE)) {
+		int ready_count = epoll_wait(epoll_fd, ready, MAX_EVENTS, WAKE_POLL_MS);
+
+		for (int r = 0; r < ready_count; r++) {
+			context *ctx = ready[r].data.ptr;
+			int count = harvest(ctx, events);
+			uint64_t now = bench_now();
+
+			for (int e = 0; e < count; e++) {
+				if (events[e].type == OCXL_EVENT_IRQ &&
+				    events[e].irq.handle == __atomic_load_n(&point->ping_handle, __ATOMIC_ACQUIRE)) {
+					point->ping_latency = now - __atomic_load_n(&point->ping_time, __ATOMIC_ACQUIRE);
+					__atomic_store_n(&point->ping_seen, true, __ATOMIC_RELEASE);
+				}
+			}
+			self->count += (count > 0) ? count : 0;
+		}
+	}
+
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+	}
+}
+
+/**
+ * Write to the per-PASID MMIO areas of the worker's contexts, until the deadline
+ */
+static void worker_mmio(worker *self)
+{
+	sweep_point *point = self->point;
+	off_t offset = (self->index % (MMIO_SIZE / sizeof(uint64_t))) * sizeof(uint64_t);
+
+	for (;;) {
+		// Amortise reading the clock over a batch of writes
+		for (unsigned i = 0; i < 256; i++) {
+			ocxl_mmio_h mmio = self->contexts[i % self->context_count]->pp_mmio;
+			if (OCXL_OK != ocxl_mmio_write64(mmio, offset, OCXL_MMIO_LITTLE_ENDIAN, i)) {
+				self->failed = true;
+				return;
+			}
+		}
+		self->count += 256;
+
+		if (bench_now() >= point->deadline) {
+			return;
+		}
+	}
+}
+
+typedef void (*worker_fn)(worker *self);
+
+static worker_fn phase_fn;
+
+static void *worker_main(void *data)
+{
+	worker *self = data;
+
+	if (phase_fn != worker_wake) {
+		pthread_barrier_wait(&self->point->barrier);
+	}
+	phase_fn(self);
+
+	return NULL;
+}
+
+/**
+ * Start the workers on a phase
+ *
+ * The workers are released together once all have started, and the deadline is set then.
+ *
+ * @return 0 on success, -1 on error
+ */
+static int start_workers(sweep_point *point, worker_fn fn)
+{
+	phase_fn = fn;
+
+	if (pthread_barrier_init(&point->barrier, NULL, point->threads + 1)) {
+		return -1;
+	}
+
+	for (unsigned t = 0; t < point->threads; t++) {
+		worker *w = &point->workers[t];
+		w->count = 0;
+		w->failed = false;
+		if (pthread_create(&w->thread, NULL, worker_main, w)) {
+			// The workers already started can't be released from the barrier
+			fprintf(stderr, "Could not start worker %u\n", t);
+			exit(1);
+		}
+	}
+
+	point->deadline = bench_now() + (uint64_t)(duration * 1e9);
+	pthread_barrier_wait(&point->barrier);
+
+	return 0;
+}
+
+/**
+ * Wait for the workers to finish a phase
+ *
+ * @return the sum of the workers' counts, or UINT64_MAX if any failed
+ */
+static uint64_t join_workers(sweep_point *point)
+{
+	uint64_t total = 0;
+	bool failed = false;
+
+	for (unsigned t = 0; t < point->threads; t++) {
+		pthread_join(point->workers[t].thread, NULL);
+		total += point->workers[t].count;
+		failed |= point->workers[t].failed;
+	}
+
+	pthread_barrier_destroy(&point->barrier);
+
+	return failed ? UINT64_MAX : total;
+}
+
+/**
+ * Measure the aggregate rate of a phase
+ *
+ * @return the rate per second, or a negative value on error
+ */
+static double measure_rate(sweep_point *point, worker_fn fn)
+{
+	uint64_t start = bench_now();
+	if (start_workers(point, fn)) {
+		return -1;
+	}
+	uint64_t total = join_workers(point);
+	uint64_t elapsed = bench_now() - start;
+
+	return (total == UINT64_MAX) ? -1 : total / (elapsed / 1e9);
+}
+
+/**
+ * Harvest any events left pending by a previous phase
+ */
+static void drain_events(sweep_point *point)
+{
+	ocxl_event events[MAX_EVENTS];
+
+	for (unsigned c = 0; c < point->contexts; c++) {
+		while (ocxl_afu_event_check(point->context[c].afu, 0, events, MAX_EVENTS) > 0) {
+		}
+	}
+}
+
+/**
+ * Measure the 99th percentile of the latency from triggering an IRQ to a worker waking with it
+ *
+ * @return the latency in nanoseconds, or a negative value on error
+ */
+static double measure_wake(sweep_point *point, uint64_t *latencies)
+{
+	uint64_t samples = 0;
+	bool failed = false;
+
+	// A stale event for the pinged IRQ would be taken for the answer to the ping
+	drain_events(point);
+
+	__atomic_store_n(&point->stop, false, __ATOMIC_RELEASE);
+	if (start_workers(point, worker_wake)) {
+		return -1;
+	}
+
+	unsigned seed = 1;
+	while (bench_now() < point->deadline && samples < MAX_WAKE_SAMPLES) {
+		context *ctx = &point->context[rand_r(&seed) % point->contexts];
+		uint64_t handle = ctx->handles[rand_r(&seed) % point->irqs];
+
+		__atomic_store_n(&point->ping_seen, false, __ATOMIC_RELEASE);
+		__atomic_store_n(&point->ping_handle, handle, __ATOMIC_RELEASE);
+		uint64_t sent = bench_now();
+		__atomic_store_n(&point->ping_time, sent, __ATOMIC_RELEASE);
+		if (virtocxl_irq_fire(handle)) {
+			failed = true;
+			break;
+		}
+
+		while (!__atomic_load_n(&point->ping_seen, __ATOMIC_ACQUIRE)) {
+			if (bench_now() - sent > WAKE_TIMEOUT_NS) {
+				fprintf(stderr, "IRQ 0x%llx was not reported\n", (unsigned long long)handle);
+				failed = true;
+				break;
+			}
+			sched_yield();
+		}
+		if (failed) {
+			break;
+		}
+
+		latencies[samples++] = point->ping_latency;
+	}
+
+	__atomic_store_n(&point->stop, true, __ATOMIC_RELEASE);
+	if (join_workers(point) == UINT64_MAX || failed || !samples) {
+		return -1;
+	}
+
+	qsort(latencies, samples, sizeof(*latencies), bench_compare_u64);
+
+	return bench_percentile(latencies, samples, 99);
+}
+
+/**
+ * Open the contexts of a point, and share them out between the workers
+ *
+ * @return 0 on success, -1 on error
+ */
+static int setup_point(sweep_point *point, virtocxl_device *device)
+{
+	point->context = calloc(point->contexts, sizeof(*point->context));
+	point->workers = calloc(point->threads, sizeof(*point->workers));
+	if (!point->context || !point->workers) {
+		return -1;
+	}
+
+	for (unsigned c = 0; c < point->contexts; c++) {
+		context *ctx = &point->context[c];
+		ctx->shared = point->threads > point->contexts;
+		pthread_mutex_init(&ctx->lock, NULL);
+		ctx->irqs = calloc(point->irqs, sizeof(*ctx->irqs));
+		ctx->handles = calloc(point->irqs, sizeof(*ctx->handles));
+		if (!ctx->irqs || !ctx->handles) {
+			return -1;
+		}
+
+		if (OCXL_OK != ocxl_afu_open_from_dev(virtocxl_device_path(device), &ctx->afu) ||
+		    OCXL_OK != ocxl_afu_attach(ctx->afu, OCXL_ATTACH_FLAGS_NONE) ||
+		    OCXL_OK != ocxl_mmio_map(ctx->afu, OCXL_PER_PASID_MMIO, &ctx->pp_mmio)) {
+			return -1;
+		}
+
+		for (unsigned i = 0; i < point->irqs; i++) {
+			if (OCXL_OK != ocxl_irq_alloc(ctx->afu, NULL, &ctx->irqs[i])) {
+				return -1;
+			}
+			ctx->handles[i] = ocxl_irq_get_handle(ctx->afu, ctx->irqs[i]);
+		}
+	}
+
+	for (unsigned t = 0; t < point->threads; t++) {
+		worker *w = &point->workers[t];
+		w->point = point;
+		w->index = t;
+
+		if (point->contexts <= point->threads) {
+			w->context_count = 1;
+		} else {
+			w->context_count = point->contexts / point->threads + (t < point->contexts % point->threads);
+		}
+
+		w->contexts = calloc(w->context_count, sizeof(*w->contexts));
+		if (!w->contexts) {
+			return -1;
+		}
+		for (unsigned c = 0; c < w->context_count; c++) {
+			w->contexts[c] = &point->context[(t + c * point->threads) % point->contexts];
+		}
+	}
+
+	return 0;
+}
+
+static void teardown_point(sweep_point *point)
+{
+	if (point->context) {
+		for (unsigned c = 0; c < point->contexts; c++) {
+			if (point->context[c].afu) {
+				ocxl_afu_close(point->context[c].afu);
+			}
+			pthread_mutex_destroy(&point->context[c].lock);
+			free(point->context[c].irqs);
+			free(point->context[c].handles);
+		}
+		free(point->context);
+	}
+
+	if (point->workers) {
+		for (unsigned t = 0; t < point->threads; t++) {
+			free(point->workers[t].contexts);
+		}
+		free(point->workers);
+	}
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double left = *(const double *)a;
+	double right = *(const double *)b;
+
+	return (left > right) - (left < right);
+}
+
+/**
+ * Measure all phases at one point of the sweep
+ *
+ * @return 0 on success, -1 on error
+ */
+static int run_point(virtocxl_device *device, size_t c, size_t i, size_t t, unsigned repetitions,
+                     uint64_t *latencies)
+{
+	sweep_point point = {
+		.contexts = context_list.values[c],
+		.irqs = irq_list.values[i],
+		.threads = thread_list.values[t],
+	};
+	double samples[METRIC_COUNT][repetitions];
+	char name[METRIC_COUNT][64];
+	bool selected = false;
+	int rc = -1;
+
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		snprintf(name[m], sizeof(name[m]), "%s/t%u-c%u-i%u", metric_names[m],
+		         point.threads, point.contexts, point.irqs);
+		selected |= bench_selected(name[m]);
+	}
+	if (!selected) {
+		return 0;
+	}
+
+	if (setup_point(&point, device)) {
+		fprintf(stderr, "Could not set up %u contexts with %u IRQs\n", point.contexts, point.irqs);
+		goto out;
+	}
+
+	for (unsigned r = 0; r < repetitions; r++) {
+		samples[METRIC_EVENTS][r] = measure_rate(&point, worker_events);
+		samples[METRIC_WAKE_P99][r] = measure_wake(&point, latencies);
+		samples[METRIC_MMIO][r] = measure_rate(&point, worker_mmio);
+
+		for (int m = 0; m < METRIC_COUNT; m++) {
+			if (samples[m][r] < 0) {
+				fprintf(stderr, "Measuring %s failed\n", name[m]);
+				goto out;
+			}
+		}
+	}
+
+	size_t index = (c * irq_list.count + i) * thread_list.count + t;
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		if (bench_selected(name[m])) {
+			bench_record(name[m], metric_units[m], samples[m], repetitions, 0);
+		}
+		qsort(samples[m], repetitions, sizeof(double), compare_double);
+		medians[m][index] = samples[m][repetitions / 2];
+	}
+
+	rc = 0;
+
+out:
+	teardown_point(&point);
+	return rc;
+}
+
+/**
+ * Report how each configuration scales with threads, and where it stops
+ */
+static void summarise()
+{
+	printf("\nScaling with threads (relative to %u thread%s, %ld CPUs online):\n", thread_list.values[0],
+	       thread_list.values[0] == 1 ? "" : "s", sysconf(_SC_NPROCESSORS_ONLN));
+
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		printf("  %s (%s)\n", metric_names[m], metric_units[m]);
+
+		for (size_t c = 0; c < context_list.count; c++) {
+			for (size_t i = 0; i < irq_list.count; i++) {
+				double *series = medians[m] + (c * irq_list.count + i) * thread_list.count;
+				if (!series[0]) {
+					continue;
+				}
+
+				printf("    c%-3u i%-3u", context_list.values[c], irq_list.values[i]);
+				for (size_t t = 0; t < thread_list.count; t++) {
+					printf(" %6.2fx", series[t] / series[0]);
+				}
+
+				// Rates stop scaling when they stop rising, latency when it starts rising
+				size_t flat = thread_list.count;
+				for (size_t t = 1; t < thread_list.count; t++) {
+					bool gained = (m == METRIC_WAKE_P99) ?
+					              series[t] <= series[t - 1] * FLAT_GAIN :
+					              series[t] >= series[t - 1] * FLAT_GAIN;
+					if (!gained) {
+						flat = t;
+						break;
+					}
+				}
+
+				if (flat == thread_list.count) {
+					printf("  %s to %u threads\n", (m == METRIC_WAKE_P99) ? "holds" : "scales",
+					       thread_list.values[thread_list.count - 1]);
+				} else if (m == METRIC_WAKE_P99) {
+					printf("  degrades beyond %u threads\n", thread_list.values[flat - 1]);
+				} else {
+					printf("  flattens beyond %u threads\n", thread_list.values[flat - 1]);
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option options[] = {
+		{"threads", required_argument, 0, OPT_THREADS},
+		{"contexts", required_argument, 0, OPT_CONTEXTS},
+		{"irqs", required_argument, 0, OPT_IRQS},
+		{"duration", required_argument, 0, OPT_DURATION},
+		{NULL, 0, 0, 0}
+	};
+	const bench_suite suite = {
+		.name = "scaling",
+		.options = options,
+		.usage = "\t--threads LIST\t\tComma separated thread counts (default 1,2,4,8)\n"
+		         "\t--contexts LIST\t\tComma separated context counts (default 1,2,4,8)\n"
+		         "\t--irqs LIST\t\tComma separated IRQs per context (default 1,8,64)\n"
+		         "\t--duration SECONDS\tDuration of each phase (default 0.1)\n"
+		         "\t--repetitions N\t\tSamples of each point (the median is summarised)\n",
+		.handle_option = handle_option,
+	};
+	virtocxl_device *device = NULL;
+	uint64_t *latencies = NULL;
+	int rc = 1;
+
+	if (bench_init(argc, argv, &suite)) {
+		exit(1);
+	}
+
+	size_t points = context_list.count * irq_list.count * thread_list.count;
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		medians[m] = calloc(points, sizeof(double));
+		if (!medians[m]) {
+			goto out;
+		}
+	}
+
+	latencies = malloc(MAX_WAKE_SAMPLES * sizeof(*latencies));
+	if (!latencies || bench_setup_devices()) {
+		goto out;
+	}
+
+	device = create_ocxl_device(AFU_NAME, MMIO_SIZE, MMIO_SIZE);
+	if (!device || virtocxl_devices_wait(&device, 1, 5000)) {
+		fprintf(stderr, "Could not create the virtual AFU\n");
+		goto out;
+	}
+
+	unsigned repetitions = bench_repetitions();
+	for (size_t c = 0; c < context_list.count; c++) {
+		for (size_t i = 0; i < irq_list.count; i++) {
+			for (size_t t = 0; t < thread_list.count; t++) {
+				if (run_point(device, c, i, t, repetitions, latencies)) {
+					goto out;
+				}
+			}
+		}
+	}
+
+	summarise();
+	rc = bench_finish();
+
+out:
+	if (device) {
+		virtocxl_device_destroy(device);
+	}
+	free(latencies);
+	for (int m = 0; m < METRIC_COUNT; m++) {
+		free(medians[m]);
+	}
+
+	return rc;
+}
@@ -0,0 +1,62 @@
+void afu_init(ocxl_afu *afu);
+ocxl_err afu_alloc(ocxl_afu_h *afu_out);
+bool device_matches(int dirfd, char *dev_name, dev_t dev);
+bool populate_metadata(dev_t dev, ocxl_afu *afu);
+void trace_metadata(ocxl_afu *afu);
+ocxl_err afu_open_device(ocxl_afu *afu);
+ocxl_err afu_open(ocxl_afu *afu);
+ocxl_err get_afu_by_path(const char *path, ocxl_afu_h *afu);
+int kernel_open(const char *path, int flags);
+int kernel_ioctl(int fd, unsigned long request, void *arg);
+const ocxl_backend_ops *backend_find(const char *name);
+void histogram_clear(struct ocxl_histogram *histogram);
+struct ocxl_histogram *histogram_new();
+ocxl_err histogram_alloc_once(ocxl_afu *afu, struct ocxl_histogram **histogram);
+ocxl_err irq_allocate(ocxl_afu *afu, ocxl_irq *irq, void *info);
+ocxl_err irq_rebind(ocxl_afu *afu);
+void populate_xsl_fault_error(ocxl_afu *afu, ocxl_event *event, void *body);
+ocxl_event_action read_kernel_event(ocxl_afu_h afu, uint16_t event_api_version, ocxl_event *event, int *last);
+ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_version, ocxl_event *event, int *last);
+ocxl_err register_mmio(ocxl_afu *afu, void *addr, size_t size, ocxl_mmio_type type, ocxl_mmio_h *handle);
+ocxl_err global_mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t flags, off_t offset, ocxl_mmio_h *region); 
+ocxl_err mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t flags, off_t offset, ocxl_mmio_h *region);
+ocxl_err mmio_check(ocxl_mmio_h region, off_t offset, size_t size);
+ocxl_err mmio_read32_native(ocxl_mmio_h region, off_t offset, uint32_t *out);
+ocxl_err mmio_read64_native(ocxl_mmio_h region, off_t offset, uint64_t *out);
+ocxl_err mmio_write32_native(ocxl_mmio_h region, off_t offset, uint32_t value);
+ocxl_err mmio_write64_native(ocxl_mmio_h region, off_t offset, uint64_t value);
+void sampler_take(struct ocxl_sampler *sampler);
+void *sampler_thread(void *arg);
+void sampler_free(struct ocxl_sampler *sampler);
+void ocxl_set_sys_path(const char *path);
+void ocxl_set_dev_path(const char *path);
+void stats_slot_release(void *data);
+void stats_slot_key_create();
+void stats_slot_take();
+int stats_block_sum(stats_block *block, uint64_t *counters);
+void stats_sum(ocxl_afu *afu, ocxl_afu_stats *stats);
+stats_shm_afu *stats_shm_slot(int slot);
+void stats_shm_slot_begin(stats_shm_afu *slot);
+void stats_shm_slot_end(stats_shm_afu *slot);
+void *stats_shm_publisher_thread(void *arg);
+void stats_shm_atfork_prepare();
+void stats_shm_atfork_parent();
+void stats_shm_atfork_child();
+uint64_t timestamp_counter_read();
+uint64_t timestamp_counter_hz();
+uint64_t timestamp_tsc_freq_hz();
+uint64_t timestamp_hz_mult(uint64_t hz);
+bool timestamp_counter_invariant();
+void timestamp_pair(uint64_t *ticks, uint64_t *ns);
+uint64_t timestamp_rate(uint64_t ticks, uint64_t ns);
+int trace_parse_site(trace_site *site);
+void trace_ring_release(void *data);
+void trace_ring_key_create();
+bool trace_pending();
+void trace_flusher_wake();
+void *trace_flusher_thread(void *arg);
+trace_ring *trace_ring_get();
+bool trace_copy_record(trace_ring *ring, uint64_t position, trace_record *out);
+int trace_compare_records(const void *a, const void *b);
+FILE *trace_get_output();
+void trace_write(const trace_record *records, size_t count, uint64_t lost);
@@ -0,0 +1,1155 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * An API level profiler for unmodified applications, preloaded in front of libocxl:
+ *   LD_PRELOAD=libocxl-prof.so application
+ *
+ * Each exported function of the library is wrapped, and the calls the application makes are
+ * counted & timed, per AFU and per thread. The library calls its own exported functions through
+ * hidden aliases, which are not interposed, so the times are those seen by the application.
+ *
+ * A report is written when the application exits, and when the report signal is received.
+ *
+ * Environment variables:
+ *   LIBOCXL_PROF_OUTPUT	File to write the report to (default stderr), %p is replaced with the PID
+ *   LIBOCXL_PROF_SIGNAL	Signal number or name (eg. USR2, the default) which writes a report, or 0 for none
+ *   LIBOCXL_PROF_HISTOGRAMS	Set to include the latency histograms of each function in the report
+ */
+
+#define _GNU_SOURCE
+#include "libocxl_internal.h"
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Not declared by libocxl.h on all architectures, but exported by the library */
+ocxl_err ocxl_afu_get_p9_thread_id(ocxl_afu_h afu, uint16_t *thread_id);
+
+/* The exported functions, see symver.map */
+#ifdef _ARCH_PPC64
+#define PROF_PPC64_FUNCTIONS(X) \
+	X(ocxl_afu_set_ppc64_amr)
+#else
+#define PROF_PPC64_FUNCTIONS(X)
+#endif
+
+#define PROF_FUNCTIONS(X) \
+	X(ocxl_afu_enable_messages) \
+	X(ocxl_afu_set_error_message_handler) \
+	X(ocxl_default_afu_error_handler) \
+	X(ocxl_default_error_handler) \
+	X(ocxl_enable_messages) \
+	X(ocxl_set_error_message_handler) \
+	X(ocxl_err_to_string) \
+	X(ocxl_info) \
+	X(ocxl_afu_get_identifier) \
+	X(ocxl_afu_get_device_path) \
+	X(ocxl_afu_get_sysfs_path) \
+	X(ocxl_afu_get_version) \
+	X(ocxl_afu_get_pasid) \
+	X(ocxl_afu_close) \
+	X(ocxl_afu_open) \
+	X(ocxl_afu_open_from_dev) \
+	X(ocxl_afu_open_specific) \
+	X(ocxl_afu_attach) \
+	X(ocxl_afu_reserve) \
+	X(ocxl_afu_get_stats) \
+	X(ocxl_irq_alloc) \
+	X(ocxl_irq_get_handle) \
+	X(ocxl_afu_get_event_fd) \
+	X(ocxl_irq_get_fd) \
+	X(ocxl_afu_event_check_versioned) \
+	X(ocxl_afu_get_p9_thread_id) \
+	X(ocxl_histogram_alloc) \
+	X(ocxl_histogram_free) \
+	X(ocxl_histogram_count) \
+	X(ocxl_histogram_mean) \
+	X(ocxl_histogram_percentile) \
+	X(ocxl_afu_enable_histograms) \
+	X(ocxl_afu_get_event_histogram) \
+	X(ocxl_irq_set_histogram_group) \
+	X(ocxl_sampler_start) \
+	X(ocxl_sampler_read) \
+	X(ocxl_sampler_merged) \
+	X(ocxl_sampler_stop) \
+	X(ocxl_timestamp) \
+	X(ocxl_timestamp_to_ns) \
+	X(ocxl_histogram_record) \
+	X(ocxl_mmio_map) \
+	X(ocxl_mmio_map_advanced) \
+	X(ocxl_mmio_unmap) \
+	X(ocxl_mmio_get_fd) \
+	X(ocxl_mmio_size) \
+	X(ocxl_mmio_get_info) \
+	X(ocxl_mmio_read32) \
+	X(ocxl_mmio_read64) \
+	X(ocxl_mmio_write32) \
+	X(ocxl_mmio_write64) \
+	X(ocxl_backend_register) \
+	X(ocxl_backend_select) \
+	X(ocxl_backend_get_name) \
+	PROF_PPC64_FUNCTIONS(X)
+
+#define PROF_ENUM(function) PROF_##function,
+#define PROF_NAME(function) #function,
+
+typedef enum {
+	PROF_FUNCTIONS(PROF_ENUM)
+	PROF_FUNCTION_COUNT
+} prof_function;
+
+static const char *prof_names[] = {
+	PROF_FUNCTIONS(PROF_NAME)
+};
+
+/* Latencies are bucketed by powers of 2 nanoseconds */
+#define PROF_BUCKETS		48
+
+/* The most distinct function & AFU pairs recorded per thread */
+#define PROF_ENTRIES		512
+
+/* The most AFUs that are told apart, AFUs opened after these are reported together */
+#define PROF_MAX_AFUS		256
+
+#define PROF_PATH_LEN		96
+
+/**
+ * The calls to a function on an AFU from a thread
+ *
+ * Only the owning thread writes the counters, reports read them while they may be changing.
+ */
+typedef struct prof_entry {
+	bool used;
+	uint16_t function;
+	uint16_t afu; /**< The AFU's index in the registry, 0 for calls not on an AFU */
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[PROF_BUCKETS];
+} prof_entry;
+
+typedef struct prof_thread {
+	struct prof_thread *next;
+	pid_t tid;
+	uint64_t dropped; /**< Calls not recorded as the entries were full */
+	prof_entry entries[PROF_ENTRIES];
+} prof_thread;
+
+/**
+ * An AFU opened by the application
+ */
+typedef struct prof_afu {
+	ocxl_afu_h handle; /**< The handle, or NULL once closed */
+	char path[PROF_PATH_LEN];
+} prof_afu;
+
+/* Index 0 is for calls that are not on an AFU */
+static prof_afu prof_afus[PROF_MAX_AFUS + 1];
+static uint16_t prof_afu_count;
+static uint64_t prof_afu_generation;
+static pthread_mutex_t prof_afu_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static prof_thread *prof_threads;
+static pthread_mutex_t prof_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void *prof_real[PROF_FUNCTION_COUNT];
+
+static __thread prof_thread *prof_self;
+static __thread unsigned prof_depth;
+static __thread ocxl_afu_h prof_cached_afu;
+static __thread uint16_t prof_cached_index;
+static __thread uint64_t prof_cached_generation;
+
+static uint64_t prof_start_ns;
+static int prof_signal_pipe[2] = { -1, -1 };
+static pthread_mutex_t prof_report_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t prof_load(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+/**
+ * Update a counter owned by the current thread, so a concurrent report never sees a torn value
+ */
+static void prof_store(uint64_t *counter, uint64_t value)
+{
+	__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Look up the real implementation of a function, in the library loaded after this one
+ *
+ * @param function the function
+ * @return the implementation
+ */
+static void *prof_resolve(prof_function function)
+{
+	void *real = __atomic_load_n(&prof_real[function], __ATOMIC_ACQUIRE);
+	if (real) {
+		return real;
+	}
+
+	real = dlsym(RTLD_NEXT, prof_names[function]);
+	if (!real) {
+		fprintf(stderr, "libocxl-prof: could not find %s in libocxl: %s\n", prof_names[function], dlerror());
+		abort();
+	}
+
+	__atomic_store_n(&prof_real[function], real, __ATOMIC_RELEASE);
+	return real;
+}
+
+#define PROF_REAL(function) ((__typeof__(&function))prof_resolve(PROF_##function))
+
+/**
+ * Take a timestamp, from the same source as the library's own timings
+ *
+ * @return the timestamp, to be converted with prof_ns()
+ */
+static uint64_t prof_now()
+{
+	return PROF_REAL(ocxl_timestamp)();
+}
+
+/**
+ * Get the time between two timestamps
+ *
+ * @param start the earlier timestamp
+ * @param end the later timestamp
+ * @return the time in nanoseconds
+ */
+static uint64_t prof_ns(uint64_t start, uint64_t end)
+{
+	__typeof__(&ocxl_timestamp_to_ns) to_ns = PROF_REAL(ocxl_timestamp_to_ns);
+	return to_ns(end) - to_ns(start);
+}
+
+/**
+ * Get the registry index of an AFU, caching the last lookup of each thread
+ *
+ * @param afu the AFU handle
+ * @return the index, or 0 if the AFU was not opened through the profiler
+ */
+static uint16_t prof_afu_index(ocxl_afu_h afu)
+{
+	if (!afu) {
+		return 0;
+	}
+
+	uint64_t generation = __atomic_load_n(&prof_afu_generation, __ATOMIC_ACQUIRE);
+	if (afu == prof_cached_afu && generation == prof_cached_generation) {
+		return prof_cached_index;
+	}
+
+	uint16_t index = 0;
+	pthread_mutex_lock(&prof_afu_mutex);
+	for (uint16_t i = prof_afu_count; i > 0; i--) {
+		if (prof_afus[i].handle == afu) {
+			index = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&prof_afu_mutex);
+
+	prof_cached_afu = afu;
+	prof_cached_index = index;
+	prof_cached_generation = generation;
+
+	return index;
+}
+
+/**
+ * Record an AFU opened by the application
+ *
+ * @param afu the AFU handle
+ */
+static void prof_afu_opened(ocxl_afu_h afu)
+{
+	const char *path = PROF_REAL(ocxl_afu_get_device_path)(afu);
+
+	pthread_mutex_lock(&prof_afu_mutex);
+	if (prof_afu_count < PROF_MAX_AFUS) {
+		prof_afu *entry = &prof_afus[++prof_afu_count];
+		entry->handle = afu;
+		snprintf(entry->path, sizeof(entry->path), "%s", path ? path : "unknown");
+		__atomic_add_fetch(&prof_afu_generation, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&prof_afu_mutex);
+}
+
+/**
+ * Forget the handle of a closed AFU, as the library may reuse its memory for another
+ *
+ * @param index the registry index of the AFU
+ */
+static void prof_afu_closed(uint16_t index)
+{
+	if (!index) {
+		return;
+	}
+
+	pthread_mutex_lock(&prof_afu_mutex);
+	prof_afus[index].handle = NULL;
+	__atomic_add_fetch(&prof_afu_generation, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&prof_afu_mutex);
+}
+
+/**
+ * Get the profile of the current thread, creating it on first use
+ *
+ * @return the profile, or NULL if it could not be allocated
+ */
+static prof_thread *prof_thread_get()
+{
+	if (LIKELY(prof_self != NULL)) {
+		return prof_self;
+	}
+
+	prof_thread *thread = calloc(1, sizeof(*thread));
+	if (!thread) {
+		return NULL;
+	}
+	thread->tid = syscall(SYS_gettid);
+
+	// Profiles outlive their threads, so they are reported after the threads exit
+	pthread_mutex_lock(&prof_thread_mutex);
+	thread->next = prof_threads;
+	prof_threads = thread;
+	pthread_mutex_unlock(&prof_thread_mutex);
+
+	prof_self = thread;
+	return thread;
+}
+
+static unsigned prof_bucket(uint64_t ns)
+{
+	unsigned bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	return (bucket < PROF_BUCKETS) ? bucket : PROF_BUCKETS - 1;
+}
+
+/**
+ * Record a call
+ *
+ * @param function the function called
+ * @param afu the registry index of the AFU it was called on
+ * @param ns the duration of the call
+ */
+static void prof_record(prof_function function, uint16_t afu, uint64_t ns)
+{
+	prof_thread *thread = prof_thread_get();
+	if (!thread) {
+		return;
+	}
+
+	unsigned slot = (function * 31 + afu) % PROF_ENTRIES;
+	for (unsigned probe = 0; probe < PROF_ENTRIES; probe++) {
+		prof_entry *entry = &thread->entries[slot];
+
+		if (!entry->used) {
+			entry->function = function;
+			entry->afu = afu;
+			__atomic_store_n(&entry->used, true, __ATOMIC_RELEASE);
+		}
+
+		if (entry->function == function && entry->afu == afu) {
+			prof_store(&entry->calls, entry->calls + 1);
+			prof_store(&entry->total_ns, entry->total_ns + ns);
+			if (ns > entry->max_ns) {
+				prof_store(&entry->max_ns, ns);
+			}
+			unsigned bucket = prof_bucket(ns);
+			prof_store(&entry->buckets[bucket], entry->buckets[bucket] + 1);
+			return;
+		}
+
+		slot = (slot + 1) % PROF_ENTRIES;
+	}
+
+	prof_store(&thread->dropped, thread->dropped + 1);
+}
+
+/**
+ * Enter a wrapped function
+ *
+ * @param[out] start the time of entry, for the outermost call only
+ * @return true if the call was made by the application, rather than by the library itself
+ */
+static bool prof_enter(uint64_t *start)
+{
+	if (prof_depth++) {
+		return false;
+	}
+
+	*start = prof_now();
+	return true;
+}
+
+/**
+ * Leave a wrapped function
+ *
+ * @param outermost the result of prof_enter()
+ * @param function the function called
+ * @param afu the registry index of the AFU it was called on
+ * @param start the time of entry
+ */
+static void prof_leave(bool outermost, prof_function function, uint16_t afu, uint64_t start)
+{
+	prof_depth--;
+
+	if (outermost) {
+		prof_record(function, afu, prof_ns(start, prof_now()));
+	}
+}
+
+/*
+ * Wrap a function: call the real implementation, timing it if the application made the call.
+ * The AFU expression is evaluated before the call, as the call may free the handle it is found
+ * through, and must tolerate the NULL handles the library rejects.
+ */
+#define PROF_WRAP(function, afu, ...) \
+	ocxl_afu_h prof_afu = (afu); \
+	uint64_t prof_start = 0; \
+	bool prof_outermost = prof_enter(&prof_start); \
+	__typeof__(function(__VA_ARGS__)) ret = PROF_REAL(function)(__VA_ARGS__); \
+	prof_leave(prof_outermost, PROF_##function, prof_outermost ? prof_afu_index(prof_afu) : 0, prof_start); \
+	return ret
+
+#define PROF_WRAP_VOID(function, afu, ...) \
+	ocxl_afu_h prof_afu = (afu); \
+	uint64_t prof_start = 0; \
+	bool prof_outermost = prof_enter(&prof_start); \
+	PROF_REAL(function)(__VA_ARGS__); \
+	prof_leave(prof_outermost, PROF_##function, prof_outermost ? prof_afu_index(prof_afu) : 0, prof_start)
+
+/* The AFU of an MMIO region or sampler, which may be NULL */
+#define PROF_MMIO_AFU(mmio) ((mmio) ? (mmio)->afu : NULL)
+#define PROF_SAMPLER_AFU(sampler) ((sampler) ? PROF_MMIO_AFU((sampler)->mmio) : NULL)
+
+/* Calls which open an AFU are attributed to the AFU they opened */
+#define PROF_WRAP_OPEN(function, afu_out, ...) \
+	uint64_t prof_start = 0; \
+	bool prof_outermost = prof_enter(&prof_start); \
+	ocxl_err ret = PROF_REAL(function)(__VA_ARGS__); \
+	if (prof_outermost && ret == OCXL_OK) { \
+		prof_afu_opened(*(afu_out)); \
+	} \
+	prof_leave(prof_outermost, PROF_##function, \
+	           (prof_outermost && ret == OCXL_OK) ? prof_afu_index(*(afu_out)) : 0, prof_start); \
+	return ret
+
+/* setup.c */
+void ocxl_enable_messages(uint64_t sources)
+{
+	PROF_WRAP_VOID(ocxl_enable_messages, NULL, sources);
+}
+
+void ocxl_set_error_message_handler(void (*handler)(ocxl_err error, const char *message))
+{
+	PROF_WRAP_VOID(ocxl_set_error_message_handler, NULL, handler);
+}
+
+const char *ocxl_err_to_string(ocxl_err err)
+{
+	PROF_WRAP(ocxl_err_to_string, NULL, err);
+}
+
+const char *ocxl_info()
+{
+	uint64_t prof_start = 0;
+	bool prof_outermost = prof_enter(&prof_start);
+	const char *ret = PROF_REAL(ocxl_info)();
+	prof_leave(prof_outermost, PROF_ocxl_info, 0, prof_start);
+	return ret;
+}
+
+void ocxl_afu_enable_messages(ocxl_afu_h afu, uint64_t sources)
+{
+	PROF_WRAP_VOID(ocxl_afu_enable_messages, afu, afu, sources);
+}
+
+void ocxl_afu_set_error_message_handler(ocxl_afu_h afu, void (*handler)(ocxl_afu_h afu, ocxl_err error,
+                                        const char *message))
+{
+	PROF_WRAP_VOID(ocxl_afu_set_error_message_handler, afu, afu, handler);
+}
+
+/* internal.c */
+void ocxl_default_error_handler(ocxl_err error, const char *message)
+{
+	PROF_WRAP_VOID(ocxl_default_error_handler, NULL, error, message);
+}
+
+void ocxl_default_afu_error_handler(ocxl_afu_h afu, ocxl_err error, const char *message)
+{
+	PROF_WRAP_VOID(ocxl_default_afu_error_handler, afu, afu, error, message);
+}
+
+/* backend.c */
+ocxl_err ocxl_backend_register(const ocxl_backend_ops *ops)
+{
+	PROF_WRAP(ocxl_backend_register, NULL, ops);
+}
+
+ocxl_err ocxl_backend_select(const char *name)
+{
+	PROF_WRAP(ocxl_backend_select, NULL, name);
+}
+
+const char *ocxl_backend_get_name()
+{
+	uint64_t prof_start = 0;
+	bool prof_outermost = prof_enter(&prof_start);
+	const char *ret = PROF_REAL(ocxl_backend_get_name)();
+	prof_leave(prof_outermost, PROF_ocxl_backend_get_name, 0, prof_start);
+	return ret;
+}
+
+/* afu.c */
+const ocxl_identifier *ocxl_afu_get_identifier(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_get_identifier, afu, afu);
+}
+
+const char *ocxl_afu_get_device_path(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_get_device_path, afu, afu);
+}
+
+const char *ocxl_afu_get_sysfs_path(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_get_sysfs_path, afu, afu);
+}
+
+void ocxl_afu_get_version(ocxl_afu_h afu, uint8_t *major, uint8_t *minor)
+{
+	PROF_WRAP_VOID(ocxl_afu_get_version, afu, afu, major, minor);
+}
+
+uint32_t ocxl_afu_get_pasid(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_get_pasid, afu, afu);
+}
+
+ocxl_err ocxl_afu_open_specific(const char *name, const char *physical_function, int16_t afu_index,
+                                ocxl_afu_h *afu)
+{
+	PROF_WRAP_OPEN(ocxl_afu_open_specific, afu, name, physical_function, afu_index, afu);
+}
+
+ocxl_err ocxl_afu_open_from_dev(const char *path, ocxl_afu_h *afu)
+{
+	PROF_WRAP_OPEN(ocxl_afu_open_from_dev, afu, path, afu);
+}
+
+ocxl_err ocxl_afu_open(const char *name, ocxl_afu_h *afu)
+{
+	PROF_WRAP_OPEN(ocxl_afu_open, afu, name, afu);
+}
+
+ocxl_err ocxl_afu_attach(ocxl_afu_h afu, uint64_t flags)
+{
+	PROF_WRAP(ocxl_afu_attach, afu, afu, flags);
+}
+
+ocxl_err ocxl_afu_reserve(ocxl_afu_h afu, uint16_t irqs, uint16_t mmios, uint16_t max_events)
+{
+	PROF_WRAP(ocxl_afu_reserve, afu, afu, irqs, mmios, max_events);
+}
+
+void ocxl_afu_get_stats(ocxl_afu_h afu, ocxl_afu_stats *stats, size_t size)
+{
+	PROF_WRAP_VOID(ocxl_afu_get_stats, afu, afu, stats, size);
+}
+
+/* The handle is freed by the call, so its AFU is looked up beforehand */
+ocxl_err ocxl_afu_close(ocxl_afu_h afu)
+{
+	uint64_t prof_start = 0;
+	bool prof_outermost = prof_enter(&prof_start);
+	uint16_t index = prof_outermost ? prof_afu_index(afu) : 0;
+	ocxl_err ret = PROF_REAL(ocxl_afu_close)(afu);
+	if (prof_outermost && ret == OCXL_OK) {
+		prof_afu_closed(index);
+	}
+	prof_leave(prof_outermost, PROF_ocxl_afu_close, index, prof_start);
+	return ret;
+}
+
+#ifdef _ARCH_PPC64
+ocxl_err ocxl_afu_set_ppc64_amr(ocxl_afu_h afu, uint64_t amr)
+{
+	PROF_WRAP(ocxl_afu_set_ppc64_amr, afu, afu, amr);
+}
+#endif
+
+/* irq.c */
+ocxl_err ocxl_irq_alloc(ocxl_afu_h afu, void *info, ocxl_irq_h *irq_handle)
+{
+	PROF_WRAP(ocxl_irq_alloc, afu, afu, info, irq_handle);
+}
+
+uint64_t ocxl_irq_get_handle(ocxl_afu_h afu, ocxl_irq_h irq)
+{
+	PROF_WRAP(ocxl_irq_get_handle, afu, afu, irq);
+}
+
+int ocxl_afu_get_event_fd(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_get_event_fd, afu, afu);
+}
+
+int ocxl_irq_get_fd(ocxl_afu_h afu, ocxl_irq_h irq)
+{
+	PROF_WRAP(ocxl_irq_get_fd, afu, afu, irq);
+}
+
+int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *events, uint16_t event_count,
+                                   uint16_t event_api_version)
+{
+	PROF_WRAP(ocxl_afu_event_check_versioned, afu, afu, timeout, events, event_count, event_api_version);
+}
+
+ocxl_err ocxl_afu_get_p9_thread_id(ocxl_afu_h afu, uint16_t *thread_id)
+{
+	PROF_WRAP(ocxl_afu_get_p9_thread_id, afu, afu, thread_id);
+}
+
+/* histogram.c */
+ocxl_err ocxl_histogram_alloc(ocxl_histogram_h *histogram)
+{
+	PROF_WRAP(ocxl_histogram_alloc, NULL, histogram);
+}
+
+void ocxl_histogram_free(ocxl_histogram_h histogram)
+{
+	PROF_WRAP_VOID(ocxl_histogram_free, NULL, histogram);
+}
+
+void ocxl_histogram_record(ocxl_histogram_h histogram, uint64_t ns)
+{
+	PROF_WRAP_VOID(ocxl_histogram_record, NULL, histogram, ns);
+}
+
+uint64_t ocxl_histogram_count(ocxl_histogram_h histogram)
+{
+	PROF_WRAP(ocxl_histogram_count, NULL, histogram);
+}
+
+uint64_t ocxl_histogram_mean(ocxl_histogram_h histogram)
+{
+	PROF_WRAP(ocxl_histogram_mean, NULL, histogram);
+}
+
+uint64_t ocxl_histogram_percentile(ocxl_histogram_h histogram, double percentile)
+{
+	PROF_WRAP(ocxl_histogram_percentile, NULL, histogram, percentile);
+}
+
+ocxl_err ocxl_afu_enable_histograms(ocxl_afu_h afu)
+{
+	PROF_WRAP(ocxl_afu_enable_histograms, afu, afu);
+}
+
+ocxl_err ocxl_afu_get_event_histogram(ocxl_afu_h afu, int source, uint64_t flags, ocxl_histogram_h snapshot)
+{
+	PROF_WRAP(ocxl_afu_get_event_histogram, afu, afu, source, flags, snapshot);
+}
+
+ocxl_err ocxl_irq_set_histogram_group(ocxl_afu_h afu, ocxl_irq_h irq, uint16_t group)
+{
+	PROF_WRAP(ocxl_irq_set_histogram_group, afu, afu, irq, group);
+}
+
+/* sampler.c */
+ocxl_err ocxl_sampler_start(ocxl_mmio_h mmio, const off_t *registers, uint16_t count, ocxl_endian endian,
+                            uint32_t rate_hz, uint32_t ring_samples, ocxl_sampler_h *sampler)
+{
+	PROF_WRAP(ocxl_sampler_start, PROF_MMIO_AFU(mmio), mmio, registers, count, endian, rate_hz, ring_samples, sampler);
+}
+
+size_t ocxl_sampler_read(ocxl_sampler_h sampler, ocxl_sample *samples, size_t count)
+{
+	PROF_WRAP(ocxl_sampler_read, PROF_SAMPLER_AFU(sampler), sampler, samples, count);
+}
+
+uint64_t ocxl_sampler_merged(ocxl_sampler_h sampler)
+{
+	PROF_WRAP(ocxl_sampler_merged, PROF_SAMPLER_AFU(sampler), sampler);
+}
+
+void ocxl_sampler_stop(ocxl_sampler_h sampler)
+{
+	PROF_WRAP_VOID(ocxl_sampler_stop, PROF_SAMPLER_AFU(sampler), sampler);
+}
+
+/* timestamp.c */
+uint64_t ocxl_timestamp()
+{
+	PROF_WRAP(ocxl_timestamp, NULL);
+}
+
+uint64_t ocxl_timestamp_to_ns(uint64_t timestamp)
+{
+	PROF_WRAP(ocxl_timestamp_to_ns, NULL, timestamp);
+}
+
+/* mmio.c */
+ocxl_err ocxl_mmio_map_advanced(ocxl_afu_h afu, ocxl_mmio_type type, size_t size, int prot, uint64_t flags,
+                                off_t offset, ocxl_mmio_h *region)
+{
+	PROF_WRAP(ocxl_mmio_map_advanced, afu, afu, type, size, prot, flags, offset, region);
+}
+
+ocxl_err ocxl_mmio_map(ocxl_afu_h afu, ocxl_mmio_type type, ocxl_mmio_h *region)
+{
+	PROF_WRAP(ocxl_mmio_map, afu, afu, type, region);
+}
+
+void ocxl_mmio_unmap(ocxl_mmio_h region)
+{
+	PROF_WRAP_VOID(ocxl_mmio_unmap, PROF_MMIO_AFU(region), region);
+}
+
+int ocxl_mmio_get_fd(ocxl_afu_h afu, ocxl_mmio_type type)
+{
+	PROF_WRAP(ocxl_mmio_get_fd, afu, afu, type);
+}
+
+size_t ocxl_mmio_size(ocxl_afu_h afu, ocxl_mmio_type type)
+{
+	PROF_WRAP(ocxl_mmio_size, afu, afu, type);
+}
+
+ocxl_err ocxl_mmio_get_info(ocxl_mmio_h region, void **address, size_t *size)
+{
+	PROF_WRAP(ocxl_mmio_get_info, PROF_MMIO_AFU(region), region, address, size);
+}
+
+ocxl_err ocxl_mmio_read32(ocxl_mmio_h mmio, off_t offset, ocxl_endian endian, uint32_t *out)
+{
+	PROF_WRAP(ocxl_mmio_read32, PROF_MMIO_AFU(mmio), mmio, offset, endian, out);
+}
+
+ocxl_err ocxl_mmio_read64(ocxl_mmio_h mmio, off_t offset, ocxl_endian endian, uint64_t *out)
+{
+	PROF_WRAP(ocxl_mmio_read64, PROF_MMIO_AFU(mmio), mmio, offset, endian, out);
+}
+
+ocxl_err ocxl_mmio_write32(ocxl_mmio_h mmio, off_t offset, ocxl_endian endian, uint32_t value)
+{
+	PROF_WRAP(ocxl_mmio_write32, PROF_MMIO_AFU(mmio), mmio, offset, endian, value);
+}
+
+ocxl_err ocxl_mmio_write64(ocxl_mmio_h mmio, off_t offset, ocxl_endian endian, uint64_t value)
+{
+	PROF_WRAP(ocxl_mmio_write64, PROF_MMIO_AFU(mmio), mmio, offset, endian, value);
+}
+
+/**
+ * The calls to a function, summed over threads and/or AFUs
+ */
+typedef struct prof_summary {
+	uint16_t function;
+	uint16_t afu;
+	pid_t tid;
+	uint64_t calls;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[PROF_BUCKETS];
+} prof_summary;
+
+/**
+ * Find or add the summary for a key
+ */
+static prof_summary *prof_summary_get(prof_summary *summaries, size_t *count, uint16_t function,
+                                      uint16_t afu, pid_t tid)
+{
+	for (size_t i = 0; i < *count; i++) {
+		if (summaries[i].function == function && summaries[i].afu == afu && summaries[i].tid == tid) {
+			return &summaries[i];
+		}
+	}
+
+	prof_summary *summary = &summaries[(*count)++];
+	memset(summary, 0, sizeof(*summary));
+	summary->function = function;
+	summary->afu = afu;
+	summary->tid = tid;
+
+	return summary;
+}
+
+static void prof_summary_add(prof_summary *summary, const prof_entry *entry)
+{
+	summary->calls += prof_load(&entry->calls);
+	summary->total_ns += prof_load(&entry->total_ns);
+	uint64_t max = prof_load(&entry->max_ns);
+	if (max > summary->max_ns) {
+		summary->max_ns = max;
+	}
+	for (int bucket = 0; bucket < PROF_BUCKETS; bucket++) {
+		summary->buckets[bucket] += prof_load(&entry->buckets[bucket]);
+	}
+}
+
+static int prof_summary_compare(const void *a, const void *b)
+{
+	const prof_summary *left = a, *right = b;
+
+	if (left->total_ns != right->total_ns) {
+		return (left->total_ns < right->total_ns) ? 1 : -1;
+	}
+
+	return (int)left->function - (int)right->function;
+}
+
+/**
+ * Estimate a percentile from the histogram, as the upper bound of the bucket holding it
+ */
+static uint64_t prof_percentile(const prof_summary *summary, double percentile)
+{
+	uint64_t rank = (uint64_t)(summary->calls * percentile / 100.0);
+	uint64_t seen = 0;
+
+	for (int bucket = 0; bucket < PROF_BUCKETS; bucket++) {
+		seen += summary->buckets[bucket];
+		if (seen > rank) {
+			uint64_t bound = bucket ? (1ULL << bucket) - 1 : 0;
+			return (bound < summary->max_ns) ? bound : summary->max_ns;
+		}
+	}
+
+	return summary->max_ns;
+}
+
+static void prof_print_summary(FILE *out, const char *label, const prof_summary *summary)
+{
+	fprintf(out, "%-32s %-12s %10llu %12.3f %10llu %10llu %10llu %10llu\n",
+	        prof_names[summary->function], label,
+	        (unsigned long long)summary->calls, summary->total_ns / 1e6,
+	        (unsigned long long)(summary->calls ? summary->total_ns / summary->calls : 0),
+	        (unsigned long long)prof_percentile(summary, 50),
+	        (unsigned long long)prof_percentile(summary, 99),
+	        (unsigned long long)summary->max_ns);
+}
+
+static void prof_print_header(FILE *out, const char *title, const char *key)
+{
+	fprintf(out, "\n%s\n%-32s %-12s %10s %12s %10s %10s %10s %10s\n", title,
+	        "function", key, "calls", "total ms", "mean ns", "p50 ns", "p99 ns", "max ns");
+}
+
+static void prof_print_histogram(FILE *out, const prof_summary *summary)
+{
+	fprintf(out, "\n%s latency histogram\n", prof_names[summary->function]);
+	for (int bucket = 0; bucket < PROF_BUCKETS; bucket++) {
+		if (!summary->buckets[bucket]) {
+			continue;
+		}
+		fprintf(out, "  < %12llu ns %12llu (%5.1f%%)\n",
+		        (unsigned long long)(1ULL << bucket), (unsigned long long)summary->buckets[bucket],
+		        100.0 * summary->buckets[bucket] / summary->calls);
+	}
+}
+
+/**
+ * Open the report file
+ *
+ * @param[out] opened true if the file must be closed after writing
+ * @return the file
+ */
+static FILE *prof_open_output(bool *opened)
+{
+	const char *pattern = getenv("LIBOCXL_PROF_OUTPUT");
+	*opened = false;
+
+	if (!pattern || !*pattern) {
+		return stderr;
+	}
+
+	char path[PATH_MAX];
+	size_t length = 0;
+	for (const char *c = pattern; *c && length < sizeof(path) - 16; c++) {
+		if (c[0] == '%' && c[1] == 'p') {
+			length += snprintf(path + length, sizeof(path) - length, "%d", (int)getpid());
+			c++;
+		} else {
+			path[length++] = *c;
+		}
+	}
+	path[length] = '\0';
+
+	FILE *out = fopen(path, "a");
+	if (!out) {
+		fprintf(stderr, "libocxl-prof: could not open '%s': %s, reporting to stderr\n", path, strerror(errno));
+		return stderr;
+	}
+
+	*opened = true;
+	return out;
+}
+
+/**
+ * Write the report
+ *
+ * @param reason why the report was written
+ */
+static void prof_report(const char *reason)
+{
+	size_t max_summaries = 0;
+	prof_thread *threads;
+
+	pthread_mutex_lock(&prof_report_mutex);
+
+	pthread_mutex_lock(&prof_thread_mutex);
+	threads = prof_threads;
+	pthread_mutex_unlock(&prof_thread_mutex);
+
+	for (prof_thread *thread = threads; thread; thread = thread->next) {
+		max_summaries += PROF_ENTRIES;
+	}
+
+	prof_summary *functions = calloc(PROF_FUNCTION_COUNT, sizeof(*functions));
+	prof_summary *by_afu = calloc(max_summaries + 1, sizeof(*by_afu));
+	prof_summary *by_thread = calloc(max_summaries + 1, sizeof(*by_thread));
+	if (!functions || !by_afu || !by_thread) {
+		fprintf(stderr, "libocxl-prof: could not allocate the report\n");
+		goto out;
+	}
+
+	size_t function_count = 0, afu_count = 0, thread_count = 0, thread_total = 0;
+	uint64_t dropped = 0, library_ns = 0;
+	for (prof_thread *thread = threads; thread; thread = thread->next) {
+		thread_total++;
+		dropped += prof_load(&thread->dropped);
+		for (int i = 0; i < PROF_ENTRIES; i++) {
+			const prof_entry *entry = &thread->entries[i];
+			if (!__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			prof_summary_add(prof_summary_get(functions, &function_count, entry->function, 0, 0), entry);
+			prof_summary_add(prof_summary_get(by_afu, &afu_count, entry->function, entry->afu, 0), entry);
+			prof_summary_add(prof_summary_get(by_thread, &thread_count, entry->function, 0, thread->tid), entry);
+			library_ns += prof_load(&entry->total_ns);
+		}
+	}
+
+	qsort(functions, function_count, sizeof(*functions), prof_summary_compare);
+	qsort(by_afu, afu_count, sizeof(*by_afu), prof_summary_compare);
+	qsort(by_thread, thread_count, sizeof(*by_thread), prof_summary_compare);
+
+	double elapsed_ms = (PROF_REAL(ocxl_timestamp_to_ns)(prof_now()) - prof_start_ns) / 1e6;
+
+	bool opened;
+	FILE *out = prof_open_output(&opened);
+
+	fprintf(out, "\nlibocxl profile of PID %d (%s)\n", (int)getpid(), reason);
+	fprintf(out, "%.3f ms elapsed, %.3f ms in libocxl over %zu thread(s)\n",
+	        elapsed_ms, library_ns / 1e6, thread_total);
+	if (dropped) {
+		fprintf(out, "%llu calls were not recorded, as too many distinct functions & AFUs were called\n",
+		        (unsigned long long)dropped);
+	}
+
+	prof_print_header(out, "Functions", "");
+	for (size_t i = 0; i < function_count; i++) {
+		prof_print_summary(out, "", &functions[i]);
+	}
+
+	prof_print_header(out, "Functions per AFU", "afu");
+	for (size_t i = 0; i < afu_count; i++) {
+		char label[16];
+		snprintf(label, sizeof(label), by_afu[i].afu ? "#%u" : "-", by_afu[i].afu);
+		prof_print_summary(out, label, &by_afu[i]);
+	}
+
+	pthread_mutex_lock(&prof_afu_mutex);
+	if (prof_afu_count) {
+		fprintf(out, "\nAFUs\n");
+	}
+	for (uint16_t afu = 1; afu <= prof_afu_count; afu++) {
+		fprintf(out, "#%-4u %s%s\n", afu, prof_afus[afu].path, prof_afus[afu].handle ? "" : " (closed)");
+	}
+	if (prof_afu_count == PROF_MAX_AFUS) {
+		fprintf(out, "AFUs opened after the first %d are reported as '-'\n", PROF_MAX_AFUS);
+	}
+	pthread_mutex_unlock(&prof_afu_mutex);
+
+	prof_print_header(out, "Functions per thread", "thread");
+	for (size_t i = 0; i < thread_count; i++) {
+		char label[16];
+		snprintf(label, sizeof(label), "%d", (int)by_thread[i].tid);
+		prof_print_summary(out, label, &by_thread[i]);
+	}
+
+	const char *histograms = getenv("LIBOCXL_PROF_HISTOGRAMS");
+	if (histograms && *histograms) {
+		for (size_t i = 0; i < function_count; i++) {
+			prof_print_histogram(out, &functions[i]);
+		}
+	}
+
+	fflush(out);
+	if (opened) {
+		fclose(out);
+	}
+
+out:
+	free(functions);
+	free(by_afu);
+	free(by_thread);
+	pthread_mutex_unlock(&prof_report_mutex);
+}
+
+/**
+ * Write a report for each signal received
+ *
+ * Reports are not written from the signal handler, as that is not async signal safe.
+ */
+static void *prof_signal_thread(__attribute__((unused)) void *arg)
+{
+	char byte;
+
+	while (true) {
+		ssize_t ret = read(prof_signal_pipe[0], &byte, 1);
+		if (ret == 1) {
+			prof_report("signal");
+		} else if (ret == 0 || errno != EINTR) {
+			return NULL;
+		}
+	}
+}
+
+static void prof_signal_handler(__attribute__((unused)) int sig)
+{
+	int saved_errno = errno;
+	char byte = 0;
+
+	if (write(prof_signal_pipe[1], &byte, 1) < 0) {
+		// Nothing can be done from here
+	}
+
+	errno = saved_errno;
+}
+
+/**
+ * Parse the report signal
+ *
+ * @param name a signal number or name, with or without the SIG prefix
+ * @return the signal, 0 for none, or -1 if it is invalid
+ */
+static int prof_parse_signal(const char *name)
+{
+	char *end;
+	long number = strtol(name, &end, 10);
+	if (*name && !*end) {
+		return (number >= 0 && number < NSIG) ? number : -1;
+	}
+
+	if (!strncasecmp(name, "SIG", 3)) {
+		name += 3;
+	}
+
+	static const struct {
+		const char *name;
+		int sig;
+	} signals[] = {
+		{ "USR1", SIGUSR1 },
+		{ "USR2", SIGUSR2 },
+		{ "HUP", SIGHUP },
+		{ "PROF", SIGPROF },
+		{ "URG", SIGURG },
+	};
+
+	for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+		if (!strcasecmp(name, signals[i].name)) {
+			return signals[i].sig;
+		}
+	}
+
+	return -1;
+}
+
+/**
+ * Install the report signal handler, unless the application already handles the signal
+ */
+static void prof_setup_signal()
+{
+	const char *name = getenv("LIBOCXL_PROF_SIGNAL");
+	int sig = name ? prof_parse_signal(name) : SIGUSR2;
+
+	if (sig < 0) {
+		fprintf(stderr, "libocxl-prof: invalid LIBOCXL_PROF_SIGNAL '%s', reports are only written at exit\n", name);
+		return;
+	}
+	if (sig == 0) {
+		return;
+	}
+
+	struct sigaction current;
+	if (sigaction(sig, NULL, &current) || current.sa_handler != SIG_DFL) {
+		if (name) {
+			fprintf(stderr, "libocxl-prof: signal %d is already handled, reports are only written at exit\n", sig);
+		}
+		return;
+	}
+
+	if (pipe2(prof_signal_pipe, O_CLOEXEC)) {
+		fprintf(stderr, "libocxl-prof: could not create the signal pipe: %s\n", strerror(errno));
+		return;
+	}
+
+	// The reporting thread must not take the application's signals
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	pthread_t thread;
+	int rc = pthread_create(&thread, NULL, prof_signal_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (rc) {
+		fprintf(stderr, "libocxl-prof: could not start the report thread: %s\n", strerror(rc));
+		return;
+	}
+	pthread_detach(thread);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = prof_signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(sig, &action, NULL);
+}
+
+__attribute__((constructor)) static void prof_init()
+{
+	// Before libocxl is initialised, timestamps are CLOCK_MONOTONIC, as are converted ones
+	prof_start_ns = PROF_REAL(ocxl_timestamp_to_ns)(prof_now());
+	prof_setup_signal();
+}
+
+__attribute__((destructor)) static void prof_fini()
+{
+	prof_report("exit");
+}
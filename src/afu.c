@@ -93,6 +93,8 @@ const char *ocxl_afu_get_device_path(ocxl_afu_h afu)
 	return afu->device_path;
 }
 
+LIBOCXL_ALIAS(ocxl_afu_get_device_path, afu_get_device_path);
+
 /**
  * Get the canonical sysfs path of the AFU.
  *
@@ -138,20 +140,22 @@ void ocxl_afu_get_version(ocxl_afu_h afu, uint8_t *major, uint8_t *minor)
  * Error messages, if enabled, are emitted by default on STDERR. This behavior may be
  * overridden by ocxl_afu_set_error_message_handler().
  *
- * Tracing, if enabled, is always emitted on STDERR. It assists a developer by showing
- * detailed AFU information, as well as MMIO & IRQ interactions between the application
- * and the AFU. It does not show direct accesses to memory from the AFU.
+ * Tracing, if enabled, is emitted on STDERR (or the file named by LIBOCXL_TRACE_OUTPUT). It assists
+ * a developer by showing detailed AFU information, as well as MMIO & IRQ interactions between the
+ * application and the AFU. It does not show direct accesses to memory from the AFU. Trace messages
+ * are recorded into per-thread buffers and written out shortly afterwards by a background thread.
  *
  * @see ocxl_afu_set_error_message_handler()
  * @see ocxl_enable_messages()
  *
  * @param afu the AFU to enable message on
- * @param sources a bitwise OR of the message sources to enable (OCXL_ERRORS, OCXL_TRACING)
+ * @param sources a bitwise OR of the message sources to enable (OCXL_ERRORS, OCXL_TRACING),
+ *        OCXL_TRACE_* may be given instead of OCXL_TRACING to trace only those categories
  */
 void ocxl_afu_enable_messages(ocxl_afu_h afu, uint64_t sources)
 {
 	afu->verbose_errors = !!(sources & OCXL_ERRORS);
-	afu->tracing = !!(sources & OCXL_TRACING);
+	afu->tracing = trace_categories(sources);
 }
 
 /**
@@ -212,6 +216,7 @@ static void afu_init(ocxl_afu *afu)
 	afu->sysfs_path = NULL;
 	afu->version_major = 0;
 	afu->version_minor = 0;
+	afu->backend = current_backend;
 	afu->fd = -1;
 	afu->fd_info.type = EPOLL_SOURCE_OCXL;
 	afu->fd_info.irq = NULL;
@@ -247,6 +252,8 @@ static void afu_init(ocxl_afu *afu)
 
 	afu->attached = false;
 
+	stats_init(afu);
+
 #ifdef _ARCH_PPC64
 	afu->ppc64_amr = 0;
 #endif
@@ -273,6 +280,12 @@ static ocxl_err afu_alloc(ocxl_afu_h *afu_out)
 
 	afu_init(afu);
 
+	ocxl_err rc = stats_alloc(afu);
+	if (rc != OCXL_OK) {
+		free(afu);
+		return rc;
+	}
+
 	*afu_out = afu;
 
 	return OCXL_OK;
@@ -291,7 +304,7 @@ static bool device_matches(int dirfd, char *dev_name, dev_t dev)
 {
 	struct stat sb;
 
-	if (fstatat(dirfd, dev_name, &sb, 0) == -1) {
+	if (current_backend->fstatat(dirfd, dev_name, &sb, 0) == -1) {
 		return false;
 	}
 
@@ -328,17 +341,21 @@ static bool populate_metadata(dev_t dev, ocxl_afu *afu)
 			return false;
 		}
 	} while (!device_matches(fd, dev_ent->d_name, dev));
+
+	// dev_ent is freed along with dev_dir
+	char dev_name[sizeof(dev_ent->d_name)];
+	(void)snprintf(dev_name, sizeof(dev_name), "%s", dev_ent->d_name);
 	closedir(dev_dir);
 
-	char *physical_function = strchr(dev_ent->d_name, '.');
+	char *physical_function = strchr(dev_name, '.');
 	if (physical_function == NULL) {
 		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not extract physical function from device name '%s', missing initial '.'",
-		       dev_ent->d_name);
+		       dev_name);
 		return false;
 	}
-	int afu_name_len = physical_function - dev_ent->d_name;
+	int afu_name_len = physical_function - dev_name;
 	if (afu_name_len > AFU_NAME_MAX) {
-		errmsg(NULL, OCXL_INTERNAL_ERROR,"AFU name '%-.*s' exceeds maximum length of %d", afu_name_len, dev_ent->d_name);
+		errmsg(NULL, OCXL_INTERNAL_ERROR,"AFU name '%-.*s' exceeds maximum length of %d", afu_name_len, dev_name);
 		return false;
 	}
 
@@ -354,24 +371,24 @@ static bool populate_metadata(dev_t dev, ocxl_afu *afu)
 		return false;
 	}
 
-	memcpy((char *)afu->identifier.afu_name, dev_ent->d_name, afu_name_len);
+	memcpy((char *)afu->identifier.afu_name, dev_name, afu_name_len);
 	((char *)afu->identifier.afu_name)[afu_name_len] = '\0';
 
-	size_t dev_path_len = strlen(DEVICE_PATH) + 1 + strlen(dev_ent->d_name) + 1;
+	size_t dev_path_len = strlen(DEVICE_PATH) + 1 + strlen(dev_name) + 1;
 	afu->device_path = malloc(dev_path_len);
 	if (NULL == afu->device_path) {
 		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not allocate %llu bytes for device path", dev_path_len);
 		return false;
 	}
-	(void)snprintf(afu->device_path, dev_path_len, "%s/%s", DEVICE_PATH, dev_ent->d_name);
+	(void)snprintf(afu->device_path, dev_path_len, "%s/%s", DEVICE_PATH, dev_name);
 
-	size_t sysfs_path_len = strlen(SYS_PATH) + 1 + strlen(dev_ent->d_name) + 1;
+	size_t sysfs_path_len = strlen(SYS_PATH) + 1 + strlen(dev_name) + 1;
 	afu->sysfs_path = malloc(sysfs_path_len);
 	if (NULL == afu->sysfs_path) {
 		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not allocate %llu bytes for sysfs path", sysfs_path_len);
 		return false;
 	}
-	(void)snprintf(afu->sysfs_path, sysfs_path_len, "%s/%s", SYS_PATH, dev_ent->d_name);
+	(void)snprintf(afu->sysfs_path, sysfs_path_len, "%s/%s", SYS_PATH, dev_name);
 
 	return true;
 }
@@ -388,10 +405,10 @@ static void trace_metadata(ocxl_afu *afu)
 	TRACE_OPEN("AFU Name=\"%s\"", afu->identifier.afu_name);
 	TRACE_OPEN("AFU Index=%u", afu->identifier.afu_index);
 	TRACE_OPEN("AFU Version=%u:%u", afu->version_major, afu->version_minor);
-	TRACE_OPEN("Global MMIO size=%llu", afu->global_mmio.length);
-	TRACE_OPEN("Per PASID MMIO size=%llu", afu->per_pasid_mmio.length);
-	TRACE_OPEN("Page Size=%llu", afu->page_size);
-	TRACE_OPEN("PASID=%lu", afu->pasid);
+	TRACE_OPEN("Global MMIO size=%zu", afu->global_mmio.length);
+	TRACE_OPEN("Per PASID MMIO size=%zu", afu->per_pasid_mmio.length);
+	TRACE_OPEN("Page Size=%zu", afu->page_size);
+	TRACE_OPEN("PASID=%u", afu->pasid);
 }
 
 /**
@@ -404,7 +421,7 @@ static void trace_metadata(ocxl_afu *afu)
  * @retval OCXL_ALREADY_DONE if the AFU is already open
  * @retval OCXL_NO_MORE_CONTEXTS if maximum number of AFU contexts has been reached
  */
-static ocxl_err afu_open(ocxl_afu *afu)
+static ocxl_err afu_open_device(ocxl_afu *afu)
 {
 	if (afu->fd != -1) {
 		return OCXL_ALREADY_DONE;
@@ -412,7 +429,7 @@ static ocxl_err afu_open(ocxl_afu *afu)
 
 	ocxl_err rc;
 
-	int fd = open(afu->device_path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	int fd = afu->backend->open(afu->device_path, O_RDWR | O_CLOEXEC | O_NONBLOCK);
 	if (fd < 0) {
 		if (errno == ENOSPC) {
 			rc = OCXL_NO_MORE_CONTEXTS;
@@ -434,7 +451,7 @@ static ocxl_err afu_open(ocxl_afu *afu)
 		return rc;
 	}
 
-	fd = epoll_create1(EPOLL_CLOEXEC);
+	fd = afu->backend->epoll_create1(EPOLL_CLOEXEC);
 	if (fd < 0) {
 		ocxl_err rc = OCXL_NO_DEV;
 		errmsg(NULL, rc, "Could not create epoll descriptor. Error %d: %s",
@@ -446,7 +463,7 @@ static ocxl_err afu_open(ocxl_afu *afu)
 	struct epoll_event ev;
 	ev.events = EPOLLIN;
 	ev.data.ptr = &afu->fd_info; // Already set up in afu_init
-	if (epoll_ctl(afu->epoll_fd, EPOLL_CTL_ADD, afu->fd, &ev) == -1) {
+	if (afu->backend->epoll_ctl(afu->epoll_fd, EPOLL_CTL_ADD, afu->fd, &ev) == -1) {
 		ocxl_err rc = OCXL_NO_DEV;
 		errmsg(NULL, rc, "Could not add device fd %d to epoll fd %d: %d: '%s'",
 		       afu->fd, afu->epoll_fd, errno, strerror(errno));
@@ -454,7 +471,7 @@ static ocxl_err afu_open(ocxl_afu *afu)
 	}
 
 	struct ocxl_ioctl_metadata metadata;
-	if (ioctl(afu->fd, OCXL_IOCTL_GET_METADATA, &metadata)) {
+	if (afu->backend->ioctl(afu->fd, OCXL_IOCTL_GET_METADATA, &metadata)) {
 		ocxl_err rc = OCXL_NO_DEV;
 		errmsg(NULL, rc, "OCXL_IOCTL_GET_METADATA failed %d:%s", errno, strerror(errno));
 		return rc;
@@ -472,6 +489,33 @@ static ocxl_err afu_open(ocxl_afu *afu)
 	return OCXL_OK;
 }
 
+/**
+ * Open a new context on an AFU, between the afu_open probes.
+ *
+ * @see afu_open_device()
+ *
+ * @param afu the AFU instance we want to open
+ *
+ * @return the result of afu_open_device()
+ */
+static ocxl_err afu_open(ocxl_afu *afu)
+{
+	PROBE(afu_open__entry, afu, afu->device_path);
+	// Find the timestamp rate now, rather than on the first conversion in a hot path
+	timestamp_calibrate();
+	uint64_t start = timestamp_read();
+
+	ocxl_err rc = afu_open_device(afu);
+
+	afu->stats.setup_ns = timestamp_interval_ns(start, timestamp_read());
+	if (rc == OCXL_OK) {
+		stats_shm_register(afu);
+	}
+	PROBE(afu_open__return, afu, rc);
+
+	return rc;
+}
+
 /**
  * Get an AFU instance at the specified device path.
  *
@@ -490,7 +534,7 @@ static ocxl_err get_afu_by_path(const char *path, ocxl_afu_h *afu)
 		goto err;
 
 	struct stat dev_stats;
-	if (stat(path, &dev_stats)) {
+	if (current_backend->stat(path, &dev_stats)) {
 		rc = OCXL_NO_DEV;
 		errmsg(NULL, rc, "Could not start AFU device '%s': Error %d: %s", path, errno, strerror(errno));
 		goto err_free;
@@ -508,6 +552,7 @@ static ocxl_err get_afu_by_path(const char *path, ocxl_afu_h *afu)
 	return OCXL_OK;
 
 err_free:
+	stats_free(afu_h);
 	free(afu_h);
 err:
 	*afu = OCXL_INVALID_AFU;
@@ -538,7 +583,7 @@ ocxl_err ocxl_afu_open_from_dev(const char *path, ocxl_afu_h *afu)
 
 	rc = afu_open((ocxl_afu *)*afu);
 	if (rc != OCXL_OK) {
-		ocxl_afu_close(*afu);
+		afu_close(*afu);
 		*afu = OCXL_INVALID_AFU;
 		return rc;
 	}
@@ -546,6 +591,8 @@ ocxl_err ocxl_afu_open_from_dev(const char *path, ocxl_afu_h *afu)
 	return OCXL_OK;
 }
 
+LIBOCXL_ALIAS(ocxl_afu_open_from_dev, afu_open_from_dev);
+
 /**
  * Open an AFU context with a specified name on a specific card/afu index.
  *
@@ -598,7 +645,7 @@ ocxl_err ocxl_afu_open_specific(const char *name, const char *physical_function,
 
 	for (size_t dev = 0; dev < glob_data.gl_pathc; dev++) {
 		const char *dev_path = glob_data.gl_pathv[dev];
-		ret = ocxl_afu_open_from_dev(dev_path, afu);
+		ret = afu_open_from_dev(dev_path, afu);
 
 		switch (ret) {
 		case OCXL_OK:
@@ -617,6 +664,8 @@ end:
 	return ret;
 }
 
+LIBOCXL_ALIAS(ocxl_afu_open_specific, afu_open_specific);
+
 /**
  * Open an AFU context with a specified name.
  *
@@ -630,7 +679,7 @@ end:
  */
 ocxl_err ocxl_afu_open(const char *name, ocxl_afu_h *afu)
 {
-	return ocxl_afu_open_specific(name, NULL, -1, afu);
+	return afu_open_specific(name, NULL, -1, afu);
 }
 
 /**
@@ -653,9 +702,12 @@ ocxl_err ocxl_afu_open(const char *name, ocxl_afu_h *afu)
  */
 ocxl_err ocxl_afu_attach(ocxl_afu_h afu, __attribute__((unused)) uint64_t flags)
 {
+	PROBE(attach__entry, afu);
+
 	if (afu->fd == -1) {
 		ocxl_err rc = OCXL_NO_CONTEXT;
 		errmsg(afu, rc, "Attempted to attach a closed AFU context");
+		PROBE(attach__return, afu, rc, 0);
 		return rc;
 	}
 
@@ -665,17 +717,65 @@ ocxl_err ocxl_afu_attach(ocxl_afu_h afu, __attribute__((unused)) uint64_t flags)
 	attach_args.amr = afu->ppc64_amr;
 #endif
 
-	if (ioctl(afu->fd, OCXL_IOCTL_ATTACH, &attach_args)) {
+	uint64_t start = timestamp_read();
+	if (afu->backend->ioctl(afu->fd, OCXL_IOCTL_ATTACH, &attach_args)) {
 		ocxl_err rc = OCXL_INTERNAL_ERROR;
 		errmsg(afu, rc, "OCXL_IOCTL_ATTACH failed %d:%s", errno, strerror(errno));
+		PROBE(attach__return, afu, rc, 0);
 		return rc;
 	}
 
 	afu->attached = true;
+	afu->stats.attach_ns = timestamp_interval_ns(start, timestamp_read());
+
+	PROBE(attach__return, afu, OCXL_OK, afu->pasid);
 
 	return OCXL_OK;
 }
 
+/**
+ * Allocate the bookkeeping for IRQs, MMIO regions & events up front.
+ *
+ * The library allocates memory as IRQs are allocated, MMIO regions are mapped, and
+ * ocxl_afu_event_check() is called with larger event buffers. Reserving enough for the
+ * application's needs at setup time ensures none of these allocate later, keeping
+ * allocations off latency sensitive paths.
+ *
+ * Reservations only grow, a smaller count than is already reserved has no effect.
+ *
+ * @pre the AFU is opened
+ *
+ * @param afu the AFU to reserve resources on
+ * @param irqs the number of IRQs that will be allocated with ocxl_irq_alloc()
+ * @param mmios the number of MMIO regions that will be mapped at once
+ * @param max_events the largest event_count that will be passed to ocxl_afu_event_check()
+ *
+ * @retval OCXL_OK if the resources were reserved
+ * @retval OCXL_NO_CONTEXT if the AFU was not opened
+ * @retval OCXL_NO_MEM if a memory allocation error occurred
+ * @retval OCXL_INTERNAL_ERROR if the existing IRQs could not be moved
+ */
+ocxl_err ocxl_afu_reserve(ocxl_afu_h afu, uint16_t irqs, uint16_t mmios, uint16_t max_events)
+{
+	if (afu->fd == -1) {
+		ocxl_err rc = OCXL_NO_CONTEXT;
+		errmsg(afu, rc, "Attempted to reserve resources on a closed AFU context");
+		return rc;
+	}
+
+	ocxl_err rc = irq_reserve(afu, irqs, false);
+	if (rc != OCXL_OK) {
+		return rc;
+	}
+
+	rc = mmio_reserve(afu, mmios);
+	if (rc != OCXL_OK) {
+		return rc;
+	}
+
+	return event_buffer_reserve(afu, max_events);
+}
+
 /**
  * Close an AFU and detach it from the context.
  *
@@ -695,12 +795,20 @@ ocxl_err ocxl_afu_close(ocxl_afu_h afu)
 		return OCXL_ALREADY_DONE;
 	}
 
-	for (uint16_t mmio_idx = 0; mmio_idx < afu->mmio_count; mmio_idx++) {
-		ocxl_mmio_unmap((ocxl_mmio_h)&afu->mmios[mmio_idx]);
+	if (afu->mmios) {
+		for (uint16_t mmio_idx = 0; mmio_idx < afu->mmio_count; mmio_idx++) {
+			mmio_unmap(afu->mmios[mmio_idx]);
+			free(afu->mmios[mmio_idx]);
+		}
+
+		free(afu->mmios);
+		afu->mmios = NULL;
+		afu->mmio_count = 0;
+		afu->mmio_max_count = 0;
 	}
 
 	if (afu->global_mmio_fd != -1) {
-		close(afu->global_mmio_fd);
+		afu->backend->close(afu->global_mmio_fd);
 		afu->global_mmio_fd = -1;
 	}
 
@@ -720,10 +828,10 @@ ocxl_err ocxl_afu_close(ocxl_afu_h afu)
 		afu->epoll_event_count = 0;
 	}
 
-	close(afu->epoll_fd);
+	afu->backend->close(afu->epoll_fd);
 	afu->epoll_fd = -1;
 
-	close(afu->fd);
+	afu->backend->close(afu->fd);
 	afu->fd = -1;
 	afu->attached = false;
 
@@ -737,11 +845,16 @@ ocxl_err ocxl_afu_close(ocxl_afu_h afu)
 		afu->sysfs_path = NULL;
 	}
 
+	stats_shm_unregister(afu);
+	stats_free(afu);
+
 	free(afu);
 
 	return OCXL_OK;
 }
 
+LIBOCXL_ALIAS(ocxl_afu_close, afu_close);
+
 /**
  * @}
  *
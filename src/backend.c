@@ -0,0 +1,231 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libocxl_internal.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * @defgroup ocxl_backend OpenCAPI Backends
+ *
+ * All operations libocxl performs on devices are made through a backend. By default, this
+ * is the kernel OpenCAPI driver, but alternative backends (eg. simulations, or recorders)
+ * may be registered with ocxl_backend_register(), and selected with ocxl_backend_select().
+ *
+ * The backend may also be selected by name with the LIBOCXL_BACKEND environment variable,
+ * which is applied when the first AFU is opened, unless ocxl_backend_select() was called first.
+ *
+ * An AFU keeps the backend that was selected when it was opened until it is closed.
+ *
+ * @{
+ */
+
+#define BACKEND_MAX 8
+
+/* The size of the first ocxl_backend_ops layout, the smallest a backend may register */
+#define BACKEND_OPS_MIN_SIZE (offsetof(ocxl_backend_ops, epoll_wait) + sizeof(((ocxl_backend_ops *)0)->epoll_wait))
+
+static int kernel_open(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+static int kernel_ioctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+/// The kernel OpenCAPI driver
+const ocxl_backend_ops kernel_backend = {
+	.size = sizeof(ocxl_backend_ops),
+	.name = "kernel",
+	.open = kernel_open,
+	.close = close,
+	.read = read,
+	.ioctl = kernel_ioctl,
+	.mmap = mmap,
+	.munmap = munmap,
+	.stat = stat,
+	.fstatat = fstatat,
+	.eventfd = eventfd,
+	.epoll_create1 = epoll_create1,
+	.epoll_ctl = epoll_ctl,
+	.epoll_wait = epoll_wait,
+};
+
+/// The backend used for newly opened AFUs
+const ocxl_backend_ops *current_backend = &kernel_backend;
+
+/// The registered backends
+pthread_mutex_t backends_mutex = PTHREAD_MUTEX_INITIALIZER;
+const ocxl_backend_ops *backends[BACKEND_MAX] = { &kernel_backend };
+size_t backend_count = 1;
+
+/// Copies of the registered backends, in which operations the backend was built without are NULL
+ocxl_backend_ops backend_copies[BACKEND_MAX];
+
+/// Set once a backend is selected with ocxl_backend_select(), which overrides LIBOCXL_BACKEND
+bool backend_selected = false;
+
+/**
+ * Find a registered backend
+ *
+ * @pre backends_mutex is held
+ *
+ * @param name the name of the backend
+ * @return the backend, or NULL if there is no backend with that name
+ */
+static const ocxl_backend_ops *backend_find(const char *name)
+{
+	for (size_t i = 0; i < backend_count; i++) {
+		if (!strcmp(backends[i]->name, name)) {
+			return backends[i];
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * @internal
+ *
+ * Select the backend named by the LIBOCXL_BACKEND environment variable, unless a backend
+ * has already been selected with ocxl_backend_select()
+ *
+ * @param name the value of the environment variable, or NULL if it is not set
+ */
+void backend_init(const char *name)
+{
+	if (!name) {
+		return;
+	}
+
+	pthread_mutex_lock(&backends_mutex);
+	if (!backend_selected) {
+		const ocxl_backend_ops *ops = backend_find(name);
+		if (ops) {
+			current_backend = ops;
+		} else {
+			errmsg(NULL, OCXL_INVALID_ARGS, "LIBOCXL_BACKEND names unknown backend '%s', using '%s'",
+			       name, current_backend->name);
+		}
+	}
+	pthread_mutex_unlock(&backends_mutex);
+}
+
+/**
+ * Register a backend, so that it may be selected with ocxl_backend_select() or LIBOCXL_BACKEND.
+ *
+ * The operations are copied, reading no more than ops->size bytes, but the name must remain
+ * valid until the program exits.
+ *
+ * @param ops the backend, with size set to sizeof(ocxl_backend_ops), every operation must be
+ *        implemented
+ *
+ * @retval OCXL_OK if the backend was registered
+ * @retval OCXL_INVALID_ARGS if the backend is incomplete, or its size is too small
+ * @retval OCXL_ALREADY_DONE if a backend with the same name is already registered
+ * @retval OCXL_NO_MEM if too many backends have been registered
+ */
+ocxl_err ocxl_backend_register(const ocxl_backend_ops *ops)
+{
+	ocxl_err rc = OCXL_OK;
+
+	if (ops && ops->size < BACKEND_OPS_MIN_SIZE) {
+		rc = OCXL_INVALID_ARGS;
+		errmsg(NULL, rc, "Backend has an unknown size %zu, it should be sizeof(ocxl_backend_ops), %zu",
+		       ops->size, sizeof(ocxl_backend_ops));
+		return rc;
+	}
+
+	if (!ops || !ops->name || !ops->open || !ops->close || !ops->read || !ops->ioctl ||
+	    !ops->mmap || !ops->munmap || !ops->stat || !ops->fstatat || !ops->eventfd ||
+	    !ops->epoll_create1 || !ops->epoll_ctl || !ops->epoll_wait) {
+		rc = OCXL_INVALID_ARGS;
+		errmsg(NULL, rc, "Backend '%s' does not implement all operations",
+		       (ops && ops->name) ? ops->name : "(null)");
+		return rc;
+	}
+
+	pthread_mutex_lock(&backends_mutex);
+	if (backend_find(ops->name)) {
+		rc = OCXL_ALREADY_DONE;
+	} else if (backend_count == BACKEND_MAX) {
+		rc = OCXL_NO_MEM;
+		errmsg(NULL, rc, "Could not register backend '%s', %d backends are already registered",
+		       ops->name, BACKEND_MAX);
+	} else {
+		ocxl_backend_ops *copy = &backend_copies[backend_count];
+		memset(copy, 0, sizeof(*copy));
+		memcpy(copy, ops, ops->size < sizeof(*copy) ? ops->size : sizeof(*copy));
+		copy->size = sizeof(*copy);
+		backends[backend_count++] = copy;
+	}
+	pthread_mutex_unlock(&backends_mutex);
+
+	return rc;
+}
+
+/**
+ * Select the backend used for AFUs opened from now on.
+ *
+ * AFUs which are already open continue to use the backend they were opened with.
+ *
+ * @param name the name of a registered backend ("kernel" for the kernel driver)
+ *
+ * @retval OCXL_OK if the backend was selected
+ * @retval OCXL_INVALID_ARGS if there is no such backend
+ */
+ocxl_err ocxl_backend_select(const char *name)
+{
+	ocxl_err rc = OCXL_OK;
+
+	pthread_mutex_lock(&backends_mutex);
+	const ocxl_backend_ops *ops = name ? backend_find(name) : NULL;
+	if (ops) {
+		current_backend = ops;
+		backend_selected = true;
+	} else {
+		rc = OCXL_INVALID_ARGS;
+		errmsg(NULL, rc, "No backend named '%s' is registered", name ? name : "(null)");
+	}
+	pthread_mutex_unlock(&backends_mutex);
+
+	return rc;
+}
+
+/**
+ * Get the name of the backend used for AFUs opened from now on.
+ *
+ * @return the name of the backend
+ */
+const char *ocxl_backend_get_name()
+{
+	return current_backend->name;
+}
+
+/**
+ * @}
+ */
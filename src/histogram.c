@@ -0,0 +1,467 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libocxl_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @defgroup ocxl_histogram OpenCAPI Latency Histograms
+ *
+ * Once enabled on an AFU with ocxl_afu_enable_histograms(), the library records the latency
+ * of every ocxl_afu_event_check() call on it, from entry to return, in a histogram. For each IRQ reported, it also records the harvest
+ * latency, from the event check's wakeup (epoll_wait() returning) to the IRQ being read &
+ * reported, in a histogram for the IRQ's group, so the cost of harvesting completions of
+ * each kind can be told apart from the time spent waiting for them. IRQs are in group 0,
+ * unless moved with ocxl_irq_set_histogram_group().
+ *
+ * Histograms have buckets of a constant relative width, so tail latencies are kept as
+ * precisely as the median, from nanoseconds to minutes. Recording is a few atomic
+ * increments, without locks or allocation, but on cache lines shared by the threads using
+ * the AFU, so it is off until enabled.
+ *
+ * Histograms are read by taking a snapshot with ocxl_afu_get_event_histogram(), which may
+ * also reset them, and querying the snapshot:
+ * - ocxl_histogram_alloc() - Allocate a snapshot
+ * - ocxl_afu_get_event_histogram() - Copy (and optionally reset) a histogram of an AFU
+ * - ocxl_histogram_count(), ocxl_histogram_mean(), ocxl_histogram_percentile() - Query it
+ * - ocxl_histogram_free() - Free the snapshot
+ *
+ * Applications may also record latencies of their own into a histogram from
+ * ocxl_histogram_alloc(), with ocxl_histogram_record(), and query it in the same way.
+ *
+ * @{
+ */
+
+/**
+ * @internal
+ *
+ * Clear a histogram
+ *
+ * @param histogram the histogram
+ */
+static void histogram_clear(struct ocxl_histogram *histogram)
+{
+	memset(histogram, 0, sizeof(*histogram));
+	histogram->min_ns = UINT64_MAX;
+}
+
+/**
+ * @internal
+ *
+ * Allocate an empty histogram
+ *
+ * @return the histogram, or NULL if it could not be allocated
+ */
+static struct ocxl_histogram *histogram_new()
+{
+	struct ocxl_histogram *histogram = malloc(sizeof(struct ocxl_histogram));
+	if (histogram) {
+		histogram_clear(histogram);
+	}
+
+	return histogram;
+}
+
+/**
+ * @internal
+ *
+ * Get the bucket a latency is counted in
+ *
+ * Latencies below 2^HISTOGRAM_SUB_BITS have a bucket each. Above that, each power of 2 is
+ * split into 2^(HISTOGRAM_SUB_BITS - 1) buckets, by the bits below the most significant.
+ *
+ * @param ns the latency
+ * @return the bucket
+ */
+size_t histogram_bucket(uint64_t ns)
+{
+	if (ns < (1ULL << HISTOGRAM_SUB_BITS)) {
+		return ns;
+	}
+
+	if (ns >= (1ULL << HISTOGRAM_MAX_BITS)) {
+		return HISTOGRAM_BUCKETS - 1;
+	}
+
+	unsigned shift = (63 - __builtin_clzll(ns)) - HISTOGRAM_SUB_BITS + 1;
+	return ((size_t)shift << (HISTOGRAM_SUB_BITS - 1)) + (ns >> shift);
+}
+
+/**
+ * @internal
+ *
+ * Get the highest latency counted in a bucket
+ *
+ * @param bucket the bucket
+ * @return the highest latency
+ */
+uint64_t histogram_bucket_highest(size_t bucket)
+{
+	if (bucket < (1ULL << HISTOGRAM_SUB_BITS)) {
+		return bucket;
+	}
+
+	if (bucket == HISTOGRAM_BUCKETS - 1) {
+		return UINT64_MAX;
+	}
+
+	unsigned shift = (bucket >> (HISTOGRAM_SUB_BITS - 1)) - 1;
+	uint64_t mantissa = bucket - ((size_t)shift << (HISTOGRAM_SUB_BITS - 1));
+	return ((mantissa + 1) << shift) - 1;
+}
+
+/**
+ * @internal
+ *
+ * Record a latency
+ *
+ * @param histogram the histogram
+ * @param ns the latency
+ */
+void histogram_record(struct ocxl_histogram *histogram, uint64_t ns)
+{
+	__atomic_fetch_add(&histogram->buckets[histogram_bucket(ns)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&histogram->total_ns, ns, __ATOMIC_RELAXED);
+
+	uint64_t min = __atomic_load_n(&histogram->min_ns, __ATOMIC_RELAXED);
+	while (ns < min && !__atomic_compare_exchange_n(&histogram->min_ns, &min, ns, true,
+	        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+
+	uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true,
+	        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	}
+}
+
+/**
+ * @internal
+ *
+ * Allocate a histogram of an AFU, unless another thread already has
+ *
+ * Event checks on other threads may read the pointer as soon as it is set.
+ *
+ * @param afu the AFU
+ * @param histogram the AFU's pointer to the histogram
+ * @retval OCXL_OK if the histogram is allocated
+ * @retval OCXL_NO_MEM if memory could not be allocated
+ */
+static ocxl_err histogram_alloc_once(ocxl_afu *afu, struct ocxl_histogram **histogram)
+{
+	if (__atomic_load_n(histogram, __ATOMIC_ACQUIRE)) {
+		return OCXL_OK;
+	}
+
+	struct ocxl_histogram *allocated = histogram_new();
+	if (!allocated) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(afu, rc, "Could not allocate a latency histogram");
+		return rc;
+	}
+
+	struct ocxl_histogram *expected = NULL;
+	if (!__atomic_compare_exchange_n(histogram, &expected, allocated, false,
+	                                 __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		free(allocated);
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * @internal
+ *
+ * Free the histograms of an AFU
+ *
+ * @param afu the AFU
+ */
+void histograms_free(ocxl_afu *afu)
+{
+	free(afu->stats.event_histogram);
+	afu->stats.event_histogram = NULL;
+
+	for (int group = 0; group < OCXL_HISTOGRAM_IRQ_GROUPS; group++) {
+		free(afu->stats.irq_histograms[group]);
+		afu->stats.irq_histograms[group] = NULL;
+	}
+}
+
+/**
+ * Allocate a histogram to take snapshots into
+ *
+ * @see ocxl_afu_get_event_histogram()
+ *
+ * @param[out] histogram the histogram, which should be freed with ocxl_histogram_free()
+ *
+ * @retval OCXL_OK if the histogram was allocated
+ * @retval OCXL_NO_MEM if memory could not be allocated
+ */
+ocxl_err ocxl_histogram_alloc(ocxl_histogram_h *histogram)
+{
+	*histogram = histogram_new();
+	if (!*histogram) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(NULL, rc, "Could not allocate %zu bytes for a histogram", sizeof(struct ocxl_histogram));
+		return rc;
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * Free a histogram
+ *
+ * @param histogram the histogram to free
+ */
+void ocxl_histogram_free(ocxl_histogram_h histogram)
+{
+	free(histogram);
+}
+
+/**
+ * Record a latency in a histogram
+ *
+ * Recording takes no locks, so a histogram may be shared by several threads.
+ *
+ * @param histogram the histogram, from ocxl_histogram_alloc()
+ * @param ns the latency in nanoseconds
+ */
+void ocxl_histogram_record(ocxl_histogram_h histogram, uint64_t ns)
+{
+	histogram_record(histogram, ns);
+	__atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the number of latencies recorded in a histogram
+ *
+ * @param histogram the histogram
+ * @return the number of latencies
+ */
+uint64_t ocxl_histogram_count(ocxl_histogram_h histogram)
+{
+	return histogram->count;
+}
+
+/**
+ * Get the mean latency recorded in a histogram
+ *
+ * @param histogram the histogram
+ * @return the mean latency in nanoseconds, or 0 if the histogram is empty
+ */
+uint64_t ocxl_histogram_mean(ocxl_histogram_h histogram)
+{
+	return histogram->count ? histogram->total_ns / histogram->count : 0;
+}
+
+/**
+ * Get a percentile of the latencies recorded in a histogram
+ *
+ * The result is the highest latency counted in the same bucket as the percentile, so it is
+ * at most 1.6% above the exact percentile. The 0th & 100th percentiles are the exact
+ * minimum and maximum.
+ *
+ * @param histogram the histogram
+ * @param percentile the percentile, from 0 to 100, eg. 99.9
+ * @return the latency in nanoseconds, or 0 if the histogram is empty
+ */
+uint64_t ocxl_histogram_percentile(ocxl_histogram_h histogram, double percentile)
+{
+	if (!histogram->count) {
+		return 0;
+	}
+
+	if (percentile <= 0) {
+		return histogram->min_ns;
+	}
+
+	if (percentile >= 100) {
+		return histogram->max_ns;
+	}
+
+	// The rank of the latency, counting from 1
+	uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0);
+	if (rank < histogram->count * percentile / 100.0 || rank == 0) {
+		rank++;
+	}
+
+	uint64_t seen = 0;
+	for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		seen += histogram->buckets[bucket];
+		if (seen >= rank) {
+			uint64_t highest = histogram_bucket_highest(bucket);
+			if (highest > histogram->max_ns) {
+				return histogram->max_ns;
+			}
+			return (highest < histogram->min_ns) ? histogram->min_ns : highest;
+		}
+	}
+
+	return histogram->max_ns;
+}
+
+/**
+ * Start recording the latency histograms of an AFU
+ *
+ * The histograms are allocated for the event checks, and each IRQ group in use. Recording
+ * updates them with atomic increments, on cache lines shared by all threads using the AFU,
+ * so AFUs record nothing until this is called. Histograms are kept until the AFU is closed.
+ *
+ * @param afu the AFU
+ *
+ * @retval OCXL_OK if the histograms are recorded
+ * @retval OCXL_NO_MEM if the histograms could not be allocated
+ */
+ocxl_err ocxl_afu_enable_histograms(ocxl_afu_h afu)
+{
+	// IRQs moved to a group from now on allocate its histogram themselves
+	ocxl_err rc = histogram_alloc_once(afu, &afu->stats.event_histogram);
+	if (rc != OCXL_OK) {
+		return rc;
+	}
+
+	rc = histogram_alloc_once(afu, &afu->stats.irq_histograms[0]);
+	for (uint16_t irq = 0; rc == OCXL_OK && irq < afu->irq_count; irq++) {
+		uint16_t group = __atomic_load_n(&afu->irqs[irq].histogram_group, __ATOMIC_SEQ_CST);
+		rc = histogram_alloc_once(afu, &afu->stats.irq_histograms[group]);
+	}
+
+	return rc;
+}
+
+/**
+ * Take a snapshot of a latency histogram of an AFU
+ *
+ * The snapshot is not atomic: latencies recorded by other threads while it is taken may
+ * be missing from some of its totals, but with OCXL_HISTOGRAM_RESET, every latency is
+ * counted in exactly one snapshot.
+ *
+ * @param afu the AFU
+ * @param source OCXL_HISTOGRAM_EVENT_CHECK for the latencies of event checks, or an IRQ
+ *        group, for the harvest latencies of its IRQs
+ * @param flags OCXL_HISTOGRAM_RESET to reset the histogram as it is read, or 0
+ * @param[out] snapshot the histogram to copy into, from ocxl_histogram_alloc(), may be NULL
+ *        when resetting
+ *
+ * @retval OCXL_OK if the snapshot was taken
+ * @retval OCXL_INVALID_ARGS if the source is not valid, or no snapshot was requested
+ */
+ocxl_err ocxl_afu_get_event_histogram(ocxl_afu_h afu, int source, uint64_t flags, ocxl_histogram_h snapshot)
+{
+	struct ocxl_histogram *histogram;
+	bool reset = flags & OCXL_HISTOGRAM_RESET;
+
+	if (source == OCXL_HISTOGRAM_EVENT_CHECK) {
+		histogram = afu->stats.event_histogram;
+	} else if (source >= 0 && source < OCXL_HISTOGRAM_IRQ_GROUPS) {
+		histogram = afu->stats.irq_histograms[source];
+	} else {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(afu, rc, "Histogram source %d is not valid, expected an IRQ group below %d",
+		       source, OCXL_HISTOGRAM_IRQ_GROUPS);
+		return rc;
+	}
+
+	if (!snapshot && !reset) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(afu, rc, "A histogram must be read or reset");
+		return rc;
+	}
+
+	if (snapshot) {
+		histogram_clear(snapshot);
+	}
+
+	// Histograms that are not recorded, & IRQ groups that have never been used, are empty
+	if (!histogram) {
+		return OCXL_OK;
+	}
+
+	uint64_t count = 0;
+	for (size_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+		uint64_t value = reset ? __atomic_exchange_n(&histogram->buckets[bucket], 0, __ATOMIC_RELAXED) :
+		                 __atomic_load_n(&histogram->buckets[bucket], __ATOMIC_RELAXED);
+		if (snapshot) {
+			snapshot->buckets[bucket] = value;
+		}
+		count += value;
+	}
+
+	uint64_t total_ns, min_ns, max_ns;
+	if (reset) {
+		total_ns = __atomic_exchange_n(&histogram->total_ns, 0, __ATOMIC_RELAXED);
+		min_ns = __atomic_exchange_n(&histogram->min_ns, UINT64_MAX, __ATOMIC_RELAXED);
+		max_ns = __atomic_exchange_n(&histogram->max_ns, 0, __ATOMIC_RELAXED);
+	} else {
+		total_ns = __atomic_load_n(&histogram->total_ns, __ATOMIC_RELAXED);
+		min_ns = __atomic_load_n(&histogram->min_ns, __ATOMIC_RELAXED);
+		max_ns = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+	}
+
+	if (snapshot) {
+		// The count is taken from the buckets, so percentiles are consistent with it
+		snapshot->count = count;
+		snapshot->total_ns = total_ns;
+		snapshot->min_ns = count ? min_ns : UINT64_MAX;
+		snapshot->max_ns = count ? max_ns : 0;
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * Set the group an IRQ's harvest latencies are recorded in
+ *
+ * IRQs are in group 0 when allocated. Moving IRQs that complete different kinds of work to
+ * their own groups keeps their harvest latency distributions apart.
+ *
+ * @param afu the AFU the IRQ belongs to
+ * @param irq the IRQ
+ * @param group the group, below OCXL_HISTOGRAM_IRQ_GROUPS
+ *
+ * @retval OCXL_OK if the group was set
+ * @retval OCXL_NO_IRQ if the IRQ is invalid
+ * @retval OCXL_INVALID_ARGS if the group is out of range
+ * @retval OCXL_NO_MEM if the group's histogram could not be allocated, when histograms are recorded
+ */
+ocxl_err ocxl_irq_set_histogram_group(ocxl_afu_h afu, ocxl_irq_h irq, uint16_t group)
+{
+	if (irq >= afu->irq_count) {
+		ocxl_err rc = OCXL_NO_IRQ;
+		errmsg(afu, rc, "IRQ %u is not valid, %u IRQs are allocated", irq, afu->irq_count);
+		return rc;
+	}
+
+	if (group >= OCXL_HISTOGRAM_IRQ_GROUPS) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(afu, rc, "IRQ group %u is out of range, there are %d groups", group, OCXL_HISTOGRAM_IRQ_GROUPS);
+		return rc;
+	}
+
+	// The group is set first, so ocxl_afu_enable_histograms() either sees it, or is seen here
+	__atomic_store_n(&afu->irqs[irq].histogram_group, group, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&afu->stats.event_histogram, __ATOMIC_SEQ_CST)) {
+		return histogram_alloc_once(afu, &afu->stats.irq_histograms[group]);
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * @}
+ */
@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <sys/select.h>
+#include <sys/types.h> // Required for ssize_t & off_t in ocxl_backend_ops
 #include <sys/mman.h>  // Required for PROT_* for MMIO map calls
 #include <endian.h> // Required for htobe32 & friends in MMIO access wrappers
 
@@ -38,7 +39,13 @@ extern "C" {
 
 #define OCXL_NO_MESSAGES 0			/**< No messages requested */
 #define OCXL_ERRORS		(1 << 0)	/**< Error messages requested */
-#define OCXL_TRACING	(1 << 1)	/**< Tracing requested */
+#define OCXL_TRACING	(1 << 1)	/**< Tracing requested, for all categories */
+#define OCXL_TRACE_OPEN		(1 << 2)	/**< Trace AFU discovery, open & attach */
+#define OCXL_TRACE_MMIO		(1 << 3)	/**< Trace MMIO mapping & accesses */
+#define OCXL_TRACE_IRQ		(1 << 4)	/**< Trace IRQ allocation & delivery */
+#define OCXL_TRACE_EVENTS	(1 << 5)	/**< Trace waiting for & harvesting events */
+#define OCXL_TRACE_FAULTS	(1 << 6)	/**< Trace translation faults */
+#define OCXL_TRACE_ALL		(OCXL_TRACE_OPEN | OCXL_TRACE_MMIO | OCXL_TRACE_IRQ | OCXL_TRACE_EVENTS | OCXL_TRACE_FAULTS) /**< The mask of all trace categories */
 
 
 /**
@@ -85,6 +92,25 @@ typedef uint16_t ocxl_irq_h;
  */
 typedef struct ocxl_mmio_area *ocxl_mmio_h;
 
+/**
+ * A handle for a latency histogram, see ocxl_histogram_alloc()
+ */
+typedef struct ocxl_histogram *ocxl_histogram_h;
+
+#define OCXL_HISTOGRAM_EVENT_CHECK (-1) /**< The latencies of whole ocxl_afu_event_check() calls */
+#define OCXL_HISTOGRAM_IRQ_GROUPS 8 /**< The number of IRQ groups, see ocxl_irq_set_histogram_group() */
+#define OCXL_HISTOGRAM_RESET (1 << 0) /**< Reset the histogram as it is read */
+
+/**
+ * A handle for a background sampler of AFU counters, see ocxl_sampler_start()
+ */
+typedef struct ocxl_sampler *ocxl_sampler_h;
+
+#define OCXL_SAMPLER_MAX_COUNTERS 16 /**< The most registers a sampler can read */
+#define OCXL_SAMPLER_MAX_RATE 10000 /**< The highest sampling rate, in Hz */
+#define OCXL_SAMPLER_RING_DEFAULT 4096 /**< The samples kept for readers, if not specified */
+#define OCXL_SAMPLER_RING_MAX (1 << 20) /**< The most samples that can be kept for readers */
+
 
 /**
  * Potential return values from ocxl_* functions
@@ -160,14 +186,86 @@ typedef struct ocxl_event {
 	};
 } ocxl_event;
 
+/**
+ * Statistics kept by the library for an AFU context, see ocxl_afu_get_stats()
+ *
+ * Counters cover the life of the context, across all threads that have used it.
+ *
+ * Counters added in later versions of the library (including those of new event types) are
+ * appended, so callers pass the sizeof(ocxl_afu_stats) they were built against.
+ */
+typedef struct ocxl_afu_stats {
+	uint64_t irqs_allocated; /**< IRQs allocated with ocxl_irq_alloc() */
+	uint64_t irqs_fired; /**< Times IRQs were triggered, including those coalesced into a single event */
+	uint64_t events[2]; /**< Events reported by ocxl_afu_event_check(), indexed by ocxl_event_type */
+	uint64_t translation_fault_addresses; /**< Distinct addresses of translation faults (a lower bound beyond 256 addresses) */
+	uint64_t event_checks; /**< Calls to ocxl_afu_event_check() */
+	uint64_t epoll_wakeups; /**< Event checks which found descriptors ready */
+	uint64_t empty_wakeups; /**< Event checks which found descriptors ready, but no events to report (spurious wakeups) */
+	uint64_t event_waits; /**< Event checks which waited for events (with a non-zero timeout) */
+	uint64_t event_wait_ns; /**< The total time event checks waited for events, in nanoseconds */
+	uint64_t mmio_reads[2]; /**< MMIO reads, indexed by ocxl_mmio_type, 0 if built with STATS_OMIT="mmio" */
+	uint64_t mmio_writes[2]; /**< MMIO writes, indexed by ocxl_mmio_type, 0 if built with STATS_OMIT="mmio" */
+	uint64_t setup_ns; /**< The time taken to open the context, in nanoseconds */
+	uint64_t attach_ns; /**< The time taken to attach the context, in nanoseconds (0 if not attached) */
+	uint64_t threads; /**< The number of threads that have counted on the context (an exited thread's counters may be continued by a later thread) */
+} ocxl_afu_stats;
+
+/**
+ * The increase of a sampler's counters over one sampling interval, see ocxl_sampler_read()
+ */
+typedef struct ocxl_sample {
+	uint64_t timestamp; /**< When the counters were read, in nanoseconds against CLOCK_MONOTONIC */
+	uint64_t interval_ns; /**< The time since the previous sample */
+	uint64_t deltas[OCXL_SAMPLER_MAX_COUNTERS]; /**< The increase of each counter, in the order the registers were given */
+} ocxl_sample;
+
 #define OCXL_ATTACH_FLAGS_NONE (0)
 
+struct stat;
+struct epoll_event;
+
+/**
+ * The operations libocxl performs on devices, allowing them to be provided by something other
+ * than the kernel driver, eg. a simulation
+ *
+ * Each operation has the semantics of the system call it is named after: it returns -1 and
+ * sets errno on failure (mmap returns MAP_FAILED).
+ *
+ * Operations may be added to the end of the table in later versions of the library, so
+ * backends set size to the sizeof(ocxl_backend_ops) they were built against, and the library
+ * reads no further.
+ *
+ * @see ocxl_backend_register()
+ */
+typedef struct ocxl_backend_ops {
+	size_t size; /**< sizeof(ocxl_backend_ops) */
+	const char *name; /**< The name the backend is selected by */
+	int (*open)(const char *path, int flags); /**< Open a device or sysfs file */
+	int (*close)(int fd);
+	ssize_t (*read)(int fd, void *buf, size_t count);
+	int (*ioctl)(int fd, unsigned long request, void *arg);
+	void *(*mmap)(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+	int (*munmap)(void *addr, size_t length);
+	int (*stat)(const char *path, struct stat *buf); /**< Used to identify devices */
+	int (*fstatat)(int dirfd, const char *path, struct stat *buf, int flags); /**< Used to identify devices */
+	int (*eventfd)(unsigned int initval, int flags); /**< Create the descriptor for an IRQ */
+	int (*epoll_create1)(int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+} ocxl_backend_ops;
+
 /* setup.c */
 void ocxl_enable_messages(uint64_t sources);
 void ocxl_set_error_message_handler(void (*handler)(ocxl_err error, const char *message));
 const char *ocxl_err_to_string(ocxl_err err) LIBOCXL_WARN_UNUSED;
 const char *ocxl_info() LIBOCXL_WARN_UNUSED;
 
+/* backend.c */
+ocxl_err ocxl_backend_register(const ocxl_backend_ops *ops) LIBOCXL_WARN_UNUSED;
+ocxl_err ocxl_backend_select(const char *name);
+const char *ocxl_backend_get_name() LIBOCXL_WARN_UNUSED;
+
 /* afu.c */
 /* AFU getters */
 const ocxl_identifier *ocxl_afu_get_identifier(ocxl_afu_h afu) LIBOCXL_WARN_UNUSED;
@@ -186,6 +284,8 @@ void ocxl_afu_set_error_message_handler(ocxl_afu_h afu, void (*handler)(ocxl_afu
                                         const char *message));
 ocxl_err ocxl_afu_close(ocxl_afu_h afu);
 ocxl_err ocxl_afu_attach(ocxl_afu_h afu, uint64_t flags) LIBOCXL_WARN_UNUSED;
+ocxl_err ocxl_afu_reserve(ocxl_afu_h afu, uint16_t irqs, uint16_t mmios, uint16_t max_events) LIBOCXL_WARN_UNUSED;
+void ocxl_afu_get_stats(ocxl_afu_h afu, ocxl_afu_stats *stats, size_t size);
 
 /* irq.c */
 /* AFU IRQ functions */
@@ -199,6 +299,28 @@ int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *even
 ocxl_err ocxl_afu_get_p9_thread_id(ocxl_afu_h afu, uint16_t *thread_id);
 #endif
 
+/* histogram.c */
+ocxl_err ocxl_histogram_alloc(ocxl_histogram_h *histogram) LIBOCXL_WARN_UNUSED;
+void ocxl_histogram_free(ocxl_histogram_h histogram);
+void ocxl_histogram_record(ocxl_histogram_h histogram, uint64_t ns);
+uint64_t ocxl_histogram_count(ocxl_histogram_h histogram) LIBOCXL_WARN_UNUSED;
+uint64_t ocxl_histogram_mean(ocxl_histogram_h histogram) LIBOCXL_WARN_UNUSED;
+uint64_t ocxl_histogram_percentile(ocxl_histogram_h histogram, double percentile) LIBOCXL_WARN_UNUSED;
+ocxl_err ocxl_afu_enable_histograms(ocxl_afu_h afu) LIBOCXL_WARN_UNUSED;
+ocxl_err ocxl_afu_get_event_histogram(ocxl_afu_h afu, int source, uint64_t flags, ocxl_histogram_h snapshot);
+ocxl_err ocxl_irq_set_histogram_group(ocxl_afu_h afu, ocxl_irq_h irq, uint16_t group) LIBOCXL_WARN_UNUSED;
+
+/* timestamp.c */
+uint64_t ocxl_timestamp() LIBOCXL_WARN_UNUSED;
+uint64_t ocxl_timestamp_to_ns(uint64_t timestamp) LIBOCXL_WARN_UNUSED;
+
+/* sampler.c */
+ocxl_err ocxl_sampler_start(ocxl_mmio_h mmio, const off_t *registers, uint16_t count, ocxl_endian endian,
+                            uint32_t rate_hz, uint32_t ring_samples, ocxl_sampler_h *sampler) LIBOCXL_WARN_UNUSED;
+size_t ocxl_sampler_read(ocxl_sampler_h sampler, ocxl_sample *samples, size_t count) LIBOCXL_WARN_UNUSED;
+uint64_t ocxl_sampler_merged(ocxl_sampler_h sampler) LIBOCXL_WARN_UNUSED;
+void ocxl_sampler_stop(ocxl_sampler_h sampler);
+
 /**
  * @addtogroup ocxl_irq
  * @{
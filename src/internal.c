@@ -40,8 +40,8 @@ pthread_mutex_t libocxl_inited_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 bool verbose_errors = false;
 bool verbose_errors_all = false;
-bool tracing = false;
-bool tracing_all = false;
+uint64_t tracing = 0;
+uint64_t tracing_all = 0;
 
 void ocxl_default_error_handler(ocxl_err error, const char *message);
 void (*error_handler)(ocxl_err error, const char *message) = ocxl_default_error_handler;
@@ -51,9 +51,12 @@ pthread_mutex_t stderr_mutex = PTHREAD_MUTEX_INITIALIZER;
 /**
  * Executed on first afu_open
  *  - Check the LIBOCXL_INFO environment variable and output the info string
- *  - Check the LIBOCXL_TRACE_ALL environment variable and enable tracing_all
+ *  - Check the LIBOCXL_TRACE_ALL environment variable and enable tracing_all, in all or the listed categories
+ *  - Apply the trace buffer, output & flight recorder settings (see trace_init())
  *  - Check the LIBOCXL_VERBOSE_ERRORS_ALL environment variable and enable verbose_errors_all
  *  - Check the LIBOCXL_SYSPATH environment variable and override sys_path
+ *  - Check the LIBOCXL_BACKEND environment variable and select the backend
+ *  - Publish statistics if requested (see stats_shm_init())
  */
 void libocxl_init()
 {
@@ -70,11 +73,8 @@ void libocxl_init()
 		fprintf(stderr, "%s\n", libocxl_info);
 	}
 
-	val = getenv("LIBOCXL_TRACE_ALL");
-	if (val && (!strcasecmp(val, "yes") || !strcmp(val, "1"))) {
-		tracing_all = true;
-		tracing = true;
-	}
+	tracing_all = trace_init(trace_parse_categories(getenv("LIBOCXL_TRACE_ALL")));
+	tracing |= tracing_all;
 
 	val = getenv("LIBOCXL_VERBOSE_ERRORS_ALL");
 	if (val && (!strcasecmp(val, "yes") || !strcmp(val, "1"))) {
@@ -86,6 +86,10 @@ void libocxl_init()
 	if (val)
 		sys_path = val;
 
+	backend_init(getenv("LIBOCXL_BACKEND"));
+
+	stats_shm_init();
+
 	libocxl_inited = true;
 
 	pthread_mutex_unlock(&libocxl_inited_mutex);
@@ -93,7 +97,7 @@ void libocxl_init()
 
 
 /**
- * Output a trace message
+ * Output a debug message immediately, trace messages are recorded with TRACE() instead
  * @param file the source filename
  * @param line the source line
  * @param function the function name
@@ -132,6 +136,8 @@ void errmsg(ocxl_afu *afu, ocxl_err error, const char *format, ...)
 	va_list ap;
 	va_start(ap, format);
 
+	trace_flight_dump();
+
 	if (afu) {
 		if (afu->verbose_errors) {
 			char buf[MAX_MESSAGE_LENGTH];
@@ -164,7 +170,7 @@ void errmsg(ocxl_afu *afu, ocxl_err error, const char *format, ...)
 void ocxl_default_error_handler(ocxl_err error, const char *message)
 {
 	pthread_mutex_lock(&stderr_mutex);
-	fprintf(stderr, "ERROR: %s: %s\n", ocxl_err_to_string(error), message);
+	fprintf(stderr, "ERROR: %s: %s\n", err_to_string(error), message);
 	pthread_mutex_unlock(&stderr_mutex);
 }
 
@@ -176,37 +182,67 @@ void ocxl_default_error_handler(ocxl_err error, const char *message)
  */
 void ocxl_default_afu_error_handler(ocxl_afu_h afu, ocxl_err error, const char *message)
 {
-	const char *dev = ocxl_afu_get_device_path(afu);
+	const char *dev = afu_get_device_path(afu);
 
 	pthread_mutex_lock(&stderr_mutex);
-	fprintf(stderr, "ERROR: %s\t%s: %s\n", dev ? dev : "No AFU", ocxl_err_to_string(error), message);
+	fprintf(stderr, "ERROR: %s\t%s: %s\n", dev ? dev : "No AFU", err_to_string(error), message);
 	pthread_mutex_unlock(&stderr_mutex);
 }
 
 /**
- * Grow a buffer geometrically
+ * Resize a buffer to hold at least a number of elements
+ *
+ * Any new elements are zeroed. The buffer may move, invalidating pointers into it.
  *
  * @param afu the AFU that owns the buffer
- * @param buffer [in,out] the buffer to grow
+ * @param buffer [in,out] the buffer to resize
  * @param [in,out] count the number of elements in the buffer
  * @param size the size of a buffer element
- * @param initial_count the initial number of elements in the buffer
+ * @param min_count the number of elements the buffer must hold
  */
-ocxl_err grow_buffer(ocxl_afu *afu, void **buffer, uint16_t *count, size_t size, size_t initial_count)
+ocxl_err reserve_buffer(ocxl_afu *afu, void **buffer, uint16_t *count, size_t size, size_t min_count)
 {
-	size_t new_count = (*count > 0) ? 2 * *count : initial_count;
-	void *temp = realloc(*buffer, new_count * size);
+	if (min_count <= *count) {
+		return OCXL_OK;
+	}
+
+	if (min_count > UINT16_MAX) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(afu, rc, "Could not grow buffer to %lu elements, the limit is %u", min_count, UINT16_MAX);
+		return rc;
+	}
+
+	void *temp = realloc(*buffer, min_count * size);
 	if (temp == NULL) {
 		ocxl_err rc = OCXL_NO_MEM;
 		errmsg(afu, rc, "Could not realloc buffer to %lu elements of %lu bytes (%lu bytes total): %d '%s'",
-		       new_count, size, new_count * size, errno, strerror(errno));
+		       min_count, size, min_count * size, errno, strerror(errno));
 		return rc;
 	}
 
-	memset((char *)temp + *count * size, '\0', new_count - *count);
+	memset((char *)temp + *count * size, '\0', (min_count - *count) * size);
 
 	*buffer = temp;
-	*count = new_count;
+	*count = min_count;
 
 	return OCXL_OK;
 }
+
+/**
+ * Grow a buffer geometrically
+ *
+ * @param afu the AFU that owns the buffer
+ * @param buffer [in,out] the buffer to grow
+ * @param [in,out] count the number of elements in the buffer
+ * @param size the size of a buffer element
+ * @param initial_count the initial number of elements in the buffer
+ */
+ocxl_err grow_buffer(ocxl_afu *afu, void **buffer, uint16_t *count, size_t size, size_t initial_count)
+{
+	size_t new_count = (*count > 0) ? 2 * *count : initial_count;
+	if (new_count > UINT16_MAX && *count < UINT16_MAX) {
+		new_count = UINT16_MAX;
+	}
+
+	return reserve_buffer(afu, buffer, count, size, new_count);
+}
@@ -42,7 +42,7 @@
 void irq_dealloc(ocxl_afu *afu, ocxl_irq *irq)
 {
 	if (irq->addr) {
-		if (munmap(irq->addr, afu->page_size)) {
+		if (afu->backend->munmap(irq->addr, afu->page_size)) {
 			errmsg(afu, OCXL_INTERNAL_ERROR, "Could not unmap IRQ page: %d: '%s'",
 			       errno, strerror(errno));
 		}
@@ -50,7 +50,7 @@ void irq_dealloc(ocxl_afu *afu, ocxl_irq *irq)
 	}
 
 	if (irq->event.irq_offset) {
-		int rc = ioctl(afu->fd, OCXL_IOCTL_IRQ_FREE, &irq->event.irq_offset);
+		int rc = afu->backend->ioctl(afu->fd, OCXL_IOCTL_IRQ_FREE, &irq->event.irq_offset);
 		if (rc) {
 			errmsg(afu, OCXL_INTERNAL_ERROR, "Could not free IRQ in kernel: %d", rc);
 		}
@@ -58,7 +58,7 @@ void irq_dealloc(ocxl_afu *afu, ocxl_irq *irq)
 	}
 
 	if (irq->event.eventfd >= 0) {
-		close(irq->event.eventfd);
+		afu->backend->close(irq->event.eventfd);
 		irq->event.eventfd = -1;
 	}
 
@@ -92,6 +92,8 @@ void irq_dealloc(ocxl_afu *afu, ocxl_irq *irq)
  */
 static ocxl_err irq_allocate(ocxl_afu *afu, ocxl_irq *irq, void *info)
 {
+	PROBE(irq_allocate__entry, afu);
+
 	irq->event.irq_offset = 0;
 	irq->event.eventfd = -1;
 	irq->event.reserved = 0;
@@ -100,29 +102,30 @@ static ocxl_err irq_allocate(ocxl_afu *afu, ocxl_irq *irq, void *info)
 	irq->info = info;
 	irq->fd_info.type = EPOLL_SOURCE_IRQ;
 	irq->fd_info.irq = irq;
+	irq->histogram_group = 0;
 
 	ocxl_err ret = OCXL_INTERNAL_ERROR;
 
-	int fd = eventfd(0, EFD_CLOEXEC);
+	int fd = afu->backend->eventfd(0, EFD_CLOEXEC);
 	if (fd < 0) {
 		errmsg(afu, ret, "Could not open eventfd : %d: '%s'", errno, strerror(errno));
 		goto errend;
 	}
 	irq->event.eventfd = fd;
 
-	int rc = ioctl(afu->fd, OCXL_IOCTL_IRQ_ALLOC, &irq->event.irq_offset);
+	int rc = afu->backend->ioctl(afu->fd, OCXL_IOCTL_IRQ_ALLOC, &irq->event.irq_offset);
 	if (rc) {
 		errmsg(afu, ret, "Could not allocate IRQ in kernel: %d: '%s'", errno, strerror(errno));
 		goto errend;
 	}
 
-	rc = ioctl(afu->fd, OCXL_IOCTL_IRQ_SET_FD, &irq->event);
+	rc = afu->backend->ioctl(afu->fd, OCXL_IOCTL_IRQ_SET_FD, &irq->event);
 	if (rc) {
 		errmsg(afu, ret, "Could not set event descriptor in kernel: %d: '%s'", errno, strerror(errno));
 		goto errend;
 	}
 
-	irq->addr = mmap(NULL, afu->page_size, PROT_WRITE, MAP_SHARED,
+	irq->addr = afu->backend->mmap(NULL, afu->page_size, PROT_WRITE, MAP_SHARED,
 	                 afu->fd, irq->event.irq_offset);
 	if (irq->addr == MAP_FAILED) {
 		errmsg(afu, ret, "mmap for IRQ failed: %d: '%s'", errno, strerror(errno));
@@ -132,19 +135,126 @@ static ocxl_err irq_allocate(ocxl_afu *afu, ocxl_irq *irq, void *info)
 	struct epoll_event ev;
 	ev.events = EPOLLIN;
 	ev.data.ptr = &irq->fd_info;
-	if (epoll_ctl(afu->epoll_fd, EPOLL_CTL_ADD, irq->event.eventfd, &ev) == -1) {
+	if (afu->backend->epoll_ctl(afu->epoll_fd, EPOLL_CTL_ADD, irq->event.eventfd, &ev) == -1) {
 		errmsg(afu, ret, "Could not add IRQ fd %d to epoll fd %d: %d: '%s'",
 		       irq->event.eventfd, afu->epoll_fd, errno, strerror(errno));
 		goto errend;
 	}
 
+	PROBE(irq_allocate__return, afu, OCXL_OK, irq->addr);
+
 	return OCXL_OK;
 
 errend:
 	irq_dealloc(afu, irq);
+	PROBE(irq_allocate__return, afu, ret, NULL);
 	return ret;
 }
 
+/**
+ * @internal
+ *
+ * Point the epoll registrations of the allocated IRQs at their current location, after the IRQ buffer has moved.
+ *
+ * @param afu the AFU the IRQs belong to
+ *
+ * @retval OCXL_OK on success
+ * @retval OCXL_INTERNAL_ERROR if an IRQ could not be reregistered
+ */
+static ocxl_err irq_rebind(ocxl_afu *afu)
+{
+	for (uint16_t irq_idx = 0; irq_idx < afu->irq_count; irq_idx++) {
+		ocxl_irq *irq = &afu->irqs[irq_idx];
+		irq->fd_info.irq = irq;
+
+		if (irq->event.eventfd < 0) {
+			continue;
+		}
+
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = &irq->fd_info;
+		if (afu->backend->epoll_ctl(afu->epoll_fd, EPOLL_CTL_MOD, irq->event.eventfd, &ev) == -1) {
+			ocxl_err rc = OCXL_INTERNAL_ERROR;
+			errmsg(afu, rc, "Could not update IRQ fd %d in epoll fd %d: %d: '%s'",
+			       irq->event.eventfd, afu->epoll_fd, errno, strerror(errno));
+			return rc;
+		}
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * @internal
+ *
+ * Ensure the IRQ buffer of an AFU can hold a number of IRQs, so they may be allocated without growing it.
+ *
+ * @param afu the AFU to reserve IRQs on
+ * @param count the number of IRQs the buffer must hold
+ * @param geometric true to grow the buffer geometrically, false to grow it to exactly count
+ *
+ * @retval OCXL_OK on success
+ * @retval OCXL_NO_MEM if a memory allocation error occurred
+ * @retval OCXL_INTERNAL_ERROR if existing IRQs could not be moved
+ */
+ocxl_err irq_reserve(ocxl_afu *afu, size_t count, bool geometric)
+{
+	if (count <= afu->irq_max_count) {
+		return OCXL_OK;
+	}
+
+	ocxl_irq *old = afu->irqs;
+	ocxl_err rc;
+	if (geometric) {
+		rc = grow_buffer(afu, (void **)&afu->irqs, &afu->irq_max_count, sizeof(ocxl_irq), INITIAL_IRQ_COUNT);
+	} else {
+		rc = reserve_buffer(afu, (void **)&afu->irqs, &afu->irq_max_count, sizeof(ocxl_irq), count);
+	}
+	if (rc != OCXL_OK) {
+		errmsg(afu, rc, "Could not grow IRQ buffer");
+		return rc;
+	}
+
+	// The epoll registrations refer to the IRQs by address
+	if (old != afu->irqs) {
+		return irq_rebind(afu);
+	}
+
+	return OCXL_OK;
+}
+
+/**
+ * @internal
+ *
+ * Ensure the epoll buffer of an AFU can hold a number of events, so ocxl_afu_event_check() need not allocate it.
+ *
+ * @param afu the AFU to reserve events on
+ * @param count the number of events the buffer must hold
+ *
+ * @retval OCXL_OK on success
+ * @retval OCXL_NO_MEM if a memory allocation error occurred
+ */
+ocxl_err event_buffer_reserve(ocxl_afu *afu, size_t count)
+{
+	if (count <= afu->epoll_event_count) {
+		return OCXL_OK;
+	}
+
+	struct epoll_event *events = malloc(count * sizeof(*events));
+	if (events == NULL) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(afu, rc, "Could not allocate space for %lu events", count);
+		return rc;
+	}
+
+	free(afu->epoll_events);
+	afu->epoll_events = events;
+	afu->epoll_event_count = count;
+
+	return OCXL_OK;
+}
+
 /**
  * Allocate an IRQ for an open AFU.
  *
@@ -154,6 +264,8 @@ errend:
  * or by obtaining an event descriptor via ocxl_irq_get_fd() and using it with
  * poll(), select(), etc.
  *
+ * The IRQ bookkeeping grows as IRQs are allocated, ocxl_afu_reserve() allocates it up front.
+ *
  * @param afu the AFU to allocate IRQs for
  * @param info user information to associate with the handle (may be NULL)
  * @param[out] irq the 0 indexed IRQ number that was allocated. This will be monotonically incremented by each subsequent call.
@@ -164,9 +276,8 @@ errend:
 ocxl_err ocxl_irq_alloc(ocxl_afu_h afu, void *info, ocxl_irq_h *irq)
 {
 	if (afu->irq_count == afu->irq_max_count) {
-		ocxl_err rc = grow_buffer(afu, (void **)&afu->irqs, &afu->irq_max_count, sizeof(ocxl_irq), INITIAL_IRQ_COUNT);
+		ocxl_err rc = irq_reserve(afu, afu->irq_count + 1, true);
 		if (rc != OCXL_OK) {
-			errmsg(afu, rc, "Could not grow IRQ buffer");
 			return rc;
 		}
 	}
@@ -178,6 +289,10 @@ ocxl_err ocxl_irq_alloc(ocxl_afu_h afu, void *info, ocxl_irq_h *irq)
 	}
 	afu->irqs[afu->irq_count].irq_number = afu->irq_count;
 
+	TRACE(afu, OCXL_TRACE_IRQ, "Allocated IRQ %u, handle=%p info=%p",
+	      afu->irq_count, afu->irqs[afu->irq_count].addr, info);
+	STATS_ADD(afu, STAT_IRQS_ALLOCATED, 1);
+
 	*irq = (ocxl_irq_h)afu->irq_count;
 	afu->irq_count++;
 
@@ -260,13 +375,15 @@ static void populate_xsl_fault_error(ocxl_afu *afu, ocxl_event *event, void *bod
 	event->translation_fault.addr = (void *)err->addr;
 #ifdef _ARCH_PPC64
 	event->translation_fault.dsisr = err->dsisr;
-	TRACE(afu, "Translation fault error received, addr=%p, dsisr=%llx, count=%llu",
+	TRACE(afu, OCXL_TRACE_FAULTS, "Translation fault error received, addr=%p, dsisr=%llx, count=%llu",
 	      event->translation_fault.addr, event->translation_fault.dsisr, err->count);
 #else
-	TRACE(afu, "Translation fault error received, addr=%p, count=%llu",
+	TRACE(afu, OCXL_TRACE_FAULTS, "Translation fault error received, addr=%p, count=%llu",
 	      event->translation_fault.addr, err->count);
 #endif
 	event->translation_fault.count = err->count;
+
+	stats_fault_address(afu, event->translation_fault.addr);
 }
 
 /**
@@ -302,7 +419,7 @@ static void populate_xsl_fault_error(ocxl_afu *afu, ocxl_event *event, void *bod
  * @retval OCXL_EVENT_ACTION_NONE if there was no event to read
  * @retval OCXL_EVENT_ACTION_IGNORE if the read was successful but should be ignored
  */
-static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_version, ocxl_event *event, int *last)
+static ocxl_event_action read_kernel_event(ocxl_afu_h afu, uint16_t event_api_version, ocxl_event *event, int *last)
 {
 	size_t event_size = sizeof(ocxl_kernel_event_header);
 	*last = 0;
@@ -323,7 +440,7 @@ static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_versi
 	char buf[event_size];
 
 	ssize_t buf_used;
-	if ((buf_used = read(afu->fd, buf, event_size)) < 0) {
+	if ((buf_used = afu->backend->read(afu->fd, buf, event_size)) < 0) {
 		if (errno == EAGAIN || errno == EWOULDBLOCK) {
 			*last = 1;
 			return OCXL_EVENT_ACTION_NONE;
@@ -340,7 +457,7 @@ static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_versi
 	ocxl_kernel_event_header *header = (ocxl_kernel_event_header *)buf;
 
 	if (header->type > max_supported_event) {
-		TRACE(afu, "Unknown event received from kernel of type %u", header->type);
+		TRACE(afu, OCXL_TRACE_EVENTS, "Unknown event received from kernel of type %u", header->type);
 		*last = !! (header->flags & OCXL_KERNEL_EVENT_FLAG_LAST);
 		return OCXL_EVENT_ACTION_IGNORE;
 	}
@@ -367,6 +484,31 @@ static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_versi
 	return OCXL_EVENT_ACTION_SUCCESS;
 }
 
+/**
+ * @internal
+ *
+ * Read a single AFU event from the main AFU descriptor, between the read_afu_event probes.
+ *
+ * @see read_kernel_event()
+ *
+ * @param afu the AFU to read the event from
+ * @param event_api_version the version of the event API that the caller wants to see
+ * @param[out] event event to populate
+ * @param[out] last true if this was the last event to read from the kernel for now
+ *
+ * @return the action to take, as read_kernel_event()
+ */
+static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_version, ocxl_event *event, int *last)
+{
+	PROBE(read_afu_event__entry, afu);
+
+	ocxl_event_action ret = read_kernel_event(afu, event_api_version, event, last);
+
+	PROBE(read_afu_event__return, afu, ret, ret == OCXL_EVENT_ACTION_SUCCESS ? (int)event->type : -1);
+
+	return ret;
+}
+
 /**
  * Check for pending IRQs and other events.
  *
@@ -395,32 +537,31 @@ static ocxl_event_action read_afu_event(ocxl_afu_h afu, uint16_t event_api_versi
 int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *events, uint16_t event_count,
                                    uint16_t event_api_version)
 {
-	TRACE(afu, "Waiting up to %dms for AFU events", timeout);
-
-	if (event_count > afu->epoll_event_count) {
-		free(afu->epoll_events);
-		afu->epoll_events = NULL;
-		afu->epoll_event_count = 0;
-
-		struct epoll_event *events = malloc(event_count * sizeof(*events));
-		if (events == NULL) {
-			errmsg(afu, OCXL_NO_MEM, "Could not allocate space for %d events", event_count);
-			return -1;
-		}
+	TRACE(afu, OCXL_TRACE_EVENTS, "Waiting up to %dms for AFU events", timeout);
+	PROBE(event_check__entry, afu, timeout, event_count);
+	uint64_t check_start = timestamp_read();
 
-		afu->epoll_events = events;
-		afu->epoll_event_count = event_count;
+	if (event_count > afu->epoll_event_count && event_buffer_reserve(afu, event_count) != OCXL_OK) {
+		PROBE(event_check__return, afu, -1);
+		return -1;
 	}
 
 	int count;
-	if ((count = epoll_wait(afu->epoll_fd, afu->epoll_events, event_count, timeout)) == -1) {
+	if ((count = afu->backend->epoll_wait(afu->epoll_fd, afu->epoll_events, event_count, timeout)) == -1) {
 		errmsg(afu, OCXL_INTERNAL_ERROR, "epoll_wait failed waiting for AFU events: %d: '%s'",
 		       errno, strerror(errno));
+		PROBE(event_check__return, afu, -1);
 		return -1;
 	}
+	uint64_t harvest_start = timestamp_read();
+	if (timeout) {
+		STATS_ADD(afu, STAT_EVENT_WAITS, 1);
+		STATS_ADD(afu, STAT_EVENT_WAIT_NS, timestamp_interval_ns(check_start, harvest_start));
+	}
 
 	uint16_t triggered = 0;
-	for (int event = 0; event < count; event++) {
+	// Events left unread when the buffer fills remain pending for the next call
+	for (int event = 0; event < count && triggered < event_count; event++) {
 		epoll_fd_source *info = (epoll_fd_source *)afu->epoll_events[event].data.ptr;
 		ocxl_event_action ret;
 		ssize_t buf_used;
@@ -429,9 +570,12 @@ int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *even
 
 		switch (info->type) {
 		case EPOLL_SOURCE_OCXL:
-			while ((ret = read_afu_event(afu, event_api_version, &events[triggered], &last)),
-			       ret == OCXL_EVENT_ACTION_SUCCESS || ret == OCXL_EVENT_ACTION_IGNORE) {
+			ret = OCXL_EVENT_ACTION_NONE;
+			while (triggered < event_count &&
+			       ((ret = read_afu_event(afu, event_api_version, &events[triggered], &last)),
+			        ret == OCXL_EVENT_ACTION_SUCCESS || ret == OCXL_EVENT_ACTION_IGNORE)) {
 				if (ret == OCXL_EVENT_ACTION_SUCCESS) {
+					STATS_ADD(afu, STAT_EVENTS + events[triggered].type, 1);
 					triggered++;
 				}
 
@@ -441,13 +585,14 @@ int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *even
 			}
 
 			if (ret == OCXL_EVENT_ACTION_FAIL) {
+				PROBE(event_check__return, afu, -1);
 				return -1;
 			}
 
 			break;
 
 		case EPOLL_SOURCE_IRQ:
-			buf_used = read(info->irq->event.eventfd, &count, sizeof(count));
+			buf_used = afu->backend->read(info->irq->event.eventfd, &count, sizeof(count));
 			if (buf_used < 0) {
 				errmsg(afu, OCXL_INTERNAL_ERROR, "read of eventfd %d IRQ %d failed: %d: %s",
 				       info->irq->event.eventfd, info->irq->irq_number, errno, strerror(errno));
@@ -461,15 +606,37 @@ int ocxl_afu_event_check_versioned(ocxl_afu_h afu, int timeout, ocxl_event *even
 			events[triggered].irq.handle = (uint64_t)info->irq->addr;
 			events[triggered].irq.info = info->irq->info;
 			events[triggered++].irq.count = count;
+			STATS_ADD(afu, STAT_EVENTS + OCXL_EVENT_IRQ, 1);
+			STATS_ADD(afu, STAT_IRQS_FIRED, count);
+			uint16_t group = __atomic_load_n(&info->irq->histogram_group, __ATOMIC_ACQUIRE);
+			struct ocxl_histogram *irq_histogram = __atomic_load_n(&afu->stats.irq_histograms[group],
+			                                       __ATOMIC_ACQUIRE);
+			if (irq_histogram) {
+				histogram_record(irq_histogram, timestamp_interval_ns(harvest_start, timestamp_read()));
+			}
 
-			TRACE(afu, "IRQ received, irq=%u id=%llx info=%p count=%llu",
-			      info->irq->irq_number, (uint64_t)info->irq->addr, info->irq->info, count);
+			TRACE(afu, OCXL_TRACE_IRQ, "IRQ received, irq=%u id=%llx info=%p count=%llu",
+			      info->irq->irq_number, (unsigned long long)info->irq->addr, info->irq->info,
+			      (unsigned long long)count);
 
 			break;
 		}
 	}
 
-	TRACE(afu, "%u events reported", triggered);
+	TRACE(afu, OCXL_TRACE_EVENTS, "%u events reported", triggered);
+	struct ocxl_histogram *event_histogram = __atomic_load_n(&afu->stats.event_histogram, __ATOMIC_ACQUIRE);
+	if (event_histogram) {
+		histogram_record(event_histogram, timestamp_interval_ns(check_start, timestamp_read()));
+	}
+	PROBE(event_check__return, afu, triggered);
+
+	STATS_ADD(afu, STAT_EVENT_CHECKS, 1);
+	if (count > 0) {
+		STATS_ADD(afu, STAT_EPOLL_WAKEUPS, 1);
+		if (triggered == 0) {
+			STATS_ADD(afu, STAT_EMPTY_WAKEUPS, 1);
+		}
+	}
 
 	return triggered;
 }
@@ -500,7 +667,7 @@ ocxl_err ocxl_afu_get_p9_thread_id(ocxl_afu_h afu, uint16_t *thread_id)
 
 	struct ocxl_ioctl_features features;
 
-	int rc = ioctl(my_afu->fd, OCXL_IOCTL_GET_FEATURES, &features);
+	int rc = my_afu->backend->ioctl(my_afu->fd, OCXL_IOCTL_GET_FEATURES, &features);
 	if (rc) {
 		errmsg(afu, OCXL_NO_DEV, "Could not identify platform: %d %s",
 		       errno, strerror(errno));
@@ -514,7 +681,7 @@ ocxl_err ocxl_afu_get_p9_thread_id(ocxl_afu_h afu, uint16_t *thread_id)
 
 	struct ocxl_ioctl_p9_wait wait_data;
 
-	rc = ioctl(my_afu->fd, OCXL_IOCTL_ENABLE_P9_WAIT, &wait_data);
+	rc = my_afu->backend->ioctl(my_afu->fd, OCXL_IOCTL_ENABLE_P9_WAIT, &wait_data);
 	if (rc) {
 		errmsg(afu, OCXL_NO_DEV, "Could not enable wait in kernel: %d %s",
 		       errno, strerror(errno));
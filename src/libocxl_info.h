@@ -0,0 +1,7 @@
+const char *libocxl_info =
+    "LibOCXL Version: 1.3.0\n"
+    "CC: gcc\n"
+    "Compiler Version: gcc (Debian 12.2.0-14+deb12u1) 12.2.0\n"
+    "CFLAGS: -g -Wall -Wextra -O2 -m64 -std=c11 -DLIBOCXL_SUPPRESS_INACCESSIBLE_WARNINGS -I src/include -I kernel/include -fPIC -D_FILE_OFFSET_BITS=64\n"
+    "Git hash: 48b47c73be621f5db21518788a8106246e6820fe-dirty\n"
+    "Build platform: Linux 6.18.44-fc-v139 #1 SMP PREEMPT_DYNAMIC @0 x86_64 unknown unknown GNU/Linux\n";
@@ -23,8 +23,11 @@
 
 #include <misc/ocxl.h>
 #include "libocxl.h"
+#include "libocxl_sdt.h"
+#include "libocxl_stats_shm.h"
 #include <stdbool.h>
 #include <pthread.h>
+#include <sys/types.h>
 
 /* LibOCXL is only tested with the following compilers:
  * CLang 3.6.2, 3.7.1, 3.8.1, 3.9.1, 4.0.1, 5.0.2, 6.0.1
@@ -56,26 +59,150 @@ do {\
         trace_message("Debug", __FILE__, __LINE__, __FUNCTION__, __dbg_format, ## __dbg_args); \
 } while (0)
 
-#define TRACE(afu, __trc_format, __trc_args...) \
+/**
+ * @internal
+ *
+ * The types a trace argument is stored as
+ */
+typedef enum {
+	TRACE_ARG_INT,
+	TRACE_ARG_LONG,
+	TRACE_ARG_LLONG,
+	TRACE_ARG_PTR,
+	TRACE_ARG_DOUBLE,
+	TRACE_ARG_STRING,
+} trace_arg_type;
+
+#define TRACE_MAX_ARGS 8
+#define TRACE_STRING_BYTES 64
+#define TRACE_MESSAGE_LENGTH 512
+#define TRACE_RING_RECORDS_DEFAULT 1024
+#define TRACE_FLUSH_INTERVAL_MS 10
+
+/**
+ * @internal
+ *
+ * A place in the source that traces, the format is parsed on first use
+ */
+typedef struct trace_site {
+	const char *format;
+	const char *file;
+	int line;
+	const char *function;
+	int arg_count; /**< The number of arguments, or -1 if the format has not been parsed */
+	uint8_t arg_types[TRACE_MAX_ARGS]; /**< The trace_arg_type of each argument */
+} trace_site;
+
+/**
+ * @internal
+ *
+ * A trace message, with its arguments unformatted
+ */
+typedef struct trace_record {
+	uint64_t sequence; /**< The position of the record in its ring + 1, or 0 while it is being written */
+	uint64_t timestamp; /**< The time of the record, from ocxl_timestamp() */
+	const trace_site *site;
+	uint32_t tid; /**< The thread that wrote the record */
+	uint64_t args[TRACE_MAX_ARGS]; /**< The arguments, strings are offsets into strings */
+	char strings[TRACE_STRING_BYTES]; /**< Copies of the string arguments */
+} trace_record;
+
+/**
+ * @internal
+ *
+ * A ring of trace records, written only by the thread that owns it
+ */
+typedef struct trace_ring {
+	struct trace_ring *next;
+	uint64_t head; /**< The number of records written */
+	uint64_t flushed; /**< The number of records written out, protected by trace_rings_mutex */
+	uint64_t mask; /**< The number of records in the ring - 1 */
+	uint32_t tid; /**< The owning thread */
+	bool released; /**< The owning thread has exited, the ring may be reused */
+	trace_record records[];
+} trace_ring;
+
+/* Never called, checks the arguments of trace messages against their format */
+__attribute__ ((format (printf, 1, 2)))
+static inline void trace_check_format(__attribute__((unused)) const char *format, ...)
+{
+}
+
+#define TRACE_SITE(__trc_format, __trc_args...) \
+do {\
+        static trace_site __trc_site = { __trc_format, __FILE__, __LINE__, __FUNCTION__, -1, { 0 } }; \
+        if (0) { \
+        	trace_check_format(__trc_format, ## __trc_args); \
+        } \
+        trace_record_site(&__trc_site, ## __trc_args); \
+} while (0)
+
+/*
+ * Trace categories may be compiled out by defining LIBOCXL_TRACE_OMIT_<category>
+ * (see TRACE_OMIT in the Makefile), leaving no tracing code at their call sites
+ */
+#define TRACE_OMITTED_OPEN 0
+#define TRACE_OMITTED_MMIO 0
+#define TRACE_OMITTED_IRQ 0
+#define TRACE_OMITTED_EVENTS 0
+#define TRACE_OMITTED_FAULTS 0
+
+#ifdef LIBOCXL_TRACE_OMIT_OPEN
+#undef TRACE_OMITTED_OPEN
+#define TRACE_OMITTED_OPEN OCXL_TRACE_OPEN
+#endif
+#ifdef LIBOCXL_TRACE_OMIT_MMIO
+#undef TRACE_OMITTED_MMIO
+#define TRACE_OMITTED_MMIO OCXL_TRACE_MMIO
+#endif
+#ifdef LIBOCXL_TRACE_OMIT_IRQ
+#undef TRACE_OMITTED_IRQ
+#define TRACE_OMITTED_IRQ OCXL_TRACE_IRQ
+#endif
+#ifdef LIBOCXL_TRACE_OMIT_EVENTS
+#undef TRACE_OMITTED_EVENTS
+#define TRACE_OMITTED_EVENTS OCXL_TRACE_EVENTS
+#endif
+#ifdef LIBOCXL_TRACE_OMIT_FAULTS
+#undef TRACE_OMITTED_FAULTS
+#define TRACE_OMITTED_FAULTS OCXL_TRACE_FAULTS
+#endif
+
+/// The trace categories compiled out of this build
+#define TRACE_OMITTED (TRACE_OMITTED_OPEN | TRACE_OMITTED_MMIO | TRACE_OMITTED_IRQ | \
+                       TRACE_OMITTED_EVENTS | TRACE_OMITTED_FAULTS)
+
+/*
+ * Trace a message in a category, if it is enabled for the AFU. The category must be a constant,
+ * so omitted categories are eliminated at compile time, arguments & all.
+ */
+#define TRACE(afu, category, __trc_format, __trc_args...) \
 do {\
-        if (UNLIKELY(afu->tracing)) { \
-        	trace_message("Trace", __FILE__, __LINE__, __FUNCTION__, __trc_format, ## __trc_args); \
+        if (!(TRACE_OMITTED & (category)) && UNLIKELY((afu)->tracing & (category))) { \
+        	TRACE_SITE(__trc_format, ## __trc_args); \
         } \
 } while (0)
 
+/*
+ * Trace a message about opening an AFU, before the AFU's own settings apply
+ */
 #define TRACE_OPEN(__trc_format, __trc_args...) \
 do {\
-        if (UNLIKELY(tracing)) { \
-        	trace_message("Trace", __FILE__, __LINE__, __FUNCTION__, __trc_format, ## __trc_args); \
+        if (!TRACE_OMITTED_OPEN && UNLIKELY(tracing & OCXL_TRACE_OPEN)) { \
+        	TRACE_SITE(__trc_format, ## __trc_args); \
         } \
 } while (0)
 
 extern bool verbose_errors;
 extern bool verbose_errors_all;
-extern bool tracing;
-extern bool tracing_all;
+extern uint64_t tracing;
+extern uint64_t tracing_all;
 extern void (*error_handler)(ocxl_err error, const char *message);
 extern const char *libocxl_info;
+extern size_t trace_ring_records;
+extern size_t trace_flight_records;
+extern bool trace_streaming;
+extern const char *trace_output_path;
 
 typedef struct ocxl_afu ocxl_afu;
 
@@ -83,8 +210,23 @@ void trace_message(const char *label, const char *file, int line, const char *fu
 void errmsg(ocxl_afu *afu, ocxl_err error, const char *format, ...);
 void ocxl_default_error_handler(ocxl_err error, const char *message);
 void ocxl_default_afu_error_handler(ocxl_afu_h afu, ocxl_err error, const char *message);
+ocxl_err reserve_buffer(ocxl_afu *afu, void **buffer, uint16_t *count, size_t size, size_t min_count);
 ocxl_err grow_buffer(ocxl_afu *afu, void **buffer, uint16_t *count, size_t size, size_t initial_count);
 ocxl_err global_mmio_open(ocxl_afu *afu);
+void trace_record_site(trace_site *site, ...);
+size_t trace_collect(size_t recent, bool consume, trace_record **records, size_t *capacity, uint64_t *lost);
+void trace_format(const trace_record *record, char *buf, size_t len);
+void trace_flush();
+void trace_flight_dump();
+uint64_t trace_init(uint64_t trace_all);
+uint64_t trace_categories(uint64_t sources);
+uint64_t trace_parse_categories(const char *categories);
+ocxl_err mmio_reserve(ocxl_afu *afu, size_t count);
+ocxl_err irq_reserve(ocxl_afu *afu, size_t count, bool geometric);
+ocxl_err event_buffer_reserve(ocxl_afu *afu, size_t count);
+void backend_init(const char *name);
+
+extern const ocxl_backend_ops *current_backend;
 
 extern const char *sys_path;
 #define SYS_PATH_DEFAULT "/sys/class/ocxl"
@@ -151,10 +293,118 @@ struct ocxl_irq {
 	void *addr; /**< The mmapped address of the IRQ page */
 	void *info; /**< Additional info to pass to the user */
 	epoll_fd_source fd_info; /**< Epoll information for this IRQ */
+	uint16_t histogram_group; /**< The IRQ group the harvest latency of this IRQ is recorded in */
 };
 
 
 
+#define HISTOGRAM_SUB_BITS 7 /**< Each power of 2 is divided into 2^(HISTOGRAM_SUB_BITS - 1) buckets */
+#define HISTOGRAM_MAX_BITS 40 /**< Latencies of 2^40ns (18 minutes) or more share the last bucket */
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2) << (HISTOGRAM_SUB_BITS - 1))
+
+/**
+ * @internal
+ *
+ * A latency histogram, with buckets of a constant relative width (HDR), so each latency is
+ * kept to within 1.6%, whether it is nanoseconds or seconds
+ */
+struct ocxl_histogram {
+	uint64_t count; /**< The sum of the buckets, not kept for the histograms of AFUs */
+	uint64_t total_ns;
+	uint64_t min_ns;
+	uint64_t max_ns;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * @internal
+ *
+ * The statistics counters of an AFU, see ocxl_afu_stats
+ */
+typedef enum {
+	STAT_IRQS_ALLOCATED,
+	STAT_IRQS_FIRED,
+	STAT_EVENTS, /**< Events reported, indexed by ocxl_event_type */
+	STAT_FAULT_EVENTS = STAT_EVENTS + OCXL_EVENT_TRANSLATION_FAULT,
+	STAT_EVENT_CHECKS,
+	STAT_EPOLL_WAKEUPS,
+	STAT_EMPTY_WAKEUPS,
+	STAT_EVENT_WAITS,
+	STAT_EVENT_WAIT_NS,
+	STAT_MMIO_READS, /**< MMIO reads, indexed by ocxl_mmio_type */
+	STAT_MMIO_WRITES = STAT_MMIO_READS + OCXL_PER_PASID_MMIO + 1, /**< MMIO writes, indexed by ocxl_mmio_type */
+	STAT_COUNT = STAT_MMIO_WRITES + OCXL_PER_PASID_MMIO + 1
+} stats_counter;
+
+#define STATS_CACHE_LINE 128 /**< POWER cache lines are 128 bytes, as are x86 adjacent line prefetch pairs */
+#define STATS_FAULT_ADDRESSES 256
+#define STATS_THREADS 64 /**< The thread slots, each AFU holds a block per slot (slot 0 marks a thread without one) */
+
+/**
+ * @internal
+ *
+ * The statistics counters of one thread on an AFU, only written by that thread
+ *
+ * Each block is aligned to its own cache lines, so threads never contend on their counters.
+ * The list & thread are only used for the blocks of threads without a slot.
+ */
+typedef struct stats_block {
+	uint64_t counters[STAT_COUNT];
+	struct stats_block *next;
+	pthread_t thread;
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_block;
+
+/**
+ * @internal
+ *
+ * A background sampler of AFU counters
+ *
+ * The ring has a single writer, the sampler thread, which publishes samples by advancing
+ * head. Readers claim the samples they have copied by advancing tail with a compare & swap,
+ * so any number of threads may consume samples. Head & tail are on their own cache lines, so
+ * the sampler and readers only contend when the ring is nearly empty.
+ */
+struct ocxl_sampler {
+	ocxl_mmio_h mmio; /**< The MMIO area the registers are read from */
+	ocxl_endian endian;
+	uint16_t count; /**< The number of registers sampled */
+	off_t registers[OCXL_SAMPLER_MAX_COUNTERS];
+	uint64_t period_ns;
+	uint64_t previous[OCXL_SAMPLER_MAX_COUNTERS]; /**< The counters at the last sample, sampler thread only */
+	uint64_t previous_ns; /**< The time of the last sample, sampler thread only */
+	uint64_t mask; /**< The number of samples in the ring - 1 */
+	ocxl_sample *ring;
+	pthread_t thread;
+	pthread_mutex_t mutex; /**< Protects stopping */
+	pthread_cond_t wakeup; /**< Wakes the sampler to stop */
+	bool stopping;
+	uint64_t head __attribute__((aligned(STATS_CACHE_LINE))); /**< The number of samples written */
+	uint64_t merged; /**< Samples merged into the next, as the ring was full */
+	uint64_t tail __attribute__((aligned(STATS_CACHE_LINE))); /**< The number of samples consumed */
+};
+
+/**
+ * @internal
+ *
+ * The statistics of an AFU
+ */
+typedef struct afu_stats {
+	stats_block *slot_blocks; /**< The blocks of the threads in each slot, STATS_THREADS allocated at open */
+	stats_block *blocks; /**< The blocks of threads without a slot, only ever prepended to */
+	uint64_t setup_ns; /**< The time taken to open the context */
+	uint64_t attach_ns; /**< The time taken to attach the context */
+	uintptr_t fault_addresses[STATS_FAULT_ADDRESSES]; /**< A hash set of the faulting addresses, 0 if unused */
+	uint64_t fault_addresses_distinct; /**< The number of distinct faulting addresses */
+	bool fault_null; /**< A fault at NULL has been seen */
+	struct ocxl_histogram *event_histogram; /**< The latencies of event checks, NULL until histograms are enabled */
+	struct ocxl_histogram *irq_histograms[OCXL_HISTOGRAM_IRQ_GROUPS]; /**< The harvest latencies of IRQs in each group, once enabled & used */
+	int shm_slot; /**< The slot published in the statistics segment, or -1 */
+	bool shm_unpublished; /**< The statistics segment had no free slot for the AFU */
+} afu_stats;
+
+#define STATS_SHM_INTERVAL_MS 250
+#define STATS_SHM_MODE 0600 /* Monitors run by other users are allowed with LIBOCXL_STATS_SHM_MODE */
+
 /**
  * @internal
  *
@@ -166,6 +416,7 @@ struct ocxl_afu {
 	char *sysfs_path;
 	uint8_t version_major;
 	uint8_t version_minor;
+	const ocxl_backend_ops *backend; /**< The backend the AFU was opened with */
 	int fd;	/**< A file descriptor for operating on the AFU */
 	epoll_fd_source fd_info; /**< Epoll information for the main AFU fd */
 	int epoll_fd; /**< A file descriptor for AFU IRQs wrapped with epoll */
@@ -179,20 +430,22 @@ struct ocxl_afu {
 	uint16_t irq_count; /**< The number of valid IRQs */
 	uint16_t irq_max_count; /**< The maximum number of IRQs available */
 
-	ocxl_mmio_area *mmios;
-	uint16_t mmio_count; /**< The number of valid MMIO regions */
-	uint16_t mmio_max_count; /**< The maximum number of MMIO regions available */
+	ocxl_mmio_area **mmios; /**< The MMIO region handles, unmapped regions have a NULL start */
+	uint16_t mmio_count; /**< The number of allocated MMIO region handles */
+	uint16_t mmio_max_count; /**< The number of MMIO region handles the mmios buffer can hold */
 
 	uint32_t pasid;
 
 	bool verbose_errors;
 	void (*error_handler)(ocxl_afu_h afu, ocxl_err error, const char *message);
 
-	bool tracing;
+	uint64_t tracing; /**< The enabled trace categories (OCXL_TRACE_*) */
 	pthread_mutex_t trace_mutex;
 
 	bool attached;
 
+	afu_stats stats;
+
 #ifdef _ARCH_PPC64
 	uint64_t ppc64_amr;
 #endif
@@ -201,4 +454,84 @@ struct ocxl_afu {
 void irq_dealloc(ocxl_afu *afu, ocxl_irq *irq);
 void libocxl_init();
 
+/*
+ * The library calls its own exported functions through hidden aliases, which bind directly,
+ * so a wrapper preloaded in front of the library (eg. the profiler) only sees the application's calls
+ */
+#define LIBOCXL_ALIAS(exported, internal) \
+	extern __typeof__(exported) internal __attribute__((alias(#exported)))
+#define LIBOCXL_HIDDEN __attribute__((visibility("hidden")))
+
+extern __typeof__(ocxl_err_to_string) err_to_string LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_afu_get_device_path) afu_get_device_path LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_afu_open_from_dev) afu_open_from_dev LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_afu_open_specific) afu_open_specific LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_afu_close) afu_close LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_mmio_map_advanced) mmio_map_advanced LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_mmio_unmap) mmio_unmap LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_mmio_read64) mmio_read64 LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_timestamp) timestamp_read LIBOCXL_HIDDEN;
+extern __typeof__(ocxl_timestamp_to_ns) timestamp_to_ns LIBOCXL_HIDDEN;
+void stats_init(ocxl_afu *afu);
+ocxl_err stats_alloc(ocxl_afu *afu);
+stats_block *stats_block_find(ocxl_afu *afu);
+void stats_free(ocxl_afu *afu);
+void stats_fault_address(ocxl_afu *afu, void *addr);
+void timestamp_init();
+void timestamp_calibrate();
+uint64_t timestamp_monotonic_ns();
+uint64_t timestamp_interval_ns(uint64_t start, uint64_t end);
+uint64_t timestamp_now_ns();
+void histograms_free(ocxl_afu *afu);
+void histogram_record(struct ocxl_histogram *histogram, uint64_t ns);
+size_t histogram_bucket(uint64_t ns);
+uint64_t histogram_bucket_highest(size_t bucket);
+void stats_shm_init();
+int stats_shm_open(uint32_t interval_ms, mode_t mode);
+void stats_shm_close();
+void stats_shm_publish();
+void stats_shm_register(ocxl_afu *afu);
+void stats_shm_unregister(ocxl_afu *afu);
+
+extern __thread uint32_t stats_thread_slot __attribute__((tls_model("initial-exec")));
+
+/*
+ * Add to a statistics counter of the current thread on an AFU. Only this thread writes
+ * the counter, so it is updated without a read-modify-write, readers only need whole values.
+ */
+#define STATS_ADD(afu, counter, value) \
+do {\
+        stats_block *__stats_block; \
+        if (LIKELY(stats_thread_slot != 0)) { \
+        	__stats_block = &(afu)->stats.slot_blocks[stats_thread_slot]; \
+        } else { \
+        	__stats_block = stats_block_find(afu); \
+        } \
+        if (LIKELY(__stats_block != NULL)) { \
+        	__atomic_store_n(&__stats_block->counters[counter], \
+        	                 __stats_block->counters[counter] + (value), __ATOMIC_RELAXED); \
+        } \
+} while (0)
+
+/*
+ * The MMIO counters, which are updated on every access, may be compiled out by defining
+ * LIBOCXL_STATS_OMIT_MMIO (see STATS_OMIT in the Makefile), leaving no counting code in
+ * the MMIO accessors
+ */
+#ifdef LIBOCXL_STATS_OMIT_MMIO
+#define STATS_OMITTED_MMIO 1
+#else
+#define STATS_OMITTED_MMIO 0
+#endif
+
+/**
+ * Count an MMIO access, unless the MMIO counters are compiled out
+ */
+#define STATS_ADD_MMIO(afu, counter) \
+do {\
+        if (!STATS_OMITTED_MMIO) { \
+        	STATS_ADD(afu, counter, 1); \
+        } \
+} while (0)
+
 #endif				/* _LIBOCXL_INTERNAL_H */
@@ -0,0 +1,132 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Static probe points (USDT), compatible with SystemTap's sys/sdt.h
+ *
+ * Each probe is a nop in the code, with an ELF note in .note.stapsdt describing its
+ * location & arguments, which bpftrace, perf & SystemTap use to attach to it at runtime.
+ *
+ * sys/sdt.h is used if it is available. Otherwise, a fallback emitting the same notes is
+ * used, which passes every argument as a signed 64 bit value (-8@), rather than deriving
+ * the size & signedness of each argument.
+ *
+ * Define LIBOCXL_NO_PROBES to build without probes.
+ */
+
+#ifndef _LIBOCXL_SDT_H
+#define _LIBOCXL_SDT_H
+
+#include <stdint.h>
+
+#if defined(LIBOCXL_NO_PROBES) || !defined(__ELF__)
+#define LIBOCXL_PROBES 0
+#elif defined(__has_include) && !defined(LIBOCXL_SDT_FALLBACK)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LIBOCXL_PROBES 1
+#endif
+#endif
+
+#ifndef LIBOCXL_PROBES
+#define LIBOCXL_PROBES 1
+
+#define _OCXL_SDT_S(x) #x
+#define _OCXL_SDT_STRING(x) _OCXL_SDT_S(x)
+
+#ifdef __LP64__
+#define _OCXL_SDT_ADDR ".8byte "
+#else
+#define _OCXL_SDT_ADDR ".4byte "
+#endif
+
+#if defined(__powerpc__)
+#define _OCXL_SDT_CONSTRAINT "nZr"
+#define _OCXL_SDT_ARG(n) "-8@%I[_SDT_A" #n "]%[_SDT_A" #n "]"
+#else
+#define _OCXL_SDT_CONSTRAINT "nor"
+#define _OCXL_SDT_ARG(n) "-8@%[_SDT_A" #n "]"
+#endif
+
+#define _OCXL_SDT_OPERAND(n, x) [_SDT_A##n] _OCXL_SDT_CONSTRAINT ((int64_t)(x))
+
+/*
+ * The probe note, and a .stapsdt.base section shared by all probes, against which
+ * tools adjust the probe addresses of prelinked objects
+ */
+#define _OCXL_SDT_NOTE(provider, name, args) \
+	"990:	nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991:	.asciz \"stapsdt\"\n" \
+	"992:	.balign 4\n" \
+	"993:	" _OCXL_SDT_ADDR "990b\n" \
+	_OCXL_SDT_ADDR "_.stapsdt.base\n" \
+	_OCXL_SDT_ADDR "0\n" \
+	".asciz \"" _OCXL_SDT_STRING(provider) "\"\n" \
+	".asciz \"" _OCXL_SDT_STRING(name) "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994:	.balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n"
+
+#define STAP_PROBE(provider, name) \
+	__asm__ __volatile__(_OCXL_SDT_NOTE(provider, name, "") :: )
+
+#define STAP_PROBE1(provider, name, a1) \
+	__asm__ __volatile__(_OCXL_SDT_NOTE(provider, name, _OCXL_SDT_ARG(1)) \
+	                     :: _OCXL_SDT_OPERAND(1, a1))
+
+#define STAP_PROBE2(provider, name, a1, a2) \
+	__asm__ __volatile__(_OCXL_SDT_NOTE(provider, name, _OCXL_SDT_ARG(1) " " _OCXL_SDT_ARG(2)) \
+	                     :: _OCXL_SDT_OPERAND(1, a1), _OCXL_SDT_OPERAND(2, a2))
+
+#define STAP_PROBE3(provider, name, a1, a2, a3) \
+	__asm__ __volatile__(_OCXL_SDT_NOTE(provider, name, _OCXL_SDT_ARG(1) " " _OCXL_SDT_ARG(2) " " _OCXL_SDT_ARG(3)) \
+	                     :: _OCXL_SDT_OPERAND(1, a1), _OCXL_SDT_OPERAND(2, a2), _OCXL_SDT_OPERAND(3, a3))
+
+#define STAP_PROBE4(provider, name, a1, a2, a3, a4) \
+	__asm__ __volatile__(_OCXL_SDT_NOTE(provider, name, _OCXL_SDT_ARG(1) " " _OCXL_SDT_ARG(2) " " \
+	                                    _OCXL_SDT_ARG(3) " " _OCXL_SDT_ARG(4)) \
+	                     :: _OCXL_SDT_OPERAND(1, a1), _OCXL_SDT_OPERAND(2, a2), _OCXL_SDT_OPERAND(3, a3), \
+	                        _OCXL_SDT_OPERAND(4, a4))
+#endif
+
+#if LIBOCXL_PROBES
+#define _OCXL_PROBE_NARGS(...) _OCXL_PROBE_NARGS_(__VA_ARGS__, 4, 3, 2, 1)
+#define _OCXL_PROBE_NARGS_(a1, a2, a3, a4, n, ...) n
+#define _OCXL_PROBE_CONCAT(a, b) a ## b
+#define _OCXL_PROBE_N(n) _OCXL_PROBE_CONCAT(STAP_PROBE, n)
+
+/**
+ * @internal
+ *
+ * Fire the libocxl:name probe, with 1 to 4 arguments
+ */
+#define PROBE(name, ...) _OCXL_PROBE_N(_OCXL_PROBE_NARGS(__VA_ARGS__))(libocxl, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* _LIBOCXL_SDT_H */
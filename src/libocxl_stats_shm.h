@@ -0,0 +1,95 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The layout of the statistics segment each process publishes, when LIBOCXL_STATS_SHM is set
+ *
+ * The segment is STATS_SHM_DIR/STATS_SHM_PREFIX<pid>, holding a header followed by a slot
+ * for each open AFU context. It is shared with monitors (ocxl-top), which may be built
+ * against a different version of the library, so:
+ *  - the version is incremented whenever the meaning or position of a field changes
+ *  - fields are only otherwise added at the end of the header or slot, and readers use
+ *    header_size & slot_size to step through the segment, rather than the sizes they were
+ *    built with
+ *
+ * Slots are written under a sequence count, which is odd while the slot is being updated.
+ * Readers copy the slot, and retry if the count was odd or changed during the copy.
+ *
+ * Counters are totals since the context was opened, monitors derive rates by sampling them.
+ * Times are in nanoseconds, against CLOCK_MONOTONIC.
+ */
+
+#ifndef _LIBOCXL_STATS_SHM_H
+#define _LIBOCXL_STATS_SHM_H
+
+#include <stdint.h>
+
+#define STATS_SHM_DIR "/dev/shm"
+#define STATS_SHM_PREFIX "libocxl."
+#define STATS_SHM_MAGIC 0x746174736c78636fULL /* "ocxlstat", in little endian memory order */
+#define STATS_SHM_VERSION 1
+#define STATS_SHM_SLOTS 64 /* Contexts beyond this are counted in contexts_unpublished */
+#define STATS_SHM_DEVICE_MAX 64
+
+/**
+ * @internal
+ *
+ * The published statistics of an AFU context
+ */
+typedef struct stats_shm_afu {
+	uint32_t sequence; /**< Odd while the slot is being written */
+	uint32_t in_use; /**< 1 while the context is open */
+	uint64_t generation; /**< Incremented each time the slot is taken by a context */
+	char device[STATS_SHM_DEVICE_MAX]; /**< The device name, eg. IBM,MEMCPY3.0004:00:00.1.0 */
+	uint32_t pasid;
+	uint32_t attached;
+	uint64_t opened_ns; /**< When the context was opened */
+	uint64_t setup_ns;
+	uint64_t attach_ns;
+	uint64_t threads;
+	uint64_t irqs_allocated;
+	uint64_t irqs_fired;
+	uint64_t irq_events;
+	uint64_t fault_events;
+	uint64_t fault_addresses;
+	uint64_t event_checks;
+	uint64_t empty_wakeups;
+	uint64_t event_waits; /**< Event checks which waited for events */
+	uint64_t event_wait_ns; /**< The total time waited for events */
+	uint64_t mmio_reads[2]; /**< Indexed by ocxl_mmio_type */
+	uint64_t mmio_writes[2]; /**< Indexed by ocxl_mmio_type */
+} stats_shm_afu;
+
+/**
+ * @internal
+ *
+ * The header of a statistics segment
+ */
+typedef struct stats_shm_header {
+	uint64_t magic; /**< STATS_SHM_MAGIC */
+	uint32_t version; /**< STATS_SHM_VERSION */
+	uint32_t header_size; /**< The offset of the first slot */
+	uint32_t slot_size;
+	uint32_t slot_count;
+	int32_t pid;
+	uint32_t interval_ms; /**< How often the slots are updated */
+	char comm[16]; /**< The process name */
+	uint64_t updated_ns; /**< When the slots were last updated */
+	uint64_t contexts_opened; /**< Contexts opened over the life of the process */
+	uint64_t contexts_unpublished; /**< Contexts currently open which did not fit in a slot */
+} stats_shm_header;
+
+#endif /* _LIBOCXL_STATS_SHM_H */
@@ -38,6 +38,45 @@
  * @{
  */
 
+/**
+ * @internal
+ *
+ * Ensure an AFU has a number of MMIO region handles, so regions may be mapped without allocating them.
+ *
+ * The handles are allocated individually, so they remain valid as more are added.
+ *
+ * @param afu the AFU to reserve MMIO regions on
+ * @param count the number of MMIO region handles required
+ *
+ * @retval OCXL_OK on success
+ * @retval OCXL_NO_MEM if there is insufficient memory
+ */
+ocxl_err mmio_reserve(ocxl_afu *afu, size_t count)
+{
+	while (afu->mmio_count < count) {
+		if (afu->mmio_count == afu->mmio_max_count) {
+			ocxl_err rc = grow_buffer(afu, (void **)&afu->mmios, &afu->mmio_max_count, sizeof(ocxl_mmio_area *),
+			                          INITIAL_MMIO_COUNT);
+			if (rc != OCXL_OK) {
+				errmsg(afu, rc, "Could not grow MMIO buffer");
+				return rc;
+			}
+		}
+
+		ocxl_mmio_area *area = calloc(1, sizeof(ocxl_mmio_area));
+		if (area == NULL) {
+			ocxl_err rc = OCXL_NO_MEM;
+			errmsg(afu, rc, "Could not allocate an MMIO region handle");
+			return rc;
+		}
+
+		area->afu = afu;
+		afu->mmios[afu->mmio_count++] = area;
+	}
+
+	return OCXL_OK;
+}
+
 /**
  * @internal
  *
@@ -58,32 +97,29 @@ static ocxl_err register_mmio(ocxl_afu *afu, void *addr, size_t size, ocxl_mmio_
 
 	// Look for an available MMIO region that has been unmapped
 	for (uint16_t mmio = 0; mmio < afu->mmio_count; mmio++) {
-		if (!afu->mmios[mmio].start) {
+		if (!afu->mmios[mmio]->start) {
 			available_mmio = mmio;
 			break;
 		}
 	}
 
 	if (available_mmio == -1) {
-		if (afu->mmio_count == afu->mmio_max_count) {
-			ocxl_err rc = grow_buffer(afu, (void **)&afu->mmios, &afu->mmio_max_count, sizeof(ocxl_mmio_area), INITIAL_MMIO_COUNT);
-			if (rc != OCXL_OK) {
-				errmsg(afu, rc, "Could not grow MMIO buffer");
-				return rc;
-			}
+		available_mmio = afu->mmio_count;
+		ocxl_err rc = mmio_reserve(afu, afu->mmio_count + 1);
+		if (rc != OCXL_OK) {
+			return rc;
 		}
-
-		available_mmio = afu->mmio_count++;
 	}
 
-	afu->mmios[available_mmio].start = addr;
-	afu->mmios[available_mmio].length = size;
-	afu->mmios[available_mmio].type = type;
-	afu->mmios[available_mmio].afu = afu;
+	ocxl_mmio_area *area = afu->mmios[available_mmio];
+	area->start = addr;
+	area->length = size;
+	area->type = type;
+	area->afu = afu;
 
-	*handle = &afu->mmios[available_mmio];
+	*handle = area;
 
-	TRACE(afu, "Mapped %ld bytes of %s MMIO at %p",
+	TRACE(afu, OCXL_TRACE_MMIO, "Mapped %ld bytes of %s MMIO at %p",
 	      size, type == OCXL_GLOBAL_MMIO ? "Global" : "Per-PASID", addr);
 
 	return OCXL_OK;
@@ -106,7 +142,7 @@ ocxl_err global_mmio_open(ocxl_afu *afu)
 		return rc;
 	}
 
-	int fd = open(path, O_RDWR | O_CLOEXEC);
+	int fd = afu->backend->open(path, O_RDWR | O_CLOEXEC);
 	if (fd < 0) {
 		ocxl_err rc = OCXL_NO_DEV;
 		errmsg(afu, rc, "Could not open global MMIO '%s': Error %d: %s", path, errno, strerror(errno));
@@ -156,7 +192,7 @@ static ocxl_err global_mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t f
 		return rc;
 	}
 
-	void *addr = mmap(NULL, size, prot, MAP_SHARED, afu->global_mmio_fd, offset);
+	void *addr = afu->backend->mmap(NULL, size, prot, MAP_SHARED, afu->global_mmio_fd, offset);
 	if (addr == MAP_FAILED) {
 		ocxl_err rc = OCXL_NO_MEM;
 		errmsg(afu, rc, "Could not map global MMIO, %d: %s", errno, strerror(errno));
@@ -167,7 +203,7 @@ static ocxl_err global_mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t f
 	ocxl_err rc = register_mmio(afu, addr, size, OCXL_GLOBAL_MMIO, &mmio_region);
 	if (rc != OCXL_OK) {
 		errmsg(afu, rc, "Could not register global MMIO region");
-		munmap(addr, size);
+		afu->backend->munmap(addr, size);
 		return rc;
 	}
 
@@ -219,7 +255,7 @@ static ocxl_err mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t flags, o
 		return rc;
 	}
 
-	void *addr = mmap(NULL, size, prot, MAP_SHARED, afu->fd, offset);
+	void *addr = afu->backend->mmap(NULL, size, prot, MAP_SHARED, afu->fd, offset);
 	if (addr == MAP_FAILED) {
 		ocxl_err rc = OCXL_NO_MEM;
 		errmsg(afu, rc, "Could not map per-PASID MMIO: %d: %s", errno, strerror(errno));
@@ -230,7 +266,7 @@ static ocxl_err mmio_map(ocxl_afu *afu, size_t size, int prot, uint64_t flags, o
 	ocxl_err rc = register_mmio(afu, addr, size, OCXL_PER_PASID_MMIO, &mmio_region);
 	if (rc != OCXL_OK) {
 		errmsg(afu, rc, "Could not register global MMIO region", afu->identifier.afu_name);
-		munmap(addr, size);
+		afu->backend->munmap(addr, size);
 		return rc;
 	}
 
@@ -303,6 +339,8 @@ ocxl_err ocxl_mmio_map_advanced(ocxl_afu_h afu, ocxl_mmio_type type, size_t size
 	}
 }
 
+LIBOCXL_ALIAS(ocxl_mmio_map_advanced, mmio_map_advanced);
+
 /**
  * Map an MMIO area of an AFU.
  *
@@ -323,7 +361,7 @@ ocxl_err ocxl_mmio_map_advanced(ocxl_afu_h afu, ocxl_mmio_type type, size_t size
  */
 ocxl_err ocxl_mmio_map(ocxl_afu_h afu, ocxl_mmio_type type, ocxl_mmio_h *region)
 {
-	return ocxl_mmio_map_advanced(afu, type, 0, PROT_READ | PROT_WRITE, 0, 0, region);
+	return mmio_map_advanced(afu, type, 0, PROT_READ | PROT_WRITE, 0, 0, region);
 }
 
 /**
@@ -339,10 +377,12 @@ void ocxl_mmio_unmap(ocxl_mmio_h region)
 		return;
 	}
 
-	munmap(region->start, region->length);
+	region->afu->backend->munmap(region->start, region->length);
 	region->start = NULL;
 }
 
+LIBOCXL_ALIAS(ocxl_mmio_unmap, mmio_unmap);
+
 /**
  * Get a file descriptor for an MMIO area of an AFU.
  *
@@ -484,11 +524,16 @@ inline static ocxl_err mmio_read32_native(ocxl_mmio_h region, off_t offset, uint
 		return ret;
 	}
 
+	PROBE(mmio_read32__entry, region->afu, region->type, offset);
+
 	__sync_synchronize();
 	*out = *(volatile uint32_t *)(region->start + offset);
 	__sync_synchronize();
 
-	TRACE(region->afu, "%s MMIO Read32@0x%04lx=0x%08x",
+	PROBE(mmio_read32__return, region->afu, region->type, offset, *out);
+	STATS_ADD_MMIO(region->afu, STAT_MMIO_READS + region->type);
+
+	TRACE(region->afu, OCXL_TRACE_MMIO, "%s MMIO Read32@0x%04lx=0x%08x",
 	      region->type == OCXL_GLOBAL_MMIO ? "Global" : "Per-PASID",
 	      offset, *out);
 
@@ -520,11 +565,16 @@ inline static ocxl_err mmio_read64_native(ocxl_mmio_h region, off_t offset, uint
 		return ret;
 	}
 
+	PROBE(mmio_read64__entry, region->afu, region->type, offset);
+
 	__sync_synchronize();
 	*out = *(volatile uint64_t *)(region->start + offset);
 	__sync_synchronize();
 
-	TRACE(region->afu, "%s MMIO Read64@0x%04lx=0x%016lx",
+	PROBE(mmio_read64__return, region->afu, region->type, offset, *out);
+	STATS_ADD_MMIO(region->afu, STAT_MMIO_READS + region->type);
+
+	TRACE(region->afu, OCXL_TRACE_MMIO, "%s MMIO Read64@0x%04lx=0x%016lx",
 	      region->type == OCXL_GLOBAL_MMIO ? "Global" : "Per-PASID",
 	      offset, *out);
 
@@ -558,12 +608,15 @@ inline static ocxl_err mmio_write32_native(ocxl_mmio_h region, off_t offset, uin
 		return ret;
 	}
 
-	TRACE(region->afu, "%s MMIO Write32@0x%04lx=0x%08x",
+	TRACE(region->afu, OCXL_TRACE_MMIO, "%s MMIO Write32@0x%04lx=0x%08x",
 	      region->type == OCXL_GLOBAL_MMIO ? "Global" : "Per-PASID",
 	      offset, value);
 
 	volatile uint32_t *addr = (uint32_t *)(region->start + offset);
 
+	PROBE(mmio_write32, region->afu, region->type, offset, value);
+	STATS_ADD_MMIO(region->afu, STAT_MMIO_WRITES + region->type);
+
 	__sync_synchronize();
 	*addr = value;
 	__sync_synchronize();
@@ -596,12 +649,15 @@ inline static ocxl_err mmio_write64_native(ocxl_mmio_h region, off_t offset, uin
 		return ret;
 	}
 
-	TRACE(region->afu, "%s MMIO Write64@0x%04lx=0x%016lx",
+	TRACE(region->afu, OCXL_TRACE_MMIO, "%s MMIO Write64@0x%04lx=0x%016lx",
 	      region->type == OCXL_GLOBAL_MMIO ? "Global" : "Per-PASID",
 	      offset, value);
 
 	volatile uint64_t *addr = (uint64_t *)(region->start + offset);
 
+	PROBE(mmio_write64, region->afu, region->type, offset, value);
+	STATS_ADD_MMIO(region->afu, STAT_MMIO_WRITES + region->type);
+
 	__sync_synchronize();
 	*addr = value;
 	__sync_synchronize();
@@ -696,6 +752,8 @@ ocxl_err ocxl_mmio_read64(ocxl_mmio_h mmio, off_t offset, ocxl_endian endian, ui
 	return OCXL_OK;
 }
 
+LIBOCXL_ALIAS(ocxl_mmio_read64, mmio_read64);
+
 /**
  * Convert endianness and write a 32-bit value to an AFU's MMIO region.
  *
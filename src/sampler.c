@@ -0,0 +1,334 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libocxl_internal.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @defgroup ocxl_sampler OpenCAPI AFU Counter Sampling
+ *
+ * A sampler reads a set of AFU counter registers (eg. the AFP3 AFUPerfCnt registers) on a
+ * thread of its own, at a fixed rate of up to OCXL_SAMPLER_MAX_RATE Hz. Each sample holds the
+ * increase of every counter since the previous sample, and the host time the counters were
+ * read at, so bandwidths can be derived without the application polling the AFU itself.
+ *
+ * Samples are kept in a ring until they are consumed with ocxl_sampler_read(), which does
+ * not block or take locks. If readers fall behind and the ring fills, further samples are
+ * merged into the next one that fits, so counts are never lost, only their resolution.
+ *
+ * - ocxl_sampler_start() - Start sampling a set of registers
+ * - ocxl_sampler_read() - Consume the samples taken
+ * - ocxl_sampler_merged() - Count the samples merged as the ring was full
+ * - ocxl_sampler_stop() - Stop sampling, and free the sampler
+ *
+ * @{
+ */
+
+/**
+ * @internal
+ *
+ * Read the counters & publish the increase since the last sample
+ *
+ * @param sampler the sampler
+ */
+static void sampler_take(struct ocxl_sampler *sampler)
+{
+	uint64_t values[OCXL_SAMPLER_MAX_COUNTERS];
+
+	uint64_t start = timestamp_read();
+	for (uint16_t i = 0; i < sampler->count; i++) {
+		if (mmio_read64(sampler->mmio, sampler->registers[i], sampler->endian, &values[i]) != OCXL_OK) {
+			values[i] = sampler->previous[i];
+		}
+	}
+	uint64_t end = timestamp_read();
+
+	uint64_t head = sampler->head;
+	if (head - __atomic_load_n(&sampler->tail, __ATOMIC_ACQUIRE) > sampler->mask) {
+		// Keep the previous values, so the next sample covers this one too
+		__atomic_store_n(&sampler->merged, sampler->merged + 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ocxl_sample *sample = &sampler->ring[head & sampler->mask];
+	sample->timestamp = timestamp_to_ns(start + (end - start) / 2);
+	sample->interval_ns = sample->timestamp - sampler->previous_ns;
+	for (uint16_t i = 0; i < sampler->count; i++) {
+		// Unsigned arithmetic keeps the increase correct across a counter wrapping
+		sample->deltas[i] = values[i] - sampler->previous[i];
+		sampler->previous[i] = values[i];
+	}
+	memset(&sample->deltas[sampler->count], 0, (OCXL_SAMPLER_MAX_COUNTERS - sampler->count) * sizeof(uint64_t));
+	sampler->previous_ns = sample->timestamp;
+
+	__atomic_store_n(&sampler->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @internal
+ *
+ * Sample the counters until the sampler is stopped
+ *
+ * Deadlines are absolute, so the time taken to sample does not accumulate as drift. If the
+ * sampler falls more than a period behind (eg. it was descheduled), the missed samples are
+ * skipped rather than taken back to back.
+ */
+static void *sampler_thread(void *arg)
+{
+	struct ocxl_sampler *sampler = arg;
+	// Deadlines are on CLOCK_MONOTONIC itself, as the wakeup waits on it
+	uint64_t next = timestamp_monotonic_ns() + sampler->period_ns;
+
+	pthread_mutex_lock(&sampler->mutex);
+	while (!sampler->stopping) {
+		uint64_t now = timestamp_monotonic_ns();
+		if (now < next) {
+			struct timespec deadline = {
+				.tv_sec = next / 1000000000,
+				.tv_nsec = next % 1000000000
+			};
+			pthread_cond_timedwait(&sampler->wakeup, &sampler->mutex, &deadline);
+			continue;
+		}
+
+		pthread_mutex_unlock(&sampler->mutex);
+		sampler_take(sampler);
+		pthread_mutex_lock(&sampler->mutex);
+
+		next += sampler->period_ns;
+		if (next + sampler->period_ns < now) {
+			next = now + sampler->period_ns;
+		}
+	}
+	pthread_mutex_unlock(&sampler->mutex);
+
+	return NULL;
+}
+
+/**
+ * @internal
+ *
+ * Free a sampler that is not running
+ *
+ * @param sampler the sampler
+ */
+static void sampler_free(struct ocxl_sampler *sampler)
+{
+	pthread_cond_destroy(&sampler->wakeup);
+	pthread_mutex_destroy(&sampler->mutex);
+	free(sampler->ring);
+	free(sampler);
+}
+
+/**
+ * Start sampling AFU counters in the background
+ *
+ * The registers are read once before this returns, as the base of the first sample, so
+ * invalid registers are reported here. Registers are read as 64 bit counters; the sampler
+ * must be stopped before the MMIO area is unmapped, or its AFU closed.
+ *
+ * @param mmio the MMIO area holding the counters, usually the global MMIO area
+ * @param registers the offsets of the counter registers
+ * @param count the number of registers, up to OCXL_SAMPLER_MAX_COUNTERS
+ * @param endian the endianness of the registers
+ * @param rate_hz the samples to take per second, up to OCXL_SAMPLER_MAX_RATE
+ * @param ring_samples the number of samples to keep for readers, rounded up to a power of 2,
+ *        or 0 for OCXL_SAMPLER_RING_DEFAULT
+ * @param[out] sampler the sampler, to be stopped with ocxl_sampler_stop()
+ *
+ * @retval OCXL_OK if the sampler was started
+ * @retval OCXL_INVALID_ARGS if the registers, rate or ring size are not valid
+ * @retval OCXL_OUT_OF_BOUNDS if a register is beyond the MMIO area
+ * @retval OCXL_NO_MEM if memory could not be allocated
+ * @retval OCXL_INTERNAL_ERROR if the sampling thread could not be started
+ */
+ocxl_err ocxl_sampler_start(ocxl_mmio_h mmio, const off_t *registers, uint16_t count, ocxl_endian endian,
+                            uint32_t rate_hz, uint32_t ring_samples, ocxl_sampler_h *sampler)
+{
+	*sampler = NULL;
+
+	if (!mmio) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(NULL, rc, "MMIO region is invalid");
+		return rc;
+	}
+
+	if (count == 0 || count > OCXL_SAMPLER_MAX_COUNTERS) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(mmio->afu, rc, "Cannot sample %u registers, expected 1 to %d", count, OCXL_SAMPLER_MAX_COUNTERS);
+		return rc;
+	}
+
+	if (rate_hz == 0 || rate_hz > OCXL_SAMPLER_MAX_RATE) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(mmio->afu, rc, "Sampling rate of %uHz is not valid, expected 1 to %dHz", rate_hz, OCXL_SAMPLER_MAX_RATE);
+		return rc;
+	}
+
+	if (ring_samples > OCXL_SAMPLER_RING_MAX) {
+		ocxl_err rc = OCXL_INVALID_ARGS;
+		errmsg(mmio->afu, rc, "Cannot keep %u samples, the limit is %d", ring_samples, OCXL_SAMPLER_RING_MAX);
+		return rc;
+	}
+
+	size_t samples = 1;
+	while (samples < (ring_samples ? ring_samples : OCXL_SAMPLER_RING_DEFAULT)) {
+		samples <<= 1;
+	}
+
+	struct ocxl_sampler *new_sampler = aligned_alloc(STATS_CACHE_LINE, sizeof(struct ocxl_sampler));
+	if (!new_sampler) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(mmio->afu, rc, "Could not allocate %zu bytes for a sampler", sizeof(struct ocxl_sampler));
+		return rc;
+	}
+	memset(new_sampler, 0, sizeof(*new_sampler));
+
+	new_sampler->ring = malloc(samples * sizeof(ocxl_sample));
+	if (!new_sampler->ring) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(mmio->afu, rc, "Could not allocate %zu bytes for %zu samples", samples * sizeof(ocxl_sample), samples);
+		free(new_sampler);
+		return rc;
+	}
+
+	new_sampler->mmio = mmio;
+	new_sampler->endian = endian;
+	new_sampler->count = count;
+	new_sampler->period_ns = 1000000000ULL / rate_hz;
+	new_sampler->mask = samples - 1;
+	memcpy(new_sampler->registers, registers, count * sizeof(off_t));
+
+	pthread_mutex_init(&new_sampler->mutex, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&new_sampler->wakeup, &attr);
+	pthread_condattr_destroy(&attr);
+
+	new_sampler->previous_ns = timestamp_now_ns();
+	for (uint16_t i = 0; i < count; i++) {
+		ocxl_err rc = mmio_read64(mmio, registers[i], endian, &new_sampler->previous[i]);
+		if (rc != OCXL_OK) {
+			sampler_free(new_sampler);
+			return rc;
+		}
+	}
+
+	// The sampler must not take the application's signals
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	int ret = pthread_create(&new_sampler->thread, NULL, sampler_thread, new_sampler);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+	if (ret) {
+		ocxl_err rc = OCXL_INTERNAL_ERROR;
+		errmsg(mmio->afu, rc, "Could not start the sampling thread: %d: '%s'", ret, strerror(ret));
+		sampler_free(new_sampler);
+		return rc;
+	}
+
+	TRACE(mmio->afu, OCXL_TRACE_MMIO, "Sampling %u registers at %uHz, keeping %zu samples", count, rate_hz, samples);
+
+	*sampler = new_sampler;
+
+	return OCXL_OK;
+}
+
+/**
+ * Consume the oldest samples taken
+ *
+ * Samples are returned once, even with several threads reading. This never blocks.
+ *
+ * @param sampler the sampler
+ * @param[out] samples the buffer to copy the samples to
+ * @param count the number of samples the buffer can hold
+ * @return the number of samples copied, 0 if none were waiting
+ */
+size_t ocxl_sampler_read(ocxl_sampler_h sampler, ocxl_sample *samples, size_t count)
+{
+	uint64_t tail = __atomic_load_n(&sampler->tail, __ATOMIC_RELAXED);
+
+	while (true) {
+		uint64_t head = __atomic_load_n(&sampler->head, __ATOMIC_ACQUIRE);
+		size_t available = head - tail;
+		if (available > count) {
+			available = count;
+		}
+		if (!available) {
+			return 0;
+		}
+
+		for (size_t i = 0; i < available; i++) {
+			samples[i] = sampler->ring[(tail + i) & sampler->mask];
+		}
+
+		// If another reader claimed them first, the copies may have been overwritten since
+		if (__atomic_compare_exchange_n(&sampler->tail, &tail, tail + available, false,
+		                                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			return available;
+		}
+	}
+}
+
+/**
+ * Get the number of samples that were merged into the following sample, as the ring was full
+ *
+ * A non-zero count means readers are not keeping up with the sampling rate, and some samples
+ * cover several periods.
+ *
+ * @param sampler the sampler
+ * @return the number of merged samples
+ */
+uint64_t ocxl_sampler_merged(ocxl_sampler_h sampler)
+{
+	return __atomic_load_n(&sampler->merged, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stop sampling, and free the sampler
+ *
+ * Samples that have not been read are discarded.
+ *
+ * @param sampler the sampler, may be NULL
+ */
+void ocxl_sampler_stop(ocxl_sampler_h sampler)
+{
+	if (!sampler) {
+		return;
+	}
+
+	pthread_mutex_lock(&sampler->mutex);
+	sampler->stopping = true;
+	pthread_cond_signal(&sampler->wakeup);
+	pthread_mutex_unlock(&sampler->mutex);
+
+	pthread_join(sampler->thread, NULL);
+
+	TRACE(sampler->mmio->afu, OCXL_TRACE_MMIO, "Stopped sampling, %lu samples were taken, %lu merged",
+	      sampler->head, sampler->merged);
+
+	sampler_free(sampler);
+}
+
+/**
+ * @}
+ */
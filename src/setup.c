@@ -59,18 +59,21 @@ __attribute__ ((used)) static void ocxl_set_dev_path(const char *path)
  * Error messages, if enabled, are emitted by default on STDERR. This behavior may be
  * overridden by ocxl_afu_set_error_message_handler().
  *
- * Tracing, if enabled, is always emitted on STDERR. It assists a developer by showing
- * detailed AFU information.
+ * Tracing, if enabled, is emitted on STDERR (or the file named by LIBOCXL_TRACE_OUTPUT). It assists
+ * a developer by showing detailed AFU information. Trace messages are recorded into per-thread buffers
+ * and written out shortly afterwards by a background thread, so they may appear after the call
+ * that emitted them returns.
  *
  * @see ocxl_set_error_message_handler()
  * @see ocxl_afu_enable_messages()
  *
- * @param sources a bitwise OR of the message sources to enable (OCXL_ERRORS, OCXL_TRACING)
+ * @param sources a bitwise OR of the message sources to enable (OCXL_ERRORS, OCXL_TRACING),
+ *        OCXL_TRACE_* may be given instead of OCXL_TRACING to trace only those categories
  */
 void ocxl_enable_messages(uint64_t sources)
 {
 	verbose_errors = !!(sources & OCXL_ERRORS);
-	tracing = !!(sources & OCXL_TRACING);
+	tracing = trace_categories(sources);
 }
 
 /**
@@ -143,6 +146,8 @@ const char *ocxl_err_to_string(ocxl_err err)
 	}
 }
 
+LIBOCXL_ALIAS(ocxl_err_to_string, err_to_string);
+
 /**
  * Get version & compilation information about LibOCXL. This must be included with
  * any bug report.
@@ -0,0 +1,776 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libocxl_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @defgroup ocxl_stats OpenCAPI Statistics
+ *
+ * The library counts the work done on each AFU context: IRQs, events, translation faults,
+ * MMIO accesses, and the time taken to set up the context. These are cheap enough to
+ * always be kept, and are retrieved with ocxl_afu_get_stats().
+ *
+ * Each thread counts into a block of its own for each AFU, so counting takes no locks or
+ * atomic read-modify-writes, and threads never share cache lines. A thread is given a slot
+ * the first time it counts, and each AFU allocates a block for every slot when it is opened,
+ * so a thread finds its block by index on any AFU, without allocating. Threads beyond
+ * STATS_THREADS at once have their blocks allocated on first use, & found in a list.
+ *
+ * @{
+ */
+
+/// The slot of the current thread, 0 until it is given one
+__thread uint32_t stats_thread_slot __attribute__((tls_model("initial-exec"))) = 0;
+
+/// Set once the current thread has failed to get a slot
+__thread bool stats_thread_slotless = false;
+
+/// The slots taken by running threads
+pthread_mutex_t stats_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+bool stats_slots_taken[STATS_THREADS];
+
+pthread_key_t stats_slot_key;
+pthread_once_t stats_slot_key_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @internal
+ *
+ * Initialize the statistics of a new AFU structure
+ *
+ * @param afu the AFU
+ */
+void stats_init(ocxl_afu *afu)
+{
+	memset(&afu->stats, 0, sizeof(afu->stats));
+	afu->stats.shm_slot = -1;
+}
+
+/**
+ * @internal
+ *
+ * Allocate the statistics blocks of a new AFU, one for each thread slot
+ *
+ * @param afu the AFU
+ *
+ * @retval OCXL_OK if the blocks were allocated
+ * @retval OCXL_NO_MEM if the blocks could not be allocated
+ */
+ocxl_err stats_alloc(ocxl_afu *afu)
+{
+	size_t size = STATS_THREADS * sizeof(stats_block);
+
+	afu->stats.slot_blocks = aligned_alloc(STATS_CACHE_LINE, size);
+	if (!afu->stats.slot_blocks) {
+		ocxl_err rc = OCXL_NO_MEM;
+		errmsg(NULL, rc, "Could not allocate %zu bytes for AFU statistics", size);
+		return rc;
+	}
+	memset(afu->stats.slot_blocks, 0, size);
+
+	return OCXL_OK;
+}
+
+/**
+ * @internal
+ *
+ * Free the slot of an exiting thread, for a later thread to take, with the counters it has
+ * left in each AFU
+ */
+static void stats_slot_release(void *data)
+{
+	pthread_mutex_lock(&stats_slots_mutex);
+	stats_slots_taken[(uintptr_t)data] = false;
+	pthread_mutex_unlock(&stats_slots_mutex);
+}
+
+static void stats_slot_key_create()
+{
+	pthread_key_create(&stats_slot_key, stats_slot_release);
+}
+
+/**
+ * @internal
+ *
+ * Give the current thread a free slot, if there is one
+ */
+static void stats_slot_take()
+{
+	pthread_once(&stats_slot_key_once, stats_slot_key_create);
+
+	pthread_mutex_lock(&stats_slots_mutex);
+	for (uint32_t slot = 1; slot < STATS_THREADS; slot++) {
+		if (!stats_slots_taken[slot]) {
+			stats_slots_taken[slot] = true;
+			stats_thread_slot = slot;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&stats_slots_mutex);
+
+	if (stats_thread_slot) {
+		pthread_setspecific(stats_slot_key, (void *)(uintptr_t)stats_thread_slot);
+	} else {
+		stats_thread_slotless = true;
+	}
+}
+
+/**
+ * @internal
+ *
+ * Find the current thread's statistics block for an AFU, when the thread has no slot
+ *
+ * The thread is given a slot on its first call. Threads that could not get one have their
+ * blocks created on first use.
+ *
+ * @param afu the AFU
+ * @return the block, or NULL if it could not be allocated
+ */
+stats_block *stats_block_find(ocxl_afu *afu)
+{
+	if (!stats_thread_slot && !stats_thread_slotless) {
+		stats_slot_take();
+	}
+	if (stats_thread_slot) {
+		return &afu->stats.slot_blocks[stats_thread_slot];
+	}
+
+	pthread_t self = pthread_self();
+	stats_block *block;
+
+	for (block = __atomic_load_n(&afu->stats.blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+		if (pthread_equal(block->thread, self)) {
+			break;
+		}
+	}
+
+	if (!block) {
+		block = aligned_alloc(STATS_CACHE_LINE, sizeof(stats_block));
+		if (!block) {
+			return NULL;
+		}
+		memset(block, 0, sizeof(*block));
+		block->thread = self;
+
+		block->next = __atomic_load_n(&afu->stats.blocks, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&afu->stats.blocks, &block->next, block, true,
+		                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+		}
+	}
+
+	return block;
+}
+
+/**
+ * @internal
+ *
+ * Free the statistics of an AFU that is being closed
+ *
+ * @param afu the AFU
+ */
+void stats_free(ocxl_afu *afu)
+{
+	stats_block *block = afu->stats.blocks;
+
+	while (block) {
+		stats_block *next = block->next;
+		free(block);
+		block = next;
+	}
+	afu->stats.blocks = NULL;
+
+	free(afu->stats.slot_blocks);
+	afu->stats.slot_blocks = NULL;
+
+	histograms_free(afu);
+}
+
+/**
+ * @internal
+ *
+ * Record the address of a translation fault, counting distinct addresses
+ *
+ * Addresses are kept in a fixed size hash set, so no allocation is needed. Once it is full,
+ * new addresses are no longer counted.
+ *
+ * @param afu the AFU
+ * @param addr the faulting address
+ */
+void stats_fault_address(ocxl_afu *afu, void *addr)
+{
+	uintptr_t address = (uintptr_t)addr;
+
+	if (!address) {
+		if (!__atomic_exchange_n(&afu->stats.fault_null, true, __ATOMIC_RELAXED)) {
+			__atomic_fetch_add(&afu->stats.fault_addresses_distinct, 1, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+
+	size_t slot = (size_t)(((uint64_t)address * 0x9E3779B97F4A7C15ULL) >> 32) % STATS_FAULT_ADDRESSES;
+
+	for (size_t probe = 0; probe < STATS_FAULT_ADDRESSES; probe++) {
+		uintptr_t *entry = &afu->stats.fault_addresses[(slot + probe) % STATS_FAULT_ADDRESSES];
+		uintptr_t current = __atomic_load_n(entry, __ATOMIC_RELAXED);
+
+		if (current == 0 && __atomic_compare_exchange_n(entry, &current, address, false,
+		        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			__atomic_fetch_add(&afu->stats.fault_addresses_distinct, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		// current now holds the address in the slot, even if another thread just claimed it
+		if (current == address) {
+			return;
+		}
+	}
+}
+
+/**
+ * @internal
+ *
+ * Add the counters of a thread's block to a sum
+ *
+ * @param block the block
+ * @param[in,out] counters the sum
+ * @return 1 if the thread counted anything, 0 if the block is unused
+ */
+static int stats_block_sum(stats_block *block, uint64_t *counters)
+{
+	int used = 0;
+
+	for (int counter = 0; counter < STAT_COUNT; counter++) {
+		uint64_t value = __atomic_load_n(&block->counters[counter], __ATOMIC_RELAXED);
+		counters[counter] += value;
+		used |= value != 0;
+	}
+
+	return used;
+}
+
+/**
+ * @internal
+ *
+ * Sum the statistics of all threads on an AFU
+ *
+ * @param afu the AFU
+ * @param[out] stats the statistics
+ */
+static void stats_sum(ocxl_afu *afu, ocxl_afu_stats *stats)
+{
+	uint64_t counters[STAT_COUNT];
+
+	memset(counters, 0, sizeof(counters));
+	memset(stats, 0, sizeof(*stats));
+
+	for (uint32_t slot = 1; slot < STATS_THREADS; slot++) {
+		stats->threads += stats_block_sum(&afu->stats.slot_blocks[slot], counters);
+	}
+	for (stats_block *block = __atomic_load_n(&afu->stats.blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+		stats->threads += stats_block_sum(block, counters);
+	}
+
+	stats->irqs_allocated = counters[STAT_IRQS_ALLOCATED];
+	stats->irqs_fired = counters[STAT_IRQS_FIRED];
+	stats->events[OCXL_EVENT_IRQ] = counters[STAT_EVENTS + OCXL_EVENT_IRQ];
+	stats->events[OCXL_EVENT_TRANSLATION_FAULT] = counters[STAT_EVENTS + OCXL_EVENT_TRANSLATION_FAULT];
+	stats->translation_fault_addresses = __atomic_load_n(&afu->stats.fault_addresses_distinct, __ATOMIC_RELAXED);
+	stats->event_checks = counters[STAT_EVENT_CHECKS];
+	stats->epoll_wakeups = counters[STAT_EPOLL_WAKEUPS];
+	stats->empty_wakeups = counters[STAT_EMPTY_WAKEUPS];
+	stats->event_waits = counters[STAT_EVENT_WAITS];
+	stats->event_wait_ns = counters[STAT_EVENT_WAIT_NS];
+	stats->mmio_reads[OCXL_GLOBAL_MMIO] = counters[STAT_MMIO_READS + OCXL_GLOBAL_MMIO];
+	stats->mmio_reads[OCXL_PER_PASID_MMIO] = counters[STAT_MMIO_READS + OCXL_PER_PASID_MMIO];
+	stats->mmio_writes[OCXL_GLOBAL_MMIO] = counters[STAT_MMIO_WRITES + OCXL_GLOBAL_MMIO];
+	stats->mmio_writes[OCXL_PER_PASID_MMIO] = counters[STAT_MMIO_WRITES + OCXL_PER_PASID_MMIO];
+	stats->setup_ns = afu->stats.setup_ns;
+	stats->attach_ns = afu->stats.attach_ns;
+}
+
+/**
+ * Get the statistics the library has kept for an AFU context.
+ *
+ * The counters of all threads that have used the context are summed. Counters are read
+ * without stopping other threads, so a snapshot taken while the context is in use may
+ * not be consistent across counters.
+ *
+ * Only the first size bytes of the statistics are written, so programs built against an
+ * earlier, smaller ocxl_afu_stats keep working as counters are added.
+ *
+ * @param afu the AFU to get the statistics of
+ * @param[out] stats the statistics
+ * @param size sizeof(ocxl_afu_stats)
+ */
+void ocxl_afu_get_stats(ocxl_afu_h afu, ocxl_afu_stats *stats, size_t size)
+{
+	ocxl_afu_stats sum;
+
+	stats_sum(afu, &sum);
+	memcpy(stats, &sum, size < sizeof(sum) ? size : sizeof(sum));
+}
+
+/**
+ * @}
+ */
+
+/*
+ * Statistics are published to a shared memory segment (see libocxl_stats_shm.h) for
+ * monitors such as ocxl-top, when enabled with LIBOCXL_STATS_SHM. A publisher thread sums
+ * the counters of each open AFU into its slot periodically, so the counting paths are
+ * unchanged, and a monitor's reads never touch the cache lines they write.
+ */
+
+/// Serializes the statistics segment & the registry of the AFUs published in it
+pthread_mutex_t stats_shm_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// The statistics segment, NULL if statistics are not being published
+stats_shm_header *stats_shm = NULL;
+size_t stats_shm_size;
+char stats_shm_path[PATH_MAX];
+
+/// The AFU published in each slot of the segment
+ocxl_afu *stats_shm_afus[STATS_SHM_SLOTS];
+
+uint32_t stats_shm_interval_ms = STATS_SHM_INTERVAL_MS;
+bool stats_shm_publisher_started = false;
+pthread_t stats_shm_publisher;
+bool stats_shm_atfork_registered = false;
+
+/**
+ * @internal
+ *
+ * Get a slot of the statistics segment
+ *
+ * @param slot the index of the slot
+ * @return the slot
+ */
+static stats_shm_afu *stats_shm_slot(int slot)
+{
+	return (stats_shm_afu *)((char *)stats_shm + sizeof(stats_shm_header)) + slot;
+}
+
+/**
+ * @internal
+ *
+ * Start updating a slot, readers discard copies made until stats_shm_slot_end()
+ *
+ * @param slot the slot
+ */
+static void stats_shm_slot_begin(stats_shm_afu *slot)
+{
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @internal
+ *
+ * Finish updating a slot
+ *
+ * @param slot the slot
+ */
+static void stats_shm_slot_end(stats_shm_afu *slot)
+{
+	__atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @internal
+ *
+ * Publish the statistics of each open AFU to its slot
+ */
+void stats_shm_publish()
+{
+	ocxl_afu_stats stats;
+
+	pthread_mutex_lock(&stats_shm_mutex);
+
+	if (!stats_shm) {
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return;
+	}
+
+	for (int index = 0; index < STATS_SHM_SLOTS; index++) {
+		ocxl_afu *afu = stats_shm_afus[index];
+		if (!afu) {
+			continue;
+		}
+
+		stats_sum(afu, &stats);
+
+		stats_shm_afu *slot = stats_shm_slot(index);
+		stats_shm_slot_begin(slot);
+		slot->pasid = afu->pasid;
+		slot->attached = afu->attached;
+		slot->setup_ns = stats.setup_ns;
+		slot->attach_ns = stats.attach_ns;
+		slot->threads = stats.threads;
+		slot->irqs_allocated = stats.irqs_allocated;
+		slot->irqs_fired = stats.irqs_fired;
+		slot->irq_events = stats.events[OCXL_EVENT_IRQ];
+		slot->fault_events = stats.events[OCXL_EVENT_TRANSLATION_FAULT];
+		slot->fault_addresses = stats.translation_fault_addresses;
+		slot->event_checks = stats.event_checks;
+		slot->empty_wakeups = stats.empty_wakeups;
+		slot->event_waits = stats.event_waits;
+		slot->event_wait_ns = stats.event_wait_ns;
+		memcpy(slot->mmio_reads, stats.mmio_reads, sizeof(slot->mmio_reads));
+		memcpy(slot->mmio_writes, stats.mmio_writes, sizeof(slot->mmio_writes));
+		stats_shm_slot_end(slot);
+	}
+
+	__atomic_store_n(&stats_shm->updated_ns, timestamp_now_ns(), __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Publish the statistics periodically
+ */
+static void *stats_shm_publisher_thread(void *arg)
+{
+	(void)arg;
+	struct timespec interval = {
+		.tv_sec = stats_shm_interval_ms / 1000,
+		.tv_nsec = (stats_shm_interval_ms % 1000) * 1000000L
+	};
+
+	while (true) {
+		nanosleep(&interval, NULL);
+		stats_shm_publish();
+	}
+
+	return NULL;
+}
+
+/**
+ * @internal
+ *
+ * Hold the segment across fork(), so the child does not inherit a locked mutex
+ */
+static void stats_shm_atfork_prepare()
+{
+	pthread_mutex_lock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Release the segment in the parent after fork()
+ */
+static void stats_shm_atfork_parent()
+{
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Drop the segment inherited by a child of fork()
+ *
+ * The segment belongs to the parent, which is still publishing in it, so the child unmaps it
+ * without removing it, and publishes nothing until it calls stats_shm_open() itself. The
+ * publisher thread is not inherited either.
+ */
+static void stats_shm_atfork_child()
+{
+	if (stats_shm) {
+		for (int index = 0; index < STATS_SHM_SLOTS; index++) {
+			if (stats_shm_afus[index]) {
+				stats_shm_afus[index]->stats.shm_slot = -1;
+				stats_shm_afus[index] = NULL;
+			}
+		}
+
+		munmap(stats_shm, stats_shm_size);
+		stats_shm = NULL;
+	}
+
+	stats_shm_publisher_started = false;
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Create the statistics segment of this process, replacing any left by an earlier process
+ * with the same PID
+ *
+ * The segment is always created afresh, and never through a symbolic link, so another user
+ * cannot direct the writes of this process to a file of their choosing.
+ *
+ * @param interval_ms how often to publish the statistics, or 0 to only publish them
+ *        when stats_shm_publish() is called
+ * @param mode the permissions of the segment, eg. 0600 to only let monitors run by the same
+ *        user (or root) read it
+ * @return 0 on success, -1 if the segment could not be created
+ */
+int stats_shm_open(uint32_t interval_ms, mode_t mode)
+{
+	pthread_mutex_lock(&stats_shm_mutex);
+
+	if (stats_shm) {
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return 0;
+	}
+
+	snprintf(stats_shm_path, sizeof(stats_shm_path), "%s/%s%d", STATS_SHM_DIR, STATS_SHM_PREFIX, (int)getpid());
+	stats_shm_size = sizeof(stats_shm_header) + STATS_SHM_SLOTS * sizeof(stats_shm_afu);
+
+	// Remove a segment left by an earlier process, or anything planted in its place
+	if (unlink(stats_shm_path) && errno != ENOENT) {
+		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not remove stale statistics segment '%s': %d: '%s'",
+		       stats_shm_path, errno, strerror(errno));
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return -1;
+	}
+
+	int fd = open(stats_shm_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, mode);
+	if (fd >= 0 && fchmod(fd, mode)) { // Not narrowed by the umask
+		close(fd);
+		unlink(stats_shm_path);
+		fd = -1;
+	}
+	if (fd < 0) {
+		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not create statistics segment '%s': %d: '%s'",
+		       stats_shm_path, errno, strerror(errno));
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return -1;
+	}
+
+	void *shm = MAP_FAILED;
+	if (!ftruncate(fd, stats_shm_size)) {
+		shm = mmap(NULL, stats_shm_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+
+	if (shm == MAP_FAILED) {
+		errmsg(NULL, OCXL_INTERNAL_ERROR, "Could not map statistics segment '%s': %d: '%s'",
+		       stats_shm_path, errno, strerror(errno));
+		unlink(stats_shm_path);
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return -1;
+	}
+
+	stats_shm_header *header = shm;
+	header->version = STATS_SHM_VERSION;
+	header->header_size = sizeof(stats_shm_header);
+	header->slot_size = sizeof(stats_shm_afu);
+	header->slot_count = STATS_SHM_SLOTS;
+	header->pid = getpid();
+	header->interval_ms = interval_ms;
+
+	FILE *comm = fopen("/proc/self/comm", "r");
+	if (comm) {
+		if (fgets(header->comm, sizeof(header->comm), comm)) {
+			header->comm[strcspn(header->comm, "\n")] = '\0';
+		}
+		fclose(comm);
+	}
+
+	// Monitors ignore the segment until the magic number appears
+	__atomic_store_n(&header->magic, STATS_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	memset(stats_shm_afus, 0, sizeof(stats_shm_afus));
+	stats_shm = header;
+
+	if (!stats_shm_atfork_registered &&
+	    !pthread_atfork(stats_shm_atfork_prepare, stats_shm_atfork_parent, stats_shm_atfork_child)) {
+		stats_shm_atfork_registered = true;
+	}
+
+	if (interval_ms && !stats_shm_publisher_started) {
+		stats_shm_interval_ms = interval_ms;
+
+		// The publisher must not take the application's signals
+		sigset_t all, previous;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &previous);
+		if (!pthread_create(&stats_shm_publisher, NULL, stats_shm_publisher_thread, NULL)) {
+			pthread_detach(stats_shm_publisher);
+			stats_shm_publisher_started = true;
+		}
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	}
+
+	pthread_mutex_unlock(&stats_shm_mutex);
+
+	return 0;
+}
+
+/**
+ * @internal
+ *
+ * Remove the statistics segment of this process
+ */
+void stats_shm_close()
+{
+	pthread_mutex_lock(&stats_shm_mutex);
+
+	if (stats_shm) {
+		for (int index = 0; index < STATS_SHM_SLOTS; index++) {
+			if (stats_shm_afus[index]) {
+				stats_shm_afus[index]->stats.shm_slot = -1;
+				stats_shm_afus[index] = NULL;
+			}
+		}
+
+		munmap(stats_shm, stats_shm_size);
+		unlink(stats_shm_path);
+		stats_shm = NULL;
+	}
+
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Publish statistics if requested by the environment
+ *  - LIBOCXL_STATS_SHM enables publishing to STATS_SHM_DIR/libocxl.<pid>
+ *  - LIBOCXL_STATS_SHM_INTERVAL sets how often the statistics are updated, in milliseconds
+ *  - LIBOCXL_STATS_SHM_MODE sets the permissions of the segment, in octal, 0600 by default
+ */
+void stats_shm_init()
+{
+	const char *val;
+
+	val = getenv("LIBOCXL_STATS_SHM");
+	if (!val || (strcasecmp(val, "yes") && strcmp(val, "1"))) {
+		return;
+	}
+
+	uint32_t interval_ms = STATS_SHM_INTERVAL_MS;
+	val = getenv("LIBOCXL_STATS_SHM_INTERVAL");
+	if (val && atol(val) > 0) {
+		interval_ms = atol(val);
+	}
+
+	mode_t mode = STATS_SHM_MODE;
+	val = getenv("LIBOCXL_STATS_SHM_MODE");
+	if (val) {
+		char *end;
+		unsigned long requested = strtoul(val, &end, 8);
+		if (*val && !*end && !(requested & ~0666UL)) {
+			mode = requested;
+		} else {
+			errmsg(NULL, OCXL_INVALID_ARGS, "Ignoring invalid LIBOCXL_STATS_SHM_MODE '%s'", val);
+		}
+	}
+
+	stats_shm_open(interval_ms, mode);
+}
+
+/**
+ * @internal
+ *
+ * Remove the statistics segment when the process exits
+ */
+__attribute__((destructor)) void stats_fini()
+{
+	stats_shm_close();
+}
+
+/**
+ * @internal
+ *
+ * Publish the statistics of an AFU that has been opened, if statistics are being published
+ *
+ * @param afu the AFU
+ */
+void stats_shm_register(ocxl_afu *afu)
+{
+	pthread_mutex_lock(&stats_shm_mutex);
+
+	if (!stats_shm) {
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return;
+	}
+
+	stats_shm->contexts_opened++;
+
+	int index;
+	for (index = 0; index < STATS_SHM_SLOTS && stats_shm_afus[index]; index++) {
+	}
+
+	if (index == STATS_SHM_SLOTS) {
+		stats_shm->contexts_unpublished++;
+		afu->stats.shm_unpublished = true;
+		pthread_mutex_unlock(&stats_shm_mutex);
+		return;
+	}
+
+	stats_shm_afus[index] = afu;
+	afu->stats.shm_slot = index;
+
+	stats_shm_afu *slot = stats_shm_slot(index);
+	stats_shm_slot_begin(slot);
+	uint64_t generation = slot->generation + 1;
+	uint32_t sequence = slot->sequence;
+	memset(slot, 0, sizeof(*slot));
+	slot->sequence = sequence;
+	slot->generation = generation;
+	slot->in_use = 1;
+	const char *device = strrchr(afu->device_path, '/');
+	snprintf(slot->device, sizeof(slot->device), "%s", device ? device + 1 : afu->device_path);
+	slot->opened_ns = timestamp_now_ns();
+	slot->setup_ns = afu->stats.setup_ns;
+	stats_shm_slot_end(slot);
+
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Stop publishing the statistics of an AFU that is being closed
+ *
+ * @param afu the AFU
+ */
+void stats_shm_unregister(ocxl_afu *afu)
+{
+	pthread_mutex_lock(&stats_shm_mutex);
+
+	if (stats_shm) {
+		if (afu->stats.shm_slot >= 0 && stats_shm_afus[afu->stats.shm_slot] == afu) {
+			stats_shm_afu *slot = stats_shm_slot(afu->stats.shm_slot);
+			stats_shm_slot_begin(slot);
+			slot->in_use = 0;
+			stats_shm_slot_end(slot);
+			stats_shm_afus[afu->stats.shm_slot] = NULL;
+		} else if (afu->stats.shm_unpublished && stats_shm->contexts_unpublished) {
+			stats_shm->contexts_unpublished--;
+		}
+	}
+	afu->stats.shm_slot = -1;
+	afu->stats.shm_unpublished = false;
+
+	pthread_mutex_unlock(&stats_shm_mutex);
+}
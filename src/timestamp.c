@@ -0,0 +1,401 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "libocxl_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#if defined(_ARCH_PPC64)
+#include <sys/platform/ppc.h>
+#elif defined(__x86_64__)
+#include <cpuid.h>
+#endif
+
+/**
+ * @defgroup ocxl_timestamp OpenCAPI Timestamps
+ *
+ * ocxl_timestamp() reads the cheapest invariant counter the CPU provides: the timebase on
+ * POWER, the TSC on x86 (when the CPU reports it as invariant), or the virtual counter on
+ * arm64. Elsewhere, or with LIBOCXL_TIMESTAMP=clock, it falls back to CLOCK_MONOTONIC.
+ *
+ * The counter is related to CLOCK_MONOTONIC, and ocxl_timestamp_to_ns() converts
+ * timestamps to nanoseconds on the CLOCK_MONOTONIC timeline, so they can be compared with
+ * the times the library reports (statistics, samples & traces all use the same source).
+ *
+ * @{
+ */
+
+#define TIMESTAMP_SHIFT 32 /**< Counter ticks are scaled to nanoseconds in 32.32 fixed point */
+#define TIMESTAMP_CALIBRATION_NS 5000000 /**< The shortest interval the counter rate is measured over */
+#define TIMESTAMP_TSC_FREQ_PATH "/sys/devices/system/cpu/cpu0/tsc_freq_khz"
+#define TIMESTAMP_PAIR_TRIES 5
+
+/// Timestamps are counter ticks, otherwise they are CLOCK_MONOTONIC nanoseconds
+bool timestamp_counter = false;
+/// A counter reading & the CLOCK_MONOTONIC time it was taken at
+uint64_t timestamp_base_ticks = 0;
+uint64_t timestamp_base_ns = 0;
+/// Nanoseconds per tick, in 32.32 fixed point
+uint64_t timestamp_mult = 1ULL << TIMESTAMP_SHIFT;
+/// The rate is known, otherwise it is measured by timestamp_calibrate() before the first conversion
+bool timestamp_calibrated = true;
+/// Serialises the measurement of the rate
+pthread_mutex_t timestamp_calibrate_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @internal
+ *
+ * Get the current CLOCK_MONOTONIC time
+ *
+ * @return the time in nanoseconds
+ */
+uint64_t timestamp_monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @internal
+ *
+ * Read the CPU's counter
+ *
+ * @return the counter, in ticks
+ */
+static uint64_t timestamp_counter_read()
+{
+#if defined(_ARCH_PPC64)
+	return __ppc_get_timebase();
+#elif defined(__x86_64__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r" (ticks));
+	return ticks;
+#else
+	return timestamp_monotonic_ns();
+#endif
+}
+
+/**
+ * @internal
+ *
+ * Get the rate of the CPU's counter, if the CPU reports it
+ *
+ * On x86, CPUID leaf 0x15 gives the TSC's ratio to the core crystal, and usually the crystal's
+ * rate. Where it leaves the crystal out, the TSC runs at the base frequency of leaf 0x16.
+ *
+ * @return the rate in Hz, or 0 if it must be found elsewhere
+ */
+static uint64_t timestamp_counter_hz()
+{
+#if defined(_ARCH_PPC64)
+	return __ppc_get_timebase_freq();
+#elif defined(__aarch64__)
+	uint64_t hz;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r" (hz));
+	return hz;
+#elif defined(__x86_64__)
+	unsigned int denominator, numerator, crystal_hz, edx;
+	if (__get_cpuid_max(0, NULL) < 0x15) {
+		return 0;
+	}
+
+	__cpuid(0x15, denominator, numerator, crystal_hz, edx);
+	if (!denominator || !numerator) {
+		return 0;
+	}
+
+	if (crystal_hz) {
+		return (uint64_t)crystal_hz * numerator / denominator;
+	}
+
+	unsigned int base_mhz, ebx, ecx;
+	if (__get_cpuid_max(0, NULL) < 0x16) {
+		return 0;
+	}
+
+	__cpuid(0x16, base_mhz, ebx, ecx, edx);
+	return (uint64_t)base_mhz * 1000000;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * @internal
+ *
+ * Get the rate of the TSC the kernel measured, if it publishes it
+ *
+ * @return the rate in Hz, or 0 if it is not published
+ */
+static uint64_t timestamp_tsc_freq_hz()
+{
+	FILE *freq = fopen(TIMESTAMP_TSC_FREQ_PATH, "r");
+	if (!freq) {
+		return 0;
+	}
+
+	unsigned long long khz = 0;
+	if (fscanf(freq, "%llu", &khz) != 1) {
+		khz = 0;
+	}
+	fclose(freq);
+
+	return khz * 1000;
+}
+
+/**
+ * @internal
+ *
+ * Convert a counter rate to nanoseconds per tick
+ *
+ * @param hz the rate of the counter
+ * @return the nanoseconds per tick, in 32.32 fixed point
+ */
+static uint64_t timestamp_hz_mult(uint64_t hz)
+{
+	return (uint64_t)(((unsigned __int128)1000000000ULL << TIMESTAMP_SHIFT) / hz);
+}
+
+/**
+ * @internal
+ *
+ * Check whether the CPU's counter runs at a constant rate, through frequency & power state
+ * changes, and is synchronised across CPUs
+ *
+ * @return true if timestamps can be taken from the counter
+ */
+static bool timestamp_counter_invariant()
+{
+#if defined(_ARCH_PPC64) || defined(__aarch64__)
+	return true;
+#elif defined(__x86_64__)
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+		return false;
+	}
+	return edx & (1 << 8);
+#else
+	return false;
+#endif
+}
+
+/**
+ * @internal
+ *
+ * Read the counter & CLOCK_MONOTONIC together
+ *
+ * The clock is read between two counter readings, and the closest bracketed of a few tries
+ * is kept, so the pair is not skewed by an interrupt or preemption.
+ *
+ * @param[out] ticks the counter, at the time of the clock reading
+ * @param[out] ns the clock
+ */
+static void timestamp_pair(uint64_t *ticks, uint64_t *ns)
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int i = 0; i < TIMESTAMP_PAIR_TRIES; i++) {
+		uint64_t before = timestamp_counter_read();
+		uint64_t clock = timestamp_monotonic_ns();
+		uint64_t after = timestamp_counter_read();
+
+		if (after - before < best) {
+			best = after - before;
+			*ticks = before + (after - before) / 2;
+			*ns = clock;
+		}
+	}
+}
+
+/**
+ * @internal
+ *
+ * Get the rate of the counter, from the base to a later reading
+ *
+ * @param ticks the counter
+ * @param ns the CLOCK_MONOTONIC time the counter was read at
+ * @return the nanoseconds per tick, in 32.32 fixed point
+ */
+static uint64_t timestamp_rate(uint64_t ticks, uint64_t ns)
+{
+	return (uint64_t)(((unsigned __int128)(ns - timestamp_base_ns) << TIMESTAMP_SHIFT) /
+	                  (ticks - timestamp_base_ticks));
+}
+
+/**
+ * @internal
+ *
+ * Select the timestamp source, & take the base for conversions, as the library is loaded
+ *
+ * This never waits: if the CPU does not report the rate of the counter, it is measured by
+ * timestamp_calibrate(), when the first AFU is opened, or before the first conversion.
+ *
+ * Set LIBOCXL_TIMESTAMP=clock to take timestamps from CLOCK_MONOTONIC, eg. on virtual machines
+ * which report an invariant TSC that is not.
+ */
+__attribute__((constructor)) void timestamp_init()
+{
+	timestamp_counter = false;
+	timestamp_mult = 1ULL << TIMESTAMP_SHIFT;
+	timestamp_calibrated = true;
+
+	const char *val = getenv("LIBOCXL_TIMESTAMP");
+	if (val && !strcasecmp(val, "clock")) {
+		return;
+	}
+
+	if (!timestamp_counter_invariant()) {
+		return;
+	}
+
+	timestamp_pair(&timestamp_base_ticks, &timestamp_base_ns);
+	timestamp_counter = true;
+
+	uint64_t hz = timestamp_counter_hz();
+	if (hz) {
+		timestamp_mult = timestamp_hz_mult(hz);
+		return;
+	}
+
+	timestamp_calibrated = false;
+}
+
+/**
+ * @internal
+ *
+ * Find the rate of the counter, if timestamp_init() could not
+ *
+ * The rate the kernel measured is used if it is published, otherwise the rate is measured
+ * from the base, over at least TIMESTAMP_CALIBRATION_NS. The base is taken as the library is
+ * loaded, so by the time an AFU is opened that has usually passed, and nothing waits.
+ *
+ * The rate is only set once, so conversions never jump. Threads converting meanwhile wait.
+ */
+void timestamp_calibrate()
+{
+	if (__atomic_load_n(&timestamp_calibrated, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	pthread_mutex_lock(&timestamp_calibrate_mutex);
+	if (timestamp_calibrated) {
+		pthread_mutex_unlock(&timestamp_calibrate_mutex);
+		return;
+	}
+
+	uint64_t hz = timestamp_tsc_freq_hz();
+	if (hz) {
+		timestamp_mult = timestamp_hz_mult(hz);
+	} else {
+		uint64_t elapsed = timestamp_monotonic_ns() - timestamp_base_ns;
+		if (elapsed < TIMESTAMP_CALIBRATION_NS) {
+			struct timespec wait = { .tv_sec = 0, .tv_nsec = TIMESTAMP_CALIBRATION_NS - elapsed };
+			while (nanosleep(&wait, &wait) && errno == EINTR) {
+			}
+		}
+
+		uint64_t ticks = 0, ns = 0;
+		timestamp_pair(&ticks, &ns);
+		timestamp_mult = timestamp_rate(ticks, ns);
+	}
+
+	__atomic_store_n(&timestamp_calibrated, true, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&timestamp_calibrate_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Convert an interval between timestamps to nanoseconds
+ *
+ * @param start the timestamp at the start of the interval
+ * @param end the timestamp at the end of the interval
+ * @return the interval in nanoseconds
+ */
+uint64_t timestamp_interval_ns(uint64_t start, uint64_t end)
+{
+	if (UNLIKELY(!__atomic_load_n(&timestamp_calibrated, __ATOMIC_ACQUIRE))) {
+		timestamp_calibrate();
+	}
+
+	uint64_t mult = timestamp_mult;
+	return (uint64_t)(((unsigned __int128)(end - start) * mult) >> TIMESTAMP_SHIFT);
+}
+
+/**
+ * @internal
+ *
+ * Get the current time, from the timestamp source
+ *
+ * @return the time in nanoseconds, on the CLOCK_MONOTONIC timeline
+ */
+uint64_t timestamp_now_ns()
+{
+	return timestamp_to_ns(timestamp_read());
+}
+
+/**
+ * Take a timestamp
+ *
+ * This is a single counter read on POWER, x86 & arm64, and does not order the instructions
+ * around it, so fence accesses that must complete before or after it.
+ *
+ * @see ocxl_timestamp_to_ns()
+ *
+ * @return the timestamp, in units of the timestamp source
+ */
+uint64_t ocxl_timestamp()
+{
+	return timestamp_counter ? timestamp_counter_read() : timestamp_monotonic_ns();
+}
+
+LIBOCXL_ALIAS(ocxl_timestamp, timestamp_read);
+
+/**
+ * Convert a timestamp to nanoseconds
+ *
+ * Converted timestamps are on the CLOCK_MONOTONIC timeline, so subtracting two gives the
+ * time between them.
+ *
+ * @param timestamp a timestamp from ocxl_timestamp()
+ * @return the time of the timestamp, in CLOCK_MONOTONIC nanoseconds
+ */
+uint64_t ocxl_timestamp_to_ns(uint64_t timestamp)
+{
+	if (!timestamp_counter) {
+		return timestamp;
+	}
+
+	// Timestamps may precede the base, if taken by other constructors
+	if (timestamp < timestamp_base_ticks) {
+		return timestamp_base_ns - timestamp_interval_ns(timestamp, timestamp_base_ticks);
+	}
+
+	return timestamp_base_ns + timestamp_interval_ns(timestamp_base_ticks, timestamp);
+}
+
+LIBOCXL_ALIAS(ocxl_timestamp_to_ns, timestamp_to_ns);
+
+/**
+ * @}
+ */
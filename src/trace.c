@@ -0,0 +1,825 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Trace records are written by TRACE() into a ring per thread, without locks or system calls.
+ * Each record holds the trace site, a timestamp & the raw arguments, and is only formatted
+ * when it is read out, either by the flusher thread (when streaming to the trace output),
+ * or by the flight recorder, which writes out the most recent records when an error occurs.
+ *
+ * Each ring has a single writer, the thread that owns it. Readers validate the records they
+ * copy against the record's sequence number, which the writer clears before, and sets after,
+ * filling in the record, so a record overwritten while being read is discarded.
+ *
+ * The flusher batches the records written over TRACE_FLUSH_INTERVAL_MS, and once the rings are
+ * drained, waits until a writer wakes it, so it does not wake while nothing is traced.
+ */
+
+#include "libocxl_internal.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/// The number of records in each thread's ring, rounded up to a power of 2
+size_t trace_ring_records = TRACE_RING_RECORDS_DEFAULT;
+
+/// The number of records written out by the flight recorder on an error, 0 to disable it
+size_t trace_flight_records = 0;
+
+/// True if trace records are streamed to the output, false if they are only kept for the flight recorder
+bool trace_streaming = true;
+
+/// The file trace records are written to, or NULL for stderr
+const char *trace_output_path = NULL;
+
+/// The rings of all threads that have traced
+trace_ring *trace_rings = NULL;
+pthread_mutex_t trace_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/// The ring of the current thread
+__thread trace_ring *trace_self = NULL;
+
+pthread_key_t trace_ring_key;
+pthread_once_t trace_ring_key_once = PTHREAD_ONCE_INIT;
+
+/// Serialises reading out the rings
+pthread_mutex_t trace_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+FILE *trace_output = NULL;
+
+/// The records being written out, protected by trace_flush_mutex
+trace_record *trace_flush_records = NULL;
+size_t trace_flush_capacity = 0;
+
+bool trace_flusher_started = false;
+pthread_t trace_flusher;
+
+/// The flusher is waiting for a record to be written, protected by trace_flusher_mutex
+bool trace_flusher_idle = false;
+pthread_mutex_t trace_flusher_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t trace_flusher_cond = PTHREAD_COND_INITIALIZER;
+
+extern pthread_mutex_t stderr_mutex;
+
+/**
+ * @internal
+ *
+ * Parse the conversions in a site's format, to know how to fetch its arguments
+ *
+ * @param site the trace site
+ * @return the number of arguments
+ */
+static int trace_parse_site(trace_site *site)
+{
+	uint8_t types[TRACE_MAX_ARGS];
+	int count = 0;
+
+	for (const char *c = site->format; *c; c++) {
+		if (*c != '%') {
+			continue;
+		}
+		c++;
+		if (*c == '%') {
+			continue;
+		}
+
+		while (*c && strchr("-+ #0123456789.", *c)) {
+			c++;
+		}
+
+		int longs = 0;
+		while (*c && strchr("hlLqjzt", *c)) {
+			longs += (*c == 'l' || *c == 'q' || *c == 'j' || *c == 'z' || *c == 't') ? 1 : 0;
+			longs += (*c == 'L' || *c == 'q') ? 2 : 0;
+			c++;
+		}
+
+		uint8_t type;
+		switch (*c) {
+		case 'd':
+		case 'i':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'o':
+		case 'c':
+			type = (longs >= 2) ? TRACE_ARG_LLONG : (longs == 1) ? TRACE_ARG_LONG : TRACE_ARG_INT;
+			break;
+		case 'p':
+			type = TRACE_ARG_PTR;
+			break;
+		case 's':
+			type = TRACE_ARG_STRING;
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A':
+			type = TRACE_ARG_DOUBLE;
+			break;
+		default:
+			// Unsupported conversions are written out as they are
+			if (!*c) {
+				c--;
+			}
+			continue;
+		}
+
+		if (count == TRACE_MAX_ARGS) {
+			break;
+		}
+		types[count++] = type;
+	}
+
+	memcpy(site->arg_types, types, count);
+	__atomic_store_n(&site->arg_count, count, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+/**
+ * @internal
+ *
+ * Mark the ring of an exiting thread for reuse
+ */
+static void trace_ring_release(void *data)
+{
+	trace_ring *ring = data;
+	__atomic_store_n(&ring->released, true, __ATOMIC_RELEASE);
+}
+
+static void trace_ring_key_create()
+{
+	pthread_key_create(&trace_ring_key, trace_ring_release);
+}
+
+/**
+ * @internal
+ *
+ * Check whether any ring holds records that have not been written out
+ *
+ * @return true if there are records to write out
+ */
+static bool trace_pending()
+{
+	bool pending = false;
+
+	pthread_mutex_lock(&trace_rings_mutex);
+	for (trace_ring *ring = trace_rings; ring; ring = ring->next) {
+		if (ring->flushed != __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+			pending = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&trace_rings_mutex);
+
+	return pending;
+}
+
+/**
+ * @internal
+ *
+ * Wake the flusher, once a record has been written while it waits
+ */
+static void trace_flusher_wake()
+{
+	pthread_mutex_lock(&trace_flusher_mutex);
+	if (trace_flusher_idle) {
+		__atomic_store_n(&trace_flusher_idle, false, __ATOMIC_RELAXED);
+		pthread_cond_signal(&trace_flusher_cond);
+	}
+	pthread_mutex_unlock(&trace_flusher_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Write out buffered trace records, while streaming
+ *
+ * Records are written out every TRACE_FLUSH_INTERVAL_MS while they are being written, and once
+ * the rings are drained, the flusher waits for trace_record_site() to wake it. The flusher marks
+ * itself idle before checking the rings, and writers publish a record before checking whether
+ * it is idle (both sequentially consistent), so either the flusher sees the record, or the
+ * writer sees it idle.
+ */
+static void *trace_flusher_thread(void *arg)
+{
+	(void)arg;
+	struct timespec interval = { .tv_sec = 0, .tv_nsec = TRACE_FLUSH_INTERVAL_MS * 1000000L };
+
+	while (true) {
+		nanosleep(&interval, NULL);
+		trace_flush();
+
+		pthread_mutex_lock(&trace_flusher_mutex);
+		__atomic_store_n(&trace_flusher_idle, true, __ATOMIC_SEQ_CST);
+		while (trace_flusher_idle && !trace_pending()) {
+			pthread_cond_wait(&trace_flusher_cond, &trace_flusher_mutex);
+		}
+		__atomic_store_n(&trace_flusher_idle, false, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&trace_flusher_mutex);
+	}
+
+	return NULL;
+}
+
+/**
+ * @internal
+ *
+ * Get the ring of the current thread, creating it on first use
+ *
+ * Rings of threads that have exited are reused, once their records have been written out.
+ *
+ * @return the ring, or NULL if it could not be allocated
+ */
+static trace_ring *trace_ring_get()
+{
+	if (LIKELY(trace_self != NULL)) {
+		return trace_self;
+	}
+
+	pthread_once(&trace_ring_key_once, trace_ring_key_create);
+
+	pthread_mutex_lock(&trace_rings_mutex);
+
+	trace_ring *ring = NULL;
+	for (trace_ring *candidate = trace_rings; candidate; candidate = candidate->next) {
+		if (__atomic_load_n(&candidate->released, __ATOMIC_ACQUIRE) &&
+		    (!trace_streaming || candidate->flushed == __atomic_load_n(&candidate->head, __ATOMIC_ACQUIRE))) {
+			ring = candidate;
+			ring->released = false;
+			break;
+		}
+	}
+
+	if (!ring) {
+		size_t records = 1;
+		while (records < trace_ring_records) {
+			records <<= 1;
+		}
+
+		ring = calloc(1, sizeof(trace_ring) + records * sizeof(trace_record));
+		if (ring) {
+			ring->mask = records - 1;
+			ring->next = trace_rings;
+			trace_rings = ring;
+		}
+	}
+
+	if (ring && trace_streaming && !trace_flusher_started) {
+		// The flusher must not take the application's signals
+		sigset_t all, previous;
+		sigfillset(&all);
+		pthread_sigmask(SIG_SETMASK, &all, &previous);
+		if (!pthread_create(&trace_flusher, NULL, trace_flusher_thread, NULL)) {
+			pthread_detach(trace_flusher);
+			trace_flusher_started = true;
+		}
+		pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	}
+
+	pthread_mutex_unlock(&trace_rings_mutex);
+
+	if (ring) {
+		ring->tid = syscall(SYS_gettid);
+		pthread_setspecific(trace_ring_key, ring);
+	}
+	trace_self = ring;
+
+	return ring;
+}
+
+/**
+ * @internal
+ *
+ * Record a trace message in the current thread's ring
+ *
+ * The arguments are stored raw, strings are copied (and may be truncated), and the message is
+ * formatted when it is read out.
+ *
+ * @param site the trace site, holding the format
+ * @param ... the arguments of the format
+ */
+void trace_record_site(trace_site *site, ...)
+{
+	trace_ring *ring = trace_ring_get();
+	if (UNLIKELY(ring == NULL)) {
+		return;
+	}
+
+	int arg_count = __atomic_load_n(&site->arg_count, __ATOMIC_ACQUIRE);
+	if (UNLIKELY(arg_count < 0)) {
+		arg_count = trace_parse_site(site);
+	}
+
+	uint64_t position = ring->head;
+	trace_record *record = &ring->records[position & ring->mask];
+
+	__atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->timestamp = timestamp_read();
+	record->site = site;
+	record->tid = ring->tid;
+
+	va_list ap;
+	va_start(ap, site);
+	size_t string_used = 0;
+	for (int arg = 0; arg < arg_count; arg++) {
+		switch (site->arg_types[arg]) {
+		case TRACE_ARG_INT:
+			record->args[arg] = (uint64_t)va_arg(ap, int);
+			break;
+		case TRACE_ARG_LONG:
+			record->args[arg] = (uint64_t)va_arg(ap, long);
+			break;
+		case TRACE_ARG_LLONG:
+			record->args[arg] = (uint64_t)va_arg(ap, long long);
+			break;
+		case TRACE_ARG_PTR:
+			record->args[arg] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+			break;
+		case TRACE_ARG_DOUBLE: {
+			double value = va_arg(ap, double);
+			memcpy(&record->args[arg], &value, sizeof(value));
+			break;
+		}
+		case TRACE_ARG_STRING: {
+			const char *value = va_arg(ap, const char *);
+			if (!value) {
+				value = "(null)";
+			}
+			size_t available = TRACE_STRING_BYTES - string_used;
+			size_t length = available ? strnlen(value, available - 1) : 0;
+			record->args[arg] = string_used;
+			if (available) {
+				memcpy(record->strings + string_used, value, length);
+				record->strings[string_used + length] = '\0';
+				string_used += length + 1;
+			} else {
+				record->args[arg] = TRACE_STRING_BYTES - 1;
+			}
+			break;
+		}
+		}
+	}
+	va_end(ap);
+
+	__atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&ring->head, position + 1, __ATOMIC_SEQ_CST);
+
+	if (UNLIKELY(__atomic_load_n(&trace_flusher_idle, __ATOMIC_SEQ_CST))) {
+		trace_flusher_wake();
+	}
+}
+
+/**
+ * @internal
+ *
+ * Copy a record out of a ring, if it has not been overwritten
+ *
+ * @param ring the ring
+ * @param position the position of the record
+ * @param[out] out the copy of the record
+ * @return true if the copy is valid
+ */
+static bool trace_copy_record(trace_ring *ring, uint64_t position, trace_record *out)
+{
+	const trace_record *record = &ring->records[position & ring->mask];
+
+	if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != position + 1) {
+		return false;
+	}
+
+	memcpy(out, record, sizeof(*out));
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return __atomic_load_n(&record->sequence, __ATOMIC_RELAXED) == position + 1;
+}
+
+static int trace_compare_records(const void *a, const void *b)
+{
+	const trace_record *left = a, *right = b;
+
+	if (left->timestamp != right->timestamp) {
+		return (left->timestamp < right->timestamp) ? -1 : 1;
+	}
+
+	return (left->sequence < right->sequence) ? -1 : (left->sequence > right->sequence);
+}
+
+/**
+ * @internal
+ *
+ * Copy records out of all the rings, ordered by time
+ *
+ * The buffer the records are copied to is reused across calls, and only reallocated when
+ * new rings have been created since.
+ *
+ * @param recent the number of most recent records to copy, or 0 for all those not yet written out
+ * @param consume true to mark the copied records as written out
+ * @param[in,out] records the buffer of records (may point to NULL), which must be freed by the caller
+ * @param[in,out] capacity the number of records the buffer holds
+ * @param[out] lost the number of records overwritten before they could be copied (may be NULL)
+ * @return the number of records, or 0 if there are none (or on error)
+ */
+size_t trace_collect(size_t recent, bool consume, trace_record **records, size_t *capacity, uint64_t *lost)
+{
+	size_t required = 0, count = 0;
+	uint64_t overwritten = 0;
+
+	pthread_mutex_lock(&trace_rings_mutex);
+	for (trace_ring *ring = trace_rings; ring; ring = ring->next) {
+		required += ring->mask + 1;
+	}
+
+	if (required > *capacity) {
+		trace_record *buffer = realloc(*records, required * sizeof(trace_record));
+		if (!buffer) {
+			pthread_mutex_unlock(&trace_rings_mutex);
+			return 0;
+		}
+		*records = buffer;
+		*capacity = required;
+	}
+	trace_record *out = *records;
+
+	for (trace_ring *ring = trace_rings; ring; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t size = ring->mask + 1;
+		uint64_t start;
+
+		if (recent) {
+			start = (head > recent) ? head - recent : 0;
+		} else {
+			start = ring->flushed;
+		}
+		if (head - start > size) {
+			if (!recent) {
+				overwritten += head - start - size;
+			}
+			start = head - size;
+		}
+
+		for (uint64_t position = start; position < head; position++) {
+			if (trace_copy_record(ring, position, &out[count])) {
+				count++;
+			} else if (!recent) {
+				overwritten++;
+			}
+		}
+
+		if (consume) {
+			ring->flushed = head;
+		}
+	}
+	pthread_mutex_unlock(&trace_rings_mutex);
+
+	qsort(out, count, sizeof(*out), trace_compare_records);
+
+	// Keep only the most recent across all threads
+	if (recent && count > recent) {
+		memmove(out, out + count - recent, recent * sizeof(*out));
+		count = recent;
+	}
+
+	if (lost) {
+		*lost = overwritten;
+	}
+
+	return count;
+}
+
+/**
+ * @internal
+ *
+ * Format a trace record's message
+ *
+ * @param record the record
+ * @param[out] buf the buffer to write the message to
+ * @param len the size of the buffer
+ */
+void trace_format(const trace_record *record, char *buf, size_t len)
+{
+	const trace_site *site = record->site;
+	int arg_count = __atomic_load_n(&site->arg_count, __ATOMIC_ACQUIRE);
+	size_t used = 0;
+	int arg = 0;
+
+	if (!len) {
+		return;
+	}
+	buf[0] = '\0';
+
+	for (const char *c = site->format; *c && used < len - 1; ) {
+		if (*c != '%') {
+			buf[used++] = *c++;
+			buf[used] = '\0';
+			continue;
+		}
+		if (c[1] == '%') {
+			buf[used++] = '%';
+			buf[used] = '\0';
+			c += 2;
+			continue;
+		}
+
+		// Extract the conversion specification, to format the argument with
+		char spec[16];
+		size_t spec_len = 0;
+		const char *start = c++;
+		while (*c && strchr("-+ #0123456789.hlLqjzt", *c)) {
+			c++;
+		}
+		if (*c) {
+			c++;
+		}
+		spec_len = c - start;
+		if (spec_len >= sizeof(spec)) {
+			spec_len = sizeof(spec) - 1;
+		}
+		memcpy(spec, start, spec_len);
+		spec[spec_len] = '\0';
+
+		char conversion = spec[spec_len - 1];
+		if (!strchr("diuxXocpsfFeEgGaA", conversion) || arg >= arg_count) {
+			used += snprintf(buf + used, len - used, "%s", spec);
+		} else {
+			uint64_t value = record->args[arg];
+			double real;
+
+			switch (site->arg_types[arg]) {
+			case TRACE_ARG_INT:
+				used += snprintf(buf + used, len - used, spec, (int)value);
+				break;
+			case TRACE_ARG_LONG:
+				used += snprintf(buf + used, len - used, spec, (long)value);
+				break;
+			case TRACE_ARG_LLONG:
+				used += snprintf(buf + used, len - used, spec, (long long)value);
+				break;
+			case TRACE_ARG_PTR:
+				used += snprintf(buf + used, len - used, spec, (void *)(uintptr_t)value);
+				break;
+			case TRACE_ARG_DOUBLE:
+				memcpy(&real, &value, sizeof(real));
+				used += snprintf(buf + used, len - used, spec, real);
+				break;
+			case TRACE_ARG_STRING:
+				used += snprintf(buf + used, len - used, spec,
+				                 record->strings + (value < TRACE_STRING_BYTES ? value : TRACE_STRING_BYTES - 1));
+				break;
+			}
+			arg++;
+		}
+
+		if (used >= len) {
+			used = len - 1;
+		}
+	}
+}
+
+/**
+ * @internal
+ *
+ * Get the trace output, opening it if required
+ *
+ * @pre trace_flush_mutex is held
+ *
+ * @return the output
+ */
+static FILE *trace_get_output()
+{
+	if (trace_output) {
+		return trace_output;
+	}
+
+	if (trace_output_path) {
+		trace_output = fopen(trace_output_path, "a");
+		if (!trace_output) {
+			fprintf(stderr, "Could not open trace output '%s': %d: '%s', tracing to stderr\n",
+			        trace_output_path, errno, strerror(errno));
+		}
+	}
+
+	if (!trace_output) {
+		trace_output = stderr;
+	}
+
+	return trace_output;
+}
+
+/**
+ * @internal
+ *
+ * Write records out to the trace output
+ */
+static void trace_write(const trace_record *records, size_t count, uint64_t lost)
+{
+	FILE *out = trace_get_output();
+	char message[TRACE_MESSAGE_LENGTH];
+
+	pthread_mutex_lock(&stderr_mutex);
+
+	if (lost) {
+		fprintf(out, "Trace: %llu records were overwritten before they could be written out\n",
+		        (unsigned long long)lost);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const trace_site *site = records[i].site;
+		uint64_t ns = timestamp_to_ns(records[i].timestamp);
+
+		trace_format(&records[i], message, sizeof(message));
+		fprintf(out, "Trace: [%llu.%09llu] %d %s:%d\t%s():\t\t%s\n",
+		        (unsigned long long)(ns / 1000000000ULL),
+		        (unsigned long long)(ns % 1000000000ULL),
+		        (int)records[i].tid, site->file, site->line, site->function, message);
+	}
+	fflush(out);
+
+	pthread_mutex_unlock(&stderr_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Write out the trace records that have not been written out yet
+ */
+void trace_flush()
+{
+	uint64_t lost;
+
+	pthread_mutex_lock(&trace_flush_mutex);
+
+	size_t count = trace_collect(0, true, &trace_flush_records, &trace_flush_capacity, &lost);
+	if (count || lost) {
+		trace_write(trace_flush_records, count, lost);
+	}
+
+	pthread_mutex_unlock(&trace_flush_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Write out the most recent trace records of all threads, when an error occurs
+ */
+void trace_flight_dump()
+{
+	if (!trace_flight_records) {
+		return;
+	}
+
+	pthread_mutex_lock(&trace_flush_mutex);
+
+	size_t count = trace_collect(trace_flight_records, false, &trace_flush_records, &trace_flush_capacity, NULL);
+	if (count) {
+		FILE *out = trace_get_output();
+		pthread_mutex_lock(&stderr_mutex);
+		fprintf(out, "Trace: flight recorder, the last %zu records before the error follow\n", count);
+		pthread_mutex_unlock(&stderr_mutex);
+
+		trace_write(trace_flush_records, count, 0);
+	}
+
+	pthread_mutex_unlock(&trace_flush_mutex);
+}
+
+/**
+ * @internal
+ *
+ * Write out the remaining trace records when the process exits
+ */
+__attribute__((destructor)) void trace_fini()
+{
+	if (trace_streaming && trace_rings) {
+		trace_flush();
+	}
+}
+
+/**
+ * @internal
+ *
+ * Get the trace categories requested by message sources
+ *
+ * @param sources a bitwise OR of message sources, OCXL_TRACING requests all categories
+ * @return the trace categories (OCXL_TRACE_*)
+ */
+uint64_t trace_categories(uint64_t sources)
+{
+	if (sources & OCXL_TRACING) {
+		return OCXL_TRACE_ALL;
+	}
+
+	return sources & OCXL_TRACE_ALL;
+}
+
+/**
+ * @internal
+ *
+ * Parse the trace categories from an environment variable
+ *
+ * @param categories "1", "yes" or "all" for all categories, otherwise a comma separated list of
+ * categories (open, mmio, irq, events, faults), may be NULL
+ * @return the trace categories (OCXL_TRACE_*)
+ */
+uint64_t trace_parse_categories(const char *categories)
+{
+	const struct {
+		const char *name;
+		uint64_t category;
+	} names[] = {
+		{ "1", OCXL_TRACE_ALL },
+		{ "yes", OCXL_TRACE_ALL },
+		{ "all", OCXL_TRACE_ALL },
+		{ "open", OCXL_TRACE_OPEN },
+		{ "mmio", OCXL_TRACE_MMIO },
+		{ "irq", OCXL_TRACE_IRQ },
+		{ "events", OCXL_TRACE_EVENTS },
+		{ "faults", OCXL_TRACE_FAULTS },
+	};
+	uint64_t ret = 0;
+
+	if (!categories) {
+		return 0;
+	}
+
+	for (const char *token = categories; *token; ) {
+		size_t len = strcspn(token, ",");
+
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if (len == strlen(names[i].name) && !strncasecmp(token, names[i].name, len)) {
+				ret |= names[i].category;
+			}
+		}
+
+		token += len;
+		if (*token == ',') {
+			token++;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @internal
+ *
+ * Apply the trace settings from the environment
+ *  - LIBOCXL_TRACE_BUFFER sets the number of records in each thread's ring
+ *  - LIBOCXL_TRACE_FLIGHT enables the flight recorder, writing out this many records on an error.
+ *    Tracing is enabled on all AFUs (in all categories, unless LIBOCXL_TRACE_ALL selects some),
+ *    but records are only written out by the flight recorder, unless LIBOCXL_TRACE_ALL is also set
+ *  - LIBOCXL_TRACE_OUTPUT sets the file trace records are written to
+ *
+ * @param trace_all the trace categories selected by LIBOCXL_TRACE_ALL
+ * @return the trace categories to enable on all AFUs
+ */
+uint64_t trace_init(uint64_t trace_all)
+{
+	const char *val;
+
+	val = getenv("LIBOCXL_TRACE_BUFFER");
+	if (val && atol(val) > 0) {
+		trace_ring_records = atol(val);
+	}
+
+	val = getenv("LIBOCXL_TRACE_OUTPUT");
+	if (val && *val) {
+		trace_output_path = val;
+	}
+
+	val = getenv("LIBOCXL_TRACE_FLIGHT");
+	if (val && atol(val) > 0) {
+		trace_flight_records = atol(val);
+		trace_streaming = (trace_all != 0);
+		return trace_all ? trace_all : OCXL_TRACE_ALL;
+	}
+
+	return trace_all;
+}
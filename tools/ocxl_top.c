@@ -0,0 +1,607 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A live view of OpenCAPI usage across the system
+ *
+ * Cards & their context usage are read from sysfs. Per-process, per-context statistics are
+ * read from the segments processes publish when run with LIBOCXL_STATS_SHM=1 (see
+ * libocxl_stats_shm.h), and rates are derived from the change in the counters between
+ * refreshes.
+ */
+
+#define _GNU_SOURCE
+#include "libocxl_stats_shm.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SYS_PATH_DEFAULT "/sys/class/ocxl"
+
+/**
+ * A card (AFU) found in sysfs
+ */
+typedef struct top_card {
+	char device[STATS_SHM_DEVICE_MAX];
+	int contexts; /**< Contexts in use, or -1 if unknown */
+	int max_contexts; /**< Contexts available, or -1 if unknown */
+} top_card;
+
+/**
+ * An open context, found in a process's statistics segment
+ */
+typedef struct top_context {
+	int pid;
+	char comm[16];
+	int slot;
+	uint64_t updated_ns; /**< When the process last updated its statistics */
+	stats_shm_afu stats;
+
+	/* Derived from the previous sample of the same context */
+	bool have_rates;
+	double irqs;
+	double faults;
+	double events;
+	double mmio_reads;
+	double mmio_writes;
+	double wait_us; /**< The mean time waited per event check, or -1 if there were no waits */
+} top_context;
+
+/**
+ * A sample of all cards & contexts
+ */
+typedef struct top_sample {
+	top_card *cards;
+	size_t card_count;
+	top_context *contexts;
+	size_t context_count;
+	size_t processes;
+	size_t stale; /**< Segments left by processes that have exited */
+	size_t incompatible; /**< Segments with a layout this tool does not understand */
+	uint64_t unpublished; /**< Contexts open that processes had no slot for */
+} top_sample;
+
+static const char *sys_path;
+static const char *shm_dir = STATS_SHM_DIR;
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [ options ]\n", name);
+	fprintf(stderr, "\t-d, --delay SECONDS\tThe time between refreshes (default 1)\n");
+	fprintf(stderr, "\t-n, --iterations N\tExit after N refreshes\n");
+	fprintf(stderr, "\t-b, --batch\t\tAppend each refresh, rather than redrawing the screen\n");
+	fprintf(stderr, "\t-s, --sysfs PATH\tThe sysfs directory of the AFUs (default LIBOCXL_SYSPATH or %s)\n",
+	        SYS_PATH_DEFAULT);
+	fprintf(stderr, "\t-m, --shm PATH\t\tThe directory holding the statistics segments (default %s)\n",
+	        STATS_SHM_DIR);
+	fprintf(stderr, "\t-h, --help\t\tPrint this message\n");
+	fprintf(stderr, "\nProcesses publish their statistics when run with LIBOCXL_STATS_SHM=1\n");
+	exit(2);
+}
+
+/**
+ * Read a sysfs attribute of a card
+ *
+ * @param device the card
+ * @param attribute the attribute name
+ * @param[out] buf the value, without the trailing newline
+ * @param size the size of buf
+ * @return true if the attribute was read
+ */
+static bool read_attribute(const char *device, const char *attribute, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/%s/%s", sys_path, device, attribute);
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return false;
+	}
+
+	bool ret = (fgets(buf, size, file) != NULL);
+	fclose(file);
+	if (ret) {
+		buf[strcspn(buf, "\n")] = '\0';
+	}
+
+	return ret;
+}
+
+static int compare_cards(const void *a, const void *b)
+{
+	return strcmp(((const top_card *)a)->device, ((const top_card *)b)->device);
+}
+
+/**
+ * Find the cards in sysfs
+ *
+ * @param sample the sample to add the cards to
+ */
+static void scan_cards(top_sample *sample)
+{
+	DIR *dir = opendir(sys_path);
+	if (!dir) {
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+
+		top_card *cards = realloc(sample->cards, (sample->card_count + 1) * sizeof(top_card));
+		if (!cards) {
+			break;
+		}
+		sample->cards = cards;
+
+		top_card *card = &sample->cards[sample->card_count++];
+		snprintf(card->device, sizeof(card->device), "%.*s", (int)sizeof(card->device) - 1, entry->d_name);
+		card->contexts = -1;
+		card->max_contexts = -1;
+
+		// The driver reports contexts as "<in use>/<max>"
+		char contexts[64];
+		if (read_attribute(entry->d_name, "contexts", contexts, sizeof(contexts))) {
+			if (sscanf(contexts, "%d/%d", &card->contexts, &card->max_contexts) < 2) {
+				card->max_contexts = -1;
+			}
+		}
+	}
+
+	closedir(dir);
+
+	qsort(sample->cards, sample->card_count, sizeof(top_card), compare_cards);
+}
+
+/**
+ * Copy a slot of a statistics segment, consistently with the process updating it
+ *
+ * @param slot the slot in the segment
+ * @param[out] copy the copy
+ * @return true if a consistent copy was made
+ */
+static bool copy_slot(const stats_shm_afu *slot, stats_shm_afu *copy)
+{
+	for (int attempt = 0; attempt < 100; attempt++) {
+		uint32_t before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(copy, (const void *)slot, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == before) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/**
+ * Read the open contexts from a process's statistics segment
+ *
+ * @param sample the sample to add the contexts to
+ * @param pid the process
+ * @param path the segment
+ */
+static void read_segment(top_sample *sample, int pid, const char *path)
+{
+	if (kill(pid, 0) && errno == ESRCH) {
+		sample->stale++;
+		return;
+	}
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(stats_shm_header)) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return;
+	}
+
+	const stats_shm_header *header = map;
+	if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != STATS_SHM_MAGIC) {
+		// Still being created
+		munmap(map, st.st_size);
+		return;
+	}
+
+	// Later versions of the same layout may extend the header & slots, but not shrink them
+	if (header->version != STATS_SHM_VERSION ||
+	    header->header_size < sizeof(stats_shm_header) || header->slot_size < sizeof(stats_shm_afu) ||
+	    header->header_size + (uint64_t)header->slot_count * header->slot_size > (uint64_t)st.st_size) {
+		sample->incompatible++;
+		munmap(map, st.st_size);
+		return;
+	}
+
+	sample->processes++;
+	sample->unpublished += header->contexts_unpublished;
+	uint64_t updated_ns = __atomic_load_n(&header->updated_ns, __ATOMIC_ACQUIRE);
+
+	for (uint32_t index = 0; index < header->slot_count; index++) {
+		const stats_shm_afu *slot = (const stats_shm_afu *)((const char *)map + header->header_size +
+		                            (size_t)index * header->slot_size);
+		stats_shm_afu copy;
+
+		if (!__atomic_load_n(&slot->in_use, __ATOMIC_RELAXED) || !copy_slot(slot, &copy) || !copy.in_use) {
+			continue;
+		}
+
+		top_context *contexts = realloc(sample->contexts, (sample->context_count + 1) * sizeof(top_context));
+		if (!contexts) {
+			break;
+		}
+		sample->contexts = contexts;
+
+		top_context *context = &sample->contexts[sample->context_count++];
+		memset(context, 0, sizeof(*context));
+		context->pid = pid;
+		memcpy(context->comm, header->comm, sizeof(context->comm));
+		context->comm[sizeof(context->comm) - 1] = '\0';
+		context->slot = index;
+		context->updated_ns = updated_ns;
+		context->stats = copy;
+		context->stats.device[sizeof(context->stats.device) - 1] = '\0';
+	}
+
+	munmap(map, st.st_size);
+}
+
+/**
+ * Find the statistics segments of all processes
+ *
+ * @param sample the sample to add the contexts to
+ */
+static void scan_processes(top_sample *sample)
+{
+	DIR *dir = opendir(shm_dir);
+	if (!dir) {
+		return;
+	}
+
+	size_t prefix_len = strlen(STATS_SHM_PREFIX);
+	struct dirent *entry;
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, STATS_SHM_PREFIX, prefix_len)) {
+			continue;
+		}
+
+		char *end;
+		long pid = strtol(entry->d_name + prefix_len, &end, 10);
+		if (*end || pid <= 0) {
+			continue;
+		}
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", shm_dir, entry->d_name);
+		read_segment(sample, pid, path);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * Derive the rates of each context from its previous sample
+ *
+ * @param sample the current sample
+ * @param previous the previous sample
+ */
+static void derive_rates(top_sample *sample, const top_sample *previous)
+{
+	for (size_t i = 0; i < sample->context_count; i++) {
+		top_context *context = &sample->contexts[i];
+
+		for (size_t j = 0; j < previous->context_count; j++) {
+			const top_context *before = &previous->contexts[j];
+			if (before->pid != context->pid || before->slot != context->slot ||
+			    before->stats.generation != context->stats.generation) {
+				continue;
+			}
+
+			if (context->updated_ns <= before->updated_ns) {
+				// Not updated by the process since the last refresh
+				context->have_rates = before->have_rates;
+				context->irqs = before->irqs;
+				context->faults = before->faults;
+				context->events = before->events;
+				context->mmio_reads = before->mmio_reads;
+				context->mmio_writes = before->mmio_writes;
+				context->wait_us = before->wait_us;
+				break;
+			}
+
+			const stats_shm_afu *now = &context->stats, *then = &before->stats;
+			double seconds = (context->updated_ns - before->updated_ns) / 1e9;
+
+			context->have_rates = true;
+			context->irqs = (now->irqs_fired - then->irqs_fired) / seconds;
+			context->faults = (now->fault_events - then->fault_events) / seconds;
+			context->events = (now->irq_events + now->fault_events - then->irq_events - then->fault_events) / seconds;
+			context->mmio_reads = (now->mmio_reads[0] + now->mmio_reads[1] -
+			                       then->mmio_reads[0] - then->mmio_reads[1]) / seconds;
+			context->mmio_writes = (now->mmio_writes[0] + now->mmio_writes[1] -
+			                        then->mmio_writes[0] - then->mmio_writes[1]) / seconds;
+			uint64_t waits = now->event_waits - then->event_waits;
+			context->wait_us = waits ? (now->event_wait_ns - then->event_wait_ns) / 1e3 / waits : -1;
+			break;
+		}
+	}
+}
+
+static double activity(const top_context *context)
+{
+	return context->irqs + context->faults + context->mmio_reads + context->mmio_writes;
+}
+
+/* Group contexts by card, the busiest first */
+static int compare_contexts(const void *a, const void *b)
+{
+	const top_context *ca = a, *cb = b;
+	int ret = strcmp(ca->stats.device, cb->stats.device);
+
+	if (ret) {
+		return ret;
+	}
+	if (activity(ca) != activity(cb)) {
+		return activity(ca) < activity(cb) ? 1 : -1;
+	}
+
+	return ca->pid - cb->pid;
+}
+
+/**
+ * Format a rate compactly, eg. 12.3k
+ */
+static const char *format_rate(char *buf, size_t size, bool valid, double rate)
+{
+	if (!valid) {
+		snprintf(buf, size, "-");
+	} else if (rate >= 1e9) {
+		snprintf(buf, size, "%.1fG", rate / 1e9);
+	} else if (rate >= 1e6) {
+		snprintf(buf, size, "%.1fM", rate / 1e6);
+	} else if (rate >= 1e4) {
+		snprintf(buf, size, "%.1fk", rate / 1e3);
+	} else {
+		snprintf(buf, size, "%.0f", rate);
+	}
+
+	return buf;
+}
+
+static void print_sample(const top_sample *sample, double delay)
+{
+	char irqs[16], faults[16], events[16], reads[16], writes[16], wait[16];
+
+	printf("ocxl-top - %zu processes, %zu contexts, %zu cards, refreshing every %.1fs\n",
+	       sample->processes, sample->context_count, sample->card_count, delay);
+	if (sample->unpublished) {
+		printf("%llu contexts not shown, their processes have too many open\n",
+		       (unsigned long long)sample->unpublished);
+	}
+	if (sample->stale || sample->incompatible) {
+		printf("Ignored %zu segments of exited processes, %zu of incompatible versions\n",
+		       sample->stale, sample->incompatible);
+	}
+
+	printf("\n%-40s %10s %6s %8s %8s %10s %10s\n",
+	       "CARD", "CONTEXTS", "PROCS", "IRQ/s", "FAULT/s", "MMIO RD/s", "MMIO WR/s");
+
+	// Cards known to sysfs, then those only seen in the processes' statistics
+	for (size_t pass = 0; pass < 2; pass++) {
+		size_t count = pass ? sample->context_count : sample->card_count;
+
+		for (size_t i = 0; i < count; i++) {
+			const char *device = pass ? sample->contexts[i].stats.device : sample->cards[i].device;
+			char contexts[24] = "-";
+
+			if (pass) {
+				bool seen = (i > 0 && !strcmp(device, sample->contexts[i - 1].stats.device));
+				for (size_t card = 0; !seen && card < sample->card_count; card++) {
+					seen = !strcmp(device, sample->cards[card].device);
+				}
+				if (seen) {
+					continue;
+				}
+			} else if (sample->cards[i].contexts >= 0 && sample->cards[i].max_contexts >= 0) {
+				snprintf(contexts, sizeof(contexts), "%d/%d",
+				         sample->cards[i].contexts, sample->cards[i].max_contexts);
+			}
+
+			size_t processes = 0;
+			bool have_rates = false;
+			double irq_rate = 0, fault_rate = 0, read_rate = 0, write_rate = 0;
+			for (size_t c = 0; c < sample->context_count; c++) {
+				const top_context *context = &sample->contexts[c];
+				if (strcmp(context->stats.device, device)) {
+					continue;
+				}
+
+				bool counted = false;
+				for (size_t other = 0; other < c && !counted; other++) {
+					counted = (sample->contexts[other].pid == context->pid &&
+					           !strcmp(sample->contexts[other].stats.device, device));
+				}
+				processes += !counted;
+
+				have_rates |= context->have_rates;
+				irq_rate += context->irqs;
+				fault_rate += context->faults;
+				read_rate += context->mmio_reads;
+				write_rate += context->mmio_writes;
+			}
+
+			printf("%-40s %10s %6zu %8s %8s %10s %10s\n", device, contexts, processes,
+			       format_rate(irqs, sizeof(irqs), have_rates, irq_rate),
+			       format_rate(faults, sizeof(faults), have_rates, fault_rate),
+			       format_rate(reads, sizeof(reads), have_rates, read_rate),
+			       format_rate(writes, sizeof(writes), have_rates, write_rate));
+		}
+	}
+
+	printf("\n%-7s %-15s %-32s %6s %4s %8s %8s %8s %10s %10s %9s\n",
+	       "PID", "COMMAND", "DEVICE", "PASID", "THR", "IRQ/s", "FAULT/s", "EVENT/s",
+	       "MMIO RD/s", "MMIO WR/s", "WAIT(us)");
+
+	for (size_t i = 0; i < sample->context_count; i++) {
+		const top_context *context = &sample->contexts[i];
+		char pasid[16] = "-";
+
+		if (context->stats.attached) {
+			snprintf(pasid, sizeof(pasid), "%u", context->stats.pasid);
+		}
+		if (context->have_rates && context->wait_us >= 0) {
+			snprintf(wait, sizeof(wait), "%.1f", context->wait_us);
+		} else {
+			snprintf(wait, sizeof(wait), "-");
+		}
+
+		printf("%-7d %-15s %-32s %6s %4llu %8s %8s %8s %10s %10s %9s\n",
+		       context->pid, context->comm, context->stats.device, pasid,
+		       (unsigned long long)context->stats.threads,
+		       format_rate(irqs, sizeof(irqs), context->have_rates, context->irqs),
+		       format_rate(faults, sizeof(faults), context->have_rates, context->faults),
+		       format_rate(events, sizeof(events), context->have_rates, context->events),
+		       format_rate(reads, sizeof(reads), context->have_rates, context->mmio_reads),
+		       format_rate(writes, sizeof(writes), context->have_rates, context->mmio_writes),
+		       wait);
+	}
+}
+
+static void free_sample(top_sample *sample)
+{
+	free(sample->cards);
+	free(sample->contexts);
+	memset(sample, 0, sizeof(*sample));
+}
+
+int main(int argc, char **argv)
+{
+	double delay = 1;
+	long iterations = -1;
+	bool batch = false;
+
+	sys_path = getenv("LIBOCXL_SYSPATH");
+	if (!sys_path) {
+		sys_path = SYS_PATH_DEFAULT;
+	}
+
+	struct option options[] = {
+		{ "delay", required_argument, 0, 'd' },
+		{ "iterations", required_argument, 0, 'n' },
+		{ "batch", no_argument, 0, 'b' },
+		{ "sysfs", required_argument, 0, 's' },
+		{ "shm", required_argument, 0, 'm' },
+		{ "help", no_argument, 0, 'h' },
+		{ NULL, 0, 0, 0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "d:n:bs:m:h", options, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			delay = atof(optarg);
+			if (delay <= 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			iterations = atol(optarg);
+			if (iterations <= 0) {
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			batch = true;
+			break;
+		case 's':
+			sys_path = optarg;
+			break;
+		case 'm':
+			shm_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!isatty(STDOUT_FILENO)) {
+		batch = true;
+	}
+
+	top_sample previous = { 0 };
+	struct timespec interval = {
+		.tv_sec = (time_t)delay,
+		.tv_nsec = (long)((delay - (time_t)delay) * 1e9),
+	};
+
+	for (long iteration = 0; iterations < 0 || iteration < iterations; iteration++) {
+		top_sample sample = { 0 };
+
+		if (iteration) {
+			nanosleep(&interval, NULL);
+		}
+
+		scan_cards(&sample);
+		scan_processes(&sample);
+		derive_rates(&sample, &previous);
+		qsort(sample.contexts, sample.context_count, sizeof(top_context), compare_contexts);
+
+		if (batch) {
+			if (iteration) {
+				printf("\n");
+			}
+		} else {
+			// Redraw from the top left of a cleared screen
+			printf("\033[H\033[2J");
+		}
+		print_sample(&sample, delay);
+		fflush(stdout);
+
+		free_sample(&previous);
+		previous = sample;
+	}
+
+	free_sample(&previous);
+
+	return 0;
+}
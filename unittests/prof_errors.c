@@ -0,0 +1,61 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Calls the library's error paths with invalid handles, so that run with the profiler preloaded,
+ * it checks that the wrappers pass the errors through, rather than dereferencing the handles.
+ */
+
+#include <libocxl.h>
+#include <stdio.h>
+
+static int failures = 0;
+
+static void expect(const char *call, ocxl_err rc, ocxl_err expected)
+{
+	if (rc != expected) {
+		fprintf(stderr, "%s returned %s, expected %s\n", call,
+		        ocxl_err_to_string(rc), ocxl_err_to_string(expected));
+		failures++;
+	}
+}
+
+int main(void)
+{
+	uint32_t value32;
+	uint64_t value64;
+	off_t reg = 0;
+	ocxl_sampler_h sampler;
+	ocxl_afu_h afu;
+
+	ocxl_enable_messages(0);
+
+	expect("ocxl_mmio_read32", ocxl_mmio_read32(NULL, 0, OCXL_MMIO_HOST_ENDIAN, &value32), OCXL_INVALID_ARGS);
+	expect("ocxl_mmio_read64", ocxl_mmio_read64(NULL, 0, OCXL_MMIO_HOST_ENDIAN, &value64), OCXL_INVALID_ARGS);
+	expect("ocxl_mmio_write32", ocxl_mmio_write32(NULL, 0, OCXL_MMIO_HOST_ENDIAN, 0), OCXL_INVALID_ARGS);
+	expect("ocxl_mmio_write64", ocxl_mmio_write64(NULL, 0, OCXL_MMIO_HOST_ENDIAN, 0), OCXL_INVALID_ARGS);
+	expect("ocxl_sampler_start", ocxl_sampler_start(NULL, &reg, 1, OCXL_MMIO_HOST_ENDIAN, 1000, 16, &sampler),
+	       OCXL_INVALID_ARGS);
+	ocxl_sampler_stop(NULL);
+	expect("ocxl_afu_open_from_dev", ocxl_afu_open_from_dev("/nonexistent/afu", &afu), OCXL_NO_DEV);
+
+	if (failures) {
+		return 1;
+	}
+
+	printf("All profiled error paths returned their errors\n");
+	return 0;
+}
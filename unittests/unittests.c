@@ -16,6 +16,7 @@
 
 #include "libocxl_internal.h"
 #include <unistd.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <sys/types.h>
@@ -25,11 +26,19 @@
 #include <pthread.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <misc/ocxl.h>
 #include "static.h"
+#include "virtocxl.h"
+#include "../afutests/afp/ocxl_afp3.h"
 
 static const char *ocxl_sysfs_path = "/tmp/ocxl-test";
-static const char *ocxl_dev_path = "/dev/ocxl-test";
+#define DUMMY_DEVICE "IBM,Dummy.0001:00:00.1.0"
+static char dummy_dev_path[PATH_MAX];
 
 #define MAX_TESTS 1024
 #define TEST_NAME_LEN	32
@@ -73,17 +82,6 @@ int current_test = -1;
 } while(0)
 
 
-// virtocxl functions
-pthread_t create_ocxl_device(const char *afu_name, size_t global_mmio_size, size_t per_pasid_mmio_size);
-void stop_afu();
-void term_afu();
-#ifdef _ARCH_PPC64
-void force_translation_fault(void *addr, uint64_t dsisr, uint64_t count);
-#else
-void force_translation_fault(void *addr, uint64_t dsisr);
-#endif
-bool afu_is_attached();
-
 /**
  * Start a test
  * @param suite the name of the test suite
@@ -259,15 +257,15 @@ end:
 	closedir(dev_dir);
 }
 
-pthread_t afu_thread = 0;
+virtocxl_device *afu_device = NULL;
 
 /**
  * Create the virtual AFU
- * @post afu_thread is set and must be joined
+ * @post afu_device is set and must be destroyed
  */
 static void create_afu() {
-	afu_thread = create_ocxl_device("IBM,Dummy", GLOBAL_MMIO_SIZE, PER_PASID_MMIO_SIZE);
-	if (!afu_thread) {
+	afu_device = create_ocxl_device("IBM,Dummy", GLOBAL_MMIO_SIZE, PER_PASID_MMIO_SIZE);
+	if (!afu_device || virtocxl_devices_wait(&afu_device, 1, 5000)) {
 		fprintf(stderr, "Could not create dummy AFU\n");
 		exit(1);
 	}
@@ -280,7 +278,7 @@ static void test_populate_metadata() {
 	test_start("AFU", "populate_metadata");
 
 	struct stat dev_stat;
-	ASSERT(!stat("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &dev_stat));
+	ASSERT(!stat(dummy_dev_path, &dev_stat));
 
 	ocxl_afu afu;
 	afu_init(&afu);
@@ -288,7 +286,7 @@ static void test_populate_metadata() {
 	ASSERT(populate_metadata(dev_stat.st_rdev, &afu));
 	ASSERT(!strcmp(afu.identifier.afu_name, "IBM,Dummy"));
 	ASSERT(afu.identifier.afu_index == 0);
-	ASSERT(!strcmp(afu.device_path, "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(afu.device_path, dummy_dev_path));
 	ASSERT(!strcmp(afu.sysfs_path, "/tmp/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
 
 	test_stop(SUCCESS);
@@ -312,18 +310,18 @@ static void test_get_afu_by_path() {
 	ASSERT(0 == afu);
 
 	afu = 0;
-	ASSERT(OCXL_OK == get_afu_by_path("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == get_afu_by_path(dummy_dev_path, &afu));
 	ASSERT(afu != 0);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 	ocxl_afu_close(afu);
 
 	afu = 0;
 
-	ASSERT(0 == symlink("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", symlink_path));
+	ASSERT(0 == symlink(dummy_dev_path, symlink_path));
 
 	ASSERT(OCXL_OK == get_afu_by_path(symlink_path, &afu));
 	ASSERT(afu != 0);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 
 	test_stop(SUCCESS);
 
@@ -344,7 +342,7 @@ static void test_afu_open() {
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
 
-	ASSERT(OCXL_OK == get_afu_by_path("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == get_afu_by_path(dummy_dev_path, &afu));
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 	ASSERT(my_afu->fd == -1);
 	ASSERT(my_afu->epoll_fd == -1);
@@ -382,13 +380,13 @@ static void test_ocxl_afu_open_specific() {
 	ocxl_enable_messages(OCXL_ERRORS);
 	ASSERT(OCXL_OK == ocxl_afu_open_specific("IBM,Dummy", "0001:00:00.1", 0, &afu));
 	ASSERT(afu != OCXL_INVALID_AFU);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 	ocxl_afu_close(afu);
 	afu = OCXL_INVALID_AFU;
 
 	ASSERT(OCXL_OK == ocxl_afu_open_specific("IBM,Dummy", "0001:00:00.1", -1, &afu));
 	ASSERT(afu != OCXL_INVALID_AFU);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 	ASSERT(my_afu->version_major == 5);
@@ -418,11 +416,11 @@ static void test_ocxl_afu_open_from_dev() {
 	ASSERT(OCXL_NO_DEV == ocxl_afu_open_from_dev("/nonexistent", &afu));
 	ocxl_enable_messages(OCXL_ERRORS);
 
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 	ASSERT(my_afu->fd != -1);
 	ASSERT(my_afu->epoll_fd != -1);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 
 	test_stop(SUCCESS);
 
@@ -444,7 +442,7 @@ static void test_afu_getters() {
 	const ocxl_identifier *identifier = ocxl_afu_get_identifier(afu);
 	ASSERT(identifier->afu_index == 0);
 	ASSERT(!strcmp(identifier->afu_name, "IBM,Dummy"));
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 	char expected_path[PATH_MAX];
 	snprintf(expected_path, sizeof(expected_path), "%s/IBM,Dummy.0001:00:00.1.0", ocxl_sysfs_path);
 	ASSERT(!strcmp(ocxl_afu_get_sysfs_path(afu), expected_path));
@@ -483,7 +481,7 @@ static void test_ocxl_afu_open() {
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 	ASSERT(my_afu->fd != -1);
 	ASSERT(my_afu->epoll_fd != -1);
-	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), "/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0"));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afu), dummy_dev_path));
 
 	test_stop(SUCCESS);
 
@@ -503,7 +501,7 @@ static void test_ocxl_afu_attach() {
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
 
 	ASSERT(!afu_is_attached());
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
 	ASSERT(afu_is_attached());
@@ -523,7 +521,7 @@ static void test_ocxl_afu_close() {
 	test_start("AFU", "ocxl_afu_close");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 	ASSERT(OCXL_OK == ocxl_afu_close(afu));
 	ASSERT(afu != 0);
@@ -548,6 +546,295 @@ end:
 	}
 }
 
+/* A backend which counts the operations made through it, passing them on to the kernel backend */
+static const ocxl_backend_ops *counted_backend;
+static struct {
+	uint64_t open;
+	uint64_t close;
+	uint64_t read;
+	uint64_t ioctl;
+	uint64_t mmap;
+	uint64_t munmap;
+	uint64_t stat;
+	uint64_t eventfd;
+	uint64_t epoll;
+} backend_counts;
+
+static int counting_open(const char *path, int flags) {
+	backend_counts.open++;
+	return counted_backend->open(path, flags);
+}
+
+static int counting_close(int fd) {
+	backend_counts.close++;
+	return counted_backend->close(fd);
+}
+
+static ssize_t counting_read(int fd, void *buf, size_t count) {
+	backend_counts.read++;
+	return counted_backend->read(fd, buf, count);
+}
+
+static int counting_ioctl(int fd, unsigned long request, void *arg) {
+	backend_counts.ioctl++;
+	return counted_backend->ioctl(fd, request, arg);
+}
+
+static void *counting_mmap(void *addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	backend_counts.mmap++;
+	return counted_backend->mmap(addr, length, prot, flags, fd, offset);
+}
+
+static int counting_munmap(void *addr, size_t length) {
+	backend_counts.munmap++;
+	return counted_backend->munmap(addr, length);
+}
+
+static int counting_stat(const char *path, struct stat *buf) {
+	backend_counts.stat++;
+	return counted_backend->stat(path, buf);
+}
+
+static int counting_fstatat(int dirfd, const char *path, struct stat *buf, int flags) {
+	backend_counts.stat++;
+	return counted_backend->fstatat(dirfd, path, buf, flags);
+}
+
+static int counting_eventfd(unsigned int initval, int flags) {
+	backend_counts.eventfd++;
+	return counted_backend->eventfd(initval, flags);
+}
+
+static int counting_epoll_create1(int flags) {
+	backend_counts.epoll++;
+	return counted_backend->epoll_create1(flags);
+}
+
+static int counting_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	backend_counts.epoll++;
+	return counted_backend->epoll_ctl(epfd, op, fd, event);
+}
+
+static int counting_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout) {
+	backend_counts.epoll++;
+	return counted_backend->epoll_wait(epfd, events, maxevents, timeout);
+}
+
+static const ocxl_backend_ops counting_backend = {
+	.size = sizeof(ocxl_backend_ops),
+	.name = "counting",
+	.open = counting_open,
+	.close = counting_close,
+	.read = counting_read,
+	.ioctl = counting_ioctl,
+	.mmap = counting_mmap,
+	.munmap = counting_munmap,
+	.stat = counting_stat,
+	.fstatat = counting_fstatat,
+	.eventfd = counting_eventfd,
+	.epoll_create1 = counting_epoll_create1,
+	.epoll_ctl = counting_epoll_ctl,
+	.epoll_wait = counting_epoll_wait,
+};
+
+/**
+ * Check that device operations are made through the selected backend
+ */
+static void test_backend() {
+	test_start("AFU", "backend");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_afu_h kernel_afu = OCXL_INVALID_AFU;
+	ocxl_backend_ops incomplete = counting_backend;
+	ocxl_mmio_h pp_mmio;
+	ocxl_irq_h irq;
+	ocxl_event event;
+
+	ASSERT(!strcmp(ocxl_backend_get_name(), "kernel"));
+	counted_backend = current_backend;
+
+	incomplete.name = "incomplete";
+	incomplete.epoll_wait = NULL;
+	ASSERT(OCXL_INVALID_ARGS == ocxl_backend_register(&incomplete));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_backend_register(NULL));
+
+	// Backends built without a size, or against a smaller table, are rejected
+	incomplete = counting_backend;
+	incomplete.name = "unsized";
+	incomplete.size = 0;
+	ASSERT(OCXL_INVALID_ARGS == ocxl_backend_register(&incomplete));
+	incomplete.size = offsetof(ocxl_backend_ops, epoll_wait);
+	ASSERT(OCXL_INVALID_ARGS == ocxl_backend_register(&incomplete));
+
+	// Backends built against a larger table are copied, up to the operations the library knows
+	struct {
+		ocxl_backend_ops ops;
+		void *later_ops[4];
+	} larger = { .ops = counting_backend, .later_ops = { NULL } };
+	larger.ops.name = "larger";
+	larger.ops.size = sizeof(larger);
+	ASSERT(OCXL_OK == ocxl_backend_register(&larger.ops));
+	memset(&larger, 0xff, sizeof(larger));
+	ASSERT(OCXL_OK == ocxl_backend_select("larger"));
+	ASSERT(!strcmp(ocxl_backend_get_name(), "larger"));
+	ASSERT(current_backend->size == sizeof(ocxl_backend_ops));
+	ASSERT(current_backend->epoll_wait == counting_epoll_wait);
+	ASSERT(OCXL_OK == ocxl_backend_select("kernel"));
+
+	ASSERT(OCXL_OK == ocxl_backend_register(&counting_backend));
+	ASSERT(OCXL_ALREADY_DONE == ocxl_backend_register(&counting_backend));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_backend_select("incomplete"));
+	ASSERT(!strcmp(ocxl_backend_get_name(), "kernel"));
+
+	ASSERT(OCXL_OK == ocxl_backend_select("counting"));
+	ASSERT(!strcmp(ocxl_backend_get_name(), "counting"));
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
+	ASSERT(backend_counts.stat >= 2); // The device itself, and the scan for its name
+	ASSERT(backend_counts.open == 2); // The device, and the global MMIO area
+	ASSERT(backend_counts.epoll == 2);
+	ASSERT(backend_counts.ioctl == 1);
+
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(backend_counts.ioctl == 2);
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &pp_mmio));
+	ASSERT(backend_counts.mmap == 1);
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	ASSERT(backend_counts.eventfd == 1);
+	ASSERT(backend_counts.ioctl == 4);
+	ASSERT(backend_counts.mmap == 2);
+	ASSERT(backend_counts.epoll == 3);
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, &event, 1));
+	ASSERT(backend_counts.epoll == 4);
+
+	// AFUs keep the backend they were opened with
+	ASSERT(OCXL_OK == ocxl_backend_select("kernel"));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &kernel_afu));
+	ASSERT(backend_counts.open == 2);
+	ASSERT(OCXL_OK == ocxl_afu_close(kernel_afu));
+	kernel_afu = OCXL_INVALID_AFU;
+
+	ASSERT(OCXL_OK == ocxl_afu_close(afu));
+	afu = OCXL_INVALID_AFU;
+	ASSERT(backend_counts.munmap == 2);
+	ASSERT(backend_counts.close == 4); // The IRQ eventfd, global MMIO, epoll & the device
+
+	// LIBOCXL_BACKEND does not override an explicit selection
+	backend_init("counting");
+	ASSERT(!strcmp(ocxl_backend_get_name(), "kernel"));
+
+	test_stop(SUCCESS);
+
+end:
+	if (kernel_afu) {
+		ocxl_afu_close(kernel_afu);
+	}
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	ocxl_backend_select("kernel");
+}
+
+/**
+ * Get the number of system calls made through the counting backend
+ */
+static uint64_t backend_syscalls() {
+	return backend_counts.open + backend_counts.close + backend_counts.read + backend_counts.ioctl +
+	       backend_counts.mmap + backend_counts.munmap + backend_counts.stat + backend_counts.eventfd +
+	       backend_counts.epoll;
+}
+
+/**
+ * Check the system calls made by an operation against its budget
+ *
+ * @param operation the name of the operation
+ * @param before the count of system calls before the operation
+ * @param budget the most system calls the operation may make
+ * @return true if the operation was within budget
+ */
+static bool within_budget(const char *operation, uint64_t before, uint64_t budget) {
+	uint64_t used = backend_syscalls() - before;
+
+	if (used > budget) {
+		fprintf(stderr, "%s made %llu system calls, its budget is %llu\n",
+		        operation, (unsigned long long)used, (unsigned long long)budget);
+	}
+
+	return used <= budget;
+}
+
+/*
+ * Allocation tracking: the library's heap calls are redirected to these functions when
+ * testobj/libocxl.a is built (see ALLOCATION_TRACKING_SYMS), so they can be counted
+ * without counting those of the tests or the virtual devices. Any thread may make them.
+ */
+bool tracking_allocations;
+uint64_t tracked_allocations;
+
+static void allocation_track() {
+	if (__atomic_load_n(&tracking_allocations, __ATOMIC_RELAXED)) {
+		__atomic_fetch_add(&tracked_allocations, 1, __ATOMIC_RELAXED);
+	}
+}
+
+void *tracked_malloc(size_t size) {
+	allocation_track();
+	return malloc(size);
+}
+
+void *tracked_calloc(size_t nmemb, size_t size) {
+	allocation_track();
+	return calloc(nmemb, size);
+}
+
+void *tracked_realloc(void *ptr, size_t size) {
+	allocation_track();
+	return realloc(ptr, size);
+}
+
+void *tracked_aligned_alloc(size_t alignment, size_t size) {
+	allocation_track();
+	return aligned_alloc(alignment, size);
+}
+
+int tracked_posix_memalign(void **ptr, size_t alignment, size_t size) {
+	allocation_track();
+	return posix_memalign(ptr, alignment, size);
+}
+
+void tracked_free(void *ptr) {
+	if (ptr) {
+		allocation_track();
+	}
+	free(ptr);
+}
+
+/**
+ * Start counting the library's heap calls
+ */
+static void allocations_start() {
+	tracked_allocations = 0;
+	tracking_allocations = true;
+}
+
+/**
+ * Stop counting the library's heap calls, and check an operation made none
+ *
+ * @param operation the name of the operation
+ * @return true if the operation made no heap calls
+ */
+static bool allocations_none(const char *operation) {
+	tracking_allocations = false;
+
+	if (tracked_allocations) {
+		fprintf(stderr, "%s made %llu heap allocations or frees, expected none\n",
+		        operation, (unsigned long long)tracked_allocations);
+	}
+
+	return tracked_allocations == 0;
+}
+
 /**
  * Check ocxl_mmio_map/unmap
  */
@@ -555,7 +842,7 @@ static void test_ocxl_mmio_map() {
 	test_start("MMIO", "ocxl_mmio_map/unmap");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 
@@ -574,7 +861,7 @@ static void test_ocxl_mmio_map() {
 
 	ocxl_mmio_unmap(global_mmio);
 	ASSERT(my_afu->global_mmio_fd != -1); // FD left open for further use
-	ASSERT(my_afu->mmios[0].start == NULL);
+	ASSERT(my_afu->mmios[0]->start == NULL);
 
 	ASSERT(OCXL_OK == ocxl_afu_close(afu));
 	ASSERT(my_afu->global_mmio_fd == -1);
@@ -596,7 +883,7 @@ static void test_mmio_check() {
 	test_start("MMIO", "mmio_check");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 
 	ASSERT(my_afu->global_mmio_fd != -1);
@@ -630,7 +917,7 @@ static void test_ocxl_mmio_read32_native() {
 	test_start("MMIO", "ocxl_mmio_read32/write32_native");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 
 	ocxl_mmio_h global_mmio;
@@ -670,7 +957,7 @@ static void test_ocxl_mmio_read64_native() {
 	test_start("MMIO", "ocxl_mmio_read64/write64_native");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 
 	ocxl_mmio_h global_mmio;
@@ -709,7 +996,7 @@ static void test_ocxl_mmio_read32() {
 	test_start("MMIO", "ocxl_mmio_read32/write32");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 
 	ocxl_mmio_h global_mmio;
 	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_GLOBAL_MMIO, &global_mmio));
@@ -769,7 +1056,7 @@ static void test_ocxl_mmio_read64() {
 	test_start("MMIO", "ocxl_mmio_read64/write64");
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 
 	ocxl_mmio_h global_mmio;
@@ -833,7 +1120,7 @@ static void test_read_afu_event() {
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
 
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
 	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
 
@@ -887,8 +1174,6 @@ end:
 	}
 }
 
-
-#ifdef __UNUSED
 /**
  * Check ocxl_afu_event_check_versioned (with kernel events)
  */
@@ -897,8 +1182,8 @@ static void test_ocxl_afu_event_check_versioned() {
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
 
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
-	ASSERT(OCXL_OK == ocxl_afu_attach(afu, afu_attach));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
 
 #define EVENT_COUNT 5
 	ocxl_event events[EVENT_COUNT];
@@ -928,7 +1213,6 @@ end:
 		ocxl_afu_close(afu);
 	}
 }
-#endif
 
 #define MAX_MESSAGE_LENGTH 255 // From internal.c
 char err_buf[MAX_MESSAGE_LENGTH];
@@ -976,7 +1260,7 @@ static void test_ocxl_set_afu_error_message_handler() {
 	memset(err_buf, '\0', sizeof(err_buf));
 
 	ocxl_afu_h afu = OCXL_INVALID_AFU;
-	ASSERT(OCXL_OK == ocxl_afu_open_from_dev("/dev/ocxl-test/IBM,Dummy.0001:00:00.1.0", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
 	ocxl_afu *my_afu = (ocxl_afu *)afu;
 
 	ocxl_afu_set_error_message_handler(afu, copy_to_err_buf_afu);
@@ -995,67 +1279,2467 @@ end:
 	}
 }
 
-static void exit_handler() {
-	void *ret;
+#define MEMCPY3_QUEUE_SIZE	4096
+#define MEMCPY3_QUEUE_LENGTH	(MEMCPY3_QUEUE_SIZE / sizeof(memcpy3_work_element))
 
-	if (afu_thread) {
-		stop_afu();
-		pthread_kill(afu_thread, SIGTERM);
-		pthread_join(afu_thread, &ret);
-		term_afu();
+/**
+ * A host side MEMCPY3 work queue
+ */
+typedef struct memcpy3_queue {
+	memcpy3_work_element *queue;
+	uint32_t length;
+	uint32_t next;
+	uint8_t wrap;
+} memcpy3_queue;
+
+/**
+ * Add a work element to the queue & mark it valid
+ * @param queue the queue
+ * @param cmd the command
+ * @param length the length field of the element
+ * @param src the source address (or IRQ handle)
+ * @param dst the destination address
+ * @return the work element in the queue
+ */
+static memcpy3_work_element *memcpy3_submit(memcpy3_queue *queue, uint8_t cmd, uint16_t length,
+        uint64_t src, uint64_t dst) {
+	memcpy3_work_element *we = queue->queue + queue->next;
+
+	we->status = 0;
+	we->length = htole16(length);
+	we->src = htole64(src);
+	we->dst = htole64(dst);
+	__sync_synchronize();
+	we->cmd = MEMCPY3_WE_CMD(1, cmd) | queue->wrap;
+
+	if (++queue->next == queue->length) {
+		queue->next = 0;
+		queue->wrap ^= MEMCPY3_WE_CMD_WRAP;
 	}
+
+	return we;
 }
 
-int main(__attribute__((unused)) int args, __attribute__((unused)) const char **argv) {
-	struct sigaction sa;
-	sa.sa_handler = exit_handler;
-	sigemptyset(&(sa.sa_mask));
-	sa.sa_flags = 0;
-	(void)sigaction(SIGINT, &sa, NULL);
+uint64_t memcpy3_irq_handle;
+int memcpy3_irq_count;
 
-	ocxl_set_sys_path(ocxl_sysfs_path);
-	ocxl_set_dev_path(ocxl_dev_path);
+static void memcpy3_record_irq(__attribute__((unused)) void *data, uint64_t handle) {
+	memcpy3_irq_handle = handle;
+	memcpy3_irq_count++;
+}
 
-	ocxl_enable_messages(OCXL_ERRORS);
+/**
+ * Check the MEMCPY3 model copy & increment, including queue wrap
+ */
+static void test_memcpy3_copy() {
+	test_start("MEMCPY3", "copy/increment");
 
-	struct stat sysfs_stat;
-	if (stat(ocxl_sysfs_path, &sysfs_stat)) {
-		if (mkdir(ocxl_sysfs_path, 0775)) {
-			fprintf(stderr, "Could not mkdir '%s': %d: %s\n",
-					ocxl_sysfs_path, errno, strerror(errno));
+	memcpy3_afu *afu = NULL;
+	uint64_t *pp_mmio = calloc(1, PER_PASID_MMIO_SIZE);
+	memcpy3_queue queue = {
+		.queue = aligned_alloc(MEMCPY3_QUEUE_SIZE, MEMCPY3_QUEUE_SIZE),
+		.length = MEMCPY3_QUEUE_LENGTH,
+	};
+	char src[256], dst[256];
+	uint32_t counter = htole32(41), result = 0;
+
+	ASSERT(pp_mmio && queue.queue);
+	memset(queue.queue, 0, MEMCPY3_QUEUE_SIZE);
+
+	afu = memcpy3_afu_create(pp_mmio, NULL, NULL);
+	ASSERT(afu);
+	ASSERT(0 == memcpy3_afu_step(afu));
+
+	pp_mmio[MEMCPY3_PP_WED / 8] = htole64(MEMCPY3_WED(queue.queue, MEMCPY3_QUEUE_SIZE / MEMCPY3_CACHELINESIZE));
+
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = i;
+	}
+	memset(dst, 0, sizeof(dst));
+
+	memcpy3_work_element *we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_COPY, sizeof(src),
+	                           (uintptr_t)src, (uintptr_t)dst);
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(!memcmp(src, dst, sizeof(src)));
+
+	we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_INCREMENT, sizeof(counter),
+	                    (uintptr_t)&counter, (uintptr_t)&result);
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(42 == le32toh(result));
+
+	// Go around the queue twice to exercise the wrap bit
+	for (uint32_t i = 0; i < 2 * MEMCPY3_QUEUE_LENGTH; i++) {
+		we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_INCREMENT, sizeof(counter),
+		                    (uintptr_t)&counter, (uintptr_t)&counter);
+		ASSERT(1 == memcpy3_afu_step(afu));
+		ASSERT(we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	}
+	ASSERT(41 + 2 * MEMCPY3_QUEUE_LENGTH == le32toh(counter));
+
+	// Nothing further should be consumed
+	ASSERT(0 == memcpy3_afu_step(afu));
+
+	memcpy3_afu_stats stats;
+	memcpy3_afu_get_stats(afu, &stats);
+	ASSERT(stats.elements == 2 + 2 * MEMCPY3_QUEUE_LENGTH);
+	ASSERT(stats.errors == 0);
+
+	test_stop(SUCCESS);
+
+end:
+	memcpy3_afu_free(afu);
+	free(queue.queue);
+	free(pp_mmio);
+}
+
+/**
+ * Check the MEMCPY3 model IRQ, stop & restart handling
+ */
+static void test_memcpy3_irq() {
+	test_start("MEMCPY3", "irq/restart");
+
+	memcpy3_afu *afu = NULL;
+	uint64_t *pp_mmio = calloc(1, PER_PASID_MMIO_SIZE);
+	memcpy3_queue queue = {
+		.queue = aligned_alloc(MEMCPY3_QUEUE_SIZE, MEMCPY3_QUEUE_SIZE),
+		.length = MEMCPY3_QUEUE_LENGTH,
+	};
+	char src[64], dst[64];
+
+	ASSERT(pp_mmio && queue.queue);
+	memset(queue.queue, 0, MEMCPY3_QUEUE_SIZE);
+	memcpy3_irq_count = 0;
+
+	afu = memcpy3_afu_create(pp_mmio, memcpy3_record_irq, NULL);
+	ASSERT(afu);
+
+	pp_mmio[MEMCPY3_PP_IRQ / 8] = htole64(0xfeedf000);
+	pp_mmio[MEMCPY3_PP_WED / 8] = htole64(MEMCPY3_WED(queue.queue, MEMCPY3_QUEUE_SIZE / MEMCPY3_CACHELINESIZE));
+
+	memset(src, 0xa5, sizeof(src));
+	memcpy3_work_element *copy_we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_COPY, sizeof(src),
+	                                (uintptr_t)src, (uintptr_t)dst);
+	memcpy3_work_element *irq_we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_IRQ, 0, 0xbeef000, 0);
+	memcpy3_work_element *next_we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_TRANSLATE_TOUCH, 0, 0, 0);
+
+	// The engine stops after the IRQ
+	ASSERT(2 == memcpy3_afu_step(afu));
+	ASSERT(copy_we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(irq_we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(next_we->status == 0);
+	ASSERT(memcpy3_irq_count == 1);
+	ASSERT(memcpy3_irq_handle == 0xbeef000);
+	ASSERT(le64toh(pp_mmio[MEMCPY3_PP_STATUS / 8]) & MEMCPY3_PP_STATUS_Stopped);
+	ASSERT(0 == memcpy3_afu_step(afu));
+
+	pp_mmio[MEMCPY3_PP_CTRL / 8] = htole64(MEMCPY3_PP_CTRL_Restart);
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(next_we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(!(le64toh(pp_mmio[MEMCPY3_PP_STATUS / 8]) & MEMCPY3_PP_STATUS_Stopped));
+	ASSERT(pp_mmio[MEMCPY3_PP_CTRL / 8] == 0);
+
+	// Invalid commands raise the error IRQ
+	memcpy3_work_element *bad_we = memcpy3_submit(&queue, 0x3f, 0, 0, 0);
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(bad_we->status == MEMCPY3_WE_STATUS_ERROR);
+	ASSERT(memcpy3_irq_count == 2);
+	ASSERT(memcpy3_irq_handle == 0xfeedf000);
+	ASSERT(le64toh(pp_mmio[MEMCPY3_PP_STATUS / 8]) & MEMCPY3_PP_STATUS_Stopped);
+
+	pp_mmio[MEMCPY3_PP_CTRL / 8] = htole64(MEMCPY3_PP_CTRL_Terminate);
+	ASSERT(0 == memcpy3_afu_step(afu));
+	ASSERT(le64toh(pp_mmio[MEMCPY3_PP_STATUS / 8]) & MEMCPY3_PP_STATUS_Terminated);
+
+	test_stop(SUCCESS);
+
+end:
+	memcpy3_afu_free(afu);
+	free(queue.queue);
+	free(pp_mmio);
+}
+
+/**
+ * Check the MEMCPY3 model compare and swap
+ */
+static void test_memcpy3_atomic_cas() {
+	test_start("MEMCPY3", "atomic_cas");
+
+	memcpy3_afu *afu = NULL;
+	uint64_t *pp_mmio = calloc(1, PER_PASID_MMIO_SIZE);
+	memcpy3_queue queue = {
+		.queue = aligned_alloc(MEMCPY3_QUEUE_SIZE, MEMCPY3_QUEUE_SIZE),
+		.length = MEMCPY3_QUEUE_LENGTH,
+	};
+	uint64_t lock = 0;
+
+	ASSERT(pp_mmio && queue.queue);
+	memset(queue.queue, 0, MEMCPY3_QUEUE_SIZE);
+
+	afu = memcpy3_afu_create(pp_mmio, NULL, NULL);
+	ASSERT(afu);
+	pp_mmio[MEMCPY3_PP_WED / 8] = htole64(MEMCPY3_WED(queue.queue, MEMCPY3_QUEUE_SIZE / MEMCPY3_CACHELINESIZE));
+
+	for (int i = 0; i < 2; i++) {
+		memcpy3_work_element *we = queue.queue + queue.next;
+		we->atomic_op = htole64(0);
+		we->cmd_extra = 0x19;
+		memcpy3_submit(&queue, MEMCPY3_WE_CMD_ATOMIC, sizeof(lock), 1, (uintptr_t)&lock);
+	}
+
+	// The first acquires the lock, the second spins on it
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(le64toh(lock) == 1);
+	ASSERT(queue.queue[0].status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(0 == memcpy3_afu_step(afu));
+	ASSERT(queue.queue[1].status == 0);
+
+	lock = 0;
+	ASSERT(1 == memcpy3_afu_step(afu));
+	ASSERT(queue.queue[1].status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(le64toh(lock) == 1);
+
+	memcpy3_afu_stats stats;
+	memcpy3_afu_get_stats(afu, &stats);
+	ASSERT(stats.cas_retries == 2);
+
+	test_stop(SUCCESS);
+
+end:
+	memcpy3_afu_free(afu);
+	free(queue.queue);
+	free(pp_mmio);
+}
+
+/**
+ * Check the MEMCPY3 model when driven from its own thread
+ */
+static void test_memcpy3_thread() {
+	test_start("MEMCPY3", "thread");
+
+	memcpy3_afu *afu = NULL;
+	uint64_t *pp_mmio = calloc(1, PER_PASID_MMIO_SIZE);
+	memcpy3_queue queue = {
+		.queue = aligned_alloc(MEMCPY3_QUEUE_SIZE, MEMCPY3_QUEUE_SIZE),
+		.length = MEMCPY3_QUEUE_LENGTH,
+	};
+	uint32_t counter = 0;
+
+	ASSERT(pp_mmio && queue.queue);
+	memset(queue.queue, 0, MEMCPY3_QUEUE_SIZE);
+
+	afu = memcpy3_afu_create(pp_mmio, NULL, NULL);
+	ASSERT(afu);
+	ASSERT(0 == memcpy3_afu_start(afu));
+	pp_mmio[MEMCPY3_PP_WED / 8] = htole64(MEMCPY3_WED(queue.queue, MEMCPY3_QUEUE_SIZE / MEMCPY3_CACHELINESIZE));
+
+	for (int i = 0; i < 1000; i++) {
+		memcpy3_work_element *we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_INCREMENT, sizeof(counter),
+		                           (uintptr_t)&counter, (uintptr_t)&counter);
+		while (!__atomic_load_n(&we->status, __ATOMIC_ACQUIRE)) {
+			;
 		}
+		ASSERT(we->status == MEMCPY3_WE_STATUS_COMPLETE);
 	}
 
-	test_afu_init();
-	test_ocxl_afu_alloc();
-	test_device_matches();
+	memcpy3_afu_stop(afu);
+	ASSERT(1000 == le32toh(counter));
 
-	create_afu();
-	sleep(1);
+	test_stop(SUCCESS);
 
-	test_populate_metadata();
-	test_afu_getters();
-	test_get_afu_by_path();
-	test_afu_open();
-	test_ocxl_afu_open_specific();
-	test_ocxl_afu_open_from_dev();
-	test_ocxl_afu_open();
-	test_ocxl_afu_attach();
-	test_ocxl_afu_close();
+end:
+	memcpy3_afu_free(afu);
+	free(queue.queue);
+	free(pp_mmio);
+}
 
-	test_ocxl_set_error_message_handler();
-	test_ocxl_set_afu_error_message_handler();
+#define AFP3_BUFFER_SIZE	(64*1024)
+#define AFP3_WED(buffer, tags_ld, size_ld, tags_st, size_st) \
+	((uint64_t)(buffer) + ((tags_ld) << 9) + ((size_ld) << 7) + ((tags_st) << 3) + ((size_st) << 1))
 
-	test_ocxl_mmio_map();
-	test_mmio_check();
-	test_ocxl_mmio_read32_native();
-	test_ocxl_mmio_read64_native();
-	test_ocxl_mmio_read32();
-	test_ocxl_mmio_read64();
+/**
+ * Read an AFP3 performance counter directly from the register block
+ * @param mmio the global MMIO area
+ * @param counter the number of the counter
+ * @return the value of the counter
+ */
+static uint64_t afp3_counter(volatile uint64_t *mmio, int counter) {
+	return le64toh(mmio[(AFUPerfCnt0_AFP_REGISTER / 8) + counter]);
+}
+
+/**
+ * Check the AFP3 model traffic generation against the bandwidth model
+ */
+static void test_afp3_bandwidth() {
+	test_start("AFP3", "bandwidth");
+
+	afp3_afu *afu = NULL;
+	volatile uint64_t *mmio = calloc(1, AFP3_GLOBAL_MMIO_SIZE);
+	uint8_t *buffer = aligned_alloc(AFP3_BUFFER_SIZE, AFP3_BUFFER_SIZE);
+	afp3_afu_config config = {
+		.bandwidth = 1e9,
+		.latency_ns = 1000,
+		.touch_memory = true,
+	};
+
+	ASSERT(mmio && buffer);
+	memset(buffer, 0, AFP3_BUFFER_SIZE);
+
+	afu = afp3_afu_create((void *)mmio, &config);
+	ASSERT(afu);
+
+	// 2 load tags & 512 store tags of 128 bytes, the stores are link limited
+	mmio[AFUWED_AFP_REGISTER / 8] = htole64(AFP3_WED(buffer, 2, 2, 7, 2));
+	mmio[AFUBufmask_AFP_REGISTER / 8] = htole64(0xf << 12);
+	mmio[AFUControl_AFP_REGISTER / 8] = htole64(AFP3_CONTROL_RESET_COUNTERS);
+	afp3_afu_step(afu);
+	ASSERT(mmio[AFUControl_AFP_REGISTER / 8] == 0);
+	ASSERT(afp3_counter(mmio, 0) == 0);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	mmio[AFUEnable_AFP_REGISTER / 8] = htole64(AFP3_ENABLE_AFU);
+	ASSERT(0 == afp3_afu_start(afu));
+	usleep(100000);
+	afp3_afu_stop(afu);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double bytes = afp3_counter(mmio, 1) * 64.0;
+
+	ASSERT(afp3_counter(mmio, 0) > 0);
+	ASSERT(afp3_counter(mmio, 0) <= elapsed * AFP3_DEFAULT_CLOCK_HZ);
+	ASSERT(afp3_counter(mmio, 1) == afp3_counter(mmio, 2) + afp3_counter(mmio, 3));
+	ASSERT(afp3_counter(mmio, 2) > 0);
+	ASSERT(afp3_counter(mmio, 3) > afp3_counter(mmio, 2));
+	ASSERT(afp3_counter(mmio, 4) == 0);
+	ASSERT(afp3_counter(mmio, 7) > 0); // Link limited
+	ASSERT(bytes <= config.bandwidth * elapsed * 1.01);
+	ASSERT(bytes >= config.bandwidth * 0.1 * 0.5);
+
+	// Stores land in the buffer
+	bool touched = false;
+	for (int i = 0; i < AFP3_BUFFER_SIZE; i++) {
+		if (buffer[i]) {
+			touched = true;
+			break;
+		}
+	}
+	ASSERT(touched);
+
+	// Disabling freezes the counters
+	mmio[AFUEnable_AFP_REGISTER / 8] = 0;
+	afp3_afu_step(afu);
+	uint64_t cycles = afp3_counter(mmio, 0);
+	usleep(1000);
+	afp3_afu_step(afu);
+	ASSERT(cycles == afp3_counter(mmio, 0));
+
+	test_stop(SUCCESS);
+
+end:
+	afp3_afu_free(afu);
+	free(buffer);
+	free((void *)mmio);
+}
+
+/**
+ * Ping the AFP3 latency mode
+ * @param mmio the global MMIO area
+ * @param flag the flag the AFU sets on completion
+ * @param enable the value to write to the enable register
+ * @param count the number of pings
+ * @return the average roundtrip in nanoseconds
+ */
+static double afp3_ping(volatile uint64_t *mmio, volatile uint64_t *flag, uint64_t enable, int count) {
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < count; i++) {
+		*flag = 0;
+		__sync_synchronize();
+		mmio[AFUEnable_AFP_REGISTER / 8] = htole64(enable);
+		while (*flag == 0) {
+			;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / count;
+}
+
+/**
+ * Check the AFP3 model MMIO ping-pong latency mode
+ */
+static void test_afp3_latency() {
+	test_start("AFP3", "latency");
+
+	afp3_afu *afu = NULL;
+	volatile uint64_t *mmio = calloc(1, AFP3_GLOBAL_MMIO_SIZE);
+	volatile uint64_t *buffer = aligned_alloc(AFP3_BUFFER_SIZE, AFP3_BUFFER_SIZE);
+	afp3_afu_config config = {
+		.latency_ns = 5000,
+		.touch_memory = true,
+	};
+
+	ASSERT(mmio && buffer);
+	memset((void *)buffer, 0, AFP3_BUFFER_SIZE);
+
+	afu = afp3_afu_create((void *)mmio, &config);
+	ASSERT(afu);
+	ASSERT(0 == afp3_afu_start(afu));
+
+	mmio[AFUWED_AFP_REGISTER / 8] = htole64(AFP3_WED(buffer, 0, 1, 7, 2));
+	mmio[AFUBufmask_AFP_REGISTER / 8] = htole64(0x7f << 12);
+
+	// 128 byte pongs carry the flag at the start of the last 64 bytes
+	double latency = afp3_ping(mmio, &buffer[8], AFP3_ENABLE_AFU | AFP3_ENABLE_PING_PONG, 200);
+	ASSERT(latency >= config.latency_ns);
+	ASSERT(afp3_afu_pings(afu) == 200);
+	ASSERT(le64toh(buffer[8]) == 200);
+	ASSERT(buffer[0] == 200);
+	ASSERT(buffer[16] == 0);
+
+	// The extra read doubles the round trip
+	mmio[AFUExtraReadEA_AFP_REGISTER / 8] = htole64((uintptr_t)&buffer[128]);
+	latency = afp3_ping(mmio, &buffer[8], AFP3_ENABLE_AFU | AFP3_ENABLE_PING_PONG | AFP3_ENABLE_EXTRA_READ, 100);
+	ASSERT(latency >= 2 * config.latency_ns);
+	ASSERT(afp3_afu_pings(afu) == 300);
+
+	// Pings are not confused with bandwidth traffic
+	afp3_afu_stop(afu);
+	ASSERT(afp3_counter(mmio, 3) == 300 * 2);
+	ASSERT(afp3_counter(mmio, 2) == 100);
+
+	test_stop(SUCCESS);
+
+end:
+	afp3_afu_free(afu);
+	free((void *)buffer);
+	free((void *)mmio);
+}
+
+/**
+ * Drive the AFP3 model on the virtual device through the library, as the AFP3 tools do
+ */
+static void test_afp3_device() {
+	test_start("AFP3", "device");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	afp3_afu *afp3 = NULL;
+	void *mmio = map_global_mmio();
+	volatile uint64_t *buffer = aligned_alloc(AFP3_BUFFER_SIZE, AFP3_BUFFER_SIZE);
+	afp3_afu_config config = {
+		.latency_ns = 1000,
+		.touch_memory = true,
+	};
+	ocxl_mmio_h global;
+	uint64_t value;
+
+	ASSERT(mmio && buffer);
+	memset((void *)buffer, 0, AFP3_BUFFER_SIZE);
+	memset(mmio, 0, AFP3_GLOBAL_MMIO_SIZE);
+
+	afp3 = afp3_afu_create(mmio, &config);
+	ASSERT(afp3);
+	ASSERT(0 == afp3_afu_start(afp3));
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_GLOBAL_MMIO, &global));
+
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUPASID_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN,
+	                                    ocxl_afu_get_pasid(afu)));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUWED_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN,
+	                                    AFP3_WED(buffer, 0, 2, 7, 2)));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUBufmask_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN, 0xf << 12));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUControl_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN,
+	                                    AFP3_CONTROL_RESET_COUNTERS));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUEnable_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN, AFP3_ENABLE_AFU));
+	usleep(10000);
+	ASSERT(OCXL_OK == ocxl_mmio_read64(global, AFUPerfCnt3_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN, &value));
+	ASSERT(value > 0);
+
+	ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUEnable_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN, 0));
+	memset((void *)buffer, 0, AFP3_BUFFER_SIZE);
+
+	for (int i = 0; i < 10; i++) {
+		buffer[8] = 0;
+		__sync_synchronize();
+		ASSERT(OCXL_OK == ocxl_mmio_write64(global, AFUEnable_AFP_REGISTER, OCXL_MMIO_LITTLE_ENDIAN,
+		                                    AFP3_ENABLE_AFU | AFP3_ENABLE_PING_PONG));
+		while (buffer[8] == 0) {
+			;
+		}
+	}
+	ASSERT(afp3_afu_pings(afp3) == 10);
+
+	test_stop(SUCCESS);
+
+end:
+	afp3_afu_free(afp3);
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	if (mmio) {
+		munmap(mmio, GLOBAL_MMIO_SIZE);
+	}
+	free((void *)buffer);
+}
+
+/**
+ * Read & reset the count of an eventfd
+ * @param fd the eventfd (nonblocking)
+ * @return the count, or 0 if it has not been signalled
+ */
+static uint64_t eventfd_take(int fd) {
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return 0;
+	}
+
+	return count;
+}
+
+/**
+ * Check IRQ allocation, triggering & freeing in the emulated device, and the IRQ storm patterns
+ */
+static void test_irq_emulation() {
+	test_start("IRQ", "emulation/storm");
+
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	virtocxl_irq *irqs = NULL;
+	int fds[2] = { -1, -1 };
+	uint64_t offsets[2];
+	uint64_t handles[2];
+	uint64_t failed;
+	struct timespec start, end;
+
+	for (int i = 0; i < 2; i++) {
+		void *page;
+
+		fds[i] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		ASSERT(fds[i] >= 0);
+		ASSERT(0 == virtocxl_irq_alloc(&irqs, &offsets[i]));
+		ASSERT(offsets[i] >= VIRTOCXL_IRQ_OFFSET_BASE);
+		ASSERT(0 == virtocxl_irq_set_fd(irqs, offsets[i], fds[i]));
+		ASSERT(0 == virtocxl_irq_map(irqs, offsets[i], page_size, &page));
+		handles[i] = (uintptr_t)page;
+	}
+	ASSERT(offsets[0] != offsets[1]);
+	ASSERT(handles[0] != handles[1]);
+	ASSERT(2 == virtocxl_irq_count(irqs));
+
+	ASSERT(EINVAL == virtocxl_irq_set_fd(irqs, offsets[1] + page_size, fds[0]));
+	ASSERT(EINVAL == virtocxl_irq_map(irqs, offsets[1] + page_size, page_size, NULL));
+
+	// Triggers accumulate in the eventfd until it is read
+	for (int i = 0; i < 3; i++) {
+		ASSERT(0 == virtocxl_irq_fire(handles[0]));
+	}
+	ASSERT(0 == virtocxl_irq_fire(handles[1]));
+	ASSERT(EINVAL == virtocxl_irq_fire(handles[1] + page_size));
+	ASSERT(3 == eventfd_take(fds[0]));
+	ASSERT(1 == eventfd_take(fds[1]));
+
+	virtocxl_irq_storm_config config = {
+		.handles = handles,
+		.handle_count = 2,
+		.pattern = VIRTOCXL_IRQ_ROUND_ROBIN,
+		.count = 101,
+	};
+	virtocxl_irq_storm *storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(101 == virtocxl_irq_storm_stop(storm, true, &failed));
+	ASSERT(0 == failed);
+	ASSERT(51 == eventfd_take(fds[0]));
+	ASSERT(50 == eventfd_take(fds[1]));
+
+	config.pattern = VIRTOCXL_IRQ_BURST;
+	config.burst = 7;
+	config.count = 21;
+	storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(21 == virtocxl_irq_storm_stop(storm, true, NULL));
+	ASSERT(14 == eventfd_take(fds[0]));
+	ASSERT(7 == eventfd_take(fds[1]));
+
+	config.pattern = VIRTOCXL_IRQ_RANDOM;
+	config.seed = 42;
+	config.count = 1000;
+	storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(1000 == virtocxl_irq_storm_stop(storm, true, NULL));
+	uint64_t first = eventfd_take(fds[0]);
+	uint64_t second = eventfd_take(fds[1]);
+	ASSERT(first + second == 1000);
+	ASSERT(first > 400 && second > 400);
+
+	// 100 paced triggers at 10kHz take at least 9.9ms
+	config.pattern = VIRTOCXL_IRQ_ROUND_ROBIN;
+	config.rate = 10000;
+	config.count = 100;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(100 == virtocxl_irq_storm_stop(storm, true, NULL));
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ASSERT((end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec) >= 9900000LL);
+	ASSERT(50 == eventfd_take(fds[0]));
+
+	// Triggers of a freed IRQ are not delivered
+	munmap((void *)handles[0], page_size);
+	ASSERT(0 == virtocxl_irq_free(&irqs, offsets[0]));
+	ASSERT(EINVAL == virtocxl_irq_fire(handles[0]));
+	ASSERT(EINVAL == virtocxl_irq_free(&irqs, offsets[0]));
+	ASSERT(1 == virtocxl_irq_count(irqs));
+
+	// The freed offset is reused
+	uint64_t offset;
+	ASSERT(0 == virtocxl_irq_alloc(&irqs, &offset));
+	ASSERT(offset == offsets[0]);
+
+	test_stop(SUCCESS);
+
+end:
+	virtocxl_irq_free_all(&irqs);
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] >= 0) {
+			close(fds[i]);
+		}
+	}
+}
+
+#define IRQ_STORM_COUNT 1000
+
+/**
+ * Check IRQs triggered by the virtual device are reported by ocxl_afu_event_check()
+ */
+static void test_ocxl_irq_event_check() {
+	test_start("IRQ", "ocxl_afu_event_check (IRQs)");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_irq_h irqs[4];
+	uint64_t handles[4];
+	uint64_t counts[4] = { 0 };
+	ocxl_event events[8];
+	int count;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+
+	for (int i = 0; i < 4; i++) {
+		ASSERT(OCXL_OK == ocxl_irq_alloc(afu, (void *)(uintptr_t)i, &irqs[i]));
+		handles[i] = ocxl_irq_get_handle(afu, irqs[i]);
+		ASSERT(handles[i]);
+		ASSERT(ocxl_irq_get_fd(afu, irqs[i]) >= 0);
+	}
+
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, events, 8));
+
+	ASSERT(0 == virtocxl_irq_fire(handles[2]));
+	ASSERT(0 == virtocxl_irq_fire(handles[2]));
+	count = ocxl_afu_event_check(afu, 100, events, 8);
+	ASSERT(1 == count);
+	ASSERT(events[0].type == OCXL_EVENT_IRQ);
+	ASSERT(events[0].irq.irq == irqs[2]);
+	ASSERT(events[0].irq.handle == handles[2]);
+	ASSERT(events[0].irq.info == (void *)2);
+	ASSERT(events[0].irq.count == 2);
+
+	virtocxl_irq_storm_config config = {
+		.handles = handles,
+		.handle_count = 4,
+		.pattern = VIRTOCXL_IRQ_ROUND_ROBIN,
+		.count = IRQ_STORM_COUNT,
+	};
+	virtocxl_irq_storm *storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(IRQ_STORM_COUNT == virtocxl_irq_storm_stop(storm, true, NULL));
+
+	uint64_t total = 0;
+	while (total < IRQ_STORM_COUNT && (count = ocxl_afu_event_check(afu, 100, events, 8)) > 0) {
+		for (int i = 0; i < count; i++) {
+			ASSERT(events[i].type == OCXL_EVENT_IRQ);
+			counts[(uintptr_t)events[i].irq.info] += events[i].irq.count;
+			total += events[i].irq.count;
+		}
+	}
+
+	for (int i = 0; i < 4; i++) {
+		ASSERT(counts[i] == IRQ_STORM_COUNT / 4);
+	}
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+#define FAULT_STORM_ADDR	0x7f0000000000ULL
+
+/**
+ * Check queued translation faults are reported by ocxl_afu_event_check() in order,
+ * without overflowing the caller's events
+ */
+static void test_ocxl_fault_event_check() {
+	test_start("IRQ", "ocxl_afu_event_check (faults)");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_irq_h irq;
+	uint64_t handle;
+	ocxl_event events[3];
+	uint64_t faults = 0, irqs = 0;
+	int count;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	handle = ocxl_irq_get_handle(afu, irq);
+
+	virtocxl_context *context = virtocxl_device_find_context(afu_device, ocxl_afu_get_pasid(afu));
+	ASSERT(context);
+
+	for (uint64_t i = 0; i < 5; i++) {
+		ASSERT(0 == virtocxl_context_translation_fault(context, (void *)(FAULT_STORM_ADDR + i), 0, i + 1));
+	}
+	ASSERT(5 == virtocxl_context_pending_faults(context));
+	ASSERT(0 == virtocxl_irq_fire(handle));
+
+	// Only 2 events fit, the rest are reported by later calls
+	while ((count = ocxl_afu_event_check(afu, 100, events, 2)) > 0) {
+		ASSERT(count <= 2);
+		for (int i = 0; i < count; i++) {
+			if (events[i].type == OCXL_EVENT_IRQ) {
+				irqs += events[i].irq.count;
+				continue;
+			}
+			ASSERT(events[i].type == OCXL_EVENT_TRANSLATION_FAULT);
+			ASSERT(events[i].translation_fault.addr == (void *)(FAULT_STORM_ADDR + faults));
+			ASSERT(events[i].translation_fault.count == faults + 1);
+			faults++;
+		}
+	}
+	ASSERT(count == 0);
+	ASSERT(faults == 5);
+	ASSERT(irqs == 1);
+	ASSERT(0 == virtocxl_context_pending_faults(context));
+
+	// Faults beyond the queue depth are dropped
+	for (uint64_t i = 0; i < VIRTOCXL_FAULT_QUEUE_DEPTH; i++) {
+		ASSERT(0 == virtocxl_context_translation_fault(context, (void *)FAULT_STORM_ADDR, 0, 1));
+	}
+	ASSERT(ENOSPC == virtocxl_context_translation_fault(context, (void *)FAULT_STORM_ADDR, 0, 1));
+	faults = 0;
+	while ((count = ocxl_afu_event_check(afu, 0, events, 3)) > 0) {
+		faults += count;
+	}
+	ASSERT(faults == VIRTOCXL_FAULT_QUEUE_DEPTH);
+
+	// A storm interleaving faults over 2 addresses with IRQs
+	virtocxl_irq_storm_config config = {
+		.handles = &handle,
+		.handle_count = 1,
+		.count = 8,
+		.fault_context = context,
+		.fault_base = FAULT_STORM_ADDR,
+		.fault_addresses = 2,
+		.faults_per_irq = 3,
+	};
+	virtocxl_irq_storm *storm = virtocxl_irq_storm_start(&config);
+	ASSERT(storm);
+	ASSERT(8 == virtocxl_irq_storm_stop(storm, true, NULL));
+
+	faults = 0;
+	irqs = 0;
+	while ((count = ocxl_afu_event_check(afu, 0, events, 3)) > 0) {
+		for (int i = 0; i < count; i++) {
+			if (events[i].type == OCXL_EVENT_IRQ) {
+				irqs += events[i].irq.count;
+				continue;
+			}
+			ASSERT(events[i].translation_fault.addr == (void *)(FAULT_STORM_ADDR + (faults % 2) * 4096));
+			ASSERT(events[i].translation_fault.count == faults / 2 + 1);
+			faults++;
+		}
+	}
+	ASSERT(faults == 6);
+	ASSERT(irqs == 2);
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+/* System call budgets of the AFU lifecycle */
+#define BUDGET_AFU_OPEN		8 // stat the device & scan for its name, open it & the global MMIO, epoll setup, get metadata
+#define BUDGET_AFU_ATTACH	1
+#define BUDGET_MMIO_MAP		1
+#define BUDGET_IRQ_ALLOC	5 // eventfd, allocate, set the eventfd, map the trigger page, add to epoll
+#define BUDGET_AFU_CLOSE(irqs)	(4 + 3 * (irqs))
+
+/**
+ * Check the hot paths stay within their system call budgets
+ *
+ * All device operations are made through the backend, so they are counted by interposing
+ * the counting backend.
+ */
+static void test_syscall_budgets() {
+	test_start("SYSCALL", "budgets");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h pp_mmio;
+	ocxl_irq_h irqs[16];
+	uint64_t handles[16];
+	ocxl_event events[32];
+	uint64_t before, value;
+	uint32_t value32;
+
+	counted_backend = current_backend;
+	ASSERT(OCXL_OK == ocxl_backend_select("counting"));
+
+	before = backend_syscalls();
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(within_budget("ocxl_afu_open_from_dev", before, BUDGET_AFU_OPEN));
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS);
+
+	before = backend_syscalls();
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(within_budget("ocxl_afu_attach", before, BUDGET_AFU_ATTACH));
+
+	before = backend_syscalls();
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &pp_mmio));
+	ASSERT(within_budget("ocxl_mmio_map", before, BUDGET_MMIO_MAP));
+
+	for (int i = 0; i < 16; i++) {
+		before = backend_syscalls();
+		ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irqs[i]));
+		ASSERT(within_budget("ocxl_irq_alloc", before, BUDGET_IRQ_ALLOC));
+		handles[i] = ocxl_irq_get_handle(afu, irqs[i]);
+	}
+
+	// Steady state MMIO is a plain memory access
+	before = backend_syscalls();
+	for (off_t offset = 0; offset < 256; offset += 8) {
+		ASSERT(OCXL_OK == ocxl_mmio_write64(pp_mmio, offset, OCXL_MMIO_LITTLE_ENDIAN, offset));
+		ASSERT(OCXL_OK == ocxl_mmio_read64(pp_mmio, offset, OCXL_MMIO_HOST_ENDIAN, &value));
+		ASSERT(OCXL_OK == ocxl_mmio_write32(pp_mmio, offset, OCXL_MMIO_BIG_ENDIAN, offset));
+		ASSERT(OCXL_OK == ocxl_mmio_read32(pp_mmio, offset, OCXL_MMIO_LITTLE_ENDIAN, &value32));
+	}
+	ASSERT(within_budget("MMIO access", before, 0));
+
+	// An idle check only waits
+	before = backend_syscalls();
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, events, 32));
+	ASSERT(within_budget("ocxl_afu_event_check (idle)", before, 1));
+
+	// Harvesting k IRQs takes a wait, and a read of each
+	for (int k = 1; k <= 16; k *= 2) {
+		for (int i = 0; i < k; i++) {
+			ASSERT(0 == virtocxl_irq_fire(handles[i]));
+		}
+
+		before = backend_syscalls();
+		ASSERT(k == ocxl_afu_event_check(afu, 0, events, 32));
+		ASSERT(within_budget("ocxl_afu_event_check (IRQs)", before, k + 1));
+	}
+
+	// Harvesting f translation faults takes a wait, and a read of each
+	virtocxl_context *context = virtocxl_device_find_context(afu_device, ocxl_afu_get_pasid(afu));
+	ASSERT(context);
+	for (int f = 1; f <= 4; f *= 2) {
+		for (int i = 0; i < f; i++) {
+			ASSERT(0 == virtocxl_context_translation_fault(context, (void *)(FAULT_STORM_ADDR + i), 0, 1));
+		}
+
+		before = backend_syscalls();
+		ASSERT(f == ocxl_afu_event_check(afu, 0, events, 32));
+		ASSERT(within_budget("ocxl_afu_event_check (faults)", before, f + 1));
+	}
+
+	before = backend_syscalls();
+	ASSERT(OCXL_OK == ocxl_afu_close(afu));
+	afu = OCXL_INVALID_AFU;
+	ASSERT(within_budget("ocxl_afu_close", before, BUDGET_AFU_CLOSE(16)));
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	ocxl_backend_select("kernel");
+}
+
+#define RESERVE_IRQS	100 // More than INITIAL_IRQ_COUNT, so the IRQ buffer would otherwise grow
+#define RESERVE_MMIOS	(INITIAL_MMIO_COUNT + 2)
+#define RESERVE_EVENTS	32
+
+typedef struct steady_state_thread {
+	ocxl_afu_h afu;
+	ocxl_mmio_h mmio;
+	uint64_t handle;
+	int events;
+} steady_state_thread;
+
+static void *steady_state_worker(void *arg) {
+	steady_state_thread *thread = arg;
+	ocxl_event events[RESERVE_EVENTS];
+	uint64_t value;
+
+	for (off_t offset = 0; offset < 256; offset += 8) {
+		ocxl_mmio_write64(thread->mmio, offset, OCXL_MMIO_LITTLE_ENDIAN, offset);
+		ocxl_mmio_read64(thread->mmio, offset, OCXL_MMIO_LITTLE_ENDIAN, &value);
+	}
+	virtocxl_irq_fire(thread->handle);
+	thread->events = ocxl_afu_event_check(thread->afu, 100, events, RESERVE_EVENTS);
+
+	return NULL;
+}
+
+/**
+ * Check nothing is allocated on the steady state paths, once ocxl_afu_reserve() has
+ * moved the allocations to setup
+ */
+static void test_allocation_free_steady_state() {
+	test_start("ALLOC", "steady state");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h mmios[RESERVE_MMIOS];
+	ocxl_irq_h irqs[RESERVE_IRQS];
+	uint64_t handles[RESERVE_IRQS];
+	ocxl_event events[RESERVE_EVENTS];
+	uint64_t value;
+	uint32_t value32;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_afu_reserve(afu, RESERVE_IRQS, RESERVE_MMIOS, RESERVE_EVENTS));
+
+	// Reservations only grow
+	ASSERT(OCXL_OK == ocxl_afu_reserve(afu, 1, 1, 1));
+	ASSERT(afu->irq_max_count == RESERVE_IRQS);
+	ASSERT(afu->mmio_count == RESERVE_MMIOS);
+	ASSERT(afu->epoll_event_count == RESERVE_EVENTS);
+
+	// With the bookkeeping reserved, setup does not allocate either
+	allocations_start();
+	for (int i = 0; i < RESERVE_MMIOS; i++) {
+		ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmios[i]));
+	}
+	for (int i = 0; i < RESERVE_IRQS; i++) {
+		ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irqs[i]));
+		handles[i] = ocxl_irq_get_handle(afu, irqs[i]);
+	}
+	ASSERT(allocations_none("Reserved setup"));
+
+	allocations_start();
+	for (off_t offset = 0; offset < 256; offset += 8) {
+		ASSERT(OCXL_OK == ocxl_mmio_write64(mmios[0], offset, OCXL_MMIO_LITTLE_ENDIAN, offset));
+		ASSERT(OCXL_OK == ocxl_mmio_read64(mmios[0], offset, OCXL_MMIO_HOST_ENDIAN, &value));
+		ASSERT(OCXL_OK == ocxl_mmio_write32(mmios[0], offset, OCXL_MMIO_BIG_ENDIAN, offset));
+		ASSERT(OCXL_OK == ocxl_mmio_read32(mmios[0], offset, OCXL_MMIO_LITTLE_ENDIAN, &value32));
+	}
+	ASSERT(allocations_none("MMIO access"));
+
+	allocations_start();
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, events, RESERVE_EVENTS));
+	ASSERT(allocations_none("ocxl_afu_event_check (idle)"));
+
+	// IRQ completions, including those allocated after the initial IRQ buffer would have filled
+	for (int i = 0; i < RESERVE_IRQS; i += 7) {
+		ASSERT(0 == virtocxl_irq_fire(handles[i]));
+	}
+	allocations_start();
+	int seen = 0, count;
+	while ((count = ocxl_afu_event_check(afu, 0, events, RESERVE_EVENTS)) > 0) {
+		for (int i = 0; i < count; i++) {
+			ASSERT(events[i].type == OCXL_EVENT_IRQ);
+			ASSERT(events[i].irq.irq % 7 == 0);
+			ASSERT(events[i].irq.handle == handles[events[i].irq.irq]);
+		}
+		seen += count;
+	}
+	ASSERT(allocations_none("ocxl_afu_event_check (IRQs)"));
+	ASSERT(seen == (RESERVE_IRQS + 6) / 7);
+
+	virtocxl_context *context = virtocxl_device_find_context(afu_device, ocxl_afu_get_pasid(afu));
+	ASSERT(context);
+	for (int i = 0; i < 4; i++) {
+		ASSERT(0 == virtocxl_context_translation_fault(context, (void *)(FAULT_STORM_ADDR + i), 0, 1));
+	}
+	allocations_start();
+	ASSERT(4 == ocxl_afu_event_check(afu, 0, events, RESERVE_EVENTS));
+	ASSERT(allocations_none("ocxl_afu_event_check (faults)"));
+
+	// Another thread counts & harvests without allocating either
+	steady_state_thread thread = { .afu = afu, .mmio = mmios[0], .handle = handles[0] };
+	pthread_t worker;
+	allocations_start();
+	ASSERT(0 == pthread_create(&worker, NULL, steady_state_worker, &thread));
+	pthread_join(worker, NULL);
+	ASSERT(allocations_none("MMIO access & ocxl_afu_event_check (second thread)"));
+	ASSERT(thread.events == 1);
+
+	// Remapping an unmapped region reuses its handle
+	ocxl_mmio_unmap(mmios[1]);
+	allocations_start();
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmios[1]));
+	ASSERT(allocations_none("ocxl_mmio_map (remap)"));
+
+	test_stop(SUCCESS);
+
+end:
+	tracking_allocations = false;
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+/**
+ * Check IRQs & MMIO regions remain usable as their buffers grow without a reservation
+ */
+static void test_buffer_growth() {
+	test_start("AFU", "buffer growth");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h mmios[RESERVE_MMIOS];
+	ocxl_irq_h irqs[RESERVE_IRQS];
+	ocxl_event events[RESERVE_EVENTS];
+	uint64_t value;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+
+	for (int i = 0; i < RESERVE_MMIOS; i++) {
+		ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmios[i]));
+	}
+	ASSERT(afu->mmio_max_count > INITIAL_MMIO_COUNT);
+
+	// Handles from before the growth still refer to their regions
+	for (int i = 0; i < RESERVE_MMIOS; i++) {
+		ASSERT(mmios[i]->afu == afu);
+		ASSERT(OCXL_OK == ocxl_mmio_write64(mmios[i], 8 * i, OCXL_MMIO_HOST_ENDIAN, i));
+	}
+	for (int i = 0; i < RESERVE_MMIOS; i++) {
+		ASSERT(OCXL_OK == ocxl_mmio_read64(mmios[0], 8 * i, OCXL_MMIO_HOST_ENDIAN, &value));
+		ASSERT(value == (uint64_t)i);
+	}
+
+	for (int i = 0; i < RESERVE_IRQS; i++) {
+		ASSERT(OCXL_OK == ocxl_irq_alloc(afu, (void *)(uintptr_t)(i + 1), &irqs[i]));
+	}
+	ASSERT(afu->irq_max_count > INITIAL_IRQ_COUNT);
+
+	// IRQs allocated before the growth are still reported
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irqs[0])));
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irqs[RESERVE_IRQS - 1])));
+	ASSERT(2 == ocxl_afu_event_check(afu, 100, events, RESERVE_EVENTS));
+	for (int i = 0; i < 2; i++) {
+		ASSERT(events[i].type == OCXL_EVENT_IRQ);
+		ASSERT(events[i].irq.irq == 0 || events[i].irq.irq == RESERVE_IRQS - 1);
+		ASSERT(events[i].irq.info == (void *)(uintptr_t)(events[i].irq.irq + 1));
+	}
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+/**
+ * Run the AFP3 model for a while in simulated time, and read back its counters
+ *
+ * @param mmio the global MMIO area
+ * @param buffer the AFU buffer
+ * @param ns the number of nanoseconds to run for
+ * @param[out] counters the first 8 performance counters
+ * @return 0 on success, -1 on error
+ */
+static int afp3_simulated_run(volatile uint64_t *mmio, uint8_t *buffer, uint64_t ns, uint64_t *counters) {
+	afp3_afu_config config = {
+		.bandwidth = 1e9,
+		.latency_ns = 1000,
+		.retry_rate = 0.01,
+	};
+
+	memset((void *)mmio, 0, AFP3_GLOBAL_MMIO_SIZE);
+	afp3_afu *afu = afp3_afu_create((void *)mmio, &config);
+	if (!afu || afp3_afu_start(afu)) {
+		afp3_afu_free(afu);
+		return -1;
+	}
+
+	mmio[AFUWED_AFP_REGISTER / 8] = htole64(AFP3_WED(buffer, 2, 2, 7, 2));
+	mmio[AFUBufmask_AFP_REGISTER / 8] = htole64(0xf << 12);
+	mmio[AFUEnable_AFP_REGISTER / 8] = htole64(AFP3_ENABLE_AFU);
+	virtocxl_clock_advance(ns);
+
+	for (int i = 0; i < 8; i++) {
+		counters[i] = afp3_counter(mmio, i);
+	}
+	afp3_afu_free(afu);
+
+	return 0;
+}
+
+/**
+ * Check the device models & event timeouts run reproducibly in simulated time
+ */
+static void test_simulated_clock() {
+	test_start("CLOCK", "simulated");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	afp3_afu *afp3 = NULL;
+	volatile uint64_t *mmio = calloc(1, AFP3_GLOBAL_MMIO_SIZE);
+	uint8_t *buffer = aligned_alloc(AFP3_BUFFER_SIZE, AFP3_BUFFER_SIZE);
+	uint64_t first[8], second[8];
+	ocxl_event events[8];
+	ocxl_irq_h irq;
+	uint64_t start;
+
+	ASSERT(mmio && buffer);
+	memset(buffer, 0, AFP3_BUFFER_SIZE);
+
+	ASSERT(0 == virtocxl_clock_set_mode(VIRTOCXL_CLOCK_SIMULATED));
+	ASSERT(virtocxl_clock_get_mode() == VIRTOCXL_CLOCK_SIMULATED);
+	ASSERT(!strcmp(ocxl_backend_get_name(), "virtocxl-simulated"));
+	ASSERT(0 == virtocxl_clock_now());
+	virtocxl_clock_advance(1000);
+	ASSERT(1000 == virtocxl_clock_now());
+	ASSERT(!virtocxl_clock_advance_next());
+
+	// Bandwidth runs give identical counters, 1ms of a 200MHz clock is exactly 200000 cycles
+	ASSERT(0 == afp3_simulated_run(mmio, buffer, 1000000, first));
+	ASSERT(0 == afp3_simulated_run(mmio, buffer, 1000000, second));
+	ASSERT(!memcmp(first, second, sizeof(first)));
+	ASSERT(first[0] == 200000);
+	ASSERT(first[4] > 0); // Retries
+	// Good responses & retries fill the 1 byte/ns link, bar a partial request per stream
+	ASSERT((first[1] + first[4]) * 64 <= 1000000);
+	ASSERT((first[1] + first[4]) * 64 >= 1000000 - 2 * 128);
+
+	// Each 128 byte ping takes exactly the latency, plus the transfer at 1 byte/ns
+	afp3_afu_config config = {
+		.bandwidth = 1e9,
+		.latency_ns = 1000,
+	};
+	memset((void *)mmio, 0, AFP3_GLOBAL_MMIO_SIZE);
+	afp3 = afp3_afu_create((void *)mmio, &config);
+	ASSERT(afp3);
+	ASSERT(0 == afp3_afu_start(afp3));
+	mmio[AFUWED_AFP_REGISTER / 8] = htole64(AFP3_WED(buffer, 0, 1, 7, 2));
+	volatile uint64_t *flag = (volatile uint64_t *)buffer + 8;
+	for (int i = 0; i < 3; i++) {
+		start = virtocxl_clock_now();
+		*flag = 0;
+		mmio[AFUEnable_AFP_REGISTER / 8] = htole64(AFP3_ENABLE_AFU | AFP3_ENABLE_PING_PONG);
+		while (*flag == 0) {
+			ASSERT(virtocxl_clock_advance_next());
+		}
+		ASSERT(virtocxl_clock_now() - start == 1128);
+	}
+	ASSERT(afp3_afu_pings(afp3) == 3);
+
+	// Event timeouts elapse in simulated time
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	uint64_t handle = ocxl_irq_get_handle(afu, irq);
+
+	start = virtocxl_clock_now();
+	ASSERT(0 == ocxl_afu_event_check(afu, 50, events, 8));
+	ASSERT(virtocxl_clock_now() - start == 50000000);
+
+	// A 1kHz storm is delivered exactly 1ms apart
+	virtocxl_irq_storm_config storm_config = {
+		.handles = &handle,
+		.handle_count = 1,
+		.rate = 1000,
+		.count = 5,
+	};
+	start = virtocxl_clock_now();
+	virtocxl_irq_storm *storm = virtocxl_irq_storm_start(&storm_config);
+	ASSERT(storm);
+	for (uint64_t i = 0; i < 5; i++) {
+		ASSERT(1 == ocxl_afu_event_check(afu, 10, events, 8));
+		ASSERT(events[0].type == OCXL_EVENT_IRQ);
+		ASSERT(events[0].irq.count == 1);
+		ASSERT(virtocxl_clock_now() - start == i * 1000000);
+	}
+	ASSERT(5 == virtocxl_irq_storm_stop(storm, true, NULL));
+	ASSERT(0 == ocxl_afu_event_check(afu, 10, events, 8));
+
+	// A storm without a rate or count never ends, so has no place in simulated time
+	storm_config.rate = 0;
+	storm_config.count = 0;
+	ASSERT(!virtocxl_irq_storm_start(&storm_config));
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	afp3_afu_free(afp3);
+	(void)virtocxl_clock_set_mode(VIRTOCXL_CLOCK_REAL);
+	free(buffer);
+	free((void *)mmio);
+}
+
+#define TOPOLOGY_CARDS		2
+#define TOPOLOGY_AFUS		2
+#define TOPOLOGY_CONTEXTS	3
+#define TOPOLOGY_DEVICES	(TOPOLOGY_CARDS * TOPOLOGY_AFUS)
+
+/**
+ * Check discovery & context exhaustion across several virtual cards & AFUs
+ */
+static void test_topology() {
+	test_start("AFU", "topology");
+
+	virtocxl_device *devices[TOPOLOGY_DEVICES] = { NULL };
+	ocxl_afu_h afus[TOPOLOGY_DEVICES * TOPOLOGY_CONTEXTS + 1] = { OCXL_INVALID_AFU };
+	size_t opened = 0;
+	uint64_t *global = NULL;
+	uint64_t value;
+	virtocxl_device_config config = {
+		.afu_name = "IBM,Topology",
+		.card = 2,
+		.version_major = 1,
+		.version_minor = 2,
+		.global_mmio_size = 4096,
+		.pp_mmio_size = 4096,
+		.max_contexts = TOPOLOGY_CONTEXTS,
+	};
+
+	ASSERT(0 == virtocxl_topology_create(&config, TOPOLOGY_CARDS, TOPOLOGY_AFUS, devices));
+	ASSERT(0 == virtocxl_devices_wait(devices, TOPOLOGY_DEVICES, 5000));
+	ASSERT(!strcmp(virtocxl_device_path(devices[3]) + strlen(virtocxl_dev_path()),
+	                "/IBM,Topology.0003:00:00.1.1"));
+
+	// A specific card & AFU index
+	ASSERT(OCXL_OK == ocxl_afu_open_specific("IBM,Topology", "0003:00:00.1", 1, &afus[opened]));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afus[opened]), virtocxl_device_path(devices[3])));
+	ASSERT(ocxl_afu_get_pasid(afus[opened]) == VIRTOCXL_PASID_BASE);
+	ASSERT(1 == virtocxl_device_context_count(devices[3]));
+	opened++;
+
+	// Contexts are spread over the AFUs as each fills up, until all are exhausted
+	while (opened < TOPOLOGY_DEVICES * TOPOLOGY_CONTEXTS) {
+		ASSERT(OCXL_OK == ocxl_afu_open("IBM,Topology", &afus[opened]));
+		opened++;
+	}
+	ASSERT(OCXL_NO_MORE_CONTEXTS == ocxl_afu_open("IBM,Topology", &afus[opened]));
+	for (size_t i = 0; i < TOPOLOGY_DEVICES; i++) {
+		ASSERT(TOPOLOGY_CONTEXTS == virtocxl_device_context_count(devices[i]));
+		for (uint32_t pasid = 0; pasid < TOPOLOGY_CONTEXTS; pasid++) {
+			ASSERT(virtocxl_device_find_context(devices[i], VIRTOCXL_PASID_BASE + pasid));
+		}
+	}
+
+	// Closing a context frees its PASID for reuse
+	ocxl_afu_close(afus[0]);
+	afus[0] = OCXL_INVALID_AFU;
+	ASSERT(TOPOLOGY_CONTEXTS - 1 == virtocxl_device_context_count(devices[3]));
+	ASSERT(OCXL_OK == ocxl_afu_open("IBM,Topology", &afus[0]));
+	ASSERT(!strcmp(ocxl_afu_get_device_path(afus[0]), virtocxl_device_path(devices[3])));
+	ASSERT(ocxl_afu_get_pasid(afus[0]) == VIRTOCXL_PASID_BASE);
+
+	// Each context attaches independently
+	ASSERT(OCXL_OK == ocxl_afu_attach(afus[0], OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(virtocxl_context_is_attached(virtocxl_device_find_context(devices[3], VIRTOCXL_PASID_BASE)));
+	ASSERT(!virtocxl_context_is_attached(virtocxl_device_find_context(devices[3], VIRTOCXL_PASID_BASE + 1)));
+
+	// The global MMIO area is shared by all contexts of an AFU
+	global = virtocxl_device_map_global_mmio(devices[3]);
+	ASSERT(global);
+	global[1] = 0x0123456789abcdefULL;
+	ocxl_mmio_h mmio;
+	ASSERT(OCXL_OK == ocxl_mmio_map(afus[0], OCXL_GLOBAL_MMIO, &mmio));
+	ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 8, OCXL_MMIO_HOST_ENDIAN, &value));
+	ASSERT(value == 0x0123456789abcdefULL);
+
+	test_stop(SUCCESS);
+
+end:
+	if (global) {
+		munmap(global, 4096);
+	}
+	for (size_t i = 0; i < opened; i++) {
+		if (afus[i]) {
+			ocxl_afu_close(afus[i]);
+		}
+	}
+	for (size_t i = 0; i < TOPOLOGY_DEVICES; i++) {
+		if (devices[i]) {
+			virtocxl_device_destroy(devices[i]);
+		}
+	}
+}
+
+/**
+ * Attach a MEMCPY3 model to a new context on the virtual device
+ */
+static void *memcpy3_context_open(virtocxl_context *context, __attribute__((unused)) void *data) {
+	memcpy3_afu *afu = memcpy3_afu_create(virtocxl_context_pp_mmio(context), virtocxl_irq_fire_cb, NULL);
+
+	if (afu && memcpy3_afu_start(afu)) {
+		memcpy3_afu_free(afu);
+		return NULL;
+	}
+
+	return afu;
+}
+
+static void memcpy3_context_close(__attribute__((unused)) virtocxl_context *context, void *context_data,
+                                  __attribute__((unused)) void *data) {
+	memcpy3_afu_free(context_data);
+}
+
+#define DOORBELL_OFFSET	0x100
+
+#define TRACE_TEST_OUTPUT "/tmp/ocxl-trace-test.log"
+#define TRACE_TEST_READS 10
+
+extern FILE *trace_output;
+
+typedef struct trace_test_thread {
+	ocxl_mmio_h mmio;
+	pid_t tid;
+} trace_test_thread;
+
+/**
+ * Trace MMIO reads from a thread of its own, and so a ring of its own
+ */
+static void *trace_test_reader(void *data) {
+	trace_test_thread *thread = data;
+	uint64_t value;
+
+	thread->tid = syscall(SYS_gettid);
+	for (int i = 0; i < TRACE_TEST_READS; i++) {
+		ocxl_mmio_read64(thread->mmio, i * 8, OCXL_MMIO_HOST_ENDIAN, &value);
+	}
+
+	return NULL;
+}
+
+/**
+ * Check trace records are captured in the rings, formatted on read out, and written by the flight recorder
+ */
+static void test_trace() {
+	test_start("TRACE", "rings/flight recorder");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	trace_record *records = NULL;
+	size_t capacity = 0;
+	FILE *log = NULL;
+	ocxl_mmio_h mmio;
+	char message[TRACE_MESSAGE_LENGTH];
+	uint64_t value, lost;
+
+	// The records & output are only those of the test when it has control of tracing
+	SKIP(tracing_all, "tracing is enabled on all AFUs");
+	SKIP(TRACE_OMITTED & OCXL_TRACE_MMIO, "MMIO tracing is compiled out");
+
+	// Only the flight recorder writes records out
+	trace_streaming = false;
+	unlink(TRACE_TEST_OUTPUT);
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmio));
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS | OCXL_TRACING);
+
+	ASSERT(OCXL_OK == ocxl_mmio_write64(mmio, 0x28, OCXL_MMIO_HOST_ENDIAN, 0xfeedf00d));
+	ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 0x28, OCXL_MMIO_HOST_ENDIAN, &value));
+
+	// Arguments are formatted when the record is read out
+	ASSERT(1 == trace_collect(1, false, &records, &capacity, NULL));
+	ASSERT(records[0].tid == syscall(SYS_gettid));
+	trace_format(&records[0], message, sizeof(message));
+	ASSERT(!strcmp(message, "Per-PASID MMIO Read64@0x0028=0x00000000feedf00d"));
+
+	// A small ring keeps only the most recent records
+	trace_ring_records = 3;
+	trace_test_thread thread = { .mmio = mmio };
+	pthread_t reader;
+	ASSERT(0 == pthread_create(&reader, NULL, trace_test_reader, &thread));
+	pthread_join(reader, NULL);
+
+	size_t count = trace_collect(0, true, &records, &capacity, &lost);
+	size_t from_reader = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (records[i].tid == (uint32_t)thread.tid) {
+			from_reader++;
+		}
+		ASSERT(i == 0 || records[i - 1].timestamp <= records[i].timestamp);
+	}
+	ASSERT(from_reader == 4);
+	ASSERT(lost >= TRACE_TEST_READS - 4);
+
+	// The flight recorder writes the most recent records before the error
+	trace_output_path = TRACE_TEST_OUTPUT;
+	trace_flight_records = 2;
+	memset(err_buf, '\0', sizeof(err_buf));
+	ocxl_afu_set_error_message_handler(afu, copy_to_err_buf_afu);
+	ocxl_mmio_read64(mmio, 0x30, OCXL_MMIO_HOST_ENDIAN, &value);
+	ASSERT(OCXL_OUT_OF_BOUNDS == ocxl_mmio_read64(mmio, PER_PASID_MMIO_SIZE, OCXL_MMIO_HOST_ENDIAN, &value));
+	ASSERT(err_buf[0]);
+
+	log = fopen(TRACE_TEST_OUTPUT, "r");
+	ASSERT(log);
+	char line[TRACE_MESSAGE_LENGTH * 2];
+	int lines = 0;
+	bool found = false;
+	while (fgets(line, sizeof(line), log)) {
+		lines++;
+		ASSERT(!strncmp(line, "Trace: ", 7));
+		found |= (strstr(line, "Read64@0x0030=") != NULL);
+	}
+	ASSERT(lines == 3);
+	ASSERT(found);
+
+	test_stop(SUCCESS);
+
+end:
+	if (log) {
+		fclose(log);
+	}
+
+	if (!tracing_all) {
+		// Discard the remaining records, rather than writing them out on exit
+		trace_collect(0, true, &records, &capacity, NULL);
+		if (trace_output && trace_output != stderr) {
+			fclose(trace_output);
+		}
+		trace_output = NULL;
+		trace_output_path = NULL;
+		trace_flight_records = 0;
+		trace_ring_records = TRACE_RING_RECORDS_DEFAULT;
+		trace_streaming = true;
+		unlink(TRACE_TEST_OUTPUT);
+	}
+	free(records);
+
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+/**
+ * Check only the enabled trace categories are recorded
+ */
+static void test_trace_categories() {
+	test_start("TRACE", "categories");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	trace_record *records = NULL;
+	size_t capacity = 0;
+	ocxl_mmio_h mmio;
+	ocxl_irq_h irq;
+	ocxl_event event;
+	uint64_t value;
+
+	ASSERT(trace_categories(OCXL_TRACING) == OCXL_TRACE_ALL);
+	ASSERT(trace_categories(OCXL_ERRORS | OCXL_TRACE_MMIO) == OCXL_TRACE_MMIO);
+	ASSERT(trace_categories(OCXL_ERRORS) == 0);
+	ASSERT(trace_parse_categories(NULL) == 0);
+	ASSERT(trace_parse_categories("1") == OCXL_TRACE_ALL);
+	ASSERT(trace_parse_categories("YES") == OCXL_TRACE_ALL);
+	ASSERT(trace_parse_categories("mmio,Faults") == (OCXL_TRACE_MMIO | OCXL_TRACE_FAULTS));
+	ASSERT(trace_parse_categories("irq,bogus,,events") == (OCXL_TRACE_IRQ | OCXL_TRACE_EVENTS));
+	ASSERT(trace_parse_categories("0") == 0);
+
+	SKIP(tracing_all, "tracing is enabled on all AFUs");
+
+	trace_streaming = false;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmio));
+
+	// Disabled categories record nothing
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS | OCXL_TRACE_IRQ);
+	trace_collect(0, true, &records, &capacity, NULL);
+	ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 0, OCXL_MMIO_HOST_ENDIAN, &value));
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, &event, 1));
+	ASSERT(0 == trace_collect(0, true, &records, &capacity, NULL));
+
+	// Enabled categories record, unless compiled out
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	ASSERT((TRACE_OMITTED & OCXL_TRACE_IRQ ? 0 : 1) == trace_collect(0, true, &records, &capacity, NULL));
+
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS | OCXL_TRACE_MMIO | OCXL_TRACE_EVENTS);
+	ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 0, OCXL_MMIO_HOST_ENDIAN, &value));
+	ASSERT((TRACE_OMITTED & OCXL_TRACE_MMIO ? 0 : 1) == trace_collect(0, true, &records, &capacity, NULL));
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, &event, 1));
+	ASSERT((TRACE_OMITTED & OCXL_TRACE_EVENTS ? 0 : 2) == trace_collect(0, true, &records, &capacity, NULL));
+
+	test_stop(SUCCESS);
+
+end:
+	if (!tracing_all) {
+		trace_collect(0, true, &records, &capacity, NULL);
+		trace_streaming = true;
+	}
+	free(records);
+
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+extern bool trace_flusher_idle;
+extern pthread_mutex_t trace_flush_mutex;
+
+/**
+ * Count the lines of the trace output which contain a string
+ */
+static int trace_test_lines(const char *match) {
+	char line[TRACE_MESSAGE_LENGTH * 2];
+	int lines = 0;
+
+	FILE *log = fopen(TRACE_TEST_OUTPUT, "r");
+	if (!log) {
+		return 0;
+	}
+	while (fgets(line, sizeof(line), log)) {
+		lines += (strstr(line, match) != NULL);
+	}
+	fclose(log);
+
+	return lines;
+}
+
+/**
+ * Wait up to a second for a condition
+ */
+#define TRACE_TEST_WAIT(condition) \
+	for (int wait = 0; wait < 1000 && !(condition); wait++) { \
+		usleep(1000); \
+	}
+
+/**
+ * Check the flusher streams records out, & waits for more once the rings are drained, rather than polling
+ */
+static void test_trace_flusher() {
+	test_start("TRACE", "flusher");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h mmio;
+	uint64_t value;
+
+	SKIP(tracing_all, "tracing is enabled on all AFUs");
+	SKIP(TRACE_OMITTED & OCXL_TRACE_MMIO, "MMIO tracing is compiled out");
+
+	trace_output_path = TRACE_TEST_OUTPUT;
+	unlink(TRACE_TEST_OUTPUT);
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmio));
+	ocxl_afu_enable_messages(afu, OCXL_ERRORS | OCXL_TRACE_MMIO);
+
+	// A new thread's ring starts the flusher, which writes its last read out shortly after
+	trace_test_thread thread = { .mmio = mmio };
+	pthread_t reader;
+	ASSERT(0 == pthread_create(&reader, NULL, trace_test_reader, &thread));
+	pthread_join(reader, NULL);
+	TRACE_TEST_WAIT(trace_test_lines("Read64@0x0048=") == 1);
+	ASSERT(trace_test_lines("Read64@0x0048=") == 1);
+
+	// Once drained, the flusher waits
+	TRACE_TEST_WAIT(__atomic_load_n(&trace_flusher_idle, __ATOMIC_SEQ_CST));
+	ASSERT(__atomic_load_n(&trace_flusher_idle, __ATOMIC_SEQ_CST));
+	usleep(TRACE_FLUSH_INTERVAL_MS * 5 * 1000);
+	ASSERT(__atomic_load_n(&trace_flusher_idle, __ATOMIC_SEQ_CST));
+
+	// Until a record wakes it
+	ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 0x100, OCXL_MMIO_HOST_ENDIAN, &value));
+	TRACE_TEST_WAIT(trace_test_lines("Read64@0x0100=") == 1);
+	ASSERT(trace_test_lines("Read64@0x0100=") == 1);
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_enable_messages(afu, OCXL_ERRORS);
+	}
+
+	if (!tracing_all) {
+		// The output is only closed once the flusher has finished with it
+		TRACE_TEST_WAIT(__atomic_load_n(&trace_flusher_idle, __ATOMIC_SEQ_CST));
+		pthread_mutex_lock(&trace_flush_mutex);
+		if (trace_output && trace_output != stderr) {
+			fclose(trace_output);
+		}
+		trace_output = NULL;
+		trace_output_path = NULL;
+		pthread_mutex_unlock(&trace_flush_mutex);
+		unlink(TRACE_TEST_OUTPUT);
+	}
+
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+/* The expected count of MMIO accesses, which are not counted if compiled out with STATS_OMIT */
+#define MMIO_COUNTED(count) (STATS_OMITTED_MMIO ? 0 : (count))
+
+extern __thread bool stats_thread_slotless;
+
+typedef struct stats_test_thread {
+	ocxl_mmio_h mmio;
+	ocxl_afu_h afu;
+	bool slotless; /**< Count as if all thread slots were taken */
+	int events;
+} stats_test_thread;
+
+static void *stats_test_reader(void *arg) {
+	stats_test_thread *thread = arg;
+	uint64_t value;
+	ocxl_event event;
+
+	stats_thread_slotless = thread->slotless;
+
+	for (int i = 0; i < 10; i++) {
+		ocxl_mmio_read64(thread->mmio, 0, OCXL_MMIO_LITTLE_ENDIAN, &value);
+	}
+	thread->events = ocxl_afu_event_check(thread->afu, 0, &event, 1);
+
+	return NULL;
+}
+
+/**
+ * Check the per-AFU statistics count the work done on the context, across threads
+ */
+static void test_afu_stats() {
+	test_start("STATS", "ocxl_afu_get_stats");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_afu_h other = OCXL_INVALID_AFU;
+	ocxl_afu_stats stats;
+	ocxl_mmio_h global, pp;
+	ocxl_irq_h irq;
+	ocxl_event events[8];
+	uint64_t value;
+	uint32_t value32;
+	int count;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ocxl_afu_get_stats(afu, &stats, sizeof(stats));
+	ASSERT(stats.setup_ns > 0);
+	ASSERT(stats.attach_ns == 0);
+	ASSERT(stats.event_checks == 0);
+
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_GLOBAL_MMIO, &global));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &pp));
+
+	for (int i = 0; i < 3; i++) {
+		ASSERT(OCXL_OK == ocxl_mmio_read64(global, 0, OCXL_MMIO_LITTLE_ENDIAN, &value));
+	}
+	ASSERT(OCXL_OK == ocxl_mmio_read32(pp, 0, OCXL_MMIO_LITTLE_ENDIAN, &value32));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(pp, 0, OCXL_MMIO_LITTLE_ENDIAN, 0));
+	ASSERT(OCXL_OK == ocxl_mmio_write32(pp, 8, OCXL_MMIO_LITTLE_ENDIAN, 0));
+
+	// An idle check
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, events, 8));
+
+	// A wakeup which finds no event
+	virtocxl_context *context = virtocxl_device_find_context(afu_device, ocxl_afu_get_pasid(afu));
+	ASSERT(context);
+	virtocxl_context_spurious_wakeup(context);
+	ASSERT(0 == ocxl_afu_event_check(afu, 100, events, 8));
+
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	uint64_t handle = ocxl_irq_get_handle(afu, irq);
+	ASSERT(0 == virtocxl_irq_fire(handle));
+	ASSERT(0 == virtocxl_irq_fire(handle));
+	ASSERT(1 == ocxl_afu_event_check(afu, 100, events, 8));
+
+	// 3 faults, over 2 addresses
+	ASSERT(0 == virtocxl_context_translation_fault(context, (void *)FAULT_STORM_ADDR, 0, 1));
+	ASSERT(0 == virtocxl_context_translation_fault(context, (void *)(FAULT_STORM_ADDR + 4096), 0, 1));
+	ASSERT(0 == virtocxl_context_translation_fault(context, (void *)FAULT_STORM_ADDR, 0, 1));
+	while ((count = ocxl_afu_event_check(afu, 0, events, 8)) > 0) {
+		;
+	}
+
+	ocxl_afu_get_stats(afu, &stats, sizeof(stats));
+	ASSERT(stats.attach_ns > 0);
+	ASSERT(stats.threads == 1);
+	ASSERT(stats.mmio_reads[OCXL_GLOBAL_MMIO] == MMIO_COUNTED(3));
+	ASSERT(stats.mmio_reads[OCXL_PER_PASID_MMIO] == MMIO_COUNTED(1));
+	ASSERT(stats.mmio_writes[OCXL_GLOBAL_MMIO] == 0);
+	ASSERT(stats.mmio_writes[OCXL_PER_PASID_MMIO] == MMIO_COUNTED(2));
+	ASSERT(stats.irqs_allocated == 1);
+	ASSERT(stats.irqs_fired == 2);
+	ASSERT(stats.events[OCXL_EVENT_IRQ] == 1);
+	ASSERT(stats.events[OCXL_EVENT_TRANSLATION_FAULT] == 3);
+	ASSERT(stats.translation_fault_addresses == 2);
+	ASSERT(stats.event_checks >= 5);
+	ASSERT(stats.epoll_wakeups >= 3);
+	ASSERT(stats.empty_wakeups == 1); // Idle polls are not wakeups
+	ASSERT(stats.event_waits == 2); // Only waits with a timeout are timed
+	ASSERT(stats.event_wait_ns > 0);
+	uint64_t checks = stats.event_checks;
+	uint64_t empty = stats.empty_wakeups;
+
+	// Another thread counts separately, & its counts are summed
+	stats_test_thread thread = { .mmio = global, .afu = afu };
+	pthread_t reader;
+	ASSERT(0 == pthread_create(&reader, NULL, stats_test_reader, &thread));
+	pthread_join(reader, NULL);
+	ASSERT(thread.events == 0);
+
+	ocxl_afu_get_stats(afu, &stats, sizeof(stats));
+	ASSERT(stats.threads == 2);
+	ASSERT(stats.mmio_reads[OCXL_GLOBAL_MMIO] == MMIO_COUNTED(13));
+	ASSERT(stats.event_checks == checks + 1);
+	ASSERT(stats.empty_wakeups == empty);
+
+	// Threads without a slot count in blocks of their own
+	thread.slotless = true;
+	ASSERT(0 == pthread_create(&reader, NULL, stats_test_reader, &thread));
+	pthread_join(reader, NULL);
+	ocxl_afu_get_stats(afu, &stats, sizeof(stats));
+	ASSERT(stats.threads == 3);
+	ASSERT(stats.mmio_reads[OCXL_GLOBAL_MMIO] == MMIO_COUNTED(23));
+	ASSERT(stats.event_checks == checks + 2);
+	checks = stats.event_checks;
+
+	// Callers built against a smaller structure only have that much of it written
+	ocxl_afu_stats partial;
+	memset(&partial, 0xa5, sizeof(partial));
+	ocxl_afu_get_stats(afu, &partial, offsetof(ocxl_afu_stats, events));
+	ASSERT(partial.irqs_allocated == stats.irqs_allocated);
+	ASSERT(partial.irqs_fired == stats.irqs_fired);
+	ASSERT(partial.events[OCXL_EVENT_IRQ] == 0xa5a5a5a5a5a5a5a5ULL);
+	ASSERT(partial.threads == 0xa5a5a5a5a5a5a5a5ULL);
+
+	// A thread alternating between contexts counts on each
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &other));
+	for (int i = 0; i < 3; i++) {
+		ASSERT(0 == ocxl_afu_event_check(afu, 0, events, 8));
+		ASSERT(0 == ocxl_afu_event_check(other, 0, events, 8));
+	}
+	ocxl_afu_get_stats(afu, &stats, sizeof(stats));
+	ASSERT(stats.event_checks == checks + 3);
+	ASSERT(stats.threads == 3);
+	ocxl_afu_get_stats(other, &stats, sizeof(stats));
+	ASSERT(stats.event_checks == 3);
+	ASSERT(stats.threads == 1);
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	if (other) {
+		ocxl_afu_close(other);
+	}
+}
+
+extern stats_shm_header *stats_shm;
+
+#define STATS_SHM_TEST_TARGET "/tmp/ocxl-stats-shm-target"
+
+/**
+ * Check statistics are published to the shared memory segment, in its versioned layout
+ */
+static void test_stats_shm() {
+	test_start("STATS", "shared memory segment");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h mmio;
+	uint64_t value;
+	char path[PATH_MAX];
+	stats_shm_header *header = MAP_FAILED;
+	size_t size = sizeof(stats_shm_header) + STATS_SHM_SLOTS * sizeof(stats_shm_afu);
+
+	snprintf(path, sizeof(path), "%s/%s%d", STATS_SHM_DIR, STATS_SHM_PREFIX, (int)getpid());
+
+	// A link planted at the segment's name is replaced, rather than followed
+	FILE *target = fopen(STATS_SHM_TEST_TARGET, "w");
+	ASSERT(target);
+	fputs("precious", target);
+	fclose(target);
+	unlink(path);
+	ASSERT(0 == symlink(STATS_SHM_TEST_TARGET, path));
+
+	ASSERT(0 == stats_shm_open(0, STATS_SHM_MODE));
+
+	struct stat st;
+	ASSERT(0 == stat(STATS_SHM_TEST_TARGET, &st));
+	ASSERT(st.st_size == strlen("precious"));
+	ASSERT(0 == lstat(path, &st));
+	ASSERT(S_ISREG(st.st_mode));
+	ASSERT((st.st_mode & 0777) == 0600);
+
+	int fd = open(path, O_RDONLY);
+	ASSERT(fd >= 0);
+	header = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	ASSERT(header != MAP_FAILED);
+
+	ASSERT(header->magic == STATS_SHM_MAGIC);
+	ASSERT(header->version == STATS_SHM_VERSION);
+	ASSERT(header->header_size == sizeof(stats_shm_header));
+	ASSERT(header->slot_size == sizeof(stats_shm_afu));
+	ASSERT(header->slot_count == STATS_SHM_SLOTS);
+	ASSERT(header->pid == getpid());
+	ASSERT(!strcmp(header->comm, "unittests"));
+
+	stats_shm_afu *slots = (stats_shm_afu *)((char *)header + header->header_size);
+	uint64_t opened = header->contexts_opened;
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(header->contexts_opened == opened + 1);
+	int slot = afu->stats.shm_slot;
+	ASSERT(slot >= 0);
+	ASSERT(slots[slot].in_use == 1);
+	ASSERT(!(slots[slot].sequence & 1));
+	ASSERT(!strcmp(slots[slot].device, DUMMY_DEVICE));
+	ASSERT(slots[slot].setup_ns > 0);
+
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &mmio));
+	for (int i = 0; i < 5; i++) {
+		ASSERT(OCXL_OK == ocxl_mmio_read64(mmio, 0, OCXL_MMIO_LITTLE_ENDIAN, &value));
+	}
+	ASSERT(OCXL_OK == ocxl_mmio_write64(mmio, 0, OCXL_MMIO_LITTLE_ENDIAN, value));
+
+	// Counters are only published periodically
+	ASSERT(slots[slot].mmio_reads[OCXL_PER_PASID_MMIO] == 0);
+	uint32_t sequence = slots[slot].sequence;
+	stats_shm_publish();
+	ASSERT(slots[slot].sequence == sequence + 2);
+	ASSERT(header->updated_ns > 0);
+	ASSERT(slots[slot].attached == 1);
+	ASSERT(slots[slot].pasid == ocxl_afu_get_pasid(afu));
+	ASSERT(slots[slot].mmio_reads[OCXL_PER_PASID_MMIO] == MMIO_COUNTED(5));
+	ASSERT(slots[slot].mmio_writes[OCXL_PER_PASID_MMIO] == MMIO_COUNTED(1));
+	ASSERT(slots[slot].threads == 1);
+
+	uint64_t generation = slots[slot].generation;
+	ocxl_afu_close(afu);
+	afu = OCXL_INVALID_AFU;
+	ASSERT(slots[slot].in_use == 0);
+
+	// A reused slot is distinguished by its generation
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(afu->stats.shm_slot == slot);
+	ASSERT(slots[slot].generation == generation + 1);
+	ASSERT(slots[slot].mmio_reads[OCXL_PER_PASID_MMIO] == 0);
+
+	// Closing the segment removes it, & stops publishing the open AFU
+	stats_shm_close();
+	ASSERT(afu->stats.shm_slot == -1);
+	ASSERT(access(path, F_OK) && errno == ENOENT);
+
+	// Other users may be let in explicitly, regardless of the umask
+	ASSERT(0 == stats_shm_open(0, 0644));
+	ASSERT(0 == stat(path, &st));
+	ASSERT((st.st_mode & 0777) == 0644);
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	if (header != MAP_FAILED) {
+		munmap(header, size);
+	}
+	stats_shm_close();
+	unlink(STATS_SHM_TEST_TARGET);
+}
+
+/**
+ * Check a child of fork() leaves the statistics segment of its parent alone
+ */
+static void test_stats_shm_fork() {
+	test_start("STATS", "shared memory segment after fork");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	char path[PATH_MAX];
+	int status;
+
+	snprintf(path, sizeof(path), "%s/%s%d", STATS_SHM_DIR, STATS_SHM_PREFIX, (int)getpid());
+
+	ASSERT(0 == stats_shm_open(0, STATS_SHM_MODE));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	int slot = afu->stats.shm_slot;
+	ASSERT(slot >= 0);
+
+	fflush(stdout);
+	fflush(stderr);
+	pid_t child = fork();
+	if (child == 0) {
+		// The child neither publishes in the parent's segment, nor removes it on exit
+		exit((stats_shm == NULL && afu->stats.shm_slot == -1) ? 0 : 1);
+	}
+	ASSERT(child > 0);
+	ASSERT(child == waitpid(child, &status, 0));
+	ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+	ASSERT(0 == access(path, F_OK));
+	ASSERT(stats_shm && stats_shm->pid == getpid());
+	ASSERT(afu->stats.shm_slot == slot);
+	stats_shm_publish();
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	stats_shm_close();
+}
+
+#define HISTOGRAM_TEST_WAIT_US 20000
+
+static void *histogram_test_firer(void *arg) {
+	usleep(HISTOGRAM_TEST_WAIT_US);
+	virtocxl_irq_fire(*(uint64_t *)arg);
+
+	return NULL;
+}
+
+/**
+ * Check event check latencies & IRQ harvest latencies are recorded in histograms, which are read through snapshots
+ */
+static void test_event_histograms() {
+	test_start("HISTOGRAM", "ocxl_afu_get_event_histogram");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_histogram_h snapshot = NULL;
+	ocxl_irq_h irq0, irq1;
+	ocxl_event events[8];
+
+	// Buckets are exact for small latencies, & within 1/64th above them
+	for (uint64_t ns = 0; ns < 128; ns++) {
+		ASSERT(histogram_bucket_highest(histogram_bucket(ns)) == ns);
+	}
+	for (uint64_t ns = 128; ns < (1ULL << HISTOGRAM_MAX_BITS); ns = ns * 3 / 2 + 7) {
+		size_t bucket = histogram_bucket(ns);
+		ASSERT(bucket < HISTOGRAM_BUCKETS - 1);
+		uint64_t highest = histogram_bucket_highest(bucket);
+		ASSERT(highest >= ns);
+		ASSERT(highest - ns <= ns / 64);
+		ASSERT(histogram_bucket(highest) == bucket);
+		ASSERT(histogram_bucket(highest + 1) == bucket + 1);
+	}
+	ASSERT(histogram_bucket(UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+
+	ASSERT(OCXL_OK == ocxl_histogram_alloc(&snapshot));
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+
+	// Nothing is recorded until histograms are enabled
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq0));
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq1));
+	ASSERT(OCXL_OK == ocxl_irq_set_histogram_group(afu, irq1, 3));
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irq0)));
+	ASSERT(1 == ocxl_afu_event_check(afu, 100, events, 8));
+	ASSERT(afu->stats.event_histogram == NULL);
+	ASSERT(afu->stats.irq_histograms[0] == NULL);
+	ASSERT(afu->stats.irq_histograms[3] == NULL);
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 0, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 0);
+
+	// Enabling allocates the histograms of the groups in use, once
+	ASSERT(OCXL_OK == ocxl_afu_enable_histograms(afu));
+	struct ocxl_histogram *event_histogram = afu->stats.event_histogram;
+	ASSERT(event_histogram != NULL);
+	ASSERT(afu->stats.irq_histograms[0] != NULL);
+	ASSERT(afu->stats.irq_histograms[3] != NULL);
+	ASSERT(afu->stats.irq_histograms[1] == NULL);
+	ASSERT(OCXL_OK == ocxl_afu_enable_histograms(afu));
+	ASSERT(afu->stats.event_histogram == event_histogram);
+
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 0);
+	ASSERT(ocxl_histogram_mean(snapshot) == 0);
+	ASSERT(ocxl_histogram_percentile(snapshot, 50) == 0);
+
+	// Percentiles are taken from the recorded latencies
+	for (uint64_t ns = 1; ns <= 1000; ns++) {
+		histogram_record(afu->stats.event_histogram, ns * 1000);
+	}
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 1000);
+	ASSERT(ocxl_histogram_mean(snapshot) == 500500);
+	ASSERT(ocxl_histogram_percentile(snapshot, 0) == 1000);
+	ASSERT(ocxl_histogram_percentile(snapshot, 100) == 1000000);
+	uint64_t p50 = ocxl_histogram_percentile(snapshot, 50);
+	ASSERT(p50 >= 500000 && p50 <= 500000 + 500000 / 64);
+	uint64_t p99 = ocxl_histogram_percentile(snapshot, 99);
+	ASSERT(p99 >= 990000 && p99 <= 990000 + 990000 / 64);
+	uint64_t p999 = ocxl_histogram_percentile(snapshot, 99.9);
+	ASSERT(p999 >= 999000 && p999 <= 1000000);
+
+	// Applications can record their own latencies
+	ocxl_histogram_h own = NULL;
+	ASSERT(OCXL_OK == ocxl_histogram_alloc(&own));
+	for (uint64_t ns = 1; ns <= 100; ns++) {
+		ocxl_histogram_record(own, ns * 10);
+	}
+	ASSERT(ocxl_histogram_count(own) == 100);
+	ASSERT(ocxl_histogram_mean(own) == 505);
+	ASSERT(ocxl_histogram_percentile(own, 0) == 10);
+	ASSERT(ocxl_histogram_percentile(own, 50) >= 500 && ocxl_histogram_percentile(own, 50) <= 500 + 500 / 64);
+	ASSERT(ocxl_histogram_percentile(own, 100) == 1000);
+	ocxl_histogram_free(own);
+
+	// Resetting without reading, the histogram is emptied
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, OCXL_HISTOGRAM_RESET, NULL));
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 0);
+
+	// Event checks are recorded, & IRQs in the histogram of their group
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irq0)));
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irq1)));
+	ASSERT(0 == virtocxl_irq_fire(ocxl_irq_get_handle(afu, irq1)));
+	int count = 0;
+	while (count < 2) {
+		int found = ocxl_afu_event_check(afu, 100, events, 8);
+		ASSERT(found > 0);
+		count += found;
+	}
+	ASSERT(0 == ocxl_afu_event_check(afu, 0, events, 8));
+
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, OCXL_HISTOGRAM_RESET,
+	                  snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) >= 2);
+	ASSERT(ocxl_histogram_percentile(snapshot, 100) > 0);
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 0);
+
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 0, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 1);
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 3, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 1);
+	ASSERT(ocxl_histogram_percentile(snapshot, 0) == ocxl_histogram_percentile(snapshot, 100));
+
+	// Groups that were never used are empty
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 5, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 0);
+
+	// Once enabled, moving an IRQ to a new group allocates its histogram
+	ASSERT(OCXL_OK == ocxl_irq_set_histogram_group(afu, irq0, 5));
+	ASSERT(afu->stats.irq_histograms[5] != NULL);
+	ASSERT(OCXL_OK == ocxl_irq_set_histogram_group(afu, irq0, 0));
+
+	// The wait for an IRQ is in the event check's latency, but not the IRQ's harvest latency
+	uint64_t handle = ocxl_irq_get_handle(afu, irq1);
+	pthread_t firer;
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 3, OCXL_HISTOGRAM_RESET, NULL));
+	ASSERT(0 == pthread_create(&firer, NULL, histogram_test_firer, &handle));
+	int found = ocxl_afu_event_check(afu, 1000, events, 8);
+	pthread_join(firer, NULL);
+	ASSERT(found == 1);
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_EVENT_CHECK, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 1);
+	ASSERT(ocxl_histogram_percentile(snapshot, 100) >= HISTOGRAM_TEST_WAIT_US * 1000);
+	ASSERT(OCXL_OK == ocxl_afu_get_event_histogram(afu, 3, 0, snapshot));
+	ASSERT(ocxl_histogram_count(snapshot) == 1);
+	ASSERT(ocxl_histogram_percentile(snapshot, 100) < HISTOGRAM_TEST_WAIT_US * 1000);
+
+	ASSERT(OCXL_INVALID_ARGS == ocxl_afu_get_event_histogram(afu, OCXL_HISTOGRAM_IRQ_GROUPS, 0, snapshot));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_afu_get_event_histogram(afu, -2, 0, snapshot));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_afu_get_event_histogram(afu, 0, 0, NULL));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_irq_set_histogram_group(afu, irq0, OCXL_HISTOGRAM_IRQ_GROUPS));
+	ASSERT(OCXL_NO_IRQ == ocxl_irq_set_histogram_group(afu, 2, 1));
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	ocxl_histogram_free(snapshot);
+}
+
+/**
+ * Check the background sampler reports the increase of AFU counters, across wrapping & a full ring
+ */
+static void test_sampler() {
+	test_start("SAMPLER", "ocxl_sampler_start");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_sampler_h sampler = NULL;
+	ocxl_mmio_h global;
+	ocxl_sample *samples = calloc(OCXL_SAMPLER_RING_DEFAULT, sizeof(ocxl_sample));
+	void *mmio = map_global_mmio();
+	const off_t registers[] = { AFUPerfCnt0_AFP_REGISTER, AFUPerfCnt1_AFP_REGISTER };
+
+	ASSERT(mmio && samples);
+	volatile uint64_t *counters = (uint64_t *)((char *)mmio + AFUPerfCnt0_AFP_REGISTER);
+	counters[0] = htole64(0);
+	counters[1] = htole64(UINT64_MAX - 1000); // Wraps while sampled
+
+	ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_GLOBAL_MMIO, &global));
+
+	ASSERT(OCXL_INVALID_ARGS == ocxl_sampler_start(global, registers, 0, OCXL_MMIO_LITTLE_ENDIAN, 1000, 0, &sampler));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_sampler_start(global, registers, OCXL_SAMPLER_MAX_COUNTERS + 1,
+	                            OCXL_MMIO_LITTLE_ENDIAN, 1000, 0, &sampler));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_sampler_start(global, registers, 2, OCXL_MMIO_LITTLE_ENDIAN, 0, 0, &sampler));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_sampler_start(global, registers, 2, OCXL_MMIO_LITTLE_ENDIAN,
+	                            OCXL_SAMPLER_MAX_RATE + 1, 0, &sampler));
+	ASSERT(OCXL_INVALID_ARGS == ocxl_sampler_start(global, registers, 2, OCXL_MMIO_LITTLE_ENDIAN, 1000,
+	                            OCXL_SAMPLER_RING_MAX + 1, &sampler));
+	const off_t beyond[] = { GLOBAL_MMIO_SIZE };
+	ASSERT(OCXL_OUT_OF_BOUNDS == ocxl_sampler_start(global, beyond, 1, OCXL_MMIO_LITTLE_ENDIAN, 1000, 0, &sampler));
+	ASSERT(sampler == NULL);
+
+	ASSERT(OCXL_OK == ocxl_sampler_start(global, registers, 2, OCXL_MMIO_LITTLE_ENDIAN, 1000, 0, &sampler));
+	for (int i = 0; i < 50; i++) {
+		counters[0] = htole64(le64toh(counters[0]) + 10);
+		counters[1] = htole64(le64toh(counters[1]) + 100);
+		usleep(1000);
+	}
+	usleep(10000);
+
+	size_t count = ocxl_sampler_read(sampler, samples, OCXL_SAMPLER_RING_DEFAULT);
+	ASSERT(count >= 10);
+	uint64_t totals[2] = { 0, 0 };
+	for (size_t i = 0; i < count; i++) {
+		ASSERT(samples[i].interval_ns > 0);
+		if (i > 0) {
+			ASSERT(samples[i].timestamp == samples[i - 1].timestamp + samples[i].interval_ns);
+		}
+		totals[0] += samples[i].deltas[0];
+		totals[1] += samples[i].deltas[1];
+		ASSERT(samples[i].deltas[2] == 0);
+	}
+	ASSERT(totals[0] == 500);
+	ASSERT(totals[1] == 5000);
+	ASSERT(ocxl_sampler_merged(sampler) == 0);
+	ocxl_sampler_stop(sampler);
+	sampler = NULL;
+
+	// Samples which do not fit in the ring are merged into the next, so nothing is lost
+	ASSERT(OCXL_OK == ocxl_sampler_start(global, registers, 1, OCXL_MMIO_LITTLE_ENDIAN, 1000, 2, &sampler));
+	counters[0] = htole64(le64toh(counters[0]) + 7);
+	usleep(20000);
+	ASSERT(ocxl_sampler_merged(sampler) > 0);
+	count = ocxl_sampler_read(sampler, samples, 8);
+	ASSERT(count == 2);
+	totals[0] = samples[0].deltas[0] + samples[1].deltas[0];
+	counters[0] = htole64(le64toh(counters[0]) + 5);
+	for (int i = 0; i < 1000 && totals[0] != 12; i++) {
+		usleep(1000);
+		count = ocxl_sampler_read(sampler, samples, 8);
+		for (size_t sample = 0; sample < count; sample++) {
+			totals[0] += samples[sample].deltas[0];
+		}
+	}
+	ASSERT(totals[0] == 12);
+
+	test_stop(SUCCESS);
+
+end:
+	ocxl_sampler_stop(sampler);
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	if (mmio) {
+		munmap(mmio, GLOBAL_MMIO_SIZE);
+	}
+	free(samples);
+}
+
+extern bool timestamp_counter;
+extern bool timestamp_calibrated;
+extern uint64_t timestamp_mult;
+extern uint64_t timestamp_base_ticks;
+extern uint64_t timestamp_base_ns;
+
+/**
+ * Check timestamps come from the CPU counter where it is invariant, & convert to CLOCK_MONOTONIC
+ */
+static void test_timestamp() {
+	test_start("TIMESTAMP", "ocxl_timestamp");
+
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+
+	const char *source = getenv("LIBOCXL_TIMESTAMP");
+	if (!source || strcasecmp(source, "clock")) {
+		ASSERT(timestamp_counter == timestamp_counter_invariant());
+	}
+
+	uint64_t previous = ocxl_timestamp();
+	for (int i = 0; i < 1000; i++) {
+		uint64_t timestamp = ocxl_timestamp();
+		ASSERT(timestamp >= previous);
+		previous = timestamp;
+	}
+	ASSERT(timestamp_interval_ns(previous, previous) == 0);
+
+	// Converted timestamps fall between the clock readings around them
+	for (int i = 0; i < 100; i++) {
+		uint64_t before = timestamp_monotonic_ns();
+		uint64_t timestamp = ocxl_timestamp();
+		uint64_t after = timestamp_monotonic_ns();
+		uint64_t ns = ocxl_timestamp_to_ns(timestamp);
+		ASSERT(ns + 100000 >= before);
+		ASSERT(ns <= after + 100000);
+	}
+
+	// Intervals agree with the clock
+	uint64_t clock_start = timestamp_monotonic_ns();
+	uint64_t start = ocxl_timestamp();
+	usleep(20000);
+	uint64_t end = ocxl_timestamp();
+	uint64_t clock_ns = timestamp_monotonic_ns() - clock_start;
+	uint64_t ns = ocxl_timestamp_to_ns(end) - ocxl_timestamp_to_ns(start);
+	ASSERT(ns >= 20000000);
+	ASSERT(ns <= clock_ns + clock_ns / 100);
+	ASSERT(timestamp_interval_ns(start, end) == ns || timestamp_interval_ns(start, end) + 1 == ns ||
+	       timestamp_interval_ns(start, end) == ns + 1);
+
+	// Timestamps taken before the base convert to earlier times
+	if (timestamp_counter) {
+		ASSERT(ocxl_timestamp_to_ns(timestamp_base_ticks - 1000000) < timestamp_base_ns);
+	}
+
+	// Loading never waits: a rate the CPU does not report is measured once, as the first AFU is opened
+	uint64_t mult = timestamp_mult;
+	clock_start = timestamp_monotonic_ns();
+	timestamp_init();
+	ASSERT(timestamp_monotonic_ns() - clock_start < 1000000);
+	if (timestamp_counter && !timestamp_calibrated) {
+		ASSERT(OCXL_OK == ocxl_afu_open_from_dev(dummy_dev_path, &afu));
+		ASSERT(timestamp_calibrated);
+		ASSERT(timestamp_mult >= mult - mult / 100 && timestamp_mult <= mult + mult / 100);
+
+		// Later conversions do not measure it again
+		mult = timestamp_mult;
+		start = ocxl_timestamp();
+		usleep(6000);
+		ns = timestamp_interval_ns(start, ocxl_timestamp());
+		ASSERT(timestamp_mult == mult);
+
+		// Without an AFU, the first conversion measures it
+		timestamp_init();
+		ASSERT(!timestamp_calibrated);
+		ns = ocxl_timestamp_to_ns(ocxl_timestamp());
+		ASSERT(timestamp_calibrated);
+		ASSERT(timestamp_mult >= mult - mult / 100 && timestamp_mult <= mult + mult / 100);
+	}
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+}
+
+uint64_t doorbell_value;
+uint32_t doorbell_pasid;
+
+/**
+ * Record & clear a doorbell
+ */
+static void record_doorbell(virtocxl_context *context, uint64_t offset, uint64_t value,
+                            __attribute__((unused)) void *data) {
+	uint64_t *pp_mmio = virtocxl_context_pp_mmio(context);
+
+	doorbell_pasid = virtocxl_context_pasid(context);
+	pp_mmio[offset / 8] = 0;
+	__atomic_store_n(&doorbell_value, value, __ATOMIC_RELEASE);
+}
+
+/**
+ * Drive a MEMCPY3 model through the per-PASID MMIO area & IRQs of the virtual device
+ */
+static void test_memcpy3_device() {
+	test_start("MEMCPY3", "device");
+
+	virtocxl_device *device = NULL;
+	ocxl_afu_h afu = OCXL_INVALID_AFU;
+	ocxl_mmio_h pp;
+	ocxl_irq_h irq;
+	ocxl_event event;
+	uint64_t value;
+	memcpy3_queue queue = {
+		.queue = aligned_alloc(MEMCPY3_QUEUE_SIZE, MEMCPY3_QUEUE_SIZE),
+		.length = MEMCPY3_QUEUE_LENGTH,
+	};
+	char src[256], dst[256];
+	virtocxl_device_config config = {
+		.afu_name = "IBM,MEMCPY3",
+		.version_major = 3,
+		.global_mmio_size = 4096,
+		.pp_mmio_size = PER_PASID_MMIO_SIZE,
+	};
+
+	ASSERT(queue.queue);
+	memset(queue.queue, 0, MEMCPY3_QUEUE_SIZE);
+
+	device = virtocxl_device_create(&config);
+	ASSERT(device);
+	virtocxl_device_set_context_hooks(device, memcpy3_context_open, memcpy3_context_close, NULL);
+	ASSERT(0 == virtocxl_device_watch_register(device, DOORBELL_OFFSET, record_doorbell, NULL));
+	ASSERT(0 == virtocxl_devices_wait(&device, 1, 5000));
+
+	ASSERT(OCXL_OK == ocxl_afu_open("IBM,MEMCPY3", &afu));
+	ASSERT(OCXL_OK == ocxl_afu_attach(afu, OCXL_ATTACH_FLAGS_NONE));
+	ASSERT(OCXL_OK == ocxl_mmio_map(afu, OCXL_PER_PASID_MMIO, &pp));
+
+	// The host & the emulator share the per-PASID MMIO area
+	virtocxl_context *context = virtocxl_device_find_context(device, ocxl_afu_get_pasid(afu));
+	ASSERT(context);
+	ASSERT(virtocxl_context_data(context));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(pp, DOORBELL_OFFSET, OCXL_MMIO_LITTLE_ENDIAN, 0xd00bd00b));
+	while (!__atomic_load_n(&doorbell_value, __ATOMIC_ACQUIRE)) {
+		;
+	}
+	ASSERT(doorbell_value == 0xd00bd00b);
+	ASSERT(doorbell_pasid == ocxl_afu_get_pasid(afu));
+	ASSERT(OCXL_OK == ocxl_mmio_read64(pp, DOORBELL_OFFSET, OCXL_MMIO_LITTLE_ENDIAN, &value));
+	ASSERT(value == 0);
+
+	// Copy, then raise an IRQ
+	ASSERT(OCXL_OK == ocxl_irq_alloc(afu, NULL, &irq));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(pp, MEMCPY3_PP_IRQ, OCXL_MMIO_LITTLE_ENDIAN,
+	                                    ocxl_irq_get_handle(afu, irq)));
+	ASSERT(OCXL_OK == ocxl_mmio_write64(pp, MEMCPY3_PP_WED, OCXL_MMIO_LITTLE_ENDIAN,
+	                                    MEMCPY3_WED(queue.queue, MEMCPY3_QUEUE_SIZE / MEMCPY3_CACHELINESIZE)));
+
+	for (size_t i = 0; i < sizeof(src); i++) {
+		src[i] = i;
+	}
+	memset(dst, 0, sizeof(dst));
+	memcpy3_work_element *copy_we = memcpy3_submit(&queue, MEMCPY3_WE_CMD_COPY, sizeof(src),
+	                                (uintptr_t)src, (uintptr_t)dst);
+	memcpy3_submit(&queue, MEMCPY3_WE_CMD_IRQ, 0, ocxl_irq_get_handle(afu, irq), 0);
+
+	ASSERT(1 == ocxl_afu_event_check(afu, 1000, &event, 1));
+	ASSERT(event.type == OCXL_EVENT_IRQ);
+	ASSERT(event.irq.irq == irq);
+	ASSERT(copy_we->status == MEMCPY3_WE_STATUS_COMPLETE);
+	ASSERT(!memcmp(src, dst, sizeof(src)));
+
+	ASSERT(OCXL_OK == ocxl_mmio_read64(pp, MEMCPY3_PP_STATUS, OCXL_MMIO_LITTLE_ENDIAN, &value));
+	ASSERT(value & MEMCPY3_PP_STATUS_Stopped);
+
+	test_stop(SUCCESS);
+
+end:
+	if (afu) {
+		ocxl_afu_close(afu);
+	}
+	if (device) {
+		virtocxl_device_destroy(device);
+	}
+	free(queue.queue);
+}
+
+static void exit_handler() {
+	if (afu_device) {
+		term_afu();
+		afu_device = NULL;
+	}
+}
+
+int main(__attribute__((unused)) int args, __attribute__((unused)) const char **argv) {
+	struct sigaction sa;
+	sa.sa_handler = exit_handler;
+	sigemptyset(&(sa.sa_mask));
+	sa.sa_flags = 0;
+	(void)sigaction(SIGINT, &sa, NULL);
+
+	ocxl_set_sys_path(ocxl_sysfs_path);
+	ocxl_set_dev_path(virtocxl_dev_path());
+	snprintf(dummy_dev_path, sizeof(dummy_dev_path), "%s/%s", virtocxl_dev_path(), DUMMY_DEVICE);
+
+	ocxl_enable_messages(OCXL_ERRORS);
+
+	struct stat sysfs_stat;
+	if (stat(ocxl_sysfs_path, &sysfs_stat)) {
+		if (mkdir(ocxl_sysfs_path, 0775)) {
+			fprintf(stderr, "Could not mkdir '%s': %d: %s\n",
+					ocxl_sysfs_path, errno, strerror(errno));
+		}
+	}
+
+	test_afu_init();
+	test_ocxl_afu_alloc();
+	test_device_matches();
+
+	test_memcpy3_copy();
+	test_memcpy3_irq();
+	test_memcpy3_atomic_cas();
+	test_memcpy3_thread();
+
+	test_afp3_bandwidth();
+	test_afp3_latency();
+
+	test_irq_emulation();
+
+	printf("Using %s virtual devices in '%s'\n", virtocxl_transport_name(), virtocxl_dev_path());
+	create_afu();
+
+	test_populate_metadata();
+	test_afu_getters();
+	test_get_afu_by_path();
+	test_afu_open();
+	test_ocxl_afu_open_specific();
+	test_ocxl_afu_open_from_dev();
+	test_ocxl_afu_open();
+	test_ocxl_afu_attach();
+	test_ocxl_afu_close();
+	test_backend();
+
+	test_ocxl_set_error_message_handler();
+	test_ocxl_set_afu_error_message_handler();
+
+	test_ocxl_mmio_map();
+	test_mmio_check();
+	test_ocxl_mmio_read32_native();
+	test_ocxl_mmio_read64_native();
+	test_ocxl_mmio_read32();
+	test_ocxl_mmio_read64();
+
+	test_afp3_device();
+	test_ocxl_irq_event_check();
+	test_ocxl_fault_event_check();
+	test_syscall_budgets();
+	test_allocation_free_steady_state();
+	test_buffer_growth();
+	test_simulated_clock();
+	test_topology();
+	test_trace();
+	test_trace_categories();
+	test_trace_flusher();
+	test_afu_stats();
+	test_stats_shm();
+	test_stats_shm_fork();
+	test_event_histograms();
+	test_sampler();
+	test_timestamp();
+	test_memcpy3_device();
 
 	test_read_afu_event();
-	// Disabled as we need epoll support in CUSE to test this
-	// test_ocxl_afu_event_check_versioned();
+	test_ocxl_afu_event_check_versioned();
 
 	exit_handler();
 
@@ -14,260 +14,1051 @@
  * limitations under the License.
  */
 
-#include "libocxl_internal.h"
-#include <fuse/cuse_lowlevel.h>
-#include <fuse/fuse_lowlevel.h>
+#define _GNU_SOURCE /* memfd_create */
+#include "virtocxl_internal.h"
 #include <linux/poll.h>
 #include <misc/ocxl.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sched.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 
-typedef struct ocxl_kernel_event_header ocxl_kernel_event_header;
-typedef struct ocxl_kernel_event_xsl_fault_error ocxl_kernel_event_xsl_fault_error;
-#define KERNEL_EVENT_SIZE (sizeof(ocxl_kernel_event_header) + sizeof(ocxl_kernel_event_xsl_fault_error))
+/* The number of idle scans of the watched registers before the watcher yields the CPU */
+#define WATCH_SPIN_LIMIT 1024
 
-ocxl_kernel_event_xsl_fault_error translation_fault = { .addr = 0 };
-bool afu_attached = false;
-const char *sysfs_path = NULL;
+static pthread_mutex_t devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static virtocxl_device *devices = NULL;
+static virtocxl_device *default_device = NULL;
+static uint32_t next_device_id = 0;
 
-static uint8_t version_major = 5;
-static uint8_t version_minor = 10;
-static size_t _global_mmio_size = 0;
-static size_t _pp_mmio_size = 0;
+/**
+ * Create the per-PASID MMIO area of a context, shared between the host & the emulator
+ *
+ * @param context the context
+ * @return 0 on success, an errno value otherwise
+ */
+static int create_pp_mmio(virtocxl_context *context)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	char name[DEVICE_NAME_MAX + 16];
+	int rc;
+
+	context->pp_mmio_fd = -1;
+	if (!context->device->pp_mmio_size) {
+		return 0;
+	}
+
+	context->pp_mmio_length = (context->device->pp_mmio_size + page_size - 1) & ~(page_size - 1);
+
+	snprintf(name, sizeof(name), "%s-%u", context->device->name, context->pasid);
+	context->pp_mmio_fd = memfd_create(name, MFD_CLOEXEC);
+	if (context->pp_mmio_fd < 0) {
+		return errno;
+	}
+
+	if (ftruncate(context->pp_mmio_fd, context->pp_mmio_length)) {
+		rc = errno;
+		goto err;
+	}
+
+	context->pp_mmio = mmap(NULL, context->pp_mmio_length, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                        context->pp_mmio_fd, 0);
+	if (context->pp_mmio == MAP_FAILED) {
+		context->pp_mmio = NULL;
+		rc = errno;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	close(context->pp_mmio_fd);
+	context->pp_mmio_fd = -1;
+	return rc;
+}
+
+/**
+ * Free the per-PASID MMIO area of a context
+ *
+ * @param context the context
+ */
+static void free_pp_mmio(virtocxl_context *context)
+{
+	if (context->pp_mmio) {
+		munmap(context->pp_mmio, context->pp_mmio_length);
+		context->pp_mmio = NULL;
+	}
+
+	if (context->pp_mmio_fd >= 0) {
+		close(context->pp_mmio_fd);
+		context->pp_mmio_fd = -1;
+	}
+}
+
+/**
+ * Open a new context on a device, as the transport opens the device node
+ *
+ * The lowest free PASID is assigned to the new context.
+ *
+ * @param device the device
+ * @param[out] context_out the new context
+ * @return 0 on success, an errno value otherwise (ENOSPC if the device has no free contexts)
+ */
+int virtocxl_context_open(virtocxl_device *device, virtocxl_context **context_out)
+{
+	virtocxl_context *context;
+	uint32_t slot;
+
+	pthread_mutex_lock(&device->lock);
+
+	for (slot = 0; slot < device->max_contexts; slot++) {
+		if (!device->contexts[slot]) {
+			break;
+		}
+	}
+
+	if (slot == device->max_contexts) {
+		pthread_mutex_unlock(&device->lock);
+		return ENOSPC;
+	}
+
+	context = calloc(1, sizeof(*context));
+	if (!context) {
+		pthread_mutex_unlock(&device->lock);
+		return ENOMEM;
+	}
+
+	context->device = device;
+	context->slot = slot;
+	context->pasid = VIRTOCXL_PASID_BASE + slot;
+
+	int rc = create_pp_mmio(context);
+	if (rc) {
+		pthread_mutex_unlock(&device->lock);
+		free(context);
+		return rc;
+	}
+
+	if (device->open_hook) {
+		context->data = device->open_hook(context, device->hook_data);
+	}
 
+	device->contexts[slot] = context;
+	device->context_count++;
+	device->latest = context;
 
-static void afu_open(fuse_req_t req, struct fuse_file_info *fi)
+	pthread_mutex_unlock(&device->lock);
+
+	*context_out = context;
+	return 0;
+}
+
+/**
+ * Free the resources of a context, with the device lock held
+ *
+ * @param context the context
+ */
+static void free_context(virtocxl_context *context)
 {
-	afu_attached = false;
-	fuse_reply_open(req, fi);
+	virtocxl_device *device = context->device;
+
+	if (device->close_hook) {
+		device->close_hook(context, context->data, device->hook_data);
+	}
+	virtocxl_irq_free_all(&context->irqs);
+	free_pp_mmio(context);
+	if (virtocxl_active_transport.release) {
+		virtocxl_active_transport.release(context);
+	}
+	free(context);
 }
 
-static void afu_read(fuse_req_t req, size_t size, off_t off, __attribute__((unused)) struct fuse_file_info *fi)
+/**
+ * Release a context, as the transport closes the device node
+ *
+ * @param context the context
+ */
+void virtocxl_context_release(virtocxl_context *context)
+{
+	virtocxl_device *device = context->device;
+
+	pthread_mutex_lock(&device->lock);
+	device->contexts[context->slot] = NULL;
+	device->context_count--;
+	if (device->latest == context) {
+		device->latest = NULL;
+	}
+	free_context(context);
+	pthread_mutex_unlock(&device->lock);
+}
+
+/**
+ * Read the oldest pending event of a context, flagged as the last if no others are pending
+ *
+ * @param context the context
+ * @param buf the buffer to read into
+ * @param size the size of the buffer
+ * @return the number of bytes read (0 if the buffer is too small for the event), or -EAGAIN if there is no event
+ */
+ssize_t virtocxl_context_read(virtocxl_context *context, void *buf, size_t size)
 {
-	char buf[KERNEL_EVENT_SIZE];
 	ocxl_kernel_event_header header = {
 			.type = OCXL_AFU_EVENT_XSL_FAULT_ERROR,
 			.flags = OCXL_KERNEL_EVENT_FLAG_LAST,
 	};
+	ssize_t ret;
 
-	if (0 != off) {
-		fuse_reply_err(req, EINVAL);
-		return;
-	}
+	pthread_mutex_lock(&context->device->lock);
 
-	if (translation_fault.addr == 0) {
-		fuse_reply_err(req, EAGAIN);
-		return;
-	}
+	if (context->fault_count == 0) {
+		if (context->spurious) {
+			context->spurious = false;
+			if (virtocxl_active_transport.consumed) {
+				virtocxl_active_transport.consumed(context);
+			}
+		}
+		ret = -EAGAIN;
+	} else if (size < KERNEL_EVENT_SIZE) {
+		ret = 0;
+	} else {
+		ocxl_kernel_event_xsl_fault_error *fault = context->faults + context->fault_head;
 
-	if (size < KERNEL_EVENT_SIZE) {
-		fuse_reply_buf(req, buf, 0);
-		return;
-	}
+		context->fault_head = (context->fault_head + 1) % VIRTOCXL_FAULT_QUEUE_DEPTH;
+		context->fault_count--;
+		if (context->fault_count) {
+			header.flags = 0;
+		}
+
+		memcpy(buf, &header, sizeof(header));
+		memcpy((char *)buf + sizeof(header), fault, sizeof(*fault));
 
-	memcpy(buf, &header, sizeof(header));
-	memcpy(buf + sizeof(header), &translation_fault, sizeof(translation_fault));
+		if (!context->fault_count && virtocxl_active_transport.consumed) {
+			virtocxl_active_transport.consumed(context);
+		}
+		ret = KERNEL_EVENT_SIZE;
+	}
 
-	fuse_reply_buf(req, buf, size);
+	pthread_mutex_unlock(&context->device->lock);
 
-	translation_fault.addr = 0;
+	return ret;
 }
 
-static void afu_ioctl(fuse_req_t req, int cmd, __attribute__((unused)) void *arg,
-		__attribute__((unused)) struct fuse_file_info *fi, __attribute__((unused)) unsigned flags,
-		__attribute__((unused)) const void *in_buf, __attribute__((unused)) size_t in_bufsz,
-		__attribute__((unused)) size_t out_bufsz)
+/**
+ * Handle an ioctl on a context
+ *
+ * @param context the context
+ * @param cmd the ioctl command
+ * @param arg the argument, a buffer of _IOC_SIZE(cmd) bytes, which is copied back to the caller
+ *            for commands which read
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_context_ioctl(virtocxl_context *context, unsigned long cmd, void *arg)
 {
-	struct ocxl_ioctl_metadata ret;
+	virtocxl_device *device = context->device;
+	struct ocxl_ioctl_metadata *metadata = arg;
+	struct ocxl_ioctl_irq_fd *irq_fd = arg;
+	uint64_t *irq_offset = arg;
+	int rc = 0;
+
+	pthread_mutex_lock(&device->lock);
 
 	switch (cmd) {
 	case OCXL_IOCTL_ATTACH:
-		afu_attached = true;
-		fuse_reply_ioctl(req, 0, NULL, 0);
+		if (context->attached) {
+			rc = EINVAL;
+			break;
+		}
+		context->attached = true;
 		break;
 
 	case OCXL_IOCTL_GET_METADATA:
-		memset(&ret, 0, sizeof(ret));
+		memset(metadata, 0, sizeof(*metadata));
+
+		metadata->version = 1;
 
-		ret.version = 1;
+		metadata->afu_version_major = device->version_major;
+		metadata->afu_version_minor = device->version_minor;
+		metadata->pasid = context->pasid;
+		metadata->pp_mmio_size = device->pp_mmio_size;
+		metadata->global_mmio_size = device->global_mmio_size;
+		break;
 
-		ret.afu_version_major = version_major;
-		ret.afu_version_minor = version_minor;
-		ret.pasid = 1234;
-		ret.pp_mmio_size = _pp_mmio_size;
-		ret.global_mmio_size = _global_mmio_size;
+	case OCXL_IOCTL_IRQ_ALLOC:
+		rc = virtocxl_irq_alloc(&context->irqs, irq_offset);
+		break;
 
-		fuse_reply_ioctl(req, 0, &ret, sizeof(ret));
+	case OCXL_IOCTL_IRQ_FREE:
+		rc = virtocxl_irq_free(&context->irqs, *irq_offset);
+		break;
 
+	case OCXL_IOCTL_IRQ_SET_FD:
+		// The transports run in the caller's process, so the eventfd number is valid here
+		rc = virtocxl_irq_set_fd(context->irqs, irq_fd->irq_offset, irq_fd->eventfd);
 		break;
 
 	default:
-		fuse_reply_err(req, EINVAL);
+		rc = EINVAL;
 	}
+
+	pthread_mutex_unlock(&device->lock);
+
+	return rc;
 }
 
-static void afu_poll (fuse_req_t req, __attribute__((unused)) struct fuse_file_info *fi,
-		__attribute__((unused)) struct fuse_pollhandle *ph)
+/**
+ * Get the poll events of a context
+ *
+ * @param context the context
+ * @return the poll events
+ */
+unsigned virtocxl_context_poll(virtocxl_context *context)
 {
-	if (translation_fault.addr != 0) {
-		fuse_reply_poll(req, POLLIN | POLLRDNORM);
-	} else if (!afu_attached) {
-		fuse_reply_poll(req, POLLERR);
+	unsigned events;
+
+	pthread_mutex_lock(&context->device->lock);
+	if (context->fault_count || context->spurious) {
+		events = POLLIN | POLLRDNORM;
+	} else if (!context->attached) {
+		events = POLLERR;
+	} else {
+		events = 0;
 	}
+	pthread_mutex_unlock(&context->device->lock);
 
-	fuse_reply_poll(req, 0);
+	return events;
 }
 
-#define DEVICE_NAME_MAX 64
-#define BUF_SIZE 1024
+/**
+ * Map part of a context, serving the per-PASID MMIO area below VIRTOCXL_IRQ_OFFSET_BASE,
+ * and IRQ trigger pages above it
+ *
+ * @param context the context
+ * @param addr the address hint
+ * @param length the length of the mapping
+ * @param prot the protection of the mapping
+ * @param flags the mapping flags
+ * @param offset the offset into the device
+ * @return the mapping, or MAP_FAILED with errno set on error
+ */
+void *virtocxl_context_mmap(virtocxl_context *context, void *addr, size_t length, int prot, int flags,
+                            off_t offset)
+{
+	if ((uint64_t)offset < VIRTOCXL_IRQ_OFFSET_BASE) {
+		if (context->pp_mmio_fd < 0 || offset < 0 || (uint64_t)offset + length > context->pp_mmio_length) {
+			errno = EINVAL;
+			return MAP_FAILED;
+		}
 
-typedef struct afu_thread_info {
-	char device_name[DEVICE_NAME_MAX];
-	struct cuse_info cuse;
-	struct cuse_lowlevel_ops afu_ops;
-} afu_thread_info;
+		return mmap(addr, length, prot, flags, context->pp_mmio_fd, offset);
+	}
 
-afu_thread_info afu_info;
-struct fuse_session *afu_session = NULL;
+	void *page;
+	pthread_mutex_lock(&context->device->lock);
+	int rc = virtocxl_irq_map(context->irqs, offset, length, &page);
+	pthread_mutex_unlock(&context->device->lock);
+	if (rc) {
+		errno = rc;
+		return MAP_FAILED;
+	}
 
-static void *start_afu_thread(void *arg) {
-	afu_thread_info *info = (afu_thread_info *)arg;
+	return page;
+}
 
-	char dev_name[PATH_MAX+9] = "DEVNAME=";
-	const char *dev_info_argv[] = { dev_name };
-	strncat(dev_name, info->device_name, sizeof(dev_name) - 9);
+/**
+ * Create the sysfs entry of a device, with its global MMIO area backed by a memfd
+ *
+ * The library opens the global_mmio_area file by path, so it is created as a link to
+ * the memfd in /proc.
+ *
+ * @param device the device
+ * @return 0 on success, -1 on error
+ */
+static int create_sysfs(virtocxl_device *device)
+{
+	char path[PATH_MAX + 32];
+	char target[64];
+	struct stat sysfs_stat;
 
-	memset(&info->cuse, 0, sizeof(info->cuse));
-	info->cuse.dev_major = 0;
-	info->cuse.dev_minor = 0;
-	info->cuse.dev_info_argc = 1;
-	info->cuse.dev_info_argv = dev_info_argv;
-	info->cuse.flags = 0;
+	if (stat(device->sysfs_path, &sysfs_stat)) {
+		if (mkdir(device->sysfs_path, 0775)) {
+			fprintf(stderr, "Could not mkdir '%s': %d: %s\n",
+					device->sysfs_path, errno, strerror(errno));
+			return -1;
+		}
+	}
 
-	char *argv[] = {
-			"testobj/unittests",
-			"-f",
-	};
+	device->global_mmio_fd = memfd_create(device->name, MFD_CLOEXEC);
+	if (device->global_mmio_fd < 0) {
+		fprintf(stderr, "Could not create global MMIO memfd for '%s': %d: %s\n",
+				device->name, errno, strerror(errno));
+		return -1;
+	}
 
-	struct fuse_args args = FUSE_ARGS_INIT(2, argv);
+	if (ftruncate(device->global_mmio_fd, device->global_mmio_size)) {
+		fprintf(stderr, "Could not size global MMIO memfd for '%s': %d: %s\n",
+				device->name, errno, strerror(errno));
+		return -1;
+	}
 
-	afu_session = cuse_lowlevel_setup(args.argc, args.argv, &info->cuse, &info->afu_ops, NULL, NULL);
-	(void)fuse_session_loop(afu_session);
+	snprintf(path, sizeof(path), "%s/global_mmio_area", device->sysfs_path);
+	snprintf(target, sizeof(target), "/proc/%d/fd/%d", getpid(), device->global_mmio_fd);
+	(void)unlink(path);
+	if (symlink(target, path)) {
+		fprintf(stderr, "Could not create global_mmio_area link '%s': %d: %s\n",
+				path, errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
 
+/**
+ * Create a new virtual OCXL device
+ *
+ * The device appears as <afu_name>.<card>:00:00.1.<afu_index> under the test device & sysfs paths.
+ *
+ * @param config the configuration of the device
+ * @return the device, or NULL on error
+ */
+virtocxl_device *virtocxl_device_create(const virtocxl_device_config *config)
+{
+	virtocxl_device *device = calloc(1, sizeof(*device));
+	if (!device) {
+		return NULL;
+	}
+
+	strncpy(device->afu_name, config->afu_name, AFU_NAME_MAX);
+	device->card = config->card ? config->card : 1;
+	device->afu_index = config->afu_index;
+	device->version_major = config->version_major;
+	device->version_minor = config->version_minor;
+	device->global_mmio_size = config->global_mmio_size;
+	device->pp_mmio_size = config->pp_mmio_size;
+	device->max_contexts = config->max_contexts ? config->max_contexts : VIRTOCXL_DEFAULT_MAX_CONTEXTS;
+	device->global_mmio_fd = -1;
+	pthread_mutex_init(&device->lock, NULL);
+
+	pthread_mutex_lock(&devices_lock);
+	device->id = next_device_id++;
+	pthread_mutex_unlock(&devices_lock);
+
+	snprintf(device->name, sizeof(device->name), "%s.%04x:00:00.1.%u",
+	         device->afu_name, device->card, device->afu_index);
+	snprintf(device->device_path, sizeof(device->device_path), "%s/%s",
+	         virtocxl_active_transport.dev_path, device->name);
+	snprintf(device->sysfs_path, sizeof(device->sysfs_path), "%s/%s", SYS_PATH, device->name);
+
+	device->contexts = calloc(device->max_contexts, sizeof(*device->contexts));
+	if (!device->contexts) {
+		goto err;
+	}
+
+	if (create_sysfs(device)) {
+		goto err;
+	}
+
+	if (virtocxl_active_transport.start(device)) {
+		fprintf(stderr, "Could not start %s device '%s'\n", virtocxl_active_transport.name, device->name);
+		goto err;
+	}
+
+	pthread_mutex_lock(&devices_lock);
+	device->next = devices;
+	devices = device;
+	pthread_mutex_unlock(&devices_lock);
+
+	return device;
+
+err:
+	if (device->global_mmio_fd >= 0) {
+		close(device->global_mmio_fd);
+	}
+	free(device->contexts);
+	pthread_mutex_destroy(&device->lock);
+	free(device);
 	return NULL;
 }
 
-void stop_afu() {
-	fuse_session_exit(afu_session);
+/**
+ * Destroy a virtual OCXL device
+ *
+ * @param device the device
+ */
+void virtocxl_device_destroy(virtocxl_device *device)
+{
+	char path[PATH_MAX + 32];
+	void *ret;
+
+	pthread_mutex_lock(&devices_lock);
+	for (virtocxl_device **prev = &devices; *prev; prev = &(*prev)->next) {
+		if (*prev == device) {
+			*prev = device->next;
+			break;
+		}
+	}
+	if (default_device == device) {
+		default_device = NULL;
+	}
+	pthread_mutex_unlock(&devices_lock);
+
+	if (device->watching) {
+		device->watching = false;
+		pthread_join(device->watch_thread, &ret);
+	}
+
+	virtocxl_active_transport.stop(device);
+
+	// Contexts the host left open
+	pthread_mutex_lock(&device->lock);
+	for (uint32_t slot = 0; slot < device->max_contexts; slot++) {
+		if (device->contexts[slot]) {
+			free_context(device->contexts[slot]);
+			device->contexts[slot] = NULL;
+		}
+	}
+	pthread_mutex_unlock(&device->lock);
+	free(device->contexts);
+
+	snprintf(path, sizeof(path), "%s/global_mmio_area", device->sysfs_path);
+	(void)unlink(path);
+	(void)rmdir(device->sysfs_path);
+	close(device->global_mmio_fd);
+
+	pthread_mutex_destroy(&device->lock);
+	free(device);
 }
 
-void term_afu() {
-	if (afu_session) {
-		fuse_session_destroy(afu_session);
-		afu_session = NULL;
+/**
+ * Create a topology of virtual OCXL devices
+ *
+ * Cards are numbered from config->card, and each carries AFU indexes 0 to afus - 1.
+ *
+ * @param config the configuration of each device
+ * @param cards the number of cards
+ * @param afus the number of AFUs on each card
+ * @param[out] devices_out the devices, an array of cards * afus entries
+ * @return 0 on success, -1 on error (no devices are left behind)
+ */
+int virtocxl_topology_create(const virtocxl_device_config *config, uint16_t cards, uint8_t afus,
+                             virtocxl_device **devices_out)
+{
+	virtocxl_device_config device_config = *config;
+	uint16_t first_card = config->card ? config->card : 1;
+	size_t count = 0;
+
+	for (uint16_t card = 0; card < cards; card++) {
+		for (uint8_t afu = 0; afu < afus; afu++) {
+			device_config.card = first_card + card;
+			device_config.afu_index = afu;
+
+			devices_out[count] = virtocxl_device_create(&device_config);
+			if (!devices_out[count]) {
+				virtocxl_topology_destroy(devices_out, count);
+				return -1;
+			}
+			count++;
+		}
 	}
+
+	return 0;
 }
 
 /**
- * Is the current AFU instance attached
- * @return true if the AFU is attached
+ * Destroy a topology of virtual OCXL devices
+ *
+ * @param devices_in the devices
+ * @param count the number of devices
  */
-bool afu_is_attached() {
-	return afu_attached;
+void virtocxl_topology_destroy(virtocxl_device **devices_in, size_t count)
+{
+	for (size_t i = 0; i < count; i++) {
+		virtocxl_device_destroy(devices_in[i]);
+		devices_in[i] = NULL;
+	}
 }
 
 /**
- * Create a new virtual OCXL device.
+ * Wait for the device nodes of some virtual devices to appear
  *
- * @param afu_name the name of the AFU
- * @param global_mmio_size the size of the global MMIO area
- * @param per_pasid_mmio_size the size of the per-PASID MMIO area
+ * Some transports (eg. CUSE) create the nodes asynchronously.
  *
- * @return the thread for the device, or 0 on error
+ * @param devices_in the devices
+ * @param count the number of devices
+ * @param timeout_ms how long to wait
+ * @return 0 if all nodes are present, -1 on timeout
  */
-pthread_t create_ocxl_device(const char *afu_name, size_t global_mmio_size, size_t per_pasid_mmio_size) {
-	char sysfs_base[PATH_MAX - 20];
-	char tmp[PATH_MAX];
-	char buf[BUF_SIZE];
+int virtocxl_devices_wait(virtocxl_device **devices_in, size_t count, int timeout_ms)
+{
+	struct stat dev_stat;
 
-	_global_mmio_size = global_mmio_size;
-	_pp_mmio_size = per_pasid_mmio_size;
+	for (int waited = 0; ; waited++) {
+		size_t ready = 0;
+		for (size_t i = 0; i < count; i++) {
+			if (!stat(devices_in[i]->device_path, &dev_stat)) {
+				ready++;
+			}
+		}
 
-	snprintf(afu_info.device_name, sizeof(afu_info.device_name), "ocxl-test/%s.0001:00:00.1.0", afu_name);
-	snprintf(sysfs_base, sizeof(sysfs_base), "%s/%s.0001:00:00.1.0", SYS_PATH, afu_name);
-	struct stat sysfs_stat;
+		if (ready == count) {
+			return 0;
+		}
 
-	if (stat(sysfs_base, &sysfs_stat)) {
-		if (mkdir(sysfs_base, 0775)) {
-			fprintf(stderr, "Could not mkdir '%s': %d: %s\n",
-					sysfs_base, errno, strerror(errno));
+		if (waited >= timeout_ms) {
+			return -1;
 		}
+
+		usleep(1000);
 	}
+}
 
-	// Create global MMIO area file
-	snprintf(tmp, sizeof(tmp), "%s/global_mmio_area", sysfs_base);
-	int fd = creat(tmp, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH);
-	if (fd < 0) {
-		fprintf(stderr, "Could not create global_mmio_area file '%s': %d: %s\n",
-				tmp, errno, strerror(errno));
-		return 0;
+/**
+ * Get the directory the virtual device nodes appear in, to be passed to ocxl_set_dev_path()
+ *
+ * @return the directory
+ */
+const char *virtocxl_dev_path()
+{
+	return virtocxl_active_transport.dev_path;
+}
+
+/**
+ * Get the name of the transport presenting the virtual devices to the library
+ *
+ * @return the name of the transport
+ */
+const char *virtocxl_transport_name()
+{
+	return virtocxl_active_transport.name;
+}
+
+/**
+ * Find a virtual device
+ *
+ * @param match called with the devices list locked, returns true for the device sought
+ * @param data passed to match
+ * @return the first matching device, or NULL if none match
+ */
+virtocxl_device *virtocxl_device_find(bool (*match)(virtocxl_device *device, void *data), void *data)
+{
+	virtocxl_device *device;
+
+	pthread_mutex_lock(&devices_lock);
+	for (device = devices; device; device = device->next) {
+		if (match(device, data)) {
+			break;
+		}
 	}
+	pthread_mutex_unlock(&devices_lock);
 
-	memset(buf, 0, sizeof(buf));
+	return device;
+}
 
-	for (size_t offset = 0; offset < global_mmio_size; offset += sizeof(buf)) {
-		int written = write(fd, buf, sizeof(buf));
-		if (written < 0) {
-			fprintf(stderr, "Could not write global_mmio_area file '%s': %d: %s\n",
-					tmp, errno, strerror(errno));
-			return 0;
+/**
+ * Get the device node path of a virtual device
+ *
+ * @param device the device
+ * @return the path
+ */
+const char *virtocxl_device_path(virtocxl_device *device)
+{
+	return device->device_path;
+}
+
+/**
+ * Map the global MMIO area of a virtual device, as seen by the AFU model
+ *
+ * Writes by the host through the library are visible through this mapping, and vice versa.
+ *
+ * @param device the device
+ * @return the mapping (of the device's global MMIO size), or NULL on error
+ */
+void *virtocxl_device_map_global_mmio(virtocxl_device *device)
+{
+	void *addr = mmap(NULL, device->global_mmio_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                  device->global_mmio_fd, 0);
+	if (addr == MAP_FAILED) {
+		fprintf(stderr, "Could not map global MMIO of '%s': %d: %s\n",
+				device->name, errno, strerror(errno));
+		return NULL;
+	}
+
+	return addr;
+}
+
+/**
+ * Count the open contexts on a virtual device
+ *
+ * @param device the device
+ * @return the number of open contexts
+ */
+uint32_t virtocxl_device_context_count(virtocxl_device *device)
+{
+	pthread_mutex_lock(&device->lock);
+	uint32_t count = device->context_count;
+	pthread_mutex_unlock(&device->lock);
+
+	return count;
+}
+
+/**
+ * Find an open context on a virtual device
+ *
+ * @param device the device
+ * @param pasid the PASID of the context
+ * @return the context, or NULL if there is no such context
+ */
+virtocxl_context *virtocxl_device_find_context(virtocxl_device *device, uint32_t pasid)
+{
+	virtocxl_context *context = NULL;
+
+	if (pasid < VIRTOCXL_PASID_BASE || pasid - VIRTOCXL_PASID_BASE >= device->max_contexts) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&device->lock);
+	context = device->contexts[pasid - VIRTOCXL_PASID_BASE];
+	pthread_mutex_unlock(&device->lock);
+
+	return context;
+}
+
+/**
+ * Is a context attached
+ *
+ * @param context the context
+ * @return true if the context is attached
+ */
+bool virtocxl_context_is_attached(virtocxl_context *context)
+{
+	return context->attached;
+}
+
+/**
+ * Raise a translation fault on a context, this should cause polling the context to register
+ * an event, and reading it to return the event.
+ *
+ * Faults are queued, and read back in the order they were raised.
+ *
+ * @param context the context
+ * @param addr the address of the fault
+ * @param dsisr the value of the PPC64 specific DSISR register (ignored elsewhere)
+ * @param count the number of times the translation fault has triggered an error
+ * @return 0 on success, ENOSPC if VIRTOCXL_FAULT_QUEUE_DEPTH faults are already pending (the fault is dropped)
+ */
+int virtocxl_context_translation_fault(virtocxl_context *context, void *addr,
+                                       __attribute__((unused)) uint64_t dsisr, uint64_t count)
+{
+	pthread_mutex_lock(&context->device->lock);
+
+	if (context->fault_count == VIRTOCXL_FAULT_QUEUE_DEPTH) {
+		pthread_mutex_unlock(&context->device->lock);
+		return ENOSPC;
+	}
+
+	ocxl_kernel_event_xsl_fault_error *fault =
+		context->faults + (context->fault_head + context->fault_count) % VIRTOCXL_FAULT_QUEUE_DEPTH;
+	fault->addr = (__u64)addr;
+#ifdef _ARCH_PPC64
+	fault->dsisr = dsisr;
+#endif
+	fault->count = count;
+
+	if (!context->fault_count++) {
+		virtocxl_active_transport.notify(context);
+	}
+	pthread_mutex_unlock(&context->device->lock);
+
+	return 0;
+}
+
+/**
+ * Wake the pollers of a context without queuing an event, as a spurious wakeup would.
+ *
+ * The context polls readable until it is next read, which finds no event.
+ *
+ * @param context the context
+ */
+void virtocxl_context_spurious_wakeup(virtocxl_context *context)
+{
+	pthread_mutex_lock(&context->device->lock);
+	if (!context->fault_count && !context->spurious) {
+		context->spurious = true;
+		virtocxl_active_transport.notify(context);
+	}
+	pthread_mutex_unlock(&context->device->lock);
+}
+
+/**
+ * Count the translation faults pending on a context
+ *
+ * @param context the context
+ * @return the number of faults which have not yet been read
+ */
+uint32_t virtocxl_context_pending_faults(virtocxl_context *context)
+{
+	pthread_mutex_lock(&context->device->lock);
+	uint32_t count = context->fault_count;
+	pthread_mutex_unlock(&context->device->lock);
+
+	return count;
+}
+
+/**
+ * Get the PASID of a context
+ *
+ * @param context the context
+ * @return the PASID
+ */
+uint32_t virtocxl_context_pasid(virtocxl_context *context)
+{
+	return context->pasid;
+}
+
+/**
+ * Get the per-PASID MMIO area of a context, as seen by the AFU model
+ *
+ * Writes by the host through the library are visible here, and vice versa.
+ *
+ * @param context the context
+ * @return the per-PASID MMIO area, or NULL if the device has none
+ */
+void *virtocxl_context_pp_mmio(virtocxl_context *context)
+{
+	return context->pp_mmio;
+}
+
+/**
+ * Get the data returned by the open hook for a context
+ *
+ * @param context the context
+ * @return the data
+ */
+void *virtocxl_context_data(virtocxl_context *context)
+{
+	return context->data;
+}
+
+/**
+ * Set hooks to be called as contexts are opened & closed on a device, typically to attach
+ * an AFU model to the per-PASID MMIO area of each context
+ *
+ * The hooks are called with the device lock held, so must not call back into the device.
+ *
+ * @param device the device
+ * @param open_hook called after a context is created, returns the data for the context (may be NULL)
+ * @param close_hook called before a context is freed (may be NULL)
+ * @param data passed to the hooks
+ */
+void virtocxl_device_set_context_hooks(virtocxl_device *device, virtocxl_context_open_hook open_hook,
+                                       virtocxl_context_close_hook close_hook, void *data)
+{
+	pthread_mutex_lock(&device->lock);
+	device->open_hook = open_hook;
+	device->close_hook = close_hook;
+	device->hook_data = data;
+	pthread_mutex_unlock(&device->lock);
+}
+
+/**
+ * Read a watched per-PASID register
+ *
+ * @param context the context
+ * @param offset the offset of the register
+ * @return the value of the register
+ */
+static uint64_t read_register(virtocxl_context *context, uint64_t offset)
+{
+	return __atomic_load_n((uint64_t *)((char *)context->pp_mmio + offset), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * The watcher thread, calls the register callbacks as the host changes the watched registers
+ *
+ * @param arg the device
+ * @return NULL
+ */
+static void *watch_thread(void *arg)
+{
+	virtocxl_device *device = arg;
+	uint32_t idle = 0;
+
+	while (device->watching) {
+		bool changed = false;
+
+		pthread_mutex_lock(&device->lock);
+		for (uint32_t slot = 0; slot < device->max_contexts; slot++) {
+			virtocxl_context *context = device->contexts[slot];
+			if (!context || !context->pp_mmio) {
+				continue;
+			}
+
+			for (uint32_t i = 0; i < device->watch_count; i++) {
+				watch *watch = device->watches + i;
+				uint64_t value = read_register(context, watch->offset);
+				if (value == context->watch_values[i]) {
+					continue;
+				}
+
+				changed = true;
+				watch->callback(context, watch->offset, value, watch->data);
+				// The callback may have consumed the value, eg. to clear a doorbell
+				context->watch_values[i] = read_register(context, watch->offset);
+			}
+		}
+		pthread_mutex_unlock(&device->lock);
+
+		if (changed) {
+			idle = 0;
+		} else if (++idle >= WATCH_SPIN_LIMIT) {
+			sched_yield();
+			idle = 0;
 		}
 	}
-	close(fd);
 
-	memset(&afu_info.afu_ops, 0, sizeof(afu_info.afu_ops));
-	afu_info.afu_ops.open = afu_open;
-	afu_info.afu_ops.read = afu_read;
-	afu_info.afu_ops.ioctl = afu_ioctl;
-	afu_info.afu_ops.poll = afu_poll;
+	return NULL;
+}
 
-	pthread_t afu_thread = 1;
-	if (pthread_create(&afu_thread, NULL, start_afu_thread, &afu_info)) {
-		fprintf(stderr, "Could not create AFU thread\n");
-		return 0;
+/**
+ * Watch a per-PASID register of every context on a device
+ *
+ * A watcher thread polls the register, and calls the callback when the host changes its value.
+ * Repeated writes of the same value are not seen, so doorbell registers should be cleared by
+ * the callback. The callback is called with the device lock held.
+ *
+ * @param device the device
+ * @param offset the offset of the 64 bit register in the per-PASID MMIO area
+ * @param callback the callback
+ * @param data passed to the callback
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_device_watch_register(virtocxl_device *device, uint64_t offset,
+                                   virtocxl_register_callback callback, void *data)
+{
+	if (offset % sizeof(uint64_t) || offset + sizeof(uint64_t) > device->pp_mmio_size) {
+		return EINVAL;
 	}
 
-	return afu_thread;
+	pthread_mutex_lock(&device->lock);
+
+	if (device->watch_count == VIRTOCXL_MAX_WATCHES) {
+		pthread_mutex_unlock(&device->lock);
+		return ENOSPC;
+	}
+
+	uint32_t index = device->watch_count;
+	for (uint32_t slot = 0; slot < device->max_contexts; slot++) {
+		virtocxl_context *context = device->contexts[slot];
+		if (context) {
+			context->watch_values[index] = read_register(context, offset);
+		}
+	}
+
+	device->watches[index].offset = offset;
+	device->watches[index].callback = callback;
+	device->watches[index].data = data;
+	device->watch_count++;
+
+	int rc = 0;
+	if (!device->watching) {
+		device->watching = true;
+		rc = pthread_create(&device->watch_thread, NULL, watch_thread, device);
+		if (rc) {
+			device->watching = false;
+			device->watch_count--;
+		}
+	}
+
+	pthread_mutex_unlock(&device->lock);
+
+	return rc;
+}
+
+/**
+ * Create a new virtual OCXL device, on card 1, AFU index 0.
+ *
+ * @param afu_name the name of the AFU
+ * @param global_mmio_size the size of the global MMIO area
+ * @param per_pasid_mmio_size the size of the per-PASID MMIO area
+ *
+ * @return the device, or NULL on error
+ */
+virtocxl_device *create_ocxl_device(const char *afu_name, size_t global_mmio_size, size_t per_pasid_mmio_size) {
+	virtocxl_device_config config = {
+		.afu_name = afu_name,
+		.card = 1,
+		.afu_index = 0,
+		.version_major = 5,
+		.version_minor = 10,
+		.global_mmio_size = global_mmio_size,
+		.pp_mmio_size = per_pasid_mmio_size,
+	};
+
+	virtocxl_device *device = virtocxl_device_create(&config);
+	if (device) {
+		default_device = device;
+	}
+
+	return device;
+}
+
+void term_afu() {
+	if (default_device) {
+		virtocxl_device_destroy(default_device);
+	}
+}
+
+/**
+ * Is the most recently opened context of the default device attached
+ * @return true if the AFU is attached
+ */
+bool afu_is_attached() {
+	virtocxl_context *context = default_device ? default_device->latest : NULL;
+
+	return context && context->attached;
+}
+
+/**
+ * Map the global MMIO area of the default device, as seen by the AFU model
+ *
+ * @return the mapping (of the global MMIO size passed to create_ocxl_device()), or NULL on error
+ */
+void *map_global_mmio() {
+	if (!default_device) {
+		return NULL;
+	}
+
+	return virtocxl_device_map_global_mmio(default_device);
 }
 
 #ifdef _ARCH_PPC64
 /**
- * Force a translation fault, this should cause afu_poll() to register an event, and afu_read() to return the event.
+ * Force a translation fault on the most recently opened context of the default device.
  *
  * @param addr the address of the fault
  * @param dsisr the value of the PPC64 specific DSISR register
  * @param count the number of times the translation fault has triggered an error
  */
 void force_translation_fault(void *addr, uint64_t dsisr, uint64_t count) {
-	translation_fault.addr = (uint64_t)addr;
-	translation_fault.dsisr = dsisr;
-	translation_fault.count = count;
+	if (default_device && default_device->latest) {
+		(void)virtocxl_context_translation_fault(default_device->latest, addr, dsisr, count);
+	}
 }
 #else
 /**
- * Force a translation fault, this should cause afu_poll() to register an event, and afu_read() to return the event.
+ * Force a translation fault on the most recently opened context of the default device.
  *
  * @param addr the address of the fault
  * @param count the number of times the translation fault has triggered an error
  */
 void force_translation_fault(void *addr, uint64_t count) {
-	translation_fault.addr = (__u64)addr;
-	translation_fault.count = count;
+	if (default_device && default_device->latest) {
+		(void)virtocxl_context_translation_fault(default_device->latest, addr, 0, count);
+	}
 }
 #endif
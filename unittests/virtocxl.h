@@ -0,0 +1,325 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _VIRTOCXL_H
+#define _VIRTOCXL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * A callback used by AFU models to trigger an IRQ
+ *
+ * @param data opaque data supplied when the model was created
+ * @param handle the handle (trigger page address) of the IRQ
+ */
+typedef void (*virtocxl_irq_trigger)(void *data, uint64_t handle);
+
+/* virtocxl.c */
+
+/* Contexts are assigned PASIDs from this base, in the order of their slots on the device */
+#define VIRTOCXL_PASID_BASE		1234
+#define VIRTOCXL_DEFAULT_MAX_CONTEXTS	64
+
+/* The number of per-PASID registers which may be watched on a device */
+#define VIRTOCXL_MAX_WATCHES		16
+
+/* The number of translation faults which may be pending on a context, further faults are dropped */
+#define VIRTOCXL_FAULT_QUEUE_DEPTH	256
+
+typedef struct virtocxl_device virtocxl_device;
+typedef struct virtocxl_context virtocxl_context;
+
+/**
+ * A hook called when a context is opened
+ *
+ * @param context the new context
+ * @param data the data passed to virtocxl_device_set_context_hooks()
+ * @return data to associate with the context, retrieved with virtocxl_context_data()
+ */
+typedef void *(*virtocxl_context_open_hook)(virtocxl_context *context, void *data);
+
+/**
+ * A hook called when a context is closed
+ *
+ * @param context the context
+ * @param context_data the data returned by the open hook
+ * @param data the data passed to virtocxl_device_set_context_hooks()
+ */
+typedef void (*virtocxl_context_close_hook)(virtocxl_context *context, void *context_data, void *data);
+
+/**
+ * A callback called when the host changes a watched per-PASID register
+ *
+ * @param context the context whose register changed
+ * @param offset the offset of the register
+ * @param value the new value of the register
+ * @param data the data passed to virtocxl_device_watch_register()
+ */
+typedef void (*virtocxl_register_callback)(virtocxl_context *context, uint64_t offset, uint64_t value, void *data);
+
+/**
+ * The configuration of a virtual OCXL device
+ */
+typedef struct virtocxl_device_config {
+	const char *afu_name; /**< The name of the AFU */
+	uint16_t card; /**< The PCI domain of the card, 0 for 1 */
+	uint8_t afu_index; /**< The index of the AFU on the card */
+	uint8_t version_major; /**< The AFU version */
+	uint8_t version_minor;
+	size_t global_mmio_size; /**< The size of the global MMIO area */
+	size_t pp_mmio_size; /**< The size of the per-PASID MMIO area */
+	uint32_t max_contexts; /**< Contexts which may be open at once, 0 for VIRTOCXL_DEFAULT_MAX_CONTEXTS */
+} virtocxl_device_config;
+
+virtocxl_device *virtocxl_device_create(const virtocxl_device_config *config);
+void virtocxl_device_destroy(virtocxl_device *device);
+int virtocxl_topology_create(const virtocxl_device_config *config, uint16_t cards, uint8_t afus,
+                             virtocxl_device **devices_out);
+void virtocxl_topology_destroy(virtocxl_device **devices_in, size_t count);
+const char *virtocxl_dev_path();
+const char *virtocxl_transport_name();
+int virtocxl_devices_wait(virtocxl_device **devices_in, size_t count, int timeout_ms);
+const char *virtocxl_device_path(virtocxl_device *device);
+void *virtocxl_device_map_global_mmio(virtocxl_device *device);
+uint32_t virtocxl_device_context_count(virtocxl_device *device);
+virtocxl_context *virtocxl_device_find_context(virtocxl_device *device, uint32_t pasid);
+bool virtocxl_context_is_attached(virtocxl_context *context);
+int virtocxl_context_translation_fault(virtocxl_context *context, void *addr, uint64_t dsisr, uint64_t count);
+void virtocxl_context_spurious_wakeup(virtocxl_context *context);
+uint32_t virtocxl_context_pending_faults(virtocxl_context *context);
+uint32_t virtocxl_context_pasid(virtocxl_context *context);
+void *virtocxl_context_pp_mmio(virtocxl_context *context);
+void *virtocxl_context_data(virtocxl_context *context);
+void virtocxl_device_set_context_hooks(virtocxl_device *device, virtocxl_context_open_hook open_hook,
+                                       virtocxl_context_close_hook close_hook, void *data);
+int virtocxl_device_watch_register(virtocxl_device *device, uint64_t offset,
+                                   virtocxl_register_callback callback, void *data);
+
+virtocxl_device *create_ocxl_device(const char *afu_name, size_t global_mmio_size, size_t per_pasid_mmio_size);
+void term_afu();
+bool afu_is_attached();
+void *map_global_mmio();
+#ifdef _ARCH_PPC64
+void force_translation_fault(void *addr, uint64_t dsisr, uint64_t count);
+#else
+void force_translation_fault(void *addr, uint64_t count);
+#endif
+
+/* virtocxl_clock.c */
+
+/* The number of device models which may be run by the simulated clock at once */
+#define VIRTOCXL_CLOCK_MAX_TICKERS	32
+
+/**
+ * The time the device models run in
+ */
+typedef enum virtocxl_clock_mode {
+	VIRTOCXL_CLOCK_REAL, /**< The monotonic clock, models run on their own threads */
+	VIRTOCXL_CLOCK_SIMULATED, /**< A virtual clock, models run as it is advanced */
+} virtocxl_clock_mode;
+
+/**
+ * Run a device model up to the current time
+ *
+ * @param data the data the ticker was registered with
+ * @param now the current time in nanoseconds
+ */
+typedef void (*virtocxl_clock_tick)(void *data, uint64_t now);
+
+/**
+ * Get the time of the next event a device model has scheduled
+ *
+ * @param data the data the ticker was registered with
+ * @return the time in nanoseconds, or UINT64_MAX if there is none
+ */
+typedef uint64_t (*virtocxl_clock_next)(void *data);
+
+int virtocxl_clock_set_mode(virtocxl_clock_mode mode);
+virtocxl_clock_mode virtocxl_clock_get_mode();
+uint64_t virtocxl_clock_now();
+void virtocxl_clock_advance(uint64_t ns);
+bool virtocxl_clock_advance_next();
+int virtocxl_clock_register(virtocxl_clock_tick tick, virtocxl_clock_next next, void *data);
+void virtocxl_clock_unregister(void *data);
+
+/* virtocxl_irq.c */
+
+/* IRQ trigger pages are mmapped from the device at offsets above the MMIO areas */
+#define VIRTOCXL_IRQ_OFFSET_BASE	(1ULL << 40)
+
+/* A trigger page slot which was lost to an unrelated mapping */
+#define VIRTOCXL_IRQ_SLOT_RETIRED	((virtocxl_irq *)1)
+
+typedef struct virtocxl_irq virtocxl_irq;
+
+int virtocxl_irq_alloc(virtocxl_irq **list, uint64_t *offset);
+int virtocxl_irq_set_fd(virtocxl_irq *list, uint64_t offset, int eventfd);
+int virtocxl_irq_map(virtocxl_irq *list, uint64_t offset, size_t length, void **addr);
+int virtocxl_irq_free(virtocxl_irq **list, uint64_t offset);
+void virtocxl_irq_free_all(virtocxl_irq **list);
+uint32_t virtocxl_irq_count(virtocxl_irq *list);
+int virtocxl_irq_fire(uint64_t handle);
+void virtocxl_irq_fire_cb(void *data, uint64_t handle);
+
+/**
+ * The order in which a storm triggers its IRQs
+ */
+typedef enum virtocxl_irq_pattern {
+	VIRTOCXL_IRQ_ROUND_ROBIN, /**< Cycle through the IRQs, one trigger each */
+	VIRTOCXL_IRQ_RANDOM, /**< Pick each IRQ uniformly at random */
+	VIRTOCXL_IRQ_BURST, /**< Cycle through the IRQs, a burst of back to back triggers each */
+} virtocxl_irq_pattern;
+
+/**
+ * The IRQs, translation faults, pattern & rate of a storm
+ *
+ * A storm with a fault context and no IRQs raises only translation faults. With both, each
+ * run of faults_per_irq faults is followed by an IRQ.
+ */
+typedef struct virtocxl_irq_storm_config {
+	const uint64_t *handles; /**< The handles of the IRQs to trigger */
+	size_t handle_count; /**< The number of handles */
+	virtocxl_irq_pattern pattern; /**< The order in which to trigger the IRQs */
+	double rate; /**< Triggers per second, 0 to trigger as fast as possible */
+	uint32_t burst; /**< Triggers per burst for VIRTOCXL_IRQ_BURST, 0 for 1 */
+	uint64_t count; /**< Total triggers, 0 to run until stopped */
+	uint64_t seed; /**< Seed for VIRTOCXL_IRQ_RANDOM, 0 for a fixed default */
+	virtocxl_context *fault_context; /**< The context to raise translation faults on, NULL for none */
+	uint64_t fault_base; /**< The address of the first fault */
+	uint32_t fault_addresses; /**< Distinct fault addresses, a page apart from fault_base, 0 for 1 */
+	uint32_t faults_per_irq; /**< Faults raised before each IRQ, if there are IRQs */
+} virtocxl_irq_storm_config;
+
+typedef struct virtocxl_irq_storm virtocxl_irq_storm;
+
+virtocxl_irq_storm *virtocxl_irq_storm_start(const virtocxl_irq_storm_config *config);
+uint64_t virtocxl_irq_storm_stop(virtocxl_irq_storm *storm, bool wait, uint64_t *failed);
+
+/* virtocxl_memcpy3.c */
+
+/* per-PASID MMIO registers */
+#define MEMCPY3_PP_MMIO_SIZE	0x30
+#define MEMCPY3_PP_WED		0
+#define MEMCPY3_PP_STATUS	0x10
+#define   MEMCPY3_PP_STATUS_Terminated	0x8
+#define   MEMCPY3_PP_STATUS_Stopped	0x10
+#define MEMCPY3_PP_CTRL		0x18
+#define   MEMCPY3_PP_CTRL_Restart	(0x1 << 0)
+#define   MEMCPY3_PP_CTRL_Terminate	(0x1 << 1)
+#define MEMCPY3_PP_IRQ		0x28
+
+#define MEMCPY3_CACHELINESIZE	128
+
+#define MEMCPY3_WED(queue, depth)			\
+	((((uint64_t)queue) & 0xfffffffffffff000ULL) |	\
+		(((uint64_t)depth) & 0xfffULL))
+
+#define MEMCPY3_WE_CMD(valid, cmd)		\
+	(((valid) & 0x1) |			\
+		(((cmd) & 0x3f) << 2))
+#define MEMCPY3_WE_CMD_VALID	(0x1 << 0)
+#define MEMCPY3_WE_CMD_WRAP	(0x1 << 1)
+
+/* work element commands */
+#define MEMCPY3_WE_CMD_COPY		0
+#define MEMCPY3_WE_CMD_IRQ		1
+#define MEMCPY3_WE_CMD_STOP		2
+#define MEMCPY3_WE_CMD_WAKE_HOST_THREAD	3
+#define MEMCPY3_WE_CMD_INCREMENT	4
+#define MEMCPY3_WE_CMD_ATOMIC		5
+#define MEMCPY3_WE_CMD_TRANSLATE_TOUCH	6
+
+/* work element status */
+#define MEMCPY3_WE_STATUS_COMPLETE		0x01
+#define MEMCPY3_WE_STATUS_FAULT_RESPONSE	0x11
+#define MEMCPY3_WE_STATUS_ERROR			0xff
+
+/**
+ * A MEMCPY3 work element, all fields are little endian
+ */
+typedef struct memcpy3_work_element {
+	volatile uint8_t cmd; /**< valid, wrap, cmd */
+	volatile uint8_t status;
+	uint16_t length; /**< also tid */
+	uint8_t cmd_extra;
+	uint8_t reserved[3];
+	uint64_t atomic_op;
+	uint64_t src; /**< also irq EA or atomic_op2 */
+	uint64_t dst;
+} memcpy3_work_element;
+
+typedef struct memcpy3_afu memcpy3_afu;
+
+/**
+ * Activity counters for a MEMCPY3 AFU model
+ */
+typedef struct memcpy3_afu_stats {
+	uint64_t elements; /**< Work elements completed */
+	uint64_t bytes; /**< Bytes copied or incremented */
+	uint64_t irqs; /**< IRQs triggered */
+	uint64_t cas_retries; /**< Compare and swaps which failed to compare and were retried */
+	uint64_t errors; /**< Work elements which failed */
+} memcpy3_afu_stats;
+
+memcpy3_afu *memcpy3_afu_create(void *pp_mmio, virtocxl_irq_trigger trigger, void *trigger_data);
+uint32_t memcpy3_afu_step(memcpy3_afu *afu);
+int memcpy3_afu_start(memcpy3_afu *afu);
+void memcpy3_afu_stop(memcpy3_afu *afu);
+void memcpy3_afu_get_stats(memcpy3_afu *afu, memcpy3_afu_stats *stats);
+void memcpy3_afu_free(memcpy3_afu *afu);
+
+/* virtocxl_afp3.c */
+
+#define AFP3_GLOBAL_MMIO_SIZE	0x10200
+
+/* AFUEnable_AFP_REGISTER */
+#define AFP3_ENABLE_AFU		(1ULL << 63)
+#define AFP3_ENABLE_PING_PONG	(1ULL << 62)
+#define AFP3_ENABLE_STORE_512	(1ULL << 61)
+#define AFP3_ENABLE_LARGE_DATA	(1ULL << 60)
+#define AFP3_ENABLE_EXTRA_READ	(1ULL << 59)
+#define AFP3_ENABLE_LOAD_512	(1ULL << 58)
+
+/* AFUControl_AFP_REGISTER */
+#define AFP3_CONTROL_RESET_COUNTERS	(1ULL << 62)
+
+#define AFP3_DEFAULT_BANDWIDTH	25e9
+#define AFP3_DEFAULT_CLOCK_HZ	200000000
+
+typedef struct afp3_afu afp3_afu;
+
+/**
+ * The performance model of an AFP3 AFU
+ */
+typedef struct afp3_afu_config {
+	double bandwidth; /**< Link bandwidth shared by loads & stores (bytes/s), 0 for AFP3_DEFAULT_BANDWIDTH */
+	uint64_t latency_ns; /**< Round trip latency of a request */
+	double retry_rate; /**< Fraction of requests which receive a retry response */
+	uint64_t clock_hz; /**< AFU clock for the cycle counters, 0 for AFP3_DEFAULT_CLOCK_HZ */
+	bool touch_memory; /**< Perform the modelled loads & stores on the host buffer */
+} afp3_afu_config;
+
+afp3_afu *afp3_afu_create(void *global_mmio, const afp3_afu_config *config);
+void afp3_afu_step(afp3_afu *afu);
+int afp3_afu_start(afp3_afu *afu);
+void afp3_afu_stop(afp3_afu *afu);
+uint64_t afp3_afu_pings(afp3_afu *afu);
+void afp3_afu_free(afp3_afu *afu);
+
+#endif /* _VIRTOCXL_H */
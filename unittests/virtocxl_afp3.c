@@ -0,0 +1,535 @@
+/*
+ * Copyright 2018 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A software model of the IBM,AFP3 traffic generator AFU.
+ *
+ * The model operates on the global MMIO register block. In bandwidth mode, it loads
+ * from & stores to the buffer programmed through the WED & bufmask registers, at a
+ * rate limited by both the modelled link bandwidth and the number of tags in flight
+ * (tags * request size / latency). In MMIO ping-pong mode, each write of the enable
+ * register is answered with a DMA write to the buffer after the modelled latency.
+ *
+ * The performance counters are maintained as the hardware does, in AFU cycles and
+ * 64 byte units.
+ *
+ * Time is taken from the virtocxl clock. In simulated time, the model is run by the clock
+ * rather than a thread, and schedules the answer to each ping as an event.
+ */
+
+#include "libocxl_internal.h"
+#include "virtocxl.h"
+#include "../afutests/afp/ocxl_afp3.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PERF_UNIT	64
+
+#define WED_BUFFER(wed)		((wed) & ~0xfffULL)
+#define WED_TAGS_LD(wed)	(((wed) >> 9) & 0x7)
+#define WED_SIZE_LD(wed)	(((wed) >> 7) & 0x3)
+#define WED_TAGS_ST(wed)	(((wed) >> 3) & 0x7)
+#define WED_SIZE_ST(wed)	(((wed) >> 1) & 0x3)
+
+/* A descheduled engine thread may catch up on at most this much traffic */
+#define MAX_CATCHUP_NS	1000000
+
+enum {
+	CNT_CYCLES = 0,
+	CNT_GOOD_TOTAL,
+	CNT_GOOD_LOAD,
+	CNT_GOOD_STORE,
+	CNT_RETRY_TOTAL,
+	CNT_RETRY_LOAD,
+	CNT_RETRY_STORE,
+	CNT_NO_CREDIT,
+	CNT_COUNT
+};
+
+typedef struct afp3_stream {
+	uint32_t size; /**< bytes per request */
+	double rate; /**< modelled bytes per ns */
+	double budget; /**< bytes which may be transferred now */
+	double stall; /**< fraction of cycles starved of link credits */
+	uint64_t offset; /**< offset of the next request within the buffer */
+} afp3_stream;
+
+struct afp3_afu {
+	volatile uint64_t *mmio;
+	afp3_afu_config config;
+
+	uint64_t enable;
+	uint64_t wed;
+	uint64_t bufmask;
+	uint8_t *buffer;
+	afp3_stream load;
+	afp3_stream store;
+
+	uint64_t last_ns;
+	double cycles; /**< fractional AFU cycles not yet accounted */
+	double no_credit_cycles;
+	uint64_t counters[CNT_COUNT];
+	uint64_t random;
+	uint8_t load_data[512];
+
+	bool ping_mode; /**< latency pings have been seen since the AFU was enabled */
+	bool ping_pending;
+	uint64_t ping_deadline;
+	uint64_t ping_enable;
+	uint64_t pings;
+
+	pthread_t thread;
+	volatile bool running;
+	bool simulated; /**< run by the simulated clock rather than a thread */
+};
+
+static const uint32_t tag_counts[] = { 0, 1, 2, 4, 16, 64, 256, 512 };
+
+/**
+ * Read a little endian global MMIO register
+ *
+ * @param afu the AFP3 AFU
+ * @param offset the offset of the register
+ * @return the value of the register
+ */
+static uint64_t reg_read(afp3_afu *afu, size_t offset)
+{
+	return le64toh(__atomic_load_n(&afu->mmio[offset / sizeof(uint64_t)], __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Write a little endian global MMIO register
+ *
+ * @param afu the AFP3 AFU
+ * @param offset the offset of the register
+ * @param value the value to write
+ */
+static void reg_write(afp3_afu *afu, size_t offset, uint64_t value)
+{
+	__atomic_store_n(&afu->mmio[offset / sizeof(uint64_t)], htole64(value), __ATOMIC_RELEASE);
+}
+
+/**
+ * Publish the performance counters to the perf counter registers
+ *
+ * @param afu the AFP3 AFU
+ */
+static void publish_counters(afp3_afu *afu)
+{
+	for (int i = 0; i < CNT_COUNT; i++) {
+		reg_write(afu, AFUPerfCnt0_AFP_REGISTER + i * sizeof(uint64_t), afu->counters[i]);
+	}
+}
+
+/**
+ * Reset the performance counters
+ *
+ * @param afu the AFP3 AFU
+ */
+static void reset_counters(afp3_afu *afu)
+{
+	memset(afu->counters, 0, sizeof(afu->counters));
+	afu->cycles = 0;
+	afu->no_credit_cycles = 0;
+	publish_counters(afu);
+}
+
+/**
+ * Decode the request size of a stream
+ *
+ * @param encoding the WED size encoding
+ * @return the request size in bytes
+ */
+static uint32_t decode_size(uint64_t encoding)
+{
+	switch (encoding) {
+	case 1:
+		return 64;
+	case 3:
+		return 256;
+	default:
+		return 128;
+	}
+}
+
+/**
+ * Work out the modelled rate of the load & store streams
+ *
+ * Each stream is limited by its tags (Little's law), and the streams share the link
+ * bandwidth in proportion to their demand.
+ *
+ * @param afu the AFP3 AFU
+ */
+static void configure_streams(afp3_afu *afu)
+{
+	double latency = afu->config.latency_ns ? afu->config.latency_ns : 1;
+	double link = afu->config.bandwidth / 1e9;
+
+	afu->load.size = (afu->enable & AFP3_ENABLE_LOAD_512) ? 512 : decode_size(WED_SIZE_LD(afu->wed));
+	afu->store.size = (afu->enable & AFP3_ENABLE_STORE_512) ? 512 : decode_size(WED_SIZE_ST(afu->wed));
+
+	double load_demand = tag_counts[WED_TAGS_LD(afu->wed)] * afu->load.size / latency;
+	double store_demand = tag_counts[WED_TAGS_ST(afu->wed)] * afu->store.size / latency;
+	double demand = load_demand + store_demand;
+	double scale = (demand > link) ? link / demand : 1.0;
+
+	afu->load.rate = load_demand * scale;
+	afu->store.rate = store_demand * scale;
+	afu->load.stall = afu->store.stall = 1.0 - scale;
+	afu->load.budget = afu->store.budget = 0;
+	afu->load.offset = afu->store.offset = 0;
+}
+
+/**
+ * Decide whether a request is retried, using a deterministic xorshift sequence
+ *
+ * @param afu the AFP3 AFU
+ * @return true if the request should be retried
+ */
+static bool retried(afp3_afu *afu)
+{
+	if (afu->config.retry_rate <= 0) {
+		return false;
+	}
+
+	afu->random ^= afu->random << 13;
+	afu->random ^= afu->random >> 7;
+	afu->random ^= afu->random << 17;
+
+	return (afu->random >> 11) * (1.0 / (1ULL << 53)) < afu->config.retry_rate;
+}
+
+/**
+ * Issue as many requests on a stream as its budget allows
+ *
+ * @param afu the AFP3 AFU
+ * @param stream the stream to issue requests on
+ * @param store true if the stream stores to the buffer
+ */
+static void run_stream(afp3_afu *afu, afp3_stream *stream, bool store)
+{
+	uint64_t region = afu->bufmask + 4096;
+	uint64_t units = stream->size / PERF_UNIT;
+
+	while (stream->budget >= stream->size) {
+		stream->budget -= stream->size;
+
+		if (retried(afu)) {
+			afu->counters[CNT_RETRY_TOTAL] += units;
+			afu->counters[store ? CNT_RETRY_STORE : CNT_RETRY_LOAD] += units;
+			continue;
+		}
+
+		if (stream->offset + stream->size > region) {
+			stream->offset = 0;
+		}
+		uint8_t *addr = afu->buffer + stream->offset;
+		stream->offset += stream->size;
+
+		if (afu->config.touch_memory) {
+			if (store) {
+				memset(addr, (uint8_t)afu->counters[CNT_GOOD_STORE], stream->size);
+			} else {
+				memcpy(afu->load_data, addr, stream->size);
+			}
+		}
+
+		afu->counters[CNT_GOOD_TOTAL] += units;
+		afu->counters[store ? CNT_GOOD_STORE : CNT_GOOD_LOAD] += units;
+	}
+}
+
+/**
+ * Answer a latency ping with a DMA write to the buffer
+ *
+ * The flag (the low bytes of the last 64 bytes written) is written last, so the
+ * host sees the whole write once the flag is set.
+ *
+ * @param afu the AFP3 AFU
+ */
+static void answer_ping(afp3_afu *afu)
+{
+	uint32_t size = (afu->ping_enable & AFP3_ENABLE_STORE_512) ? 512 : decode_size(WED_SIZE_ST(afu->wed));
+	volatile uint64_t *data = (volatile uint64_t *)afu->buffer;
+	size_t flag = (size - 64) / sizeof(uint64_t);
+
+	afu->pings++;
+
+	if (afu->ping_enable & AFP3_ENABLE_EXTRA_READ) {
+		uint64_t ea = reg_read(afu, AFUExtraReadEA_AFP_REGISTER);
+		if (ea && afu->config.touch_memory) {
+			memcpy(afu->load_data, (void *)(uintptr_t)ea, afu->load.size);
+		}
+		afu->counters[CNT_GOOD_TOTAL] += afu->load.size / PERF_UNIT;
+		afu->counters[CNT_GOOD_LOAD] += afu->load.size / PERF_UNIT;
+	}
+
+	for (size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		if (i != flag) {
+			data[i] = afu->pings;
+		}
+	}
+	__atomic_store_n(&data[flag], htole64(afu->pings), __ATOMIC_RELEASE);
+
+	afu->counters[CNT_GOOD_TOTAL] += size / PERF_UNIT;
+	afu->counters[CNT_GOOD_STORE] += size / PERF_UNIT;
+}
+
+/**
+ * Pick up register writes from the host
+ *
+ * @param afu the AFP3 AFU
+ * @param now the current time in nanoseconds
+ */
+static void check_registers(afp3_afu *afu, uint64_t now)
+{
+	if (reg_read(afu, AFUControl_AFP_REGISTER) & AFP3_CONTROL_RESET_COUNTERS) {
+		// The control register behaves as a doorbell
+		reg_write(afu, AFUControl_AFP_REGISTER, 0);
+		reset_counters(afu);
+	}
+
+	uint64_t enable = reg_read(afu, AFUEnable_AFP_REGISTER);
+	uint64_t wed = reg_read(afu, AFUWED_AFP_REGISTER);
+	uint64_t bufmask = reg_read(afu, AFUBufmask_AFP_REGISTER);
+
+	if (!(enable & AFP3_ENABLE_AFU)) {
+		afu->ping_mode = false;
+	} else if ((enable & AFP3_ENABLE_PING_PONG) && !afu->ping_pending) {
+		/* Each MMIO write is a single ping, consume it so a rewrite of the same
+		 * value by the host can be observed
+		 */
+		uint64_t expected = htole64(enable);
+		if (__atomic_compare_exchange_n(&afu->mmio[AFUEnable_AFP_REGISTER / sizeof(uint64_t)],
+		                                &expected, htole64(enable & ~AFP3_ENABLE_PING_PONG),
+		                                false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			uint32_t size = (enable & AFP3_ENABLE_STORE_512) ? 512 : decode_size(WED_SIZE_ST(wed));
+			double latency = afu->config.latency_ns + size / (afu->config.bandwidth / 1e9);
+			if (enable & AFP3_ENABLE_EXTRA_READ) {
+				latency += afu->config.latency_ns;
+			}
+
+			afu->ping_mode = true;
+			afu->ping_pending = true;
+			afu->ping_enable = enable;
+			afu->ping_deadline = now + (uint64_t)latency;
+		}
+	}
+	enable &= ~AFP3_ENABLE_PING_PONG;
+
+	if (enable != afu->enable || wed != afu->wed || bufmask != afu->bufmask) {
+		afu->wed = wed;
+		afu->bufmask = bufmask;
+		afu->buffer = (uint8_t *)(uintptr_t)WED_BUFFER(wed);
+		afu->enable = enable;
+		configure_streams(afu);
+	}
+}
+
+/**
+ * Run the AFU up to the current time
+ *
+ * @param afu the AFP3 AFU
+ */
+void afp3_afu_step(afp3_afu *afu)
+{
+	uint64_t now = virtocxl_clock_now();
+	uint64_t elapsed = now - afu->last_ns;
+	afu->last_ns = now;
+
+	check_registers(afu, now);
+
+	if (!(afu->enable & AFP3_ENABLE_AFU)) {
+		return;
+	}
+
+	afu->cycles += elapsed * (afu->config.clock_hz / 1e9);
+	afu->counters[CNT_CYCLES] += (uint64_t)afu->cycles;
+	afu->cycles -= (uint64_t)afu->cycles;
+
+	if (afu->ping_pending) {
+		if (now >= afu->ping_deadline) {
+			afu->ping_pending = false;
+			answer_ping(afu);
+		}
+	} else if (!afu->ping_mode && afu->buffer) {
+		// Simulated time never falls behind, so is never capped
+		uint64_t budget_ns = (elapsed < MAX_CATCHUP_NS || afu->simulated) ? elapsed : MAX_CATCHUP_NS;
+
+		afu->load.budget += budget_ns * afu->load.rate;
+		afu->store.budget += budget_ns * afu->store.rate;
+		run_stream(afu, &afu->load, false);
+		run_stream(afu, &afu->store, true);
+
+		afu->no_credit_cycles += elapsed * (afu->config.clock_hz / 1e9) *
+		                         ((afu->load.stall > afu->store.stall) ? afu->load.stall : afu->store.stall);
+		afu->counters[CNT_NO_CREDIT] += (uint64_t)afu->no_credit_cycles;
+		afu->no_credit_cycles -= (uint64_t)afu->no_credit_cycles;
+	}
+
+	publish_counters(afu);
+}
+
+/**
+ * The engine thread, polls the registers & generates traffic until stopped
+ *
+ * @param arg the AFP3 AFU
+ * @return NULL
+ */
+static void *afp3_afu_thread(void *arg)
+{
+	afp3_afu *afu = arg;
+
+	while (afu->running) {
+		afp3_afu_step(afu);
+	}
+
+	return NULL;
+}
+
+/**
+ * Create a new AFP3 AFU model
+ *
+ * @param global_mmio the global MMIO area to operate on (at least AFP3_GLOBAL_MMIO_SIZE bytes)
+ * @param config the performance model, or NULL for the defaults
+ * @return the model, or NULL on allocation failure
+ */
+afp3_afu *afp3_afu_create(void *global_mmio, const afp3_afu_config *config)
+{
+	afp3_afu *afu = calloc(1, sizeof(*afu));
+	if (!afu) {
+		return NULL;
+	}
+
+	afu->mmio = global_mmio;
+	if (config) {
+		afu->config = *config;
+	}
+	if (afu->config.bandwidth <= 0) {
+		afu->config.bandwidth = AFP3_DEFAULT_BANDWIDTH;
+	}
+	if (!afu->config.clock_hz) {
+		afu->config.clock_hz = AFP3_DEFAULT_CLOCK_HZ;
+	}
+	afu->random = 0x9e3779b97f4a7c15ULL;
+	afu->simulated = virtocxl_clock_get_mode() == VIRTOCXL_CLOCK_SIMULATED;
+	afu->last_ns = virtocxl_clock_now();
+
+	configure_streams(afu);
+
+	return afu;
+}
+
+/**
+ * Run the AFU up to a point in simulated time
+ *
+ * @param data the AFP3 AFU
+ * @param now unused, the model reads the clock
+ */
+static void afp3_afu_tick(void *data, __attribute__((unused)) uint64_t now)
+{
+	afp3_afu_step(data);
+}
+
+/**
+ * Get the time of the next event of the AFU in simulated time
+ *
+ * @param data the AFP3 AFU
+ * @return the time a pending ping is answered, or UINT64_MAX if there is none
+ */
+static uint64_t afp3_afu_next(void *data)
+{
+	afp3_afu *afu = data;
+
+	return afu->ping_pending ? afu->ping_deadline : UINT64_MAX;
+}
+
+/**
+ * Start running the AFU, from a dedicated thread in real time, or from the clock in simulated time
+ *
+ * @param afu the AFP3 AFU
+ * @return 0 on success, an errno value otherwise
+ */
+int afp3_afu_start(afp3_afu *afu)
+{
+	int rc;
+
+	if (afu->running) {
+		return EBUSY;
+	}
+
+	afu->simulated = virtocxl_clock_get_mode() == VIRTOCXL_CLOCK_SIMULATED;
+	afu->last_ns = virtocxl_clock_now();
+	afu->running = true;
+	if (afu->simulated) {
+		rc = virtocxl_clock_register(afp3_afu_tick, afp3_afu_next, afu);
+	} else {
+		rc = pthread_create(&afu->thread, NULL, afp3_afu_thread, afu);
+	}
+	if (rc) {
+		afu->running = false;
+	}
+
+	return rc;
+}
+
+/**
+ * Stop the engine thread of the AFU
+ *
+ * @param afu the AFP3 AFU
+ */
+void afp3_afu_stop(afp3_afu *afu)
+{
+	if (!afu->running) {
+		return;
+	}
+
+	afu->running = false;
+	if (afu->simulated) {
+		virtocxl_clock_unregister(afu);
+	} else {
+		pthread_join(afu->thread, NULL);
+	}
+}
+
+/**
+ * Get the number of latency pings answered by the AFU
+ *
+ * @param afu the AFP3 AFU
+ * @return the number of pings answered
+ */
+uint64_t afp3_afu_pings(afp3_afu *afu)
+{
+	return afu->pings;
+}
+
+/**
+ * Stop & free an AFU model
+ *
+ * @param afu the AFP3 AFU (may be NULL)
+ */
+void afp3_afu_free(afp3_afu *afu)
+{
+	if (!afu) {
+		return;
+	}
+
+	afp3_afu_stop(afu);
+	free(afu);
+}
@@ -0,0 +1,350 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The clock the virtual devices model latency & bandwidth against.
+ *
+ * In real time, the clock is CLOCK_MONOTONIC, and the models run on their own threads.
+ * In simulated time, the clock only moves when it is advanced, and models do not run
+ * threads: they register tickers, which are run in virtual time order from the thread
+ * advancing the clock. Time jumps straight to the next event any model has scheduled,
+ * so a simulation runs as fast as the host can step it, and gives the same timings on
+ * every run.
+ *
+ * Simulated time also selects the "virtocxl-simulated" backend, whose epoll_wait()
+ * advances the clock rather than sleeping, so ocxl_afu_event_check() timeouts elapse
+ * in virtual time.
+ */
+
+#include "libocxl_internal.h"
+#include "virtocxl.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define SIMULATED_BACKEND "virtocxl-simulated"
+
+typedef struct ticker {
+	virtocxl_clock_tick tick;
+	virtocxl_clock_next next;
+	void *data;
+} ticker;
+
+static virtocxl_clock_mode clock_mode = VIRTOCXL_CLOCK_REAL;
+static uint64_t simulated_now;
+
+/* Serialises advancing the clock, and protects the tickers */
+static pthread_mutex_t clock_lock = PTHREAD_MUTEX_INITIALIZER;
+static ticker tickers[VIRTOCXL_CLOCK_MAX_TICKERS];
+static size_t ticker_count;
+
+static bool backend_registered;
+
+/**
+ * Get the current time of the clock
+ *
+ * @return the time in nanoseconds, which starts from 0 in simulated time
+ */
+uint64_t virtocxl_clock_now()
+{
+	struct timespec ts;
+
+	if (__atomic_load_n(&clock_mode, __ATOMIC_ACQUIRE) == VIRTOCXL_CLOCK_SIMULATED) {
+		return __atomic_load_n(&simulated_now, __ATOMIC_ACQUIRE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Get the mode of the clock
+ *
+ * @return the mode
+ */
+virtocxl_clock_mode virtocxl_clock_get_mode()
+{
+	return __atomic_load_n(&clock_mode, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Run all tickers at the current simulated time
+ *
+ * @pre clock_lock is held
+ */
+static void run_tickers()
+{
+	for (size_t i = 0; i < ticker_count; i++) {
+		tickers[i].tick(tickers[i].data, simulated_now);
+	}
+}
+
+/**
+ * Find the next event scheduled by any ticker
+ *
+ * @pre clock_lock is held
+ *
+ * @return the time of the event, or UINT64_MAX if none are scheduled
+ */
+static uint64_t next_event()
+{
+	uint64_t next = UINT64_MAX;
+
+	for (size_t i = 0; i < ticker_count; i++) {
+		if (tickers[i].next) {
+			uint64_t when = tickers[i].next(tickers[i].data);
+			if (when < next) {
+				next = when;
+			}
+		}
+	}
+
+	return next;
+}
+
+/**
+ * Advance simulated time, running the tickers at each scheduled event on the way
+ *
+ * The tickers are first run at the current time, so models see anything the host has
+ * written since they last ran.
+ *
+ * @pre clock_lock is held
+ *
+ * @param target the time to advance to
+ */
+static void advance_to(uint64_t target)
+{
+	run_tickers();
+
+	for (;;) {
+		uint64_t next = next_event();
+		// A model must not schedule an event it has already passed
+		if (next <= simulated_now || next > target) {
+			break;
+		}
+
+		__atomic_store_n(&simulated_now, next, __ATOMIC_RELEASE);
+		run_tickers();
+	}
+
+	if (target > simulated_now) {
+		__atomic_store_n(&simulated_now, target, __ATOMIC_RELEASE);
+		run_tickers();
+	}
+}
+
+/**
+ * Advance simulated time, running the device models up to the new time
+ *
+ * Does nothing in real time.
+ *
+ * @param ns the number of nanoseconds to advance by
+ */
+void virtocxl_clock_advance(uint64_t ns)
+{
+	if (virtocxl_clock_get_mode() != VIRTOCXL_CLOCK_SIMULATED) {
+		return;
+	}
+
+	pthread_mutex_lock(&clock_lock);
+	advance_to(simulated_now + ns);
+	pthread_mutex_unlock(&clock_lock);
+}
+
+/**
+ * Let the device models make progress while the host polls for them
+ *
+ * Host poll loops call this on each iteration. In simulated time, the clock is advanced to
+ * the next event scheduled by a model, in real time, the models run on their own threads,
+ * so the CPU is yielded to them.
+ *
+ * @return false if the clock is simulated and no events are scheduled, so polling cannot succeed
+ */
+bool virtocxl_clock_advance_next()
+{
+	if (virtocxl_clock_get_mode() != VIRTOCXL_CLOCK_SIMULATED) {
+		sched_yield();
+		return true;
+	}
+
+	pthread_mutex_lock(&clock_lock);
+	run_tickers();
+	uint64_t next = next_event();
+	bool scheduled = next != UINT64_MAX && next > simulated_now;
+	if (scheduled) {
+		advance_to(next);
+	}
+	pthread_mutex_unlock(&clock_lock);
+
+	return scheduled;
+}
+
+/**
+ * Register a device model to be run as simulated time advances
+ *
+ * @param tick called with the new time whenever the clock moves, and before it is advanced
+ * @param next returns the time of the next event the model has scheduled, or UINT64_MAX if none (may be NULL)
+ * @param data passed to the callbacks, and identifies the ticker to virtocxl_clock_unregister()
+ * @return 0 on success, ENOSPC if VIRTOCXL_CLOCK_MAX_TICKERS are already registered
+ */
+int virtocxl_clock_register(virtocxl_clock_tick tick, virtocxl_clock_next next, void *data)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&clock_lock);
+	if (ticker_count == VIRTOCXL_CLOCK_MAX_TICKERS) {
+		rc = ENOSPC;
+	} else {
+		tickers[ticker_count].tick = tick;
+		tickers[ticker_count].next = next;
+		tickers[ticker_count].data = data;
+		ticker_count++;
+	}
+	pthread_mutex_unlock(&clock_lock);
+
+	return rc;
+}
+
+/**
+ * Stop running a device model as simulated time advances
+ *
+ * @param data the data the ticker was registered with
+ */
+void virtocxl_clock_unregister(void *data)
+{
+	pthread_mutex_lock(&clock_lock);
+	for (size_t i = 0; i < ticker_count; i++) {
+		if (tickers[i].data == data) {
+			// Keep the remaining tickers in registration order, so they run deterministically
+			memmove(tickers + i, tickers + i + 1, (ticker_count - i - 1) * sizeof(*tickers));
+			ticker_count--;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&clock_lock);
+}
+
+static int simulated_open(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+static int simulated_ioctl(int fd, unsigned long request, void *arg)
+{
+	return ioctl(fd, request, arg);
+}
+
+/**
+ * Wait for epoll events, letting the timeout elapse in simulated time
+ *
+ * The clock is advanced from event to event until a descriptor becomes ready or the
+ * timeout expires. If no model has anything scheduled, an infinite wait blocks in real time,
+ * as only another thread could make a descriptor ready.
+ */
+static int simulated_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	pthread_mutex_lock(&clock_lock);
+	uint64_t deadline = (timeout < 0) ? UINT64_MAX : simulated_now + (uint64_t)timeout * 1000000ULL;
+	pthread_mutex_unlock(&clock_lock);
+
+	for (;;) {
+		int count = epoll_wait(epfd, events, maxevents, 0);
+		if (count) {
+			return count;
+		}
+
+		pthread_mutex_lock(&clock_lock);
+		run_tickers();
+		uint64_t next = next_event();
+		uint64_t now = simulated_now;
+		if (next <= now || next > deadline) {
+			next = deadline;
+		}
+		if (next != UINT64_MAX) {
+			advance_to(next);
+		}
+		pthread_mutex_unlock(&clock_lock);
+
+		if (next == UINT64_MAX) {
+			return epoll_wait(epfd, events, maxevents, -1);
+		}
+
+		if (next == deadline) {
+			return epoll_wait(epfd, events, maxevents, 0);
+		}
+	}
+}
+
+/// The library backend which makes event timeouts elapse in simulated time
+const ocxl_backend_ops simulated_backend = {
+	.size = sizeof(ocxl_backend_ops),
+	.name = SIMULATED_BACKEND,
+	.open = simulated_open,
+	.close = close,
+	.read = read,
+	.ioctl = simulated_ioctl,
+	.mmap = mmap,
+	.munmap = munmap,
+	.stat = stat,
+	.fstatat = fstatat,
+	.eventfd = eventfd,
+	.epoll_create1 = epoll_create1,
+	.epoll_ctl = epoll_ctl,
+	.epoll_wait = simulated_epoll_wait,
+};
+
+/**
+ * Switch between real & simulated time
+ *
+ * Entering simulated time resets the clock to 0, and selects the simulated backend for AFUs
+ * opened from then on. Returning to real time selects the kernel backend. Models should be
+ * stopped while the mode is changed.
+ *
+ * @param mode the mode
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_clock_set_mode(virtocxl_clock_mode mode)
+{
+	if (!backend_registered) {
+		ocxl_err rc = ocxl_backend_register(&simulated_backend);
+		if (rc != OCXL_OK && rc != OCXL_ALREADY_DONE) {
+			return ENOSPC;
+		}
+		backend_registered = true;
+	}
+
+	pthread_mutex_lock(&clock_lock);
+	__atomic_store_n(&simulated_now, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&clock_mode, mode, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&clock_lock);
+
+	if (OCXL_OK != ocxl_backend_select(mode == VIRTOCXL_CLOCK_SIMULATED ? SIMULATED_BACKEND : "kernel")) {
+		return EINVAL;
+	}
+
+	return 0;
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Present the virtual devices as CUSE character devices under /dev/ocxl-test.
+ * This exercises the real kernel paths (epoll on a character device etc.), but needs root.
+ */
+
+#include "virtocxl_internal.h"
+#include <fuse/cuse_lowlevel.h>
+#include <fuse/fuse_lowlevel.h>
+#include <linux/poll.h>
+#include <misc/ocxl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define CUSE_DEV_PATH "/dev/ocxl-test"
+
+/* Identify the context behind a descriptor, so mmap() can be routed to it */
+#define VIRTOCXL_IOCTL_GET_CONTEXT	_IOR(OCXL_MAGIC, 0x3f, __u64)
+
+/* Large enough for the argument of any of the ioctls handled */
+#define IOCTL_ARG_MAX 128
+
+typedef struct cuse_device {
+	struct cuse_info cuse;
+	struct cuse_lowlevel_ops afu_ops;
+	struct fuse_session *session;
+	pthread_t thread;
+	dev_t rdev;
+} cuse_device;
+
+/**
+ * Get the context of an open device
+ *
+ * @param fi the file info of the open device
+ * @return the context
+ */
+static virtocxl_context *request_context(struct fuse_file_info *fi)
+{
+	return (virtocxl_context *)(uintptr_t)fi->fh;
+}
+
+static void afu_open(fuse_req_t req, struct fuse_file_info *fi)
+{
+	virtocxl_context *context;
+
+	int rc = virtocxl_context_open(fuse_req_userdata(req), &context);
+	if (rc) {
+		fuse_reply_err(req, rc);
+		return;
+	}
+
+	fi->fh = (uintptr_t)context;
+	fuse_reply_open(req, fi);
+}
+
+static void afu_release(fuse_req_t req, struct fuse_file_info *fi)
+{
+	virtocxl_context_release(request_context(fi));
+
+	fuse_reply_err(req, 0);
+}
+
+static void afu_read(fuse_req_t req, size_t size, off_t off, struct fuse_file_info *fi)
+{
+	char buf[KERNEL_EVENT_SIZE];
+
+	if (0 != off) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	ssize_t len = virtocxl_context_read(request_context(fi), buf, size < sizeof(buf) ? size : sizeof(buf));
+	if (len < 0) {
+		fuse_reply_err(req, -len);
+		return;
+	}
+
+	fuse_reply_buf(req, buf, len);
+}
+
+static void afu_ioctl(fuse_req_t req, int cmd, __attribute__((unused)) void *arg,
+		struct fuse_file_info *fi, __attribute__((unused)) unsigned flags,
+		const void *in_buf, size_t in_bufsz, __attribute__((unused)) size_t out_bufsz)
+{
+	virtocxl_context *context = request_context(fi);
+	char buf[IOCTL_ARG_MAX];
+	size_t size = _IOC_SIZE((unsigned)cmd);
+	uint64_t context_id;
+
+	if ((unsigned)cmd == VIRTOCXL_IOCTL_GET_CONTEXT) {
+		context_id = (uintptr_t)context;
+		fuse_reply_ioctl(req, 0, &context_id, sizeof(context_id));
+		return;
+	}
+
+	if (size > sizeof(buf)) {
+		fuse_reply_err(req, EINVAL);
+		return;
+	}
+
+	memset(buf, 0, size);
+	if (_IOC_DIR((unsigned)cmd) & _IOC_WRITE) {
+		if (in_bufsz < size) {
+			fuse_reply_err(req, EINVAL);
+			return;
+		}
+		memcpy(buf, in_buf, size);
+	}
+
+	int rc = virtocxl_context_ioctl(context, (unsigned)cmd, buf);
+	if (rc) {
+		fuse_reply_err(req, rc);
+		return;
+	}
+
+	if (_IOC_DIR((unsigned)cmd) & _IOC_READ) {
+		fuse_reply_ioctl(req, 0, buf, size);
+	} else {
+		fuse_reply_ioctl(req, 0, NULL, 0);
+	}
+}
+
+static void afu_poll(fuse_req_t req, struct fuse_file_info *fi, struct fuse_pollhandle *ph)
+{
+	virtocxl_context *context = request_context(fi);
+
+	// Keep the most recent handle so a forced fault can wake the poller
+	if (ph) {
+		pthread_mutex_lock(&context->device->lock);
+		struct fuse_pollhandle *old = context->transport_data;
+		context->transport_data = ph;
+		pthread_mutex_unlock(&context->device->lock);
+		if (old) {
+			fuse_pollhandle_destroy(old);
+		}
+	}
+
+	fuse_reply_poll(req, virtocxl_context_poll(context));
+}
+
+static void *start_afu_thread(void *arg) {
+	virtocxl_device *device = arg;
+	cuse_device *cuse = device->transport_data;
+
+	char dev_name[PATH_MAX+9] = "DEVNAME=";
+	const char *dev_info_argv[] = { dev_name };
+	// DEVNAME is relative to /dev
+	strncat(dev_name, device->device_path + strlen("/dev/"), sizeof(dev_name) - strlen(dev_name) - 1);
+
+	memset(&cuse->cuse, 0, sizeof(cuse->cuse));
+	cuse->cuse.dev_major = 0;
+	cuse->cuse.dev_minor = 0;
+	cuse->cuse.dev_info_argc = 1;
+	cuse->cuse.dev_info_argv = dev_info_argv;
+	cuse->cuse.flags = 0;
+
+	char *argv[] = {
+			"testobj/unittests",
+			"-f",
+	};
+
+	struct fuse_args args = FUSE_ARGS_INIT(2, argv);
+
+	cuse->session = cuse_lowlevel_setup(args.argc, args.argv, &cuse->cuse, &cuse->afu_ops, NULL, device);
+	(void)fuse_session_loop(cuse->session);
+
+	return NULL;
+}
+
+/**
+ * Start the CUSE thread of a device
+ *
+ * @param device the device
+ * @return 0 on success, -1 on error
+ */
+static int cuse_start(virtocxl_device *device)
+{
+	cuse_device *cuse = calloc(1, sizeof(*cuse));
+	if (!cuse) {
+		return -1;
+	}
+
+	cuse->afu_ops.open = afu_open;
+	cuse->afu_ops.release = afu_release;
+	cuse->afu_ops.read = afu_read;
+	cuse->afu_ops.ioctl = afu_ioctl;
+	cuse->afu_ops.poll = afu_poll;
+
+	device->transport_data = cuse;
+
+	if (pthread_create(&cuse->thread, NULL, start_afu_thread, device)) {
+		device->transport_data = NULL;
+		free(cuse);
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Stop the CUSE thread of a device, removing its device node
+ *
+ * @param device the device
+ */
+static void cuse_stop(virtocxl_device *device)
+{
+	cuse_device *cuse = device->transport_data;
+	void *ret;
+
+	if (cuse->session) {
+		fuse_session_exit(cuse->session);
+	}
+	pthread_kill(cuse->thread, SIGTERM);
+	pthread_join(cuse->thread, &ret);
+	if (cuse->session) {
+		fuse_session_destroy(cuse->session);
+	}
+
+	device->transport_data = NULL;
+	free(cuse);
+}
+
+static void cuse_notify(virtocxl_context *context)
+{
+	if (context->transport_data) {
+		fuse_lowlevel_notify_poll(context->transport_data);
+	}
+}
+
+static void cuse_release(virtocxl_context *context)
+{
+	if (context->transport_data) {
+		fuse_pollhandle_destroy(context->transport_data);
+		context->transport_data = NULL;
+	}
+}
+
+const virtocxl_transport virtocxl_active_transport = {
+	.name = "CUSE",
+	.dev_path = CUSE_DEV_PATH,
+	.start = cuse_start,
+	.stop = cuse_stop,
+	.notify = cuse_notify,
+	.consumed = NULL,
+	.release = cuse_release,
+};
+
+/**
+ * Does a device have a given device number, caching the number once the node appears
+ *
+ * @param device the device
+ * @param data the device number
+ * @return true if the device matches
+ */
+static bool match_rdev(virtocxl_device *device, void *data)
+{
+	cuse_device *cuse = device->transport_data;
+	struct stat dev_stat;
+
+	if (!cuse->rdev && !stat(device->device_path, &dev_stat)) {
+		cuse->rdev = dev_stat.st_rdev;
+	}
+
+	return cuse->rdev && cuse->rdev == *(dev_t *)data;
+}
+
+void *__real_mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+/**
+ * Find the context a descriptor is open on
+ *
+ * @param fd the file descriptor
+ * @return the context, or NULL if the descriptor is not open on a virtual device
+ */
+static virtocxl_context *fd_context(int fd)
+{
+	struct stat fd_stat;
+	uint64_t context_id;
+
+	if (fd < 0 || fstat(fd, &fd_stat) || !S_ISCHR(fd_stat.st_mode)) {
+		return NULL;
+	}
+
+	if (!virtocxl_device_find(match_rdev, &fd_stat.st_rdev) ||
+	    ioctl(fd, VIRTOCXL_IOCTL_GET_CONTEXT, &context_id)) {
+		return NULL;
+	}
+
+	return (virtocxl_context *)(uintptr_t)context_id;
+}
+
+/**
+ * Intercept mmap() of the virtual devices to serve per-PASID MMIO & IRQ trigger pages
+ *
+ * CUSE does not support mmap, so the unit tests are linked with --wrap=mmap64, and
+ * mappings of a device are satisfied by the context's per-PASID MMIO area, or its emulated IRQs.
+ */
+void *__wrap_mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	virtocxl_context *context = fd_context(fd);
+	if (!context) {
+		return __real_mmap64(addr, length, prot, flags, fd, offset);
+	}
+
+	return virtocxl_context_mmap(context, addr, length, prot, flags, offset);
+}
@@ -0,0 +1,388 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Present the virtual devices to the library within the test process, without CUSE or root.
+ *
+ * The test binary is linked with --wrap for the system calls the library makes on a device
+ * (open, stat, fstatat, ioctl, read, close & mmap). Each device node is a placeholder file,
+ * which the wrapped stat calls report as a character device. Opening a node creates a context,
+ * and returns an eventfd which stands in for the device: it is signalled while the context has
+ * an event pending, so epoll works on it unmodified. All other descriptors & paths are passed
+ * through to the real calls.
+ *
+ * Unlike the CUSE devices, an unattached context does not report POLLERR.
+ */
+
+#define _GNU_SOURCE
+#include "virtocxl_internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+
+#define INPROC_DEV_PATH "/tmp/ocxl-test-dev"
+
+/* The major number reported for the device nodes, from the range reserved for local use */
+#define INPROC_MAJOR 241
+
+/* Descriptors open on a device must be below this */
+#define INPROC_MAX_FDS 4096
+
+int __real_open64(const char *path, int flags, ...);
+int __real_stat64(const char *path, struct stat *buf);
+int __real_fstatat64(int dirfd, const char *path, struct stat *buf, int flags);
+int __real_ioctl(int fd, unsigned long request, ...);
+ssize_t __real_read(int fd, void *buf, size_t count);
+int __real_close(int fd);
+void *__real_mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset);
+
+typedef struct inproc_device {
+	dev_t st_dev;
+	ino_t st_ino;
+} inproc_device;
+
+typedef struct inproc_context {
+	int fd;
+} inproc_context;
+
+static pthread_mutex_t fd_lock = PTHREAD_MUTEX_INITIALIZER;
+static virtocxl_context *fd_contexts[INPROC_MAX_FDS];
+
+/**
+ * Find the context a descriptor is open on
+ *
+ * @param fd the file descriptor
+ * @return the context, or NULL if the descriptor is not open on a virtual device
+ */
+static virtocxl_context *fd_context(int fd)
+{
+	if (fd < 0 || fd >= INPROC_MAX_FDS) {
+		return NULL;
+	}
+
+	return __atomic_load_n(&fd_contexts[fd], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Create the placeholder node of a device
+ *
+ * @param device the device
+ * @return 0 on success, -1 on error
+ */
+static int inproc_start(virtocxl_device *device)
+{
+	struct stat node_stat;
+
+	if (__real_stat64(INPROC_DEV_PATH, &node_stat) && mkdir(INPROC_DEV_PATH, 0775)) {
+		fprintf(stderr, "Could not mkdir '%s': %d: %s\n", INPROC_DEV_PATH, errno, strerror(errno));
+		return -1;
+	}
+
+	inproc_device *inproc = calloc(1, sizeof(*inproc));
+	if (!inproc) {
+		return -1;
+	}
+
+	int fd = __real_open64(device->device_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0664);
+	if (fd < 0 || fstat(fd, &node_stat)) {
+		fprintf(stderr, "Could not create device node '%s': %d: %s\n",
+				device->device_path, errno, strerror(errno));
+		if (fd >= 0) {
+			__real_close(fd);
+		}
+		free(inproc);
+		return -1;
+	}
+	__real_close(fd);
+
+	inproc->st_dev = node_stat.st_dev;
+	inproc->st_ino = node_stat.st_ino;
+	device->transport_data = inproc;
+
+	return 0;
+}
+
+/**
+ * Remove the placeholder node of a device
+ *
+ * Descriptors still open on the device are forgotten, but left open for the host to close.
+ *
+ * @param device the device
+ */
+static void inproc_stop(virtocxl_device *device)
+{
+	pthread_mutex_lock(&fd_lock);
+	for (int fd = 0; fd < INPROC_MAX_FDS; fd++) {
+		if (fd_contexts[fd] && fd_contexts[fd]->device == device) {
+			__atomic_store_n(&fd_contexts[fd], NULL, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&fd_lock);
+
+	(void)unlink(device->device_path);
+	free(device->transport_data);
+	device->transport_data = NULL;
+}
+
+static void inproc_notify(virtocxl_context *context)
+{
+	inproc_context *inproc = context->transport_data;
+	uint64_t one = 1;
+
+	if (inproc) {
+		(void)!write(inproc->fd, &one, sizeof(one));
+	}
+}
+
+static void inproc_consumed(virtocxl_context *context)
+{
+	inproc_context *inproc = context->transport_data;
+	uint64_t count;
+
+	if (inproc) {
+		(void)!__real_read(inproc->fd, &count, sizeof(count));
+	}
+}
+
+static void inproc_release(virtocxl_context *context)
+{
+	free(context->transport_data);
+	context->transport_data = NULL;
+}
+
+const virtocxl_transport virtocxl_active_transport = {
+	.name = "in-process",
+	.dev_path = INPROC_DEV_PATH,
+	.start = inproc_start,
+	.stop = inproc_stop,
+	.notify = inproc_notify,
+	.consumed = inproc_consumed,
+	.release = inproc_release,
+};
+
+/**
+ * Is a device's placeholder node a given file
+ *
+ * @param device the device
+ * @param data the stat of the file
+ * @return true if the file is the device's node
+ */
+static bool match_node(virtocxl_device *device, void *data)
+{
+	inproc_device *inproc = device->transport_data;
+	struct stat *node_stat = data;
+
+	return inproc && inproc->st_dev == node_stat->st_dev && inproc->st_ino == node_stat->st_ino;
+}
+
+/**
+ * Find the device whose node a file is
+ *
+ * @param node_stat the stat of the file
+ * @return the device, or NULL if the file is not a device node
+ */
+static virtocxl_device *node_device(const struct stat *node_stat)
+{
+	if (!S_ISREG(node_stat->st_mode)) {
+		return NULL;
+	}
+
+	return virtocxl_device_find(match_node, (void *)node_stat);
+}
+
+/**
+ * Present the stat of a placeholder node as that of a character device
+ *
+ * @param buf the stat of the file
+ * @return 0
+ */
+static int fake_node_stat(struct stat *buf)
+{
+	virtocxl_device *device = node_device(buf);
+
+	if (device) {
+		buf->st_mode = (buf->st_mode & ~S_IFMT) | S_IFCHR;
+		buf->st_rdev = makedev(INPROC_MAJOR, device->id);
+		buf->st_size = 0;
+	}
+
+	return 0;
+}
+
+int __wrap_stat64(const char *path, struct stat *buf)
+{
+	if (__real_stat64(path, buf)) {
+		return -1;
+	}
+
+	return fake_node_stat(buf);
+}
+
+int __wrap_fstatat64(int dirfd, const char *path, struct stat *buf, int flags)
+{
+	if (__real_fstatat64(dirfd, path, buf, flags)) {
+		return -1;
+	}
+
+	return fake_node_stat(buf);
+}
+
+/**
+ * Open a context on a device
+ *
+ * @param device the device
+ * @param flags the open flags
+ * @return the descriptor of the context, or -1 with errno set on error
+ */
+static int open_context(virtocxl_device *device, int flags)
+{
+	virtocxl_context *context;
+	int rc;
+
+	int fd = eventfd(0, EFD_NONBLOCK | ((flags & O_CLOEXEC) ? EFD_CLOEXEC : 0));
+	if (fd < 0) {
+		return -1;
+	}
+
+	if (fd >= INPROC_MAX_FDS) {
+		rc = EMFILE;
+		goto err;
+	}
+
+	inproc_context *inproc = calloc(1, sizeof(*inproc));
+	if (!inproc) {
+		rc = ENOMEM;
+		goto err;
+	}
+	inproc->fd = fd;
+
+	rc = virtocxl_context_open(device, &context);
+	if (rc) {
+		free(inproc);
+		goto err;
+	}
+
+	pthread_mutex_lock(&device->lock);
+	context->transport_data = inproc;
+	pthread_mutex_unlock(&device->lock);
+
+	pthread_mutex_lock(&fd_lock);
+	__atomic_store_n(&fd_contexts[fd], context, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fd_lock);
+
+	return fd;
+
+err:
+	__real_close(fd);
+	errno = rc;
+	return -1;
+}
+
+int __wrap_open64(const char *path, int flags, ...)
+{
+	struct stat node_stat;
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	if (!(flags & O_CREAT) && !__real_stat64(path, &node_stat)) {
+		virtocxl_device *device = node_device(&node_stat);
+		if (device) {
+			return open_context(device, flags);
+		}
+	}
+
+	return __real_open64(path, flags, mode);
+}
+
+int __wrap_close(int fd)
+{
+	virtocxl_context *context = fd_context(fd);
+
+	if (context) {
+		pthread_mutex_lock(&fd_lock);
+		__atomic_store_n(&fd_contexts[fd], NULL, __ATOMIC_RELEASE);
+		pthread_mutex_unlock(&fd_lock);
+
+		virtocxl_context_release(context);
+	}
+
+	return __real_close(fd);
+}
+
+ssize_t __wrap_read(int fd, void *buf, size_t count)
+{
+	virtocxl_context *context = fd_context(fd);
+
+	if (!context) {
+		return __real_read(fd, buf, count);
+	}
+
+	ssize_t len = virtocxl_context_read(context, buf, count);
+	if (len < 0) {
+		errno = -len;
+		return -1;
+	}
+
+	return len;
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...)
+{
+	virtocxl_context *context = fd_context(fd);
+	va_list ap;
+
+	va_start(ap, request);
+	void *arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (!context) {
+		return __real_ioctl(fd, request, arg);
+	}
+
+	int rc = virtocxl_context_ioctl(context, request, arg);
+	if (rc) {
+		errno = rc;
+		return -1;
+	}
+
+	return 0;
+}
+
+void *__wrap_mmap64(void *addr, size_t length, int prot, int flags, int fd, off_t offset)
+{
+	virtocxl_context *context = fd_context(fd);
+
+	if (!context) {
+		return __real_mmap64(addr, length, prot, flags, fd, offset);
+	}
+
+	return virtocxl_context_mmap(context, addr, length, prot, flags, offset);
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The interface between the virtual device core (virtocxl.c) and the transports which
+ * present the devices to the library: CUSE (virtocxl_cuse.c) and in-process syscall
+ * interposition (virtocxl_inproc.c). Exactly one transport is linked into a test binary.
+ */
+
+#ifndef _VIRTOCXL_INTERNAL_H
+#define _VIRTOCXL_INTERNAL_H
+
+#include "libocxl_internal.h"
+#include "virtocxl.h"
+#include <sys/types.h>
+
+#define DEVICE_NAME_MAX 64
+
+typedef struct ocxl_kernel_event_header ocxl_kernel_event_header;
+typedef struct ocxl_kernel_event_xsl_fault_error ocxl_kernel_event_xsl_fault_error;
+#define KERNEL_EVENT_SIZE (sizeof(ocxl_kernel_event_header) + sizeof(ocxl_kernel_event_xsl_fault_error))
+
+typedef struct watch {
+	uint64_t offset;
+	virtocxl_register_callback callback;
+	void *data;
+} watch;
+
+struct virtocxl_context {
+	virtocxl_device *device;
+	uint32_t slot;
+	uint32_t pasid;
+	bool attached;
+	ocxl_kernel_event_xsl_fault_error faults[VIRTOCXL_FAULT_QUEUE_DEPTH]; /**< Pending faults, oldest first from fault_head */
+	uint32_t fault_head;
+	uint32_t fault_count;
+	bool spurious; /**< Pollers were woken without an event, until the context is next read */
+	virtocxl_irq *irqs;
+	int pp_mmio_fd;
+	size_t pp_mmio_length;
+	void *pp_mmio;
+	uint64_t watch_values[VIRTOCXL_MAX_WATCHES];
+	void *data;
+	void *transport_data;
+};
+
+struct virtocxl_device {
+	char afu_name[AFU_NAME_MAX + 1];
+	uint16_t card;
+	uint8_t afu_index;
+	uint8_t version_major;
+	uint8_t version_minor;
+	size_t global_mmio_size;
+	size_t pp_mmio_size;
+	uint32_t max_contexts;
+	uint32_t id;
+
+	char name[DEVICE_NAME_MAX];
+	char device_path[PATH_MAX];
+	char sysfs_path[PATH_MAX];
+	int global_mmio_fd;
+
+	pthread_mutex_t lock;
+	virtocxl_context **contexts;
+	uint32_t context_count;
+	virtocxl_context *latest;
+
+	virtocxl_context_open_hook open_hook;
+	virtocxl_context_close_hook close_hook;
+	void *hook_data;
+
+	watch watches[VIRTOCXL_MAX_WATCHES];
+	uint32_t watch_count;
+	pthread_t watch_thread;
+	volatile bool watching;
+
+	void *transport_data;
+
+	virtocxl_device *next;
+};
+
+/**
+ * A means of presenting virtual devices to the library
+ */
+typedef struct virtocxl_transport {
+	const char *name;
+	const char *dev_path; /**< The directory the device nodes appear in */
+	int (*start)(virtocxl_device *device); /**< Make the device node available, returns 0 on success */
+	void (*stop)(virtocxl_device *device); /**< Remove the device node */
+	void (*notify)(virtocxl_context *context); /**< Wake pollers of a context, called with the device lock held */
+	void (*consumed)(virtocxl_context *context); /**< All events of a context have been read, called with the device lock held */
+	void (*release)(virtocxl_context *context); /**< Free the transport data of a context (may be NULL) */
+} virtocxl_transport;
+
+extern const virtocxl_transport virtocxl_active_transport;
+
+int virtocxl_context_open(virtocxl_device *device, virtocxl_context **context_out);
+void virtocxl_context_release(virtocxl_context *context);
+ssize_t virtocxl_context_read(virtocxl_context *context, void *buf, size_t size);
+int virtocxl_context_ioctl(virtocxl_context *context, unsigned long cmd, void *arg);
+unsigned virtocxl_context_poll(virtocxl_context *context);
+void *virtocxl_context_mmap(virtocxl_context *context, void *addr, size_t length, int prot, int flags,
+                            off_t offset);
+virtocxl_device *virtocxl_device_find(bool (*match)(virtocxl_device *device, void *data), void *data);
+
+#endif /* _VIRTOCXL_INTERNAL_H */
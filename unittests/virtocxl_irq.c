@@ -0,0 +1,656 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * AFU IRQ emulation for virtocxl.
+ *
+ * As with the kernel driver, an IRQ is allocated against an offset in the device's
+ * mmap space, bound to an eventfd, and the trigger page mapped at that offset serves
+ * as the handle the AFU uses to raise it. Trigger pages are placed in a reserved
+ * address range, so a handle resolves to its IRQ in constant time.
+ */
+
+#include "libocxl_internal.h"
+#include "virtocxl.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define IRQ_PAGES	65536
+
+/* Sleep rather than spin when the next paced trigger is further away than this */
+#define STORM_SLEEP_NS	100000
+
+/* The distance between the distinct addresses of a storm's translation faults */
+#define STORM_FAULT_STRIDE	4096
+
+struct virtocxl_irq {
+	uint64_t offset;
+	int eventfd;
+	uint32_t slot;
+	void *page;
+	uint64_t triggers;
+	virtocxl_irq *next;
+};
+
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t *irq_region = NULL;
+static size_t irq_page_size;
+static virtocxl_irq *irq_slots[IRQ_PAGES];
+static uint32_t irq_next_slot = 0;
+
+/**
+ * Reserve the address range for trigger pages
+ *
+ * @pre irq_lock is held
+ * @return 0 on success, an errno value otherwise
+ */
+static int reserve_region()
+{
+	if (irq_region) {
+		return 0;
+	}
+
+	irq_page_size = sysconf(_SC_PAGESIZE);
+	void *region = mmap(NULL, IRQ_PAGES * irq_page_size, PROT_NONE,
+	                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (region == MAP_FAILED) {
+		return errno;
+	}
+
+	irq_region = region;
+
+	return 0;
+}
+
+/**
+ * Find a free trigger page slot
+ *
+ * @pre irq_lock is held
+ * @param[out] slot the free slot
+ * @return 0 on success, ENOSPC if there are none left
+ */
+static int find_slot(uint32_t *slot)
+{
+	for (uint32_t i = 0; i < IRQ_PAGES; i++) {
+		uint32_t candidate = (irq_next_slot + i) % IRQ_PAGES;
+		if (!irq_slots[candidate]) {
+			irq_next_slot = (candidate + 1) % IRQ_PAGES;
+			*slot = candidate;
+			return 0;
+		}
+	}
+
+	return ENOSPC;
+}
+
+/**
+ * Look up an IRQ by offset
+ *
+ * @param list the IRQs of the context
+ * @param offset the offset of the IRQ
+ * @return the IRQ, or NULL if there is no IRQ at that offset
+ */
+static virtocxl_irq *find_irq(virtocxl_irq *list, uint64_t offset)
+{
+	for (virtocxl_irq *irq = list; irq; irq = irq->next) {
+		if (irq->offset == offset) {
+			return irq;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Allocate an IRQ for a context (OCXL_IOCTL_IRQ_ALLOC)
+ *
+ * @param list the IRQs of the context
+ * @param[out] offset the mmap offset of the IRQ's trigger page
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_irq_alloc(virtocxl_irq **list, uint64_t *offset)
+{
+	uint64_t candidate = VIRTOCXL_IRQ_OFFSET_BASE;
+	virtocxl_irq *irq;
+
+	pthread_mutex_lock(&irq_lock);
+	int rc = reserve_region();
+	pthread_mutex_unlock(&irq_lock);
+	if (rc) {
+		return rc;
+	}
+
+	// Use the lowest free offset, as the kernel does
+	while (find_irq(*list, candidate)) {
+		candidate += irq_page_size;
+	}
+
+	irq = calloc(1, sizeof(*irq));
+	if (!irq) {
+		return ENOMEM;
+	}
+
+	irq->offset = candidate;
+	irq->eventfd = -1;
+	irq->next = *list;
+	*list = irq;
+	*offset = candidate;
+
+	return 0;
+}
+
+/**
+ * Bind an eventfd to an IRQ (OCXL_IOCTL_IRQ_SET_FD)
+ *
+ * The emulated device shares the caller's fd table, so the descriptor is duplicated,
+ * as the kernel takes its own reference.
+ *
+ * @param list the IRQs of the context
+ * @param offset the offset of the IRQ
+ * @param eventfd the eventfd to signal when the IRQ is triggered
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_irq_set_fd(virtocxl_irq *list, uint64_t offset, int eventfd)
+{
+	virtocxl_irq *irq = find_irq(list, offset);
+	if (!irq) {
+		return EINVAL;
+	}
+
+	int fd = dup(eventfd);
+	if (fd < 0) {
+		return errno;
+	}
+
+	pthread_mutex_lock(&irq_lock);
+	int old = irq->eventfd;
+	irq->eventfd = fd;
+	pthread_mutex_unlock(&irq_lock);
+
+	if (old >= 0) {
+		close(old);
+	}
+
+	return 0;
+}
+
+/**
+ * Map the trigger page of an IRQ
+ *
+ * @param list the IRQs of the context
+ * @param offset the offset of the IRQ
+ * @param length the length of the mapping
+ * @param[out] addr the address of the trigger page (the IRQ handle)
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_irq_map(virtocxl_irq *list, uint64_t offset, size_t length, void **addr)
+{
+	virtocxl_irq *irq = find_irq(list, offset);
+	if (!irq || length != irq_page_size) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&irq_lock);
+
+	if (irq->page) {
+		pthread_mutex_unlock(&irq_lock);
+		return EBUSY;
+	}
+
+	uint32_t slot;
+	int rc = find_slot(&slot);
+	if (rc) {
+		pthread_mutex_unlock(&irq_lock);
+		return rc;
+	}
+
+	// Free slots are always covered by our reservation, so can be replaced
+	void *page = mmap(irq_region + slot * irq_page_size, irq_page_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+	if (page == MAP_FAILED) {
+		rc = errno;
+		pthread_mutex_unlock(&irq_lock);
+		return rc;
+	}
+
+	irq->slot = slot;
+	irq->page = page;
+	irq_slots[slot] = irq;
+
+	pthread_mutex_unlock(&irq_lock);
+
+	*addr = page;
+
+	return 0;
+}
+
+/**
+ * Free an IRQ (OCXL_IOCTL_IRQ_FREE)
+ *
+ * @param list the IRQs of the context
+ * @param offset the offset of the IRQ
+ * @return 0 on success, an errno value otherwise
+ */
+int virtocxl_irq_free(virtocxl_irq **list, uint64_t offset)
+{
+	virtocxl_irq **prev = list;
+	virtocxl_irq *irq;
+
+	for (irq = *list; irq; prev = &irq->next, irq = irq->next) {
+		if (irq->offset == offset) {
+			break;
+		}
+	}
+
+	if (!irq) {
+		return EINVAL;
+	}
+
+	*prev = irq->next;
+
+	pthread_mutex_lock(&irq_lock);
+	if (irq->page) {
+		/* The trigger page belongs to the caller, which unmaps it before freeing the IRQ,
+		 * so reclaim the hole. If an unrelated mapping has already landed there, the slot
+		 * is retired rather than clobbering it.
+		 */
+		void *page = mmap(irq->page, irq_page_size, PROT_NONE,
+		                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+		if (page == irq->page) {
+			irq_slots[irq->slot] = NULL;
+		} else {
+			if (page != MAP_FAILED) {
+				munmap(page, irq_page_size);
+			}
+			irq_slots[irq->slot] = VIRTOCXL_IRQ_SLOT_RETIRED;
+		}
+	}
+	int fd = irq->eventfd;
+	pthread_mutex_unlock(&irq_lock);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(irq);
+
+	return 0;
+}
+
+/**
+ * Free all IRQs of a context, as done by the kernel when the device is closed
+ *
+ * @param list the IRQs of the context
+ */
+void virtocxl_irq_free_all(virtocxl_irq **list)
+{
+	while (*list) {
+		virtocxl_irq_free(list, (*list)->offset);
+	}
+}
+
+/**
+ * Count the IRQs allocated to a context
+ *
+ * @param list the IRQs of the context
+ * @return the number of IRQs
+ */
+uint32_t virtocxl_irq_count(virtocxl_irq *list)
+{
+	uint32_t count = 0;
+
+	for (virtocxl_irq *irq = list; irq; irq = irq->next) {
+		count++;
+	}
+
+	return count;
+}
+
+/**
+ * Trigger an IRQ by its handle, as an AFU would
+ *
+ * @param handle the IRQ handle (the address of its trigger page)
+ * @return 0 on success, EINVAL if the handle is not a mapped IRQ, or ENODEV if no eventfd is bound
+ */
+int virtocxl_irq_fire(uint64_t handle)
+{
+	uint64_t one = 1;
+	int rc = 0;
+
+	if (!irq_region || handle < (uintptr_t)irq_region) {
+		return EINVAL;
+	}
+
+	uint64_t slot = (handle - (uintptr_t)irq_region) / irq_page_size;
+	if (slot >= IRQ_PAGES) {
+		return EINVAL;
+	}
+
+	pthread_mutex_lock(&irq_lock);
+	virtocxl_irq *irq = irq_slots[slot];
+	if (!irq || irq == VIRTOCXL_IRQ_SLOT_RETIRED) {
+		rc = EINVAL;
+	} else if (irq->eventfd < 0) {
+		rc = ENODEV;
+	} else if (write(irq->eventfd, &one, sizeof(one)) != sizeof(one)) {
+		rc = errno;
+	} else {
+		irq->triggers++;
+	}
+	pthread_mutex_unlock(&irq_lock);
+
+	return rc;
+}
+
+/**
+ * Trigger an IRQ on behalf of an AFU model
+ *
+ * Suitable for use as a virtocxl_irq_trigger callback.
+ *
+ * @param data unused
+ * @param handle the IRQ handle
+ */
+void virtocxl_irq_fire_cb(__attribute__((unused)) void *data, uint64_t handle)
+{
+	(void)virtocxl_irq_fire(handle);
+}
+
+struct virtocxl_irq_storm {
+	virtocxl_irq_storm_config config;
+	uint64_t *handles;
+	pthread_t thread;
+	volatile bool running;
+	uint64_t fired;
+	uint64_t failed;
+	uint64_t faults;
+	uint64_t n; /**< triggers so far */
+	uint64_t irqs; /**< IRQ triggers so far */
+	uint64_t random;
+	uint64_t start;
+	double period;
+	uint32_t burst;
+	uint64_t cycle;
+	bool simulated; /**< run by the simulated clock rather than a thread */
+};
+
+/**
+ * Wait until a point in time, sleeping if it is far enough away
+ *
+ * @param storm the storm, which may be stopped while waiting
+ * @param deadline the time to wait until
+ */
+static void wait_until(virtocxl_irq_storm *storm, uint64_t deadline)
+{
+	uint64_t now;
+
+	while (storm->running && (now = virtocxl_clock_now()) < deadline) {
+		if (deadline - now > STORM_SLEEP_NS) {
+			struct timespec ts = {
+				.tv_sec = 0,
+				.tv_nsec = (deadline - now) - STORM_SLEEP_NS / 2,
+			};
+			nanosleep(&ts, NULL);
+		}
+	}
+}
+
+/**
+ * Pick the next IRQ to trigger
+ *
+ * @param storm the storm
+ * @param n the number of IRQ triggers so far
+ * @return the index of the handle to trigger
+ */
+static size_t pick_irq(virtocxl_irq_storm *storm, uint64_t n)
+{
+	size_t count = storm->config.handle_count;
+	uint32_t burst = storm->config.burst ? storm->config.burst : 1;
+
+	switch (storm->config.pattern) {
+	case VIRTOCXL_IRQ_RANDOM:
+		storm->random ^= storm->random << 13;
+		storm->random ^= storm->random >> 7;
+		storm->random ^= storm->random << 17;
+		return storm->random % count;
+
+	case VIRTOCXL_IRQ_BURST:
+		return (n / burst) % count;
+
+	case VIRTOCXL_IRQ_ROUND_ROBIN:
+	default:
+		return n % count;
+	}
+}
+
+/**
+ * Raise the next translation fault of a storm
+ *
+ * Faults cycle through the distinct addresses, the count of each address's fault
+ * increasing with every cycle.
+ *
+ * @param storm the storm
+ * @return 0 on success, ENOSPC if the fault was dropped
+ */
+static int raise_fault(virtocxl_irq_storm *storm)
+{
+	uint32_t addresses = storm->config.fault_addresses ? storm->config.fault_addresses : 1;
+	uint64_t n = storm->faults++;
+	void *addr = (void *)(uintptr_t)(storm->config.fault_base + (n % addresses) * STORM_FAULT_STRIDE);
+
+	return virtocxl_context_translation_fault(storm->config.fault_context, addr, 0, n / addresses + 1);
+}
+
+/**
+ * Has a storm made all of its triggers
+ *
+ * @param storm the storm
+ * @return true if the storm has a count, and has reached it
+ */
+static bool storm_done(virtocxl_irq_storm *storm)
+{
+	return storm->config.count && storm->n >= storm->config.count;
+}
+
+/**
+ * Get the time the next trigger of a storm is due
+ *
+ * Bursts are fired back to back, then paced as a group.
+ *
+ * @param storm the storm
+ * @return the time in nanoseconds
+ */
+static uint64_t storm_due(virtocxl_irq_storm *storm)
+{
+	return storm->start + (uint64_t)((storm->n - storm->n % storm->burst) * storm->period);
+}
+
+/**
+ * Make the next trigger of a storm, either an IRQ or a translation fault
+ *
+ * @param storm the storm
+ */
+static void storm_trigger(virtocxl_irq_storm *storm)
+{
+	int rc;
+
+	if (storm->config.fault_context &&
+	    (!storm->config.handle_count || storm->n % storm->cycle != storm->cycle - 1)) {
+		rc = raise_fault(storm);
+		// A full queue stalls the device, rather than contending for it with the reader
+		if (rc == ENOSPC && virtocxl_clock_get_mode() == VIRTOCXL_CLOCK_REAL) {
+			sched_yield();
+		}
+	} else {
+		rc = virtocxl_irq_fire(storm->handles[pick_irq(storm, storm->irqs++)]);
+	}
+
+	if (rc) {
+		storm->failed++;
+	} else {
+		storm->fired++;
+	}
+	storm->n++;
+}
+
+/**
+ * The storm thread, triggers IRQs & raises faults according to the pattern & rate
+ *
+ * @param arg the storm
+ * @return NULL
+ */
+static void *storm_thread(void *arg)
+{
+	virtocxl_irq_storm *storm = arg;
+
+	while (storm->running && !storm_done(storm)) {
+		if (storm->period && storm->n % storm->burst == 0) {
+			wait_until(storm, storm_due(storm));
+		}
+
+		storm_trigger(storm);
+	}
+
+	return NULL;
+}
+
+/**
+ * Make the triggers of a storm which are due, in simulated time
+ *
+ * @param data the storm
+ * @param now the current time
+ */
+static void storm_tick(void *data, uint64_t now)
+{
+	virtocxl_irq_storm *storm = data;
+
+	while (!storm_done(storm) && storm_due(storm) <= now) {
+		storm_trigger(storm);
+	}
+}
+
+/**
+ * Get the time of the next trigger of a storm, in simulated time
+ *
+ * @param data the storm
+ * @return the time the trigger is due, or UINT64_MAX if the storm is done
+ */
+static uint64_t storm_next(void *data)
+{
+	virtocxl_irq_storm *storm = data;
+
+	return storm_done(storm) ? UINT64_MAX : storm_due(storm);
+}
+
+/**
+ * Start firing IRQs and/or raising translation faults
+ *
+ * In real time, the storm runs from a dedicated thread. In simulated time, triggers are
+ * made as the clock reaches them, and a storm with no rate must have a count, all of which
+ * are made immediately.
+ *
+ * @param config the IRQs, faults, pattern & rate to fire at
+ * @return the storm, or NULL on error
+ */
+virtocxl_irq_storm *virtocxl_irq_storm_start(const virtocxl_irq_storm_config *config)
+{
+	bool simulated = virtocxl_clock_get_mode() == VIRTOCXL_CLOCK_SIMULATED;
+
+	if (!config->handle_count && !config->fault_context) {
+		return NULL;
+	}
+
+	if (simulated && config->rate <= 0 && !config->count) {
+		return NULL;
+	}
+
+	virtocxl_irq_storm *storm = calloc(1, sizeof(*storm));
+	if (!storm) {
+		return NULL;
+	}
+
+	storm->handles = calloc(config->handle_count ? config->handle_count : 1, sizeof(*storm->handles));
+	if (!storm->handles) {
+		free(storm);
+		return NULL;
+	}
+	if (config->handle_count) {
+		memcpy(storm->handles, config->handles, config->handle_count * sizeof(*storm->handles));
+	}
+	storm->config = *config;
+	storm->config.handles = storm->handles;
+	storm->random = config->seed ? config->seed : 0x9e3779b97f4a7c15ULL;
+	storm->burst = (config->pattern == VIRTOCXL_IRQ_BURST && config->burst) ? config->burst : 1;
+	storm->period = config->rate > 0 ? 1e9 / config->rate : 0;
+	storm->cycle = (uint64_t)config->faults_per_irq + 1;
+	storm->start = virtocxl_clock_now();
+
+	storm->running = true;
+	storm->simulated = simulated;
+	if (simulated) {
+		if (virtocxl_clock_register(storm_tick, storm_next, storm)) {
+			free(storm->handles);
+			free(storm);
+			return NULL;
+		}
+		// Make the triggers due now
+		virtocxl_clock_advance(0);
+	} else if (pthread_create(&storm->thread, NULL, storm_thread, storm)) {
+		free(storm->handles);
+		free(storm);
+		return NULL;
+	}
+
+	return storm;
+}
+
+/**
+ * Stop a storm & free it
+ *
+ * @param storm the storm
+ * In simulated time, waiting advances the clock until the last trigger is made.
+ *
+ * @param wait true to wait for the configured count to be fired, false to stop immediately
+ * @param[out] failed the number of triggers which did not reach an IRQ, or faults which were dropped (may be NULL)
+ * @return the number of IRQs triggered & faults raised
+ */
+uint64_t virtocxl_irq_storm_stop(virtocxl_irq_storm *storm, bool wait, uint64_t *failed)
+{
+	if (storm->simulated) {
+		while (wait && !storm_done(storm) && virtocxl_clock_advance_next()) {
+		}
+		virtocxl_clock_unregister(storm);
+	} else {
+		if (!wait || !storm->config.count) {
+			storm->running = false;
+		}
+		pthread_join(storm->thread, NULL);
+	}
+
+	uint64_t fired = storm->fired;
+	if (failed) {
+		*failed = storm->failed;
+	}
+
+	free(storm->handles);
+	free(storm);
+
+	return fired;
+}
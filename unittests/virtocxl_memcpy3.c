@@ -0,0 +1,463 @@
+/*
+ * Copyright 2017 International Business Machines
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A software model of the IBM,MEMCPY3 AFU.
+ *
+ * The model operates on a per-PASID MMIO register block and executes work elements
+ * from the host-resident queue programmed through the WED register. As the emulated
+ * device lives in the same address space as the host code, effective addresses in
+ * work elements are dereferenced directly.
+ */
+
+#include "libocxl_internal.h"
+#include "virtocxl.h"
+#include <endian.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMCPY_WED_QUEUE(wed)	((wed) & 0xfffffffffffff000ULL)
+#define MEMCPY_WED_DEPTH(wed)	((wed) & 0xfffULL)
+
+#define MEMCPY_WE_CMD_GET(cmd)	(((cmd) >> 2) & 0x3f)
+
+/* The compare value of a CAS must match for the swap to occur */
+#define MEMCPY_ATOMIC_CAS_EQ	0x19
+
+/* Number of idle polls before the engine thread yields the CPU */
+#define IDLE_SPIN_COUNT	1024
+
+struct memcpy3_afu {
+	volatile uint64_t *pp_mmio;
+	virtocxl_irq_trigger trigger;
+	void *trigger_data;
+
+	uint64_t wed;
+	memcpy3_work_element *queue;
+	uint32_t queue_length;
+	uint32_t next;
+	uint8_t wrap;
+
+	uint64_t status;
+	memcpy3_afu_stats stats;
+
+	pthread_t thread;
+	volatile bool running;
+};
+
+/**
+ * Read a little endian per-PASID register
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param offset the offset of the register
+ * @return the value of the register
+ */
+static uint64_t reg_read(memcpy3_afu *afu, size_t offset)
+{
+	return le64toh(__atomic_load_n(&afu->pp_mmio[offset / sizeof(uint64_t)], __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Write a little endian per-PASID register
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param offset the offset of the register
+ * @param value the value to write
+ */
+static void reg_write(memcpy3_afu *afu, size_t offset, uint64_t value)
+{
+	__atomic_store_n(&afu->pp_mmio[offset / sizeof(uint64_t)], htole64(value), __ATOMIC_RELEASE);
+}
+
+/**
+ * Update the status register of the AFU
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param set the bits to set
+ * @param clear the bits to clear
+ */
+static void update_status(memcpy3_afu *afu, uint64_t set, uint64_t clear)
+{
+	afu->status = (afu->status & ~clear) | set;
+	reg_write(afu, MEMCPY3_PP_STATUS, afu->status);
+}
+
+/**
+ * Raise an IRQ
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param handle the handle of the IRQ to trigger
+ */
+static void raise_irq(memcpy3_afu *afu, uint64_t handle)
+{
+	if (handle && afu->trigger) {
+		afu->trigger(afu->trigger_data, handle);
+		afu->stats.irqs++;
+	}
+}
+
+/**
+ * Complete a work element
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param we the work element
+ * @param status the status to report to the host
+ */
+static void complete(memcpy3_afu *afu, memcpy3_work_element *we, uint8_t status)
+{
+	__atomic_store_n(&we->status, status, __ATOMIC_RELEASE);
+	afu->stats.elements++;
+}
+
+/**
+ * Fail a work element, stopping the engine and signalling the error IRQ
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param we the work element
+ */
+static void fail(memcpy3_afu *afu, memcpy3_work_element *we)
+{
+	complete(afu, we, MEMCPY3_WE_STATUS_ERROR);
+	afu->stats.errors++;
+	update_status(afu, MEMCPY3_PP_STATUS_Stopped, 0);
+	raise_irq(afu, reg_read(afu, MEMCPY3_PP_IRQ));
+}
+
+/**
+ * Increment a little endian integer in host memory
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param we the increment work element
+ * @return false on success, true if the element is malformed
+ */
+static bool execute_increment(memcpy3_afu *afu, memcpy3_work_element *we)
+{
+	void *src = (void *)(uintptr_t)le64toh(we->src);
+	void *dst = (void *)(uintptr_t)le64toh(we->dst);
+
+	if (!src || !dst) {
+		return true;
+	}
+
+	switch (le16toh(we->length)) {
+	case sizeof(uint32_t):
+		*(volatile uint32_t *)dst = htole32(le32toh(*(volatile uint32_t *)src) + 1);
+		break;
+	case sizeof(uint64_t):
+		*(volatile uint64_t *)dst = htole64(le64toh(*(volatile uint64_t *)src) + 1);
+		break;
+	default:
+		return true;
+	}
+
+	afu->stats.bytes += le16toh(we->length);
+
+	return false;
+}
+
+/**
+ * Execute a compare and swap
+ *
+ * The compare value (atomic_op) and swap value (src) are little endian, as is the
+ * target, so the comparison is performed on the raw values.
+ *
+ * @param we the atomic work element
+ * @param[out] swapped true if the swap occurred
+ * @return false on success, true if the element is malformed
+ */
+static bool execute_cas(memcpy3_work_element *we, bool *swapped)
+{
+	void *dst = (void *)(uintptr_t)le64toh(we->dst);
+
+	if (!dst || we->cmd_extra != MEMCPY_ATOMIC_CAS_EQ) {
+		return true;
+	}
+
+	switch (le16toh(we->length)) {
+	case sizeof(uint32_t): {
+		uint32_t expected = (uint32_t)we->atomic_op;
+		*swapped = __atomic_compare_exchange_n((uint32_t *)dst, &expected, (uint32_t)we->src,
+		                                       false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		break;
+	}
+	case sizeof(uint64_t): {
+		uint64_t expected = we->atomic_op;
+		*swapped = __atomic_compare_exchange_n((uint64_t *)dst, &expected, we->src,
+		                                       false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		break;
+	}
+	default:
+		return true;
+	}
+
+	return false;
+}
+
+/**
+ * Execute a single work element
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param we the work element
+ * @return false if the element was consumed, true if it must be retried
+ */
+static bool execute(memcpy3_afu *afu, memcpy3_work_element *we)
+{
+	void *src = (void *)(uintptr_t)le64toh(we->src);
+	void *dst = (void *)(uintptr_t)le64toh(we->dst);
+	uint16_t length = le16toh(we->length);
+	bool swapped;
+
+	switch (MEMCPY_WE_CMD_GET(we->cmd)) {
+	case MEMCPY3_WE_CMD_COPY:
+		if (length && (!src || !dst)) {
+			fail(afu, we);
+			break;
+		}
+		memcpy(dst, src, length);
+		afu->stats.bytes += length;
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		break;
+
+	case MEMCPY3_WE_CMD_IRQ:
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		update_status(afu, MEMCPY3_PP_STATUS_Stopped, 0);
+		raise_irq(afu, le64toh(we->src));
+		break;
+
+	case MEMCPY3_WE_CMD_STOP:
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		update_status(afu, MEMCPY3_PP_STATUS_Stopped, 0);
+		break;
+
+	case MEMCPY3_WE_CMD_WAKE_HOST_THREAD:
+		/* There is no thread to wake, so behave as if the wake was rejected and
+		 * fall back to the interrupt, as the hardware does for a descheduled thread
+		 */
+		complete(afu, we, MEMCPY3_WE_STATUS_FAULT_RESPONSE);
+		update_status(afu, MEMCPY3_PP_STATUS_Stopped, 0);
+		raise_irq(afu, le64toh(we->src));
+		break;
+
+	case MEMCPY3_WE_CMD_INCREMENT:
+		if (execute_increment(afu, we)) {
+			fail(afu, we);
+			break;
+		}
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		break;
+
+	case MEMCPY3_WE_CMD_ATOMIC:
+		if (execute_cas(we, &swapped)) {
+			fail(afu, we);
+			break;
+		}
+		if (!swapped) {
+			// Spin on the element until the compare succeeds (lock acquisition)
+			afu->stats.cas_retries++;
+			return true;
+		}
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		break;
+
+	case MEMCPY3_WE_CMD_TRANSLATE_TOUCH:
+		complete(afu, we, MEMCPY3_WE_STATUS_COMPLETE);
+		break;
+
+	default:
+		fail(afu, we);
+	}
+
+	return false;
+}
+
+/**
+ * Pick up a new WED & control requests from the per-PASID registers
+ *
+ * @param afu the MEMCPY3 AFU
+ */
+static void check_registers(memcpy3_afu *afu)
+{
+	uint64_t wed = reg_read(afu, MEMCPY3_PP_WED);
+	if (wed != afu->wed) {
+		afu->wed = wed;
+		afu->queue = (memcpy3_work_element *)(uintptr_t)MEMCPY_WED_QUEUE(wed);
+		afu->queue_length = MEMCPY_WED_DEPTH(wed) * MEMCPY3_CACHELINESIZE / sizeof(memcpy3_work_element);
+		afu->next = 0;
+		afu->wrap = 0;
+		update_status(afu, 0, MEMCPY3_PP_STATUS_Stopped);
+	}
+
+	uint64_t ctrl = reg_read(afu, MEMCPY3_PP_CTRL);
+	if (ctrl) {
+		// The control register behaves as a doorbell
+		reg_write(afu, MEMCPY3_PP_CTRL, 0);
+
+		if (ctrl & MEMCPY3_PP_CTRL_Terminate) {
+			update_status(afu, MEMCPY3_PP_STATUS_Terminated, 0);
+		} else if (ctrl & MEMCPY3_PP_CTRL_Restart) {
+			update_status(afu, 0, MEMCPY3_PP_STATUS_Stopped);
+		}
+	}
+}
+
+/**
+ * Process any pending requests on the AFU
+ *
+ * Register writes are observed, then work elements are executed until the queue is
+ * empty or the engine stops.
+ *
+ * @param afu the MEMCPY3 AFU
+ * @return the number of work elements consumed
+ */
+uint32_t memcpy3_afu_step(memcpy3_afu *afu)
+{
+	uint32_t consumed = 0;
+
+	check_registers(afu);
+
+	while (afu->queue_length &&
+	       !(afu->status & (MEMCPY3_PP_STATUS_Stopped | MEMCPY3_PP_STATUS_Terminated))) {
+		memcpy3_work_element *we = afu->queue + afu->next;
+		uint8_t cmd = __atomic_load_n(&we->cmd, __ATOMIC_ACQUIRE);
+
+		if (!(cmd & MEMCPY3_WE_CMD_VALID) || (cmd & MEMCPY3_WE_CMD_WRAP) != afu->wrap) {
+			break;
+		}
+
+		if (execute(afu, we)) {
+			break;
+		}
+
+		consumed++;
+		if (++afu->next == afu->queue_length) {
+			afu->next = 0;
+			afu->wrap ^= MEMCPY3_WE_CMD_WRAP;
+		}
+	}
+
+	return consumed;
+}
+
+/**
+ * The engine thread, polls the registers & queue until stopped
+ *
+ * @param arg the MEMCPY3 AFU
+ * @return NULL
+ */
+static void *memcpy3_afu_thread(void *arg)
+{
+	memcpy3_afu *afu = arg;
+	uint32_t idle = 0;
+
+	while (afu->running) {
+		if (memcpy3_afu_step(afu)) {
+			idle = 0;
+		} else if (++idle >= IDLE_SPIN_COUNT) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Create a new MEMCPY3 AFU model
+ *
+ * @param pp_mmio the per-PASID MMIO area to operate on (at least MEMCPY3_PP_MMIO_SIZE bytes)
+ * @param trigger a callback to trigger an IRQ by its handle (may be NULL)
+ * @param trigger_data an opaque pointer passed to the callback
+ * @return the model, or NULL on allocation failure
+ */
+memcpy3_afu *memcpy3_afu_create(void *pp_mmio, virtocxl_irq_trigger trigger, void *trigger_data)
+{
+	memcpy3_afu *afu = calloc(1, sizeof(*afu));
+	if (!afu) {
+		return NULL;
+	}
+
+	afu->pp_mmio = pp_mmio;
+	afu->trigger = trigger;
+	afu->trigger_data = trigger_data;
+	afu->wed = reg_read(afu, MEMCPY3_PP_WED);
+	update_status(afu, 0, 0);
+
+	return afu;
+}
+
+/**
+ * Start polling the AFU from a dedicated thread
+ *
+ * @param afu the MEMCPY3 AFU
+ * @return 0 on success, an errno value otherwise
+ */
+int memcpy3_afu_start(memcpy3_afu *afu)
+{
+	if (afu->running) {
+		return EBUSY;
+	}
+
+	afu->running = true;
+	int rc = pthread_create(&afu->thread, NULL, memcpy3_afu_thread, afu);
+	if (rc) {
+		afu->running = false;
+	}
+
+	return rc;
+}
+
+/**
+ * Stop the polling thread of the AFU
+ *
+ * @param afu the MEMCPY3 AFU
+ */
+void memcpy3_afu_stop(memcpy3_afu *afu)
+{
+	if (!afu->running) {
+		return;
+	}
+
+	afu->running = false;
+	pthread_join(afu->thread, NULL);
+}
+
+/**
+ * Get the activity counters of the AFU
+ *
+ * @param afu the MEMCPY3 AFU
+ * @param[out] stats the counters
+ */
+void memcpy3_afu_get_stats(memcpy3_afu *afu, memcpy3_afu_stats *stats)
+{
+	*stats = afu->stats;
+}
+
+/**
+ * Stop & free an AFU model
+ *
+ * @param afu the MEMCPY3 AFU (may be NULL)
+ */
+void memcpy3_afu_free(memcpy3_afu *afu)
+{
+	if (!afu) {
+		return;
+	}
+
+	memcpy3_afu_stop(afu);
+	free(afu);
+}